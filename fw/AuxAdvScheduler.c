@@ -1,212 +1,372 @@
 /*
  * Written by Sultan Qasim Khan
- * Copyright (c) 2019, NCC Group plc
+ * Copyright (c) 2019-2020, NCC Group plc
  * Released as open source under GPLv3
  */
 
 #include <string.h>
-#include <stdlib.h>
 
 // My includes
 #include <AuxAdvScheduler.h>
+#include <csa2.h>
 
 struct AuxSchedInfo
 {
     uint8_t chan;
     PHY_Mode phy;
+    uint32_t aa;
+    uint32_t crcInit;
     uint32_t radio_time; // start time
     uint32_t duration; // in radio ticks
 };
 
-#define MAX_AUX_EVENTS 8
+struct PeriodicTrain
+{
+    bool active;
+    PHY_Mode phy;
+    uint16_t eventCounter; // paEventCounter of next event
+    uint8_t missed; // consecutive events without a packet
+    uint32_t aa;
+    uint32_t crcInit;
+    uint32_t anchor; // expected start of next event (radio ticks)
+    uint32_t interval; // in radio ticks
+    uint32_t sca_ppm; // advertiser sleep clock accuracy
+    CSA2_Context csa2;
+};
+
+// be ready some time before a periodic packet is expected
+#define PERIODIC_LEAD_TICKS (700 * 4)
 
-// non-periodic
+// max distance from expected anchor for a packet to be the sync packet
+#define SYNC_ANCHOR_TOL (200 * 4)
+
+// give up on a train after this many consecutive empty events
+#define PERIODIC_MAX_MISSED 6
+
+// non-periodic, a binary min-heap ordered by start time
 static struct AuxSchedInfo aux_events[MAX_AUX_EVENTS];
 static uint32_t num_aux_events = 0;
 
-static int sched_event_cmp_fn(const void *a, const void *b)
+static struct PeriodicTrain trains[MAX_PERIODIC_TRAINS];
+
+// radio times wrap around, so compare by signed difference
+static inline bool time_before(uint32_t a, uint32_t b)
 {
-    const struct AuxSchedInfo *a_ = (const struct AuxSchedInfo *)a;
-    const struct AuxSchedInfo *b_ = (const struct AuxSchedInfo *)b;
-    return a_->radio_time - b_->radio_time;
+    return (int32_t)(a - b) < 0;
 }
 
-static void resort_sched(void)
+static void heap_swap(uint32_t a, uint32_t b)
 {
-    qsort(aux_events, num_aux_events, sizeof(struct AuxSchedInfo), sched_event_cmp_fn);
+    struct AuxSchedInfo tmp = aux_events[a];
+    aux_events[a] = aux_events[b];
+    aux_events[b] = tmp;
 }
 
-// we're not handling periodic advertising (AUX_SYNC_IND) for now
+static void sift_up(uint32_t i)
+{
+    while (i > 0)
+    {
+        uint32_t parent = (i - 1) >> 1;
+        if (!time_before(aux_events[i].radio_time, aux_events[parent].radio_time))
+            break;
+        heap_swap(i, parent);
+        i = parent;
+    }
+}
 
-// list order is early to late
-static bool insert_event_sorted(const struct AuxSchedInfo *event,
-        struct AuxSchedInfo *elist, uint32_t *num_events, uint32_t max_events)
+static void sift_down(uint32_t i)
 {
-    for (uint32_t i = 0; i < *num_events; i++)
+    for (;;)
     {
-        // not duplicate if not on same channel/phy
-        if ((elist[i].chan == event->chan) &&
-            (elist[i].phy == event->phy))
-        {
-            // deduplicate (check for overlap)
-            uint32_t start_a, start_b, end_a, end_b, offset;
-            start_a = elist[i].radio_time;
-            end_a = elist[i].radio_time + elist[i].duration;
-            start_b = event->radio_time;
-            end_b = event->radio_time + event->duration;
-
-            // offset calculation to simplify handling of wraparound
-            if (start_b - start_a >= 0x80000000) // b before a, wraparond
-                offset = start_b;
-            else if (start_a - start_b >= 0x80000000)
-                offset = start_a;
-            else if (start_a > start_b)
-                offset = start_b;
-            else
-                offset = start_a;
-            start_a -= offset;
-            start_b -= offset;
-            end_a -= offset;
-            end_b -= offset;
-
-            // now actually check for overlap
-            // Note: this logic doesn't handle merging events, but that's OK
-            if (start_b < start_a)
-            {
-                // Case A: starts earlier, ends before next start
-                if (end_b < start_a) {} // no overlap, do nothing here, insert to list below
-                // Case B: starts earlier, ends earlier
-                else if (end_b < end_a)
-                {
-                    // stretch start_a back to start_b
-                    elist[i].duration += start_a - start_b;
-                    elist[i].radio_time = event->radio_time;
-                    resort_sched();
-                    return true;
-                }
-                // Case C: starts earlier, ends later
-                else
-                {
-                    // replace with the new event
-                    elist[i] = *event;
-                    resort_sched();
-                    return true;
-                }
-            }
-            else if (start_b < end_a) // but start_b >= start_a
-            {
-                // Case D: starts later, ends earlier
-                if (end_b < end_a)
-                {
-                    // full overlap, no need to re-add
-                    return true;
-                }
-                // Case E: starts later, ends later
-                else
-                {
-                    // stretch out the end of the event in elist
-                    elist[i].duration += end_b - end_a;
-                    return true;
-                }
-            }
-            // Case F: start_b >= end_a, so no overlap
-        }
+        uint32_t l = 2*i + 1;
+        uint32_t r = l + 1;
+        uint32_t smallest = i;
 
-        // if we're here, its a distinct event that needs to be added
-        // no more space
-        if (*num_events == max_events)
-            return false;
+        if (l < num_aux_events &&
+                time_before(aux_events[l].radio_time, aux_events[smallest].radio_time))
+            smallest = l;
+        if (r < num_aux_events &&
+                time_before(aux_events[r].radio_time, aux_events[smallest].radio_time))
+            smallest = r;
+        if (smallest == i)
+            break;
 
-        if (elist[i].radio_time > event->radio_time)
-        {
-            // we found a spot to insert
-            uint32_t num_to_move = *num_events - i;
+        heap_swap(i, smallest);
+        i = smallest;
+    }
+}
 
-            // make space and insert
-            memmove(elist + i + 1, elist + i, sizeof(struct AuxSchedInfo) * num_to_move);
-            elist[i] = *event;
-            *num_events += 1;
+static void heapify(void)
+{
+    uint32_t i = num_aux_events / 2;
 
-            return true;
-        }
+    while (i-- > 0)
+        sift_down(i);
+}
+
+static inline bool same_target(const struct AuxSchedInfo *a, const struct AuxSchedInfo *b)
+{
+    return a->chan == b->chan && a->phy == b->phy && a->aa == b->aa;
+}
+
+bool AuxAdvScheduler_insert(uint8_t chan, PHY_Mode phy, uint32_t aa,
+        uint32_t crcInit, uint32_t radio_time, uint32_t duration)
+{
+    uint32_t i;
+    struct AuxSchedInfo e;
+    e.chan = chan;
+    e.phy = phy;
+    e.aa = aa;
+    e.crcInit = crcInit;
+    e.radio_time = radio_time;
+    e.duration = duration;
+
+    // deduplicate by merging with an overlapping window for the same target
+    for (i = 0; i < num_aux_events; i++)
+    {
+        struct AuxSchedInfo *o = aux_events + i;
+        uint32_t o_end = o->radio_time + o->duration;
+        uint32_t e_end = e.radio_time + e.duration;
+
+        if (!same_target(o, &e))
+            continue;
+
+        // overlap if each starts before the other ends
+        if (!time_before(e.radio_time, o_end) || !time_before(o->radio_time, e_end))
+            continue;
+
+        // union of the two windows
+        if (time_before(e.radio_time, o->radio_time))
+            o->radio_time = e.radio_time;
+        if (time_before(o_end, e_end))
+            o_end = e_end;
+        o->duration = o_end - o->radio_time;
+
+        // start can only have moved earlier
+        sift_up(i);
+        return true;
     }
 
-    // if we're here, its a distinct event that needs to be added
     // no more space
-    if (*num_events == max_events)
+    if (num_aux_events == MAX_AUX_EVENTS)
         return false;
 
-    // insert at the end
-    elist[*num_events] = *event;
-    *num_events += 1;
+    aux_events[num_aux_events] = e;
+    sift_up(num_aux_events);
+    num_aux_events++;
+
     return true;
 }
 
-static void sched_list_pop(struct AuxSchedInfo *elist, uint32_t *num_events, uint32_t index)
+// window widening to cover advertiser and our own clock drift
+static inline uint32_t train_widening(const struct PeriodicTrain *t)
 {
-    if (index >= *num_events)
-        return;
+    // assume our clock is 50 ppm, drift accumulates over missed events
+    uint32_t ppm = t->sca_ppm + 50;
+    return (uint32_t)(((uint64_t)t->interval * (t->missed + 1) * ppm) / 1000000);
+}
 
-    memmove(elist + index, elist + index + 1,
-            sizeof(struct AuxSchedInfo) * (*num_events - index - 1));
+static inline uint32_t train_start(const struct PeriodicTrain *t)
+{
+    return t->anchor - PERIODIC_LEAD_TICKS - train_widening(t);
+}
 
-    *num_events -= 1;
+static inline uint32_t train_end(const struct PeriodicTrain *t)
+{
+    // long enough for a maximum length packet (~17 ms coded, ~2 ms 1M)
+    uint32_t listen = (t->phy == PHY_CODED) ? 18000 * 4 : 3000 * 4;
+    return t->anchor + listen + train_widening(t);
 }
 
-bool AuxAdvScheduler_insert(uint8_t chan, PHY_Mode phy, uint32_t radio_time, uint32_t duration)
+static struct PeriodicTrain *find_train(uint32_t aa)
 {
-    struct AuxSchedInfo e;
-    e.chan = chan;
-    e.phy = phy;
-    e.radio_time = radio_time;
-    e.duration = duration;
+    int i;
+
+    for (i = 0; i < MAX_PERIODIC_TRAINS; i++)
+    {
+        if (trains[i].active && trains[i].aa == aa)
+            return trains + i;
+    }
+
+    return NULL;
+}
+
+/* SyncInfo format (little endian):
+ * Bits 0-12:   Sync Packet Offset
+ * Bit 13:      Offset Units (0 = 30 us, 1 = 300 us)
+ * Bit 14:      Offset Adjust (add 2.4576 s)
+ * Bytes 2-3:   Interval (1.25 ms units)
+ * Bytes 4-8:   ChM (37 bits), SCA (upper 3 bits)
+ * Bytes 9-12:  AA
+ * Bytes 13-15: CRCInit
+ * Bytes 16-17: Event Counter
+ */
+bool AuxAdvScheduler_addPeriodic(const uint8_t *syncInfo, PHY_Mode phy,
+        uint32_t pkt_radio_time)
+{
+    static const uint16_t sca_ppm_table[8] = {500, 250, 150, 100, 75, 50, 30, 20};
+    struct PeriodicTrain *t;
+    uint16_t offsetField, interval;
+    uint32_t offsetUs;
+    uint64_t chanMap = 0;
+    uint32_t aa;
+    int i;
+
+    memcpy(&offsetField, syncInfo, 2);
+    memcpy(&interval, syncInfo + 2, 2);
+    memcpy(&aa, syncInfo + 9, 4);
+
+    // offset of zero means the sync packet is too far away to express
+    if ((offsetField & 0x1FFF) == 0 || interval < 6)
+        return false;
+
+    offsetUs = (offsetField & 0x1FFF) * ((offsetField & 0x2000) ? 300 : 30);
+    if (offsetField & 0x4000)
+        offsetUs += 2457600;
 
-    return insert_event_sorted(&e, aux_events, &num_aux_events, MAX_AUX_EVENTS);
+    // already following this train? just refresh the timing
+    t = find_train(aa);
+    if (!t)
+    {
+        for (i = 0; i < MAX_PERIODIC_TRAINS; i++)
+        {
+            if (!trains[i].active)
+            {
+                t = trains + i;
+                break;
+            }
+        }
+    }
+    if (!t)
+        return false;
+
+    memcpy(&chanMap, syncInfo + 4, 5);
+    t->sca_ppm = sca_ppm_table[(chanMap >> 37) & 0x7];
+    chanMap &= 0x1FFFFFFFFFULL;
+    if (chanMap == 0)
+        return false;
+
+    t->phy = phy;
+    t->aa = aa;
+    t->crcInit = 0;
+    memcpy(&t->crcInit, syncInfo + 13, 3);
+    memcpy(&t->eventCounter, syncInfo + 16, 2);
+    t->interval = interval * 5000; // 4 MHz clock, 1.25 ms per unit
+    t->anchor = pkt_radio_time + offsetUs * 4;
+    t->missed = 0;
+    csa2_computeMappingCtx(&t->csa2, aa, chanMap);
+    t->active = true;
+
+    return true;
+}
+
+void AuxAdvScheduler_periodicSeen(uint32_t aa, uint32_t radio_time)
+{
+    struct PeriodicTrain *t = find_train(aa);
+    int32_t diff;
+
+    if (!t)
+        return;
+
+    // only the packet that anchors the current event, not chained packets
+    // chained packets start at least 300 us after the previous one ends
+    diff = (int32_t)(radio_time - t->anchor);
+    if (diff < 0) diff = -diff;
+    if ((uint32_t)diff > SYNC_ANCHOR_TOL + train_widening(t))
+        return;
+
+    // re-anchor on the observed packet to cancel out drift
+    t->anchor = radio_time + t->interval;
+    t->eventCounter++;
+    t->missed = 0;
 }
 
 static void sched_clear_past(uint32_t cur_radio_time)
 {
-    for (int i = 0; i < num_aux_events; i++)
+    uint32_t i, kept = 0;
+
+    // heap is ordered by start, not end, so compact then rebuild the heap
+    for (i = 0; i < num_aux_events; i++)
     {
         struct AuxSchedInfo *e = aux_events + i;
-        uint32_t etime = e->radio_time + e->duration;
-        if (etime < cur_radio_time) {
-            sched_list_pop(aux_events, &num_aux_events, i);
-            i--; // deal with list shift
+        if (!time_before(e->radio_time + e->duration, cur_radio_time))
+            aux_events[kept++] = *e;
+    }
+    if (kept != num_aux_events)
+    {
+        num_aux_events = kept;
+        heapify();
+    }
+
+    // advance trains past events that ended without us seeing a packet
+    for (i = 0; i < MAX_PERIODIC_TRAINS; i++)
+    {
+        struct PeriodicTrain *t = trains + i;
+        while (t->active && time_before(train_end(t), cur_radio_time))
+        {
+            t->anchor += t->interval;
+            t->eventCounter++;
+            if (++t->missed > PERIODIC_MAX_MISSED)
+                t->active = false;
         }
     }
 }
 
-// return value is the radio time until which the returned chan and phy remain valid
-// chan 0xFF means nothing scheduled right now
-uint32_t AuxAdvScheduler_next(uint32_t radio_time, uint8_t *chan, PHY_Mode *phy)
+uint32_t AuxAdvScheduler_next(uint32_t radio_time, uint8_t *chan, PHY_Mode *phy,
+        uint32_t *aa, uint32_t *crcInit)
 {
-    int32_t time_to_soonest_aux = 0x7FFFFFFF;
+    struct PeriodicTrain *soonestTrain = NULL;
+    uint32_t soonest = radio_time + 0x7FFFFFFF;
+    uint32_t i;
 
     // clean up first
     sched_clear_past(radio_time);
 
-    // priority is: (non-periodic) aux, then regular advertising (0xFF do whatever)
+    for (i = 0; i < MAX_PERIODIC_TRAINS; i++)
+    {
+        if (trains[i].active && time_before(train_start(trains + i), soonest))
+        {
+            soonestTrain = trains + i;
+            soonest = train_start(trains + i);
+        }
+    }
+
     // (lazy) first come first serve for overlapping events
-    if (num_aux_events)
-        time_to_soonest_aux = (int32_t)(aux_events[0].radio_time - radio_time);
+    if (num_aux_events && !time_before(soonest, aux_events[0].radio_time))
+    {
+        soonestTrain = NULL;
+        soonest = aux_events[0].radio_time;
+    }
 
-    if (time_to_soonest_aux <= 0)
+    if (!time_before(radio_time, soonest))
     {
         // top priority, stay as long as it lasts
-        *chan = aux_events[0].chan;
-        *phy = aux_events[0].phy;
-        return aux_events[0].radio_time + aux_events[0].duration;
+        if (soonestTrain)
+        {
+            *chan = csa2_computeChannelCtx(&soonestTrain->csa2,
+                    soonestTrain->eventCounter);
+            *phy = soonestTrain->phy;
+            if (aa) *aa = soonestTrain->aa;
+            if (crcInit) *crcInit = soonestTrain->crcInit;
+            return train_end(soonestTrain);
+        } else {
+            *chan = aux_events[0].chan;
+            *phy = aux_events[0].phy;
+            if (aa) *aa = aux_events[0].aa;
+            if (crcInit) *crcInit = aux_events[0].crcInit;
+            return aux_events[0].radio_time + aux_events[0].duration;
+        }
     }
 
-    // no aux happening
+    // nothing happening
     *chan = 0xFF;
     *phy = PHY_1M;
-    return radio_time + time_to_soonest_aux;
+    return soonest;
 }
 
 void AuxAdvScheduler_reset(void)
 {
     num_aux_events = 0;
-    memset(aux_events, 0, sizeof(struct AuxSchedInfo) * MAX_AUX_EVENTS);
+    memset(aux_events, 0, sizeof(aux_events));
+    memset(trains, 0, sizeof(trains));
 }
@@ -1,6 +1,6 @@
 /*
  * Written by Sultan Qasim Khan
- * Copyright (c) 2019, NCC Group plc
+ * Copyright (c) 2019-2020, NCC Group plc
  * Released as open source under GPLv3
  */
 
@@ -11,9 +11,28 @@
 #include <stdint.h>
 #include <RadioWrapper.h>
 
-bool AuxAdvScheduler_insert(uint8_t chan, PHY_Mode phy,
-        uint32_t radio_time, uint32_t duration);
-uint32_t AuxAdvScheduler_next(uint32_t radio_time, uint8_t *chan, PHY_Mode *phy);
+// max pending aux packets, and max periodic advertising trains followed
+#define MAX_AUX_EVENTS 64
+#define MAX_PERIODIC_TRAINS 4
+
+// aa and crcInit are the access address and CRC init to listen with
+bool AuxAdvScheduler_insert(uint8_t chan, PHY_Mode phy, uint32_t aa,
+        uint32_t crcInit, uint32_t radio_time, uint32_t duration);
+
+// Start following the periodic advertising train described by an 18 byte
+// SyncInfo field, received in a packet starting at pkt_radio_time
+bool AuxAdvScheduler_addPeriodic(const uint8_t *syncInfo, PHY_Mode phy,
+        uint32_t pkt_radio_time);
+
+// Report a packet received at radio_time on a periodic train's access address
+void AuxAdvScheduler_periodicSeen(uint32_t aa, uint32_t radio_time);
+
+// return value is the radio time until which the returned values remain valid
+// chan 0xFF means nothing scheduled right now
+// aa and crcInit may be NULL if not needed
+uint32_t AuxAdvScheduler_next(uint32_t radio_time, uint8_t *chan, PHY_Mode *phy,
+        uint32_t *aa, uint32_t *crcInit);
+
 void AuxAdvScheduler_reset(void);
 
 #endif
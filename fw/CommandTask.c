@@ -18,6 +18,15 @@
 #include <PacketTask.h>
 #include <messenger.h>
 #include <TXQueue.h>
+#include <stats.h>
+#include <mac_filter.h>
+#include <pdu_filter.h>
+#include <adv_agg.h>
+#include <testgen.h>
+#include <timebase.h>
+#include <ll_crypto.h>
+#include <adv_sweep.h>
+#include <adv_sets.h>
 
 #include <ti/sysbios/BIOS.h>
 #include <ti/sysbios/knl/Task.h>
@@ -39,6 +48,8 @@ static uint8_t msgBuf[MESSAGE_MAX];
 
 /***** Prototypes *****/
 static void commandTaskFunction(UArg arg0, UArg arg1);
+static bool handleCommand(uint8_t *msg, int len, bool apply);
+static bool handleMulti(uint8_t seq, uint8_t *recs, int len);
 
 /***** Function definitions *****/
 void CommandTask_init(void) {
@@ -60,95 +71,394 @@ static void commandTaskFunction(UArg arg0, UArg arg1)
     {
         ret = messenger_recv(msgBuf);
 
-        /* ignore errors and empty messages
-         * first byte is length / 4
+        // empty messages are used for resynchronization
+        if (ret == 0) continue;
+
+        /* first byte is length / 4
          * second byte is opcode
          */
-        if (ret < 2) continue;
+        if (ret < 2 || !handleCommand(msgBuf, ret, true))
+            stats.cmdErrors++;
+    }
+}
 
-        switch (msgBuf[1])
+/* Returns false if the command was malformed or invalid. With apply false,
+ * the command is only checked, with nothing changed, so COMMAND_MULTI can
+ * check every record first. Once checked, a command applies successfully,
+ * short of hardware faults (eg. the sync pin failing to open). Filter table
+ * additions and removals depend on the table's contents, so they always fail
+ * the check, and can't be part of a COMMAND_MULTI.
+ */
+static bool handleCommand(uint8_t *msg, int len, bool apply)
+{
+    switch (msg[1])
+    {
+    case COMMAND_SETCHANAAPHY:
+        if (len != 12) return false;
+        if (msg[2] > 39) return false;
+        if (msg[7] > 2) return false;
+        if (!apply) break;
+        setChanAAPHYCRCI(msg[2], *(uint32_t *)(msg + 3),
+                (PHY_Mode)msg[7], *(uint32_t *)(msg + 8));
+        break;
+    case COMMAND_PAUSEDONE:
+        if (len != 3) return false;
+        if (!apply) break;
+        pauseAfterSniffDone(msg[2] ? true : false);
+        break;
+    case COMMAND_RSSIFILT:
+        if (len != 3) return false;
+        if (!apply) break;
+        setMinRssi((int8_t)msg[2]);
+        break;
+    case COMMAND_MACFILT:
+        if (!apply) break;
+        if (len == 8)
+            setMacFilt(true, msg + 2); // filter to supplied MAC
+        else
+            setMacFilt(false, NULL); // disable MAC filter
+        break;
+    case COMMAND_ADVHOP:
+        if (len != 2) return false;
+        if (!apply) break;
+        advHopSeekMode();
+        break;
+    case COMMAND_FOLLOW:
+        if (len != 3) return false;
+        if (!apply) break;
+        setFollowConnections(msg[2] ? true : false);
+        break;
+    case COMMAND_AUXADV:
+        if (len != 3) return false;
+        if (!apply) break;
+        setAuxAdvEnabled(msg[2] ? true : false);
+        break;
+    case COMMAND_RESET:
+        if (len != 2) return false;
+        if (!apply) break;
+        SysCtrlSystemReset();
+        break;
+    case COMMAND_MARKER:
+        if (len != 2) return false;
+        if (!apply) break;
+        sendMarker();
+        break;
+    case COMMAND_TRANSMIT:
+        if (len < 4) return false;
+        // msg[2] is LLID, msg[3] is length of data
+        if (len != msg[3] + 4) return false;
+        if (!apply) break;
+        TXQueue_insert(msg[3], msg[2], msg + 4);
+        break;
+    case COMMAND_CONNECT:
+        // 1 byte len, 1 byte opcode, 1 byte RxAdd, 6 byte peer addr, 22 byte LLData,
+        // optional 1 byte to cycle through primary channels
+        if (len != 31 && len != 32) return false;
+        if (!apply) break;
+        initiateConn(msg[2] != 0, msg + 3, msg + 9, len == 32 && msg[31]);
+        break;
+    case COMMAND_SETADDR:
+        if (len != 9) return false;
+        if (!apply) break;
+        setAddr(msg[2] != 0, msg + 3);
+        break;
+    case COMMAND_ADVERTISE:
+        // 1 byte len, 1 byte opcode,
+        // 1 byte adv len, 31 byte adv, 1 byte scanRsp len, 31 byte scanRsp
+        if (len != 66) return false;
+        if (msg[2] > 31) return false;
+        if (msg[34] > 31) return false;
+        if (!apply) break;
+        advertise(msg + 3, msg[2], msg + 35, msg[34]);
+        break;
+    case COMMAND_ADVINTRVL:
+    {
+        if (len != 4) return false;
+        uint16_t intervalMs;
+        memcpy(&intervalMs, msg + 2, 2);
+        if (intervalMs < 20) return false;
+        if (!apply) break;
+        setAdvInterval(intervalMs);
+        break;
+    }
+    case COMMAND_SETIRK:
+        if (!apply) break;
+        if (len == 18)
+            setRpaFilt(true, msg + 2); // filter to supplied IRK
+        else
+            setRpaFilt(false, NULL); // disable RPA filter
+        break;
+    case COMMAND_SETFRAMING:
+        if (len != 3) return false;
+        if (msg[2] > MESSENGER_FRAMING_COBS) return false;
+        if (!apply) break;
+        messenger_set_framing(msg[2]);
+        break;
+    case COMMAND_BATCHING:
+    {
+        // 1 byte len, 1 byte opcode, 2 byte max length, 2 byte linger microseconds
+        if (len != 6) return false;
+        if (!apply) break;
+        uint16_t maxLen, lingerUs;
+        memcpy(&maxLen, msg + 2, 2);
+        memcpy(&lingerUs, msg + 4, 2);
+        setBatching(maxLen, lingerUs);
+        break;
+    }
+    case COMMAND_STATS:
+    {
+        // 1 byte len, 1 byte opcode, 2 byte period (ms, 0 for once)
+        if (len != 4) return false;
+        if (!apply) break;
+        uint16_t periodMs;
+        memcpy(&periodMs, msg + 2, 2);
+        stats_request(periodMs);
+        break;
+    }
+    case COMMAND_TXSTATUS:
+        // 1 byte len, 1 byte opcode, 1 byte counter reset flag
+        if (len != 3) return false;
+        if (!apply) break;
+        if (msg[2])
+            TXQueue_resetCounters();
+        TXQueue_reportStatus(TXSTATUS_REQUESTED);
+        break;
+    case COMMAND_MACTBL:
+        // 1 byte len, 1 byte opcode, 1 byte table op, 6 byte MAC (add/remove)
+        if (len == 3 && msg[2] == FILTTBL_CLEAR)
         {
-        case COMMAND_SETCHANAAPHY:
-            if (ret != 12) continue;
-            if (msgBuf[2] > 39) continue;
-            if (msgBuf[7] > 2) continue;
-            setChanAAPHYCRCI(msgBuf[2], *(uint32_t *)(msgBuf + 3),
-                    (PHY_Mode)msgBuf[7], *(uint32_t *)(msgBuf + 8));
-            break;
-        case COMMAND_PAUSEDONE:
-            if (ret != 3) continue;
-            pauseAfterSniffDone(msgBuf[2] ? true : false);
-            break;
-        case COMMAND_RSSIFILT:
-            if (ret != 3) continue;
-            setMinRssi((int8_t)msgBuf[2]);
-            break;
-        case COMMAND_MACFILT:
-            if (ret == 8)
-                setMacFilt(true, msgBuf + 2); // filter to supplied MAC
-            else
-                setMacFilt(false, NULL); // disable MAC filter
-            break;
-        case COMMAND_ADVHOP:
-            if (ret != 2) continue;
-            advHopSeekMode();
+            if (apply) mac_filter_clear();
             break;
-        case COMMAND_FOLLOW:
-            if (ret != 3) continue;
-            setFollowConnections(msgBuf[2] ? true : false);
-            break;
-        case COMMAND_AUXADV:
-            if (ret != 3) continue;
-            setAuxAdvEnabled(msgBuf[2] ? true : false);
-            break;
-        case COMMAND_RESET:
-            if (ret != 2) continue;
-            SysCtrlSystemReset();
-            break;
-        case COMMAND_MARKER:
-            if (ret != 2) continue;
-            sendMarker();
-            break;
-        case COMMAND_TRANSMIT:
-            if (ret < 4) continue;
-            // msgBuf[2] is LLID, msgBuf[3] is length of data
-            if (ret != msgBuf[3] + 4) continue;
-            TXQueue_insert(msgBuf[3], msgBuf[2], msgBuf + 4);
-            break;
-        case COMMAND_CONNECT:
-            // 1 byte len, 1 byte opcode, 1 byte RxAdd, 6 byte peer addr, 22 byte LLData
-            if (ret != 31) continue;
-            initiateConn(msgBuf[2] != 0, msgBuf + 3, msgBuf + 9);
-            break;
-        case COMMAND_SETADDR:
-            if (ret != 9) continue;
-            setAddr(msgBuf[2] != 0, msgBuf + 3);
-            break;
-        case COMMAND_ADVERTISE:
-            // 1 byte len, 1 byte opcode,
-            // 1 byte adv len, 31 byte adv, 1 byte scanRsp len, 31 byte scanRsp
-            if (ret != 66) continue;
-            if (msgBuf[2] > 31) continue;
-            if (msgBuf[34] > 31) continue;
-            advertise(msgBuf + 3, msgBuf[2], msgBuf + 35, msgBuf[34]);
+        }
+        // adding or removing depends on the table's contents, so can't be checked
+        if (len != 9 || !apply) return false;
+        if (msg[2] == FILTTBL_ADD) return mac_filter_add(msg + 3);
+        if (msg[2] == FILTTBL_REMOVE) return mac_filter_remove(msg + 3);
+        return false;
+    case COMMAND_IRKTBL:
+        // 1 byte len, 1 byte opcode, 1 byte table op, 16 byte IRK (add/remove)
+        if (len == 3 && msg[2] == FILTTBL_CLEAR)
+        {
+            if (apply) irk_filter_clear();
             break;
-        case COMMAND_ADVINTRVL:
+        }
+        // adding or removing depends on the table's contents, so can't be checked
+        if (len != 19 || !apply) return false;
+        if (msg[2] == FILTTBL_ADD) return irk_filter_add(msg + 3);
+        if (msg[2] == FILTTBL_REMOVE) return irk_filter_remove(msg + 3);
+        return false;
+    case COMMAND_FOLLOWCONN:
+    {
+        // 1 byte len, 1 byte opcode, 1 byte flags, 1 byte PHY,
+        // 4 byte request timestamp, 22 byte LLData
+        if (len != 30) return false;
+        if (msg[3] > 2) return false;
+        if (!apply) break;
+        uint32_t connTime;
+        memcpy(&connTime, msg + 4, 4);
+        followConn((PHY_Mode)msg[3], connTime, (msg[2] & FOLLOWCONN_CSA2) != 0,
+                (msg[2] & FOLLOWCONN_AUX) != 0, msg + 8);
+        break;
+    }
+    case COMMAND_FRAMEFMT:
+        // 1 byte len, 1 byte opcode, 1 byte FRAMEFMT flags
+        if (len != 3) return false;
+        if (msg[2] & ~(FRAMEFMT_TS64 | FRAMEFMT_AA | FRAMEFMT_SEQ | FRAMEFMT_COMPACT))
+            return false;
+        if (!apply) break;
+        setFrameFormat(msg[2]);
+        break;
+    case COMMAND_SYNC:
+    {
+        // 1 byte len, 1 byte opcode, 1 byte mode, 2 byte pulse period (ms)
+        if (len != 5) return false;
+        uint16_t periodMs;
+        memcpy(&periodMs, msg + 3, 2);
+        if (msg[2] > SYNC_OUTPUT) return false;
+        if (msg[2] == SYNC_OUTPUT && periodMs < 2) return false;
+        if (!apply) break;
+        return timebase_setSync(msg[2], periodMs);
+    }
+    case COMMAND_PDUFILT:
+        // 1 byte len, 1 byte opcode, 1 byte table op, rule (add)
+        if (len == 3 && msg[2] == FILTTBL_CLEAR)
         {
-            if (ret != 4) continue;
-            uint16_t intervalMs;
-            memcpy(&intervalMs, msgBuf + 2, 2);
-            if (intervalMs < 20) continue;
-            setAdvInterval(intervalMs);
+            if (apply) pdu_filter_clear();
             break;
         }
-        case COMMAND_SETIRK:
-            if (ret == 18)
-                setRpaFilt(true, msgBuf + 2); // filter to supplied IRK
-            else
-                setRpaFilt(false, NULL); // disable RPA filter
+        // adding fails if the table is full, so can't be checked
+        if (len <= 3 || msg[2] != FILTTBL_ADD || !apply) return false;
+        return pdu_filter_add(msg + 3, len - 3);
+    case COMMAND_ADVAGG:
+    {
+        // 1 byte len, 1 byte opcode, 2 byte summary period (ms, 0 to disable)
+        if (len != 4) return false;
+        if (!apply) break;
+        uint16_t periodMs;
+        memcpy(&periodMs, msg + 2, 2);
+        adv_agg_set(periodMs);
+        break;
+    }
+    case COMMAND_SNAPLEN:
+    {
+        // 1 byte len, 1 byte opcode, 2 byte adv snap length, 2 byte data snap length
+        if (len != 6) return false;
+        if (!apply) break;
+        uint16_t advLen, dataLen;
+        memcpy(&advLen, msg + 2, 2);
+        memcpy(&dataLen, msg + 4, 2);
+        setSnapLen(advLen, dataLen);
+        break;
+    }
+    case COMMAND_TESTGEN:
+    {
+        // 1 byte len, 1 byte opcode, 2 byte frame length,
+        // 4 byte frames per second (0 to stop), 4 byte frame count (0 for no limit)
+        if (len != 12) return false;
+        uint16_t frameLen;
+        uint32_t rate, count;
+        memcpy(&frameLen, msg + 2, 2);
+        memcpy(&rate, msg + 4, 4);
+        memcpy(&count, msg + 8, 4);
+        if (rate && (frameLen < TESTGEN_MIN_LEN || frameLen > TESTGEN_MAX_LEN))
+            return false;
+        if (!apply) break;
+        return testgen_start(frameLen, rate, count);
+    }
+    case COMMAND_CONNMAX:
+        // 1 byte len, 1 byte opcode, 1 byte connection count (1 to 4)
+        if (len != 3) return false;
+        if (msg[2] < 1 || msg[2] > 4) return false;
+        if (!apply) break;
+        setConnMax(msg[2]);
+        break;
+    case COMMAND_ACQUIRE:
+    {
+        // 1 byte len, 1 byte opcode, 4 byte access address,
+        // 5 byte channel map, 1 byte PHY
+        if (len != 12) return false;
+        if (msg[11] > 2) return false;
+        uint32_t aa;
+        uint64_t chanMap = 0;
+        memcpy(&aa, msg + 2, 4);
+        memcpy(&chanMap, msg + 6, 5);
+        if (chanMap >> 37 || __builtin_popcountll(chanMap) < 2) return false;
+        if (!apply) break;
+        acquireConn(aa, chanMap, (PHY_Mode)msg[11]);
+        break;
+    }
+    case COMMAND_LTK:
+        // 1 byte len, 1 byte opcode, 16 byte LTK (MSB first), or none to clear
+        if (len != 2 && len != 18) return false;
+        if (!apply) break;
+        ll_crypto_setLTK(len == 18 ? msg + 2 : NULL);
+        break;
+    case COMMAND_SWEEP:
+        // 1 byte len, 1 byte opcode, 1 byte PHY mask (1M, coded), 0 to stop
+        if (len != 3) return false;
+        if (msg[2] & ~(SWEEP_PHY_1M | SWEEP_PHY_CODED)) return false;
+        if (!apply) break;
+        setAdvSweep(msg[2]);
+        break;
+    case COMMAND_ADVSET:
+    {
+        // 1 byte len, 1 byte opcode, 1 byte set index, 1 byte flags
+        // (enable, extended), 2 byte interval (ms), 1 byte adv len, adv,
+        // 1 byte scanRsp len, scanRsp
+        if (len < 4) return false;
+        if (msg[2] >= ADV_SETS_MAX) return false;
+        if (!(msg[3] & 0x01))
+        {
+            if (len != 4) return false;
+            if (apply) removeAdvSet(msg[2]);
             break;
-        default:
+        }
+        if (len < 8 + msg[6] || len != 8 + msg[6] + msg[7 + msg[6]]) return false;
+        bool extended = msg[3] & 0x02 ? true : false;
+        if (msg[6] > (extended ? ADV_EXT_DATA_MAX : ADV_LEGACY_DATA_MAX)) return false;
+        if (msg[7 + msg[6]] > (extended ? 0 : ADV_LEGACY_DATA_MAX)) return false;
+        uint16_t intervalMs;
+        memcpy(&intervalMs, msg + 4, 2);
+        if (intervalMs < 20) return false;
+        if (!apply) break;
+        return advertiseSet(msg[2], extended, intervalMs,
+                msg + 7, msg[6], msg + 8 + msg[6], msg[7 + msg[6]]);
+    }
+    case COMMAND_FLUSH:
+        // 1 byte len, 1 byte opcode, 1 byte sequence number
+        if (len != 3) return false;
+        if (!apply) break;
+        flushPackets(msg[2]);
+        break;
+    case COMMAND_MULTI:
+        // 1 byte len, 1 byte opcode, 1 byte sequence number, records
+        if (len < 3 || !apply) return false;
+        return handleMulti(msg[2], msg + 3, len - 3);
+    default:
+        return false;
+    }
+
+    return true;
+}
+
+// PacketTask turns this into a MESSAGE_CMDACK
+static void sendCmdAck(uint8_t seq, uint8_t status, uint8_t count)
+{
+    BLE_Frame frame;
+    uint8_t buf[3];
+
+    buf[0] = seq;
+    buf[1] = status;
+    buf[2] = count;
+
+    frame.timestamp = 0;
+    frame.rssi = 0;
+    frame.channel = 45; // indicates command ack
+    frame.phy = PHY_1M;
+    frame.pData = buf;
+    frame.pEntry = NULL;
+    frame.length = sizeof(buf);
+
+    indicatePacket(&frame);
+}
+
+/* Each record is a 1 byte length (of opcode and args), opcode, and args.
+ * Record framing, then every record's arguments, are checked before anything
+ * is applied, so a bad record leaves the configuration untouched. RadioTask
+ * may still run in between records being applied, if a handler blocks (eg.
+ * in the RF driver stopping the radio).
+ */
+static bool handleMulti(uint8_t seq, uint8_t *recs, int len)
+{
+    uint8_t status = CMDACK_OK;
+    uint8_t count = 0;
+    int i;
+
+    for (i = 0; i < len; i += recs[i] + 1)
+    {
+        if (recs[i] == 0 || i + 1 + recs[i] > len ||
+                recs[i + 1] == COMMAND_MULTI || recs[i + 1] == COMMAND_RESET)
+        {
+            status = CMDACK_MALFORMED;
             break;
         }
     }
+
+    // record length byte stands in for the usual length header
+    for (i = 0; status == CMDACK_OK && i < len; i += recs[i] + 1)
+    {
+        if (!handleCommand(recs + i, recs[i] + 1, false))
+            status = CMDACK_FAILED;
+    }
+
+    for (i = 0; status == CMDACK_OK && i < len; i += recs[i] + 1)
+    {
+        if (handleCommand(recs + i, recs[i] + 1, true))
+            count++;
+        else
+            status = CMDACK_FAILED;
+    }
+
+    sendCmdAck(seq, status, count);
+    return status == CMDACK_OK;
 }
@@ -25,5 +25,39 @@ void CommandTask_init(void);
 #define COMMAND_ADVERTISE       0x1C
 #define COMMAND_ADVINTRVL       0x1D
 #define COMMAND_SETIRK          0x1E
+#define COMMAND_SETFRAMING      0x1F
+#define COMMAND_BATCHING        0x20
+#define COMMAND_STATS           0x21
+#define COMMAND_MACTBL          0x22
+#define COMMAND_IRKTBL          0x23
+#define COMMAND_TXSTATUS        0x24
+#define COMMAND_MULTI           0x25
+#define COMMAND_FOLLOWCONN      0x26
+#define COMMAND_FRAMEFMT        0x27
+#define COMMAND_SYNC            0x28
+#define COMMAND_PDUFILT         0x29
+#define COMMAND_ADVAGG          0x2A
+#define COMMAND_SNAPLEN         0x2B
+#define COMMAND_TESTGEN         0x2C
+#define COMMAND_CONNMAX         0x2D
+#define COMMAND_ACQUIRE         0x2E
+#define COMMAND_LTK             0x2F
+#define COMMAND_SWEEP           0x30
+#define COMMAND_ADVSET          0x31
+#define COMMAND_FLUSH           0x32
+
+// operations for COMMAND_MACTBL, COMMAND_IRKTBL, and COMMAND_PDUFILT
+#define FILTTBL_CLEAR           0x00
+#define FILTTBL_ADD             0x01
+#define FILTTBL_REMOVE          0x02
+
+// flags for COMMAND_FOLLOWCONN
+#define FOLLOWCONN_CSA2         0x01
+#define FOLLOWCONN_AUX          0x02
+
+// status codes in MESSAGE_CMDACK for COMMAND_MULTI
+#define CMDACK_OK               0x00
+#define CMDACK_MALFORMED        0x01 // bad record framing, nothing applied
+#define CMDACK_FAILED           0x02 // a sub-command was rejected, nothing applied
 
 #endif /* COMMANDTASK_H */
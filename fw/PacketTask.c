@@ -8,22 +8,32 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
-#include <stdatomic.h>
 #include <xdc/std.h>
 #include <xdc/runtime/System.h>
 
 #include <RadioTask.h>
 #include <RadioWrapper.h>
+#include <PacketTask.h>
 #include <messenger.h>
-#include <rpa_resolver.h>
+#include <mac_filter.h>
+#include <pdu_filter.h>
+#include <adv_agg.h>
+#include <stats.h>
+#include <byte_ring.h>
+#include <timebase.h>
+#include <testgen.h>
+#include <trace.h>
 
 #include <ti/sysbios/BIOS.h>
 #include <ti/sysbios/knl/Task.h>
 #include <ti/sysbios/knl/Semaphore.h>
 #include <ti/sysbios/knl/Event.h>
+#include <ti/sysbios/knl/Clock.h>
+#include <ti/sysbios/hal/Hwi.h>
 
 /* Drivers */
 #include <ti/drivers/PIN.h>
+#include <ti/drivers/rf/RF.h>
 
 /* Board Header files */
 #include "ti_drivers_config.h"
@@ -34,8 +44,24 @@
 
 #define RX_ACTIVITY_LED CONFIG_PIN_RLED
 
-/***** Type declarations *****/
+// frames are sent in full at least this often (microseconds) in compact mode,
+// so the host's reference time is never stale for long
+#define COMPACT_SYNC_US 100000
+
+// frame timestamps are 30 bits (4 MHz ticks >> 2)
+#define FRAME_TS_MASK 0x3FFFFFFF
 
+/***** Type declarations *****/
+typedef struct
+{
+    BLE_Frame frame;        // length is after snapping
+    uint16_t origLength;    // length as received
+    uint32_t queueTime;     // radio time when queued, for latency stats
+    uint32_t accessAddr;    // for FRAMEFMT_AA
+    bool decrypted;         // for FRAMEFMT_DECRYPTED
+    LLCryptoRetry retry;    // to decrypt before sending, queued unsnapped
+    uint16_t seq;           // for FRAMEFMT_SEQ
+} QueuedFrame;
 
 /***** Variable declarations *****/
 static Task_Params packetTaskParams;
@@ -45,15 +71,33 @@ static Semaphore_Handle packetAvailSem;
 
 static int8_t minRssi = -128;
 
-static uint8_t targMac[6];
-static bool filterMacs = false;
+// max batch message length (0 disables batching), and linger in clock ticks
+static volatile uint16_t batchMax = 0;
+static volatile uint32_t batchLinger = 0;
+
+// FRAMEFMT flags for frame messages
+static volatile uint8_t frameFormat = 0;
+
+// bytes of advertising and data channel frames sent to host (0 for all)
+static volatile uint16_t advSnapLen = 0;
+static volatile uint16_t dataSnapLen = 0;
+
+// timestamp of the last frame sent in full, which compact frames are relative
+// to, so a compact frame lost by the host doesn't shift those after it
+static uint32_t syncTs = 0;
+static bool syncValid = false;
+
+// next FRAMEFMT_SEQ number, counting frames dropped for lack of queue space
+static uint16_t frameSeq = 0;
 
-static uint8_t targIrk[16];
-static bool filterRpas = false;
+// set by flushPackets, for PacketTask to act on before sending anything more
+static volatile bool flushReq = false;
+static volatile uint8_t flushSeq = 0;
 
 /***** Prototypes *****/
 static void packetTaskFunction(UArg arg0, UArg arg1);
 static bool macFilterCheck(BLE_Frame *frame);
+static uint16_t snapLength(const BLE_Frame *frame);
 
 /* Pin driver handle */
 static PIN_Handle ledPinHandle;
@@ -65,28 +109,32 @@ static PIN_Config ledPinTable[] = {
     PIN_TERMINATE
 };
 
-// size must be a power of 2
-#define JANKY_QUEUE_SIZE 8u
-#define JANKY_QUEUE_MASK (JANKY_QUEUE_SIZE - 1)
-
 // 255+2=257 is the most we need, but use 260 for better alignment/performance
 #define PACKET_SIZE 260
 
-static uint8_t packet_buf[PACKET_SIZE*JANKY_QUEUE_SIZE];
-static BLE_Frame s_frames[JANKY_QUEUE_SIZE];
+// frames not backed by an RF queue entry (debug prints, markers, states)
+// are small, and get copied into the queue (up to this size)
+#define COPY_SIZE 128
 
-static volatile atomic_uint queue_head; // insert here
-static volatile atomic_uint queue_tail; // take out item from here
+// RF backed frames this small are copied too, so their entry is freed
+// right away; bigger frames keep their RF queue entry till they're sent
+#define COPY_THRESH 64
 
-/***** Function definitions *****/
-void PacketTask_init(void) {
-    int i;
+// size must be a power of 2
+#define QUEUE_BUF_SIZE 4096u
 
-    /* initialize s_frames */
-    for (i = 0; i < JANKY_QUEUE_SIZE; i++) {
-        s_frames[i].pData = packet_buf + PACKET_SIZE*i;
-    }
+// records are a QueuedFrame, followed by the frame data if copied
+static uint8_t queue_buf[QUEUE_BUF_SIZE] __attribute__ ((aligned (4)));
+static ByteRing frameQueue;
 
+/***** Function definitions *****/
+// frames sent as MESSAGE_BLEFRAME(X), rather than out of band messages
+static inline bool isHostFrame(const BLE_Frame *frame)
+{
+    return frame->channel < 40 || frame->channel == TESTGEN_CHANNEL;
+}
+
+void PacketTask_init(void) {
     /* Open LED pins */
     ledPinHandle = PIN_open(&ledPinState, ledPinTable);
     if (!ledPinHandle)
@@ -95,6 +143,7 @@ void PacketTask_init(void) {
     }
 
     packetAvailSem = Semaphore_create(0, NULL, NULL);
+    ByteRing_init(&frameQueue, queue_buf, sizeof(queue_buf));
 
     // Open UART
     messenger_init();
@@ -107,16 +156,99 @@ void PacketTask_init(void) {
     Task_construct(&packetTask, packetTaskFunction, &packetTaskParams, NULL);
 }
 
-static void sendPacket(BLE_Frame *frame)
+// space needed to build message for frame
+static unsigned maxMessageLen(const BLE_Frame *frame)
 {
-    // static to avoid making stack huge
-    // this is not reentrant!
-    static uint8_t msg_buf[MESSAGE_MAX];
-    uint8_t *msg_ptr = msg_buf;
+    if (frame->channel == 43)
+        return STATS_MESSAGE_MAX;
+    if (frame->channel == 47)
+        return ADVSUMMARY_MESSAGE_MAX;
+    if (frame->channel == 48)
+        return TRACE_MESSAGE_MAX;
+    return frame->length + 22; // worst case MESSAGE_BLEFRAMEX header
+}
 
-    // should never happen
-    if (frame->length > PACKET_SIZE)
-        return;
+// whether a frame can go as MESSAGE_BLEFRAMEC with the given FRAMEFMT flags
+static bool compactOk(const QueuedFrame *qframe, uint8_t fmt)
+{
+    const BLE_Frame *frame = &qframe->frame;
+
+    if (!(fmt & FRAMEFMT_COMPACT) || !syncValid)
+        return false;
+
+    // fields only MESSAGE_BLEFRAMEX has room for
+    if (fmt & (FRAMEFMT_TS64 | FRAMEFMT_AA))
+        return false;
+    if (qframe->origLength > frame->length || frame->length > 0xFF)
+        return false;
+
+    // past due (or before the last full frame) is sent in full
+    return ((frame->timestamp - syncTs) & FRAME_TS_MASK) < COMPACT_SYNC_US;
+}
+
+/* Compact frame message format:
+ * Byte 0:      MESSAGE_BLEFRAMEC
+ * Byte 1:      channel and PHY, as in MESSAGE_BLEFRAME
+ * Bytes 2+:    LEB128 varint, the difference (us) from the timestamp of the
+ *              last frame sent in full shifted left by 2, ORed with
+ *              COMPACT flags
+ * Then 1 byte length, 1 byte RSSI, 16 bit sequence number if COMPACT_SEQ,
+ * and the body.
+ */
+static uint8_t *buildCompact(const QueuedFrame *qframe, uint8_t fmt, uint8_t *msg_ptr)
+{
+    const BLE_Frame *frame = &qframe->frame;
+    uint32_t v;
+
+    *msg_ptr++ = MESSAGE_BLEFRAMEC;
+    *msg_ptr++ = frame->channel | (frame->phy << 6);
+
+    // compactOk made sure this is under COMPACT_SYNC_US
+    v = ((frame->timestamp - syncTs) & FRAME_TS_MASK) << 2;
+    if (fmt & FRAMEFMT_SEQ)
+        v |= COMPACT_SEQ;
+    if (qframe->decrypted)
+        v |= COMPACT_DECRYPTED;
+
+    while (v >= 0x80)
+    {
+        *msg_ptr++ = (v & 0x7F) | 0x80;
+        v >>= 7;
+    }
+    *msg_ptr++ = v;
+
+    *msg_ptr++ = frame->length;
+    *msg_ptr++ = (uint8_t)frame->rssi;
+    if (fmt & FRAMEFMT_SEQ)
+    {
+        memcpy(msg_ptr, &qframe->seq, sizeof(qframe->seq));
+        msg_ptr += sizeof(qframe->seq);
+    }
+
+    memcpy(msg_ptr, frame->pData, frame->length);
+    return msg_ptr + frame->length;
+}
+
+// dst must have room for maxMessageLen(frame) bytes
+// returns length of built message
+static unsigned buildMessage(const QueuedFrame *qframe, uint8_t *dst)
+{
+    const BLE_Frame *frame = &qframe->frame;
+    uint16_t origLength = qframe->origLength;
+    uint8_t *msg_ptr = dst;
+    uint8_t fmt = frameFormat;
+
+    // special case: stats are gathered when it's time to send them
+    if (frame->channel == 43)
+        return stats_buildMessage(dst);
+
+    // same for advertiser summaries
+    if (frame->channel == 47)
+        return adv_agg_buildMessage(dst);
+
+    // and for trace records
+    if (frame->channel == 48)
+        return trace_buildMessage(dst);
 
     // special case: debug prints
     if (frame->channel == 40)
@@ -134,12 +266,94 @@ static void sendPacket(BLE_Frame *frame)
         // bytes 1-4 are timestamp (little endian)
         memcpy(msg_ptr, &frame->timestamp, sizeof(frame->timestamp));
         msg_ptr += sizeof(frame->timestamp);
+
+        // bytes 5-12 are 64 bit timestamp, for hosts that want it
+        uint64_t ts64 = timebase_extend_us(frame->timestamp);
+        memcpy(msg_ptr, &ts64, sizeof(ts64));
+        msg_ptr += sizeof(ts64);
     } else if (frame->channel == 42) {
         // byte 0 is message type
         *msg_ptr++ = MESSAGE_STATE;
 
         // byte 1 is the new state
         *msg_ptr++ = frame->pData[0];
+    } else if (frame->channel == 44) {
+        // byte 0 is message type
+        *msg_ptr++ = MESSAGE_TXSTATUS;
+
+        // bytes 1 and up are TX queue status
+        memcpy(msg_ptr, frame->pData, frame->length);
+        msg_ptr += frame->length;
+    } else if (frame->channel == 45) {
+        // byte 0 is message type
+        *msg_ptr++ = MESSAGE_CMDACK;
+
+        // bytes 1-3 are sequence number, status, and commands applied
+        memcpy(msg_ptr, frame->pData, frame->length);
+        msg_ptr += frame->length;
+    } else if (frame->channel == 46) {
+        // byte 0 is message type
+        *msg_ptr++ = MESSAGE_SYNC;
+
+        // bytes 1-4 are pulse count, bytes 5-12 are 64 bit timestamp
+        memcpy(msg_ptr, frame->pData, frame->length);
+        msg_ptr += frame->length;
+    } else if (compactOk(qframe, fmt)) {
+        msg_ptr = buildCompact(qframe, fmt, msg_ptr);
+    } else if ((fmt & ~FRAMEFMT_COMPACT) || origLength > frame->length || qframe->decrypted) {
+        uint8_t flags = fmt & ~FRAMEFMT_COMPACT;
+
+        // snapped frames always say how long they really were
+        if (origLength > frame->length)
+            flags |= FRAMEFMT_ORIGLEN;
+
+        // and decrypted frames say they were decrypted
+        if (qframe->decrypted)
+            flags |= FRAMEFMT_DECRYPTED;
+
+        // byte 0 is message type, byte 1 is FRAMEFMT flags
+        *msg_ptr++ = MESSAGE_BLEFRAMEX;
+        *msg_ptr++ = flags;
+
+        // then timestamp (little endian), 8 bytes if FRAMEFMT_TS64, else 4
+        if (flags & FRAMEFMT_TS64)
+        {
+            uint64_t ts64 = timebase_extend_us(frame->timestamp);
+            memcpy(msg_ptr, &ts64, sizeof(ts64));
+            msg_ptr += sizeof(ts64);
+        } else {
+            memcpy(msg_ptr, &frame->timestamp, sizeof(frame->timestamp));
+            msg_ptr += sizeof(frame->timestamp);
+        }
+
+        // then length, and original length if FRAMEFMT_ORIGLEN
+        memcpy(msg_ptr, &frame->length, sizeof(frame->length));
+        msg_ptr += sizeof(frame->length);
+        if (flags & FRAMEFMT_ORIGLEN)
+        {
+            memcpy(msg_ptr, &origLength, sizeof(origLength));
+            msg_ptr += sizeof(origLength);
+        }
+
+        // then access address if FRAMEFMT_AA
+        if (flags & FRAMEFMT_AA)
+        {
+            memcpy(msg_ptr, &qframe->accessAddr, sizeof(qframe->accessAddr));
+            msg_ptr += sizeof(qframe->accessAddr);
+        }
+
+        // then sequence number if FRAMEFMT_SEQ
+        if (flags & FRAMEFMT_SEQ)
+        {
+            memcpy(msg_ptr, &qframe->seq, sizeof(qframe->seq));
+            msg_ptr += sizeof(qframe->seq);
+        }
+
+        // then rssi, channel and PHY, and body as in MESSAGE_BLEFRAME
+        *msg_ptr++ = (uint8_t)frame->rssi;
+        *msg_ptr++ = frame->channel | (frame->phy << 6);
+        memcpy(msg_ptr, frame->pData, frame->length);
+        msg_ptr += frame->length;
     } else {
         // byte 0 is message type
         *msg_ptr++ = MESSAGE_BLEFRAME;
@@ -163,11 +377,180 @@ static void sendPacket(BLE_Frame *frame)
         msg_ptr += frame->length;
     }
 
-    messenger_send(msg_buf, msg_ptr - msg_buf);
+    // the host takes compact frame timestamps from the last full one
+    if (isHostFrame(frame) && dst[0] != MESSAGE_BLEFRAMEC)
+    {
+        syncTs = frame->timestamp;
+        syncValid = true;
+    }
+
+    return msg_ptr - dst;
+}
+
+/* Batch message format:
+ * Byte 0:      MESSAGE_BATCH
+ * Then for each contained message:
+ *   Bytes 0-1: message length (little endian)
+ *   Bytes 2+:  message, exactly as it would be sent alone
+ */
+static uint8_t batch_buf[MESSAGE_MAX] = {MESSAGE_BATCH};
+static unsigned batch_len = 1;
+static unsigned batch_cnt = 0;
+
+#if STATS_LATENCY
+// queue times of batched frames that count towards latency stats
+#define BATCH_TIMES_MAX 64
+static uint32_t batch_times[BATCH_TIMES_MAX];
+static unsigned batch_times_cnt = 0;
+
+static inline bool latencyTracked(const BLE_Frame *frame)
+{
+    return isHostFrame(frame);
+}
+#endif
+
+static void flushBatch()
+{
+    // no point wrapping a lone message
+    if (batch_cnt == 1)
+        messenger_send(batch_buf + 3, batch_len - 3);
+    else if (batch_cnt > 1)
+        messenger_send(batch_buf, batch_len);
+
+#if STATS_LATENCY
+    if (batch_times_cnt)
+    {
+        uint32_t now = RF_getCurrentTime();
+        unsigned i;
+
+        for (i = 0; i < batch_times_cnt; i++)
+            stats_latency(latency.rxToUart, now - batch_times[i]);
+        batch_times_cnt = 0;
+    }
+#endif
+
+    batch_len = 1;
+    batch_cnt = 0;
+}
+
+static void sendPacket(const QueuedFrame *qframe, unsigned maxBatch)
+{
+    const BLE_Frame *frame = &qframe->frame;
+    // static to avoid making stack huge
+    // this is not reentrant!
+    static uint8_t msg_buf[MESSAGE_MAX];
+    uint16_t msg_len;
+    unsigned max_len = maxMessageLen(frame);
+
+    // should never happen
+    if (frame->length > PACKET_SIZE)
+        return;
+
+    // 2 more bytes for batch record length
+    if (batch_len + max_len + 2 > maxBatch)
+        flushBatch();
+#if STATS_LATENCY
+    else if (batch_times_cnt == BATCH_TIMES_MAX)
+        flushBatch();
+#endif
+
+    if (batch_len + max_len + 2 > maxBatch)
+    {
+        // batching disabled, or frame too big for a batch
+        messenger_send(msg_buf, buildMessage(qframe, msg_buf));
+#if STATS_LATENCY
+        if (latencyTracked(frame))
+            stats_latency(latency.rxToUart, RF_getCurrentTime() - qframe->queueTime);
+#endif
+        return;
+    }
+
+    msg_len = buildMessage(qframe, batch_buf + batch_len + 2);
+    memcpy(batch_buf + batch_len, &msg_len, sizeof(msg_len));
+    batch_len += msg_len + 2;
+    batch_cnt++;
+
+#if STATS_LATENCY
+    if (latencyTracked(frame))
+        batch_times[batch_times_cnt++] = qframe->queueTime;
+#endif
+}
+
+/* Flush ack message format:
+ * Byte 0:      MESSAGE_FLUSHACK
+ * Byte 1:      sequence number from COMMAND_FLUSH
+ * Bytes 2-5:   timestamp (little endian), as in MESSAGE_MARKER
+ * Bytes 6-13:  64 bit timestamp
+ */
+static void flushAll()
+{
+    QueuedFrame *qframe;
+    uint8_t msg[14];
+    uint32_t ts;
+    uint64_t ts64;
+    unsigned key;
+
+    flushReq = false;
+
+    // whatever was batched is as stale as what's queued
+    batch_len = 1;
+    batch_cnt = 0;
+
+    // and must not be a reference for compact frames
+    syncValid = false;
+#if STATS_LATENCY
+    batch_times_cnt = 0;
+#endif
+
+    RadioWrapper_flush();
+
+    // nothing can be queued between emptying the queue and resetting its count
+    key = Hwi_disable();
+    while ((qframe = ByteRing_peek(&frameQueue, NULL)) != NULL)
+    {
+        if (qframe->frame.pEntry)
+            RadioWrapper_releaseEntry(qframe->frame.pEntry);
+        ByteRing_pop(&frameQueue);
+    }
+    Semaphore_reset(packetAvailSem, 0);
+
+    // frames after the ack are numbered from zero
+    frameSeq = 0;
+    Hwi_restore(key);
+
+    // sent alone rather than batched, so the host finds it without decoding
+    ts = RF_getCurrentTime() >> 2;
+    ts64 = timebase_extend_us(ts);
+    msg[0] = MESSAGE_FLUSHACK;
+    msg[1] = flushSeq;
+    memcpy(msg + 2, &ts, sizeof(ts));
+    memcpy(msg + 6, &ts64, sizeof(ts64));
+    messenger_send(msg, sizeof(msg));
+}
+
+// try the packet counters decryptDataPDU didn't, now we're off the RX path
+static void retryDecrypt(QueuedFrame *qframe)
+{
+    BLE_Frame *frame = &qframe->frame;
+
+    if (ll_crypto_retry(&qframe->retry, frame->pData))
+    {
+        frame->length = frame->pData[1] + 2;
+        qframe->origLength = frame->length;
+        qframe->decrypted = true;
+    }
+    qframe->retry.c = NULL;
+
+    frame->length = snapLength(frame);
 }
 
 static void packetTaskFunction(UArg arg0, UArg arg1)
 {
+    QueuedFrame *qframe;
+    unsigned maxBatch;
+    uint32_t lingerEnd, now;
+    bool gotFrame;
+
     while (1)
     {
         // wait for a packet
@@ -176,56 +559,243 @@ static void packetTaskFunction(UArg arg0, UArg arg1)
         // activate LED
         PIN_setOutputValue(ledPinHandle, RX_ACTIVITY_LED, 1);
 
-        // send packet
-        sendPacket(s_frames + (atomic_load(&queue_tail) & JANKY_QUEUE_MASK));
+        maxBatch = batchMax;
+        lingerEnd = Clock_getTicks() + batchLinger;
+        gotFrame = true;
+
+        while (gotFrame)
+        {
+            if (flushReq)
+            {
+                flushAll();
+                break;
+            }
+
+            // may be empty if a flush raced with a producer's post
+            qframe = ByteRing_peek(&frameQueue, NULL);
+            if (!qframe)
+                break;
+
+            if (qframe->retry.c)
+                retryDecrypt(qframe);
+
+            // send (or batch) packet
+            sendPacket(qframe, maxBatch);
+
+            // messenger is done with the data, RF core can have the entry back
+            if (qframe->frame.pEntry)
+                RadioWrapper_releaseEntry(qframe->frame.pEntry);
+
+            // we can now reuse the queue space
+            ByteRing_pop(&frameQueue);
+
+            if (!maxBatch)
+                break;
+
+            // take more queued packets, waiting till the linger time is up
+            now = Clock_getTicks();
+            if ((int32_t)(lingerEnd - now) > 0)
+                gotFrame = Semaphore_pend(packetAvailSem, lingerEnd - now);
+            else
+                gotFrame = Semaphore_pend(packetAvailSem, BIOS_NO_WAIT);
+        }
+
+        flushBatch();
+
+        // catch trace records whose trace frame didn't fit in the queue
+        if (!Semaphore_getCount(packetAvailSem) && trace_pending())
+        {
+            static uint8_t trace_buf[TRACE_MESSAGE_MAX];
+            messenger_send(trace_buf, trace_buildMessage(trace_buf));
+        }
 
         // deactivate LED
         PIN_setOutputValue(ledPinHandle, RX_ACTIVITY_LED, 0);
+    }
+}
+
+// bytes of frame to queue for host, never cutting into the header
+static uint16_t snapLength(const BLE_Frame *frame)
+{
+    uint16_t snap;
+
+    if (isAdvFrame(frame))
+        snap = advSnapLen;
+    else if (frame->length >= 1 && (frame->pData[0] & 0x3) == 0x3)
+        return frame->length; // LL control PDUs are always sent in full
+    else
+        snap = dataSnapLen;
+
+    if (snap && snap < frame->length)
+        return snap;
+    return frame->length;
+}
+
+// returns false if the frame is filtered out before reactToPDU
+static bool filterFrame(BLE_Frame *frame)
+{
+    // It only makes sense to filter advertisements
+    if (frame->channel < 37)
+        return true;
 
-        // we can now handle a new packet (wraparound is OK)
-        atomic_fetch_add(&queue_tail, 1);
+    // RSSI filtering
+    if (frame->rssi < minRssi)
+    {
+        stats.rssiRejects++;
+        return false;
     }
+
+    // MAC filtering
+    if (!macFilterCheck(frame))
+    {
+        stats.macRejects++;
+        return false;
+    }
+
+    return true;
 }
 
-void indicatePacket(BLE_Frame *frame)
+// hand a frame reactToPDU is done with to PacketTask
+static void queueFrame(BLE_Frame *frame, uint32_t accessAddr, bool decrypted,
+        const LLCryptoRetry *retry)
 {
-    int queue_check, queue_head_;
+    QueuedFrame *qframe;
+    uint16_t length = frame->length;
+    uint16_t seq = 0;
+    unsigned key;
+    bool copy;
 
-    // Frames with channel 40 and up are out of band messages (eg. debug prints)
     if (frame->channel < 40)
     {
-        // It only makes sense to filter advertisements
-        if (frame->channel >= 37)
+        // PDU filtering only spares the host from frames it doesn't want
+        if (isAdvFrame(frame) && !pdu_filter_check(frame))
         {
-            // RSSI filtering
-            if (frame->rssi < minRssi)
-                return;
+            stats.pduRejects++;
+            return;
+        }
 
-            // MAC filtering
-            if (!macFilterCheck(frame))
-                return;
+        // in aggregation mode, repeats of an advertisement only get summarized
+        if (!adv_agg_update(frame))
+        {
+            stats.aggSuppressed++;
+            return;
         }
 
-        // always process PDU regardless of queue state
-        reactToPDU(frame);
+        // the MIC is needed to retry decryption, so snap after that
+        if (!retry || !retry->c)
+            length = snapLength(frame);
     }
 
-    if (frame->length > PACKET_SIZE)
+    if (length > (frame->pEntry ? PACKET_SIZE : COPY_SIZE))
         return;
 
+    copy = !frame->pEntry || length <= COPY_THRESH;
+
+    // producers in different contexts must not interleave reservations
+    key = Hwi_disable();
+
+    // numbered before a full queue can drop it, so the host sees the gap
+    if (isHostFrame(frame))
+        seq = frameSeq++;
+
+    qframe = ByteRing_reserve(&frameQueue,
+            sizeof(QueuedFrame) + (copy ? length : 0));
+
     // discard the packet if we're full
-    queue_check = (atomic_load(&queue_head) - atomic_load(&queue_tail)) & JANKY_QUEUE_MASK;
-    if (queue_check == JANKY_QUEUE_MASK) return;
-
-    // wraparound is safe due to our masking
-    queue_head_ = atomic_fetch_add(&queue_head, 1) & JANKY_QUEUE_MASK;
-
-    memcpy(s_frames[queue_head_].pData, frame->pData, frame->length);
-    s_frames[queue_head_].length = frame->length;
-    s_frames[queue_head_].rssi = frame->rssi;
-    s_frames[queue_head_].timestamp = frame->timestamp;
-    s_frames[queue_head_].channel = frame->channel;
-    s_frames[queue_head_].phy = frame->phy;
+    if (!qframe)
+    {
+        Hwi_restore(key);
+        stats.queueDrops++;
+        return;
+    }
+
+    qframe->frame = *frame;
+    qframe->frame.length = length;
+    qframe->origLength = frame->length;
+    qframe->queueTime = STATS_LATENCY ? RF_getCurrentTime() : 0;
+    qframe->accessAddr = accessAddr;
+    qframe->decrypted = decrypted;
+    qframe->retry.c = NULL;
+    if (retry)
+        qframe->retry = *retry;
+    qframe->seq = seq;
+    if (copy)
+    {
+        qframe->frame.pData = (uint8_t *)(qframe + 1);
+        qframe->frame.pEntry = NULL;
+        memcpy(qframe->frame.pData, frame->pData, length);
+    } else {
+        // zero copy: we own the RF queue entry until it's sent
+        frame->pEntry = NULL;
+    }
+
+    ByteRing_commit(&frameQueue);
+    Hwi_restore(key);
+
+    Semaphore_post(packetAvailSem);
+}
+
+void indicatePacket(BLE_Frame *frame)
+{
+    uint32_t accessAddr = 0;
+    LLCryptoRetry retry = {NULL};
+    bool decrypted = false;
+
+    // Frames with channel 40 and up are out of band messages (eg. debug prints)
+    if (frame->channel < 40)
+    {
+        stats.rxFrames[frame->channel]++;
+
+        // before reactToPDU can move the radio on to another connection
+        if (frameFormat & FRAMEFMT_AA)
+            accessAddr = frameAccessAddress(frame);
+
+        if (!filterFrame(frame))
+            return;
+
+        // so reactToPDU can follow LL control PDUs of encrypted connections
+        decrypted = decryptDataPDU(frame, &retry);
+
+        // always process PDU regardless of queue state
+        reactToPDU(frame);
+    }
+
+    queueFrame(frame, accessAddr, decrypted, &retry);
+}
+
+// rest of indicatePacket, for frames indicateUrgent reacted to fully
+static void indicateReacted(BLE_Frame *frame)
+{
+    queueFrame(frame, (frameFormat & FRAMEFMT_AA) ? frameAccessAddress(frame) : 0,
+            false, NULL);
+}
+
+// and for those it only took hop timing from
+static void indicateTimed(BLE_Frame *frame)
+{
+    uint32_t accessAddr = (frameFormat & FRAMEFMT_AA) ? frameAccessAddress(frame) : 0;
+
+    reactToPDU(frame);
+    queueFrame(frame, accessAddr, false, NULL);
+}
+
+RadioWrapper_Callback indicateUrgent(BLE_Frame *frame, RadioWrapper_Callback callback)
+{
+    // other callbacks (eg. connection acquisition) see frames as they are
+    if (callback != indicatePacket || !isUrgentFrame(frame))
+        return callback;
+
+    stats.rxFrames[frame->channel]++;
+    if (!filterFrame(frame))
+        return NULL;
+
+    return reactToUrgentPDU(frame) ? indicateReacted : indicateTimed;
+}
+
+void flushPackets(uint8_t seq)
+{
+    flushSeq = seq;
+    flushReq = true;
     Semaphore_post(packetAvailSem);
 }
 
@@ -234,31 +804,50 @@ void setMinRssi(int8_t rssi)
     minRssi = rssi;
 }
 
-// RPA and MAC filters are mutually exclusive
+void setBatching(uint16_t maxLen, uint16_t lingerUs)
+{
+    if (maxLen > MESSAGE_MAX)
+        maxLen = MESSAGE_MAX;
+    batchLinger = lingerUs / Clock_tickPeriod;
+    batchMax = maxLen;
+}
+
+void setFrameFormat(uint8_t flags)
+{
+    frameFormat = flags;
+}
+
+void setSnapLen(uint16_t advLen, uint16_t dataLen)
+{
+    // always keep the 2 byte PDU header
+    if (advLen && advLen < 2)
+        advLen = 2;
+    if (dataLen && dataLen < 2)
+        dataLen = 2;
+    advSnapLen = advLen;
+    dataSnapLen = dataLen;
+}
+
+// single target MAC and IRK filters replace the whole filter table
 void setMacFilt(bool filt, uint8_t *mac)
 {
-    if (mac != NULL)
-        memcpy(targMac, mac, 6);
-    filterMacs = filt;
-    filterRpas = false;
+    mac_filter_clear();
+    irk_filter_clear();
+    if (filt && mac != NULL)
+        mac_filter_add(mac);
 }
 
 void setRpaFilt(bool filt, void *irk)
 {
-    if (irk != NULL)
-        memcpy(targIrk, irk, 16);
-    filterRpas = filt;
-    filterMacs = false;
+    mac_filter_clear();
+    irk_filter_clear();
+    if (filt && irk != NULL)
+        irk_filter_add(irk);
 }
 
 bool macOk(uint8_t *mac, bool isRandom)
 {
-    if (filterMacs)
-        return memcmp(mac, targMac, 6) == 0;
-    else if (filterRpas)
-        return isRandom && rpa_match(targIrk, mac);
-    else
-        return true;
+    return mac_filter_check(mac, isRandom);
 }
 
 static bool macFilterCheck(BLE_Frame *frame)
@@ -267,7 +856,7 @@ static bool macFilterCheck(BLE_Frame *frame)
     uint8_t *mac;
     bool isRandom;
 
-    if (!filterMacs && !filterRpas)
+    if (!mac_filter_active())
         return true;
 
     // make sure it has a header at least
@@ -17,13 +17,49 @@ void PacketTask_init(void);
 /* asynchronously blink LED and display packet over UART */
 void indicatePacket(BLE_Frame *frame);
 
+/* Time critical part of callback's handling of a frame, for the RF callback
+ * before the frame waits for a Swi. For urgent frames going to
+ * indicatePacket, filters them and reacts to what can't wait (see
+ * isUrgentFrame). Returns the callback for the rest, or NULL if the frame
+ * was filtered out.
+ */
+RadioWrapper_Callback indicateUrgent(BLE_Frame *frame, RadioWrapper_Callback callback);
+
+/* drop everything waiting to be sent, then send a MESSAGE_FLUSHACK with seq
+ * and the radio time, which the host takes as zero time */
+void flushPackets(uint8_t seq);
+
 /* set the minimum RSSI accepted by the packet filter */
 void setMinRssi(int8_t rssi);
 
-/* specify whether or not we want MAC filtering, and specify target MAC */
+/* pack queued messages into batches of up to maxLen bytes (0 to disable),
+ * waiting up to lingerUs microseconds for a batch to fill */
+void setBatching(uint16_t maxLen, uint16_t lingerUs);
+
+/* optional fields for frames, sent as MESSAGE_BLEFRAMEX when any are set */
+#define FRAMEFMT_TS64 0x01 // 64 bit timestamp instead of 32 bit
+#define FRAMEFMT_ORIGLEN 0x02 // original length (set on snapped frames only)
+#define FRAMEFMT_AA 0x04 // access address, to tell connections apart
+#define FRAMEFMT_DECRYPTED 0x08 // decrypted with MIC removed (set by firmware only)
+#define FRAMEFMT_SEQ 0x10 // 16 bit count of frames queued for host, to find drops
+#define FRAMEFMT_COMPACT 0x20 // MESSAGE_BLEFRAMEC (delta timestamp) when possible
+
+/* flags in the low bits of a MESSAGE_BLEFRAMEC timestamp varint */
+#define COMPACT_SEQ 0x01 // sequence number follows RSSI
+#define COMPACT_DECRYPTED 0x02 // as FRAMEFMT_DECRYPTED
+
+void setFrameFormat(uint8_t flags);
+
+/* only send the first advLen/dataLen bytes of advertising/data channel PDUs
+ * (0 for all), LL control PDUs are always sent in full */
+void setSnapLen(uint16_t advLen, uint16_t dataLen);
+
+/* specify whether or not we want MAC filtering, and specify target MAC
+ * (replaces any MAC and IRK filter table entries) */
 void setMacFilt(bool filt, uint8_t *mac);
 
-/* specify whether or not we want RPA filtering, and specify target IRK */
+/* specify whether or not we want RPA filtering, and specify target IRK
+ * (replaces any MAC and IRK filter table entries) */
 void setRpaFilt(bool filt, void *irk);
 
 /* check if specified MAC address is allowed by filter */
@@ -79,6 +79,45 @@ RFQueue_nextEntry()
   return (readEntry->status);
 }
 
+//*****************************************************************************
+//
+//! Take ownership of the current dataEntry and move to the next one.
+//! The entry is marked busy so the RF core won't overwrite it, and must be
+//! handed back with RFQueue_releaseEntry() once the caller is done with it.
+//!
+//! \return rfc_dataEntryGeneral_t* of the taken entry
+//
+//*****************************************************************************
+rfc_dataEntryGeneral_t*
+RFQueue_takeEntry()
+{
+  rfc_dataEntryGeneral_t *entry = readEntry;
+
+  /* Still unavailable to the RF core, but no longer finished */
+  entry->status = DATA_ENTRY_BUSY;
+
+  /* Move read entry pointer to next entry */
+  readEntry = (rfc_dataEntryGeneral_t*)readEntry->pNextEntry;
+
+  return (entry);
+}
+
+//*****************************************************************************
+//
+//! Return a dataEntry taken with RFQueue_takeEntry() to the RF core
+//!
+//! \param entry is the entry to release
+//!
+//! \return None
+//
+//*****************************************************************************
+void
+RFQueue_releaseEntry(rfc_dataEntryGeneral_t *entry)
+{
+  /* Set status to pending */
+  entry->status = DATA_ENTRY_PENDING;
+}
+
 //*****************************************************************************
 //
 //! Define a queue
@@ -59,6 +59,8 @@
 
 extern uint8_t RFQueue_nextEntry();
 extern rfc_dataEntryGeneral_t* RFQueue_getDataEntry();
+extern rfc_dataEntryGeneral_t* RFQueue_takeEntry();
+extern void RFQueue_releaseEntry(rfc_dataEntryGeneral_t *entry);
 extern uint8_t RFQueue_defineQueue(dataQueue_t *queue ,uint8_t *buf, uint16_t buf_len, uint8_t numEntries, uint16_t length);
 
 #endif
@@ -7,6 +7,7 @@
 /***** Includes *****/
 #include <stdlib.h>
 #include <stdbool.h>
+#include <string.h>
 #include <xdc/std.h>
 #include <xdc/runtime/System.h>
 
@@ -19,10 +20,16 @@
 #include <ti/drivers/PIN.h>
 
 #include "csa2.h"
+#include "hop_table.h"
+#include "estimator.h"
 #include "adv_header_cache.h"
-#include "debug.h"
+#include "trace.h"
 #include "conf_queue.h"
+#include "conn_acquire.h"
+#include "map_learn.h"
+#include "ll_crypto.h"
 #include "TXQueue.h"
+#include "stats.h"
 
 #include <RadioTask.h>
 #include <RadioWrapper.h>
@@ -30,6 +37,8 @@
 #include <DelayHopTrigger.h>
 #include <DelayStopTrigger.h>
 #include <AuxAdvScheduler.h>
+#include <adv_sweep.h>
+#include <adv_sets.h>
 
 /***** Defines *****/
 #define RADIO_TASK_STACK_SIZE 1024
@@ -41,8 +50,6 @@
 
 #define BLE_ADV_AA 0x8E89BED6
 
-#define ARR_SZ(x) (sizeof(x) / sizeof(x[0]))
-
 // more states will be added later, eg. auxiliary advertising channel
 typedef enum
 {
@@ -55,47 +62,75 @@ typedef enum
     MASTER,
     SLAVE,
     ADVERTISING,
-    SCANNING
+    SCANNING,
+    ACQUIRING
 } SnifferState;
 
 /***** Variable declarations *****/
 static Task_Params radioTaskParams;
 Task_Struct radioTask; /* not static so you can see in ROV */
 static uint8_t radioTaskStack[RADIO_TASK_STACK_SIZE];
-static uint8_t mapping_table[37];
 
 static volatile SnifferState snifferState = STATIC;
 static SnifferState sniffDoneState = STATIC;
 
 static uint8_t statChan = 37;
 static PHY_Mode statPHY = PHY_1M;
+static uint32_t statAA = BLE_ADV_AA;
 static uint32_t statCRCI = 0x555555;
 
-static struct RadioConfig rconf;
-static uint32_t accessAddress = BLE_ADV_AA;
-static uint8_t curUnmapped;
-static uint8_t hopIncrement;
-static uint32_t crcInit;
-static uint32_t nextHopTime;
-static uint32_t connEventCount;
-static bool use_csa2;
-static uint32_t empty_hops = 0;
+/* State of a connection being followed. Several connections can be followed
+ * at once in the DATA state, with each event going to the connection whose
+ * anchor is nearest. Other states (including advertising channel hopping,
+ * which borrows the hop interval and event counter) only use conns[0].
+ */
+typedef struct
+{
+    bool active;
+    uint8_t conflictsLost;  // consecutive events given up to other connections
+    uint32_t serial;        // order of acquisition, older connections win ties
+    struct RadioConfig rconf;
+    RConfQueue rconfQueue;
+    uint32_t accessAddress;
+    uint8_t curUnmapped;
+    uint8_t hopIncrement;
+    uint8_t mapping_table[37];
+    uint32_t crcInit;
+    uint32_t nextHopTime;
+    uint32_t connEventCount;
+    bool use_csa2;
+    CSA2_Context csa2;
+    uint32_t empty_hops;
+    Estimator anchorOffsetEst;
+    MapLearn mapLearn;
+    int8_t anchorRssi;      // RSSI of the first packet of the current event
+    LLCrypto crypto;
+} ConnCtx;
+
+#define CONN_MAX HOP_TABLE_COUNT
+
+static ConnCtx conns[CONN_MAX];
+static ConnCtx *conn = conns; // connection the radio is serving
+static uint8_t connMax = 1;
+static uint32_t connSerial = 0;
 
 static volatile bool gotLegacy;
 static volatile bool firstPacket;
-static uint32_t anchorOffset[16];
-static uint32_t aoInd = 0;
 
 static uint32_t timestamp37 = 0;
 static uint32_t lastAdvTicks = 0;
-static uint32_t advInterval[9];
-static uint32_t aiInd = 0;
+static Estimator advIntervalEst;
+static volatile bool advIntervalOk;
 static bool postponed = false;
 static bool followConnections = true;
 
 static bool advHopEnabled = false;
 static bool auxAdvEnabled = false;
 
+// access address and CRC init of scheduled aux/periodic packet being listened for
+static volatile uint32_t auxListenAA = BLE_ADV_AA;
+static volatile uint32_t auxListenCRCI = 0x555555;
+
 // MAC addresses need to be 16 bit aligned for radio core, hence type
 static bool ourAddrRandom = false;
 static bool peerAddrRandom = false;
@@ -104,12 +139,28 @@ static uint16_t peerAddr[3];
 
 static uint8_t connReqLLData[22];
 
-static uint8_t s_advLen;
-static uint8_t s_advData[31];
-static uint8_t s_scanRspLen;
-static uint8_t s_scanRspData[31];
+// connection handed over by the host, applied by RadioTask
+static volatile bool followPending = false;
+static uint8_t followLLData[22];
+static uint32_t followTime;
+static PHY_Mode followPhy;
+static bool followCsa2;
+static bool followAux;
+
+// connection to acquire mid-stream, applied by RadioTask
+static volatile bool acqPending = false;
+static uint32_t acqAA;
+static uint64_t acqChanMap;
+static PHY_Mode acqPhy;
+
+// interval of advertising set 0, the one set by advertise()
 static uint16_t s_advIntervalMs = 100;
 
+// initiator listens on each primary channel in turn for this long
+#define INIT_HOP_WINDOW_TICKS (25 * 4000)
+static bool initHop3 = false;
+static uint8_t initChan = 37;
+
 // target offset before anchor point to start listing on next data channel
 // 0.5 ms @ 4 Mhz
 #define AO_TARG 2000
@@ -121,15 +172,37 @@ static uint16_t s_advIntervalMs = 100;
 // radio will get stuck if end time is in past
 #define LISTEN_TICKS_MIN 2000
 
+// shortest useful connection event listen (2 ms past the anchor), events of
+// different connections starting closer together than this conflict
+#define CONN_EVENT_MIN (AO_TARG + 8000)
+
+// with room for more connections, listen for CONNECT_INDs in gaps of 4 ms+,
+// and cut connection events short (5 ms past the anchor) to make such gaps
+#define GAP_LISTEN_MIN 16000
+#define GAP_EVENT_MAX (AO_TARG + 20000)
+
+// as slave, window widening is 16 us plus the combined sleep clock accuracy
+// (500 ppm master worst case, plus our crystal) of time since the last anchor
+#define SLAVE_WIDEN_MIN 64
+#define SLAVE_WIDEN_DIV 1800
+
 /***** Prototypes *****/
 static void radioTaskFunction(UArg arg0, UArg arg1);
-static void computeMap1(uint64_t map);
-static void handleConnFinished(void);
+static void computeMap1(ConnCtx *c, uint64_t map);
+static void resetAnchorOffsetEst(ConnCtx *c);
+static void resetAdvIntervalEst(void);
+static void handleConnFinished(ConnCtx *c);
 static void reactToDataPDU(const BLE_Frame *frame);
 static void reactToAdvExtPDU(const BLE_Frame *frame, uint8_t advLen);
-static void handleConnReq(PHY_Mode phy, uint32_t connTime, uint8_t *llData,
-        bool isAuxReq);
+static void reactToAdvTiming(const BLE_Frame *frame);
+static ConnCtx *allocConn(uint32_t aa, bool evict);
+static void handleConnReq(ConnCtx *c, PHY_Mode phy, uint32_t connTime,
+        uint8_t *llData, bool isAuxReq);
 static void reactToTransmitted(dataQueue_t *pTXQ, uint32_t numEntries);
+static void acquireCallback(BLE_Frame *frame);
+static void handleAcquired(const AcqResult *r);
+static void skipPastConnEvents(ConnCtx *c);
+static inline bool isDataState(SnifferState state);
 
 /***** Function definitions *****/
 void RadioTask_init(void)
@@ -139,24 +212,21 @@ void RadioTask_init(void)
     radioTaskParams.priority = RADIO_TASK_PRIORITY;
     radioTaskParams.stack = &radioTaskStack;
     Task_construct(&radioTask, radioTaskFunction, &radioTaskParams, NULL);
-}
 
-static int _compare(const void *a, const void *b)
-{
-    return *(int32_t *)a - *(int32_t *)b;
+    resetAnchorOffsetEst(conns);
+    resetAdvIntervalEst();
 }
 
-// not technically correct for even sized arrays but it doesn't matter here
-static uint32_t median(uint32_t *arr, size_t sz)
+// anchor offsets are in radio ticks, tolerate 10 us jitter
+static void resetAnchorOffsetEst(ConnCtx *c)
 {
-    qsort(arr, sz, sizeof(uint32_t), _compare);
-    return arr[sz >> 1];
+    est_init(&c->anchorOffsetEst, 3, 40);
 }
 
-static uint32_t percentile25(uint32_t *arr, size_t sz)
+// advertising intervals (37 to 39) are in microseconds, tolerate 5 us jitter
+static void resetAdvIntervalEst(void)
 {
-    qsort(arr, sz, sizeof(uint32_t), _compare);
-    return arr[sz >> 2];
+    est_init(&advIntervalEst, 3, 5);
 }
 
 static bool enoughTimeForAdvHopCheck()
@@ -164,13 +234,13 @@ static bool enoughTimeForAdvHopCheck()
     uint8_t chan;
     PHY_Mode phy;
     uint32_t cur_t = RF_getCurrentTime();
-    uint32_t etime = AuxAdvScheduler_next(cur_t, &chan, &phy);
+    uint32_t etime = AuxAdvScheduler_next(cur_t, &chan, &phy, NULL, NULL);
 
     if (chan != 0xFF)
         return false; // aux PDU time!
 
     // upcoming aux pkt, no time for check
-    if (etime - LISTEN_TICKS_MIN - cur_t - (rconf.hopIntervalTicks * 8) >= 0x80000000)
+    if (etime - LISTEN_TICKS_MIN - cur_t - (conn->rconf.hopIntervalTicks * 8) >= 0x80000000)
         return false;
 
     return true;
@@ -191,47 +261,174 @@ static void stateTransition(SnifferState newState)
     frame.channel = 42; // indicates state message
     frame.phy = PHY_1M;
     frame.pData = &buf;
+    frame.pEntry = NULL;
     frame.length = 1;
 
     // Does thread safe copying into queue
     indicatePacket(&frame);
 }
 
-// no side effects
-static inline uint8_t getCurrChan()
+// channels are precomputed in the background, one hop table per context
+static inline uint8_t getCurrChan(const ConnCtx *c)
 {
-    if (use_csa2)
-        return csa2_computeChannel(connEventCount);
+    return hop_table_getChannel(c - conns, c->connEventCount);
+}
+
+// restart channel lookahead from the current event and channel map
+static void resetHopTable(ConnCtx *c)
+{
+    if (c->use_csa2)
+        hop_table_resetCSA2(c - conns, c->connEventCount, &c->csa2);
     else
-        return mapping_table[curUnmapped];
+        hop_table_resetCSA1(c - conns, c->connEventCount, c->curUnmapped,
+                c->hopIncrement, c->mapping_table);
+}
+
+// recompute channel mapping after a channel map change
+static void applyChanMap(ConnCtx *c)
+{
+    if (c->use_csa2)
+        csa2_computeMappingCtx(&c->csa2, c->accessAddress, c->rconf.chanMap);
+    else
+        computeMap1(c, c->rconf.chanMap);
+    resetHopTable(c);
+}
+
+// unmapped channel of the current event, before remapping
+static inline uint8_t getCurrUnmapped(const ConnCtx *c)
+{
+    if (c->use_csa2)
+        return csa2_computeUnmappedCtx(&c->csa2, c->connEventCount);
+    return c->curUnmapped;
 }
 
 // performs channel hopping "housekeeping"
-static void afterConnEvent(bool slave)
+static void afterConnEvent(ConnCtx *c, bool slave)
 {
     // we're done if we got lost
     // the +3 on slaveLatency is to tolerate occasional missed packets
-    if (empty_hops > rconf.slaveLatency + 3)
-        handleConnFinished();
+    if (c->active && c->empty_hops > c->rconf.slaveLatency + 3)
+        handleConnFinished(c);
 
-    curUnmapped = (curUnmapped + hopIncrement) % 37;
-    connEventCount++;
-    if (rconf_dequeue(connEventCount & 0xFFFF, &rconf))
+    c->curUnmapped = (c->curUnmapped + c->hopIncrement) % 37;
+    c->connEventCount++;
+    if (rconf_dequeue(&c->rconfQueue, c->connEventCount & 0xFFFF, &c->rconf))
     {
-        nextHopTime += rconf.offset * 5000;
-        if (use_csa2)
-            csa2_computeMapping(accessAddress, rconf.chanMap);
-        else
-            computeMap1(rconf.chanMap);
+        c->nextHopTime += c->rconf.offset * 5000;
+        applyChanMap(c);
     }
-    nextHopTime += rconf.hopIntervalTicks;
+    c->nextHopTime += c->rconf.hopIntervalTicks;
 
     // slaves need to adjust for master clock drift
-    if (slave && (connEventCount & 0xF) == 0xF)
+    if (slave && (c->connEventCount & 0xF) == 0xF && c->anchorOffsetEst.count)
+    {
+        int32_t correction = est_value(&c->anchorOffsetEst) - AO_TARG;
+        c->nextHopTime += correction;
+
+        // future anchor offsets are relative to the corrected schedule
+        est_offset(&c->anchorOffsetEst, -correction);
+    }
+}
+
+// when to start listening as slave, ahead of the expected anchor
+static uint32_t slaveStartTime(const ConnCtx *c)
+{
+    uint32_t sinceAnchor = (c->empty_hops + 1) * c->rconf.hopIntervalTicks;
+    uint32_t widening = SLAVE_WIDEN_MIN + sinceAnchor / SLAVE_WIDEN_DIV;
+
+    // never before the previous event ended
+    if (widening > AO_TARG)
+        widening = AO_TARG;
+    return c->nextHopTime - c->rconf.hopIntervalTicks + AO_TARG - widening;
+}
+
+// start of the receive window for a connection's next event
+static inline uint32_t eventStart(const ConnCtx *c)
+{
+    return c->nextHopTime - c->rconf.hopIntervalTicks;
+}
+
+// whether a should get a conflicting event rather than b
+static bool higherPriority(const ConnCtx *a, const ConnCtx *b)
+{
+    // take turns rather than starving a connection with a clashing schedule
+    if (a->conflictsLost != b->conflictsLost)
+        return a->conflictsLost > b->conflictsLost;
+    return (int32_t)(a->serial - b->serial) < 0;
+}
+
+// pick the connection to serve next, dropping events that lose conflicts
+static ConnCtx *scheduleConn(void)
+{
+    ConnCtx *best;
+    unsigned i;
+    bool conflict;
+
+    do {
+        best = NULL;
+        for (i = 0; i < CONN_MAX; i++)
+        {
+            if (!conns[i].active)
+                continue;
+            if (!best || (int32_t)(eventStart(conns + i) - eventStart(best)) < 0)
+                best = conns + i;
+        }
+        if (!best)
+            return NULL;
+
+        // events starting soon after the earliest one can't both be served
+        conflict = false;
+        for (i = 0; i < CONN_MAX && !conflict; i++)
+        {
+            ConnCtx *c = conns + i;
+            ConnCtx *loser;
+
+            if (!c->active || c == best)
+                continue;
+            if (eventStart(c) - eventStart(best) >= CONN_EVENT_MIN)
+                continue;
+
+            loser = higherPriority(best, c) ? c : best;
+            loser->conflictsLost++;
+            afterConnEvent(loser, true);
+            conflict = true;
+        }
+    } while (conflict);
+
+    return best;
+}
+
+// when the event of c must end to make way for the next connection
+static uint32_t eventEnd(const ConnCtx *c)
+{
+    uint32_t end = c->nextHopTime;
+    unsigned i;
+
+    for (i = 0; i < CONN_MAX; i++)
     {
-        uint32_t medAnchorOffset = median(anchorOffset, ARR_SZ(anchorOffset));
-        nextHopTime += medAnchorOffset - AO_TARG;
+        uint32_t start;
+
+        if (!conns[i].active || conns + i == c)
+            continue;
+        start = eventStart(conns + i);
+        if ((int32_t)(start - end) < 0)
+            end = start;
     }
+
+    return end;
+}
+
+static unsigned activeConns(void)
+{
+    unsigned i, n = 0;
+
+    for (i = 0; i < CONN_MAX; i++)
+    {
+        if (conns[i].active)
+            n++;
+    }
+
+    return n;
 }
 
 static void radioTaskFunction(UArg arg0, UArg arg1)
@@ -245,31 +442,87 @@ static void radioTaskFunction(UArg arg0, UArg arg1)
         // zero empty_hops on state change to avoid possible confusion
         if (snifferState != lastState)
         {
-            empty_hops = 0;
+            conn->empty_hops = 0;
             lastState = snifferState;
         }
 
+        if (followPending)
+        {
+            ConnCtx *c;
+
+            followPending = false;
+            c = allocConn(*(uint32_t *)followLLData, true);
+            c->use_csa2 = followCsa2;
+            handleConnReq(c, followPhy, followTime << 2, followLLData, followAux);
+            skipPastConnEvents(c);
+            if (snifferState != DATA)
+                stateTransition(DATA);
+            continue;
+        }
+
+        if (acqPending)
+        {
+            acqPending = false;
+            acq_start(acqAA, acqChanMap, acqPhy);
+            stateTransition(ACQUIRING);
+            continue;
+        }
+
         if (snifferState == STATIC)
         {
-            if (auxAdvEnabled)
+            if (statAA == BLE_ADV_AA && adv_sweep_enabled())
             {
+                uint8_t chan, sweepChan;
+                PHY_Mode phy, sweepPhy;
+                uint32_t aa = BLE_ADV_AA, crci = 0x555555;
+                uint32_t cur_t = RF_getCurrentTime();
+                uint32_t etime = adv_sweep_next(cur_t, &sweepChan, &sweepPhy);
+
+                // aux packets still get listened for when scheduled
+                chan = 0xFF;
+                if (auxAdvEnabled)
+                {
+                    uint32_t auxTime = AuxAdvScheduler_next(cur_t, &chan, &phy, &aa, &crci);
+                    if (chan != 0xFF || (int32_t)(auxTime - etime) < 0)
+                        etime = auxTime;
+                }
+                if (etime - LISTEN_TICKS_MIN - cur_t >= 0x80000000)
+                    continue;
+                if (chan == 0xFF)
+                {
+                    chan = sweepChan;
+                    phy = sweepPhy;
+                    aa = BLE_ADV_AA;
+                    crci = 0x555555;
+                } else {
+                    auxListenAA = aa;
+                    auxListenCRCI = crci;
+                }
+                RadioWrapper_recvFrames(phy, chan, aa, crci, etime, indicatePacket);
+                auxListenAA = BLE_ADV_AA;
+            } else if (auxAdvEnabled) {
                 uint8_t chan;
                 PHY_Mode phy;
-                uint32_t aa = BLE_ADV_AA;
+                uint32_t aa, crci;
                 uint32_t cur_t = RF_getCurrentTime();
-                uint32_t etime = AuxAdvScheduler_next(cur_t, &chan, &phy);
+                uint32_t etime = AuxAdvScheduler_next(cur_t, &chan, &phy, &aa, &crci);
                 if (etime - LISTEN_TICKS_MIN - cur_t >= 0x80000000)
                     continue; // pointless to listen for tiny period, may stall radio with etime in past
                 if (chan == 0xFF)
                 {
                     chan = statChan;
                     phy = statPHY;
-                    aa = accessAddress;
+                    aa = statAA;
+                    crci = statCRCI;
+                } else {
+                    auxListenAA = aa;
+                    auxListenCRCI = crci;
                 }
-                RadioWrapper_recvFrames(phy, chan, aa, statCRCI, etime, indicatePacket);
+                RadioWrapper_recvFrames(phy, chan, aa, crci, etime, indicatePacket);
+                auxListenAA = BLE_ADV_AA;
             } else {
                 /* receive forever (until stopped) */
-                RadioWrapper_recvFrames(statPHY, statChan, accessAddress, statCRCI, 0xFFFFFFFF,
+                RadioWrapper_recvFrames(statPHY, statChan, statAA, statCRCI, 0xFFFFFFFF,
                         indicatePacket);
             }
         } else if (snifferState == ADVERT_SEEK) {
@@ -291,21 +544,23 @@ static void radioTaskFunction(UArg arg0, UArg arg1)
             // Timeout case
             if (!gotLegacy && auxAdvEnabled) {
                 // assume 700 us hop interval
-                rconf.hopIntervalTicks = 700 * 4;
-                connEventCount = 0;
-                dprintf("No legacy ads, jumping to ADVERT_HOP");
+                conn->rconf.hopIntervalTicks = 700 * 4;
+                conn->connEventCount = 0;
+                dtrace0(TRACE_NO_LEGACY_ADS);
                 stateTransition(ADVERT_HOP);
                 continue;
             }
 
-            if (aiInd == ARR_SZ(advInterval))
+            // lock on as soon as a few intervals agree, or give it a try
+            // after as many samples as we used to need
+            if (est_stable(&advIntervalEst, 4, 3) || advIntervalEst.count >= 9)
             {
                 // two hops from 37 -> 39, four ticks per microsecond, 4 / 2 = 2
-                rconf.hopIntervalTicks = percentile25(advInterval, ARR_SZ(advInterval)) * 2;
+                conn->rconf.hopIntervalTicks = est_value(&advIntervalEst) * 2;
 
                 // If hop interval is over 11 ms (* 4000 ticks/ms), something is wrong
                 // Hop interval under 400 us is also wrong
-                if ((rconf.hopIntervalTicks > 11*4000) || (rconf.hopIntervalTicks < 400*4))
+                if ((conn->rconf.hopIntervalTicks > 11*4000) || (conn->rconf.hopIntervalTicks < 400*4))
                 {
                     // try again
                     advHopSeekMode();
@@ -313,24 +568,23 @@ static void radioTaskFunction(UArg arg0, UArg arg1)
                 }
 
                 // DEBUG
-                dprintf("hop us %lu", rconf.hopIntervalTicks >> 2);
+                dtrace1(TRACE_HOP_US, conn->rconf.hopIntervalTicks >> 2);
 
-                connEventCount = 0;
+                conn->connEventCount = 0;
                 stateTransition(ADVERT_HOP);
             }
         } else if (snifferState == ADVERT_HOP) {
             // hop between 37/38/39 targeting a particular MAC
             gotLegacy = false; // used to avoid spurious increments of connEventCount
             postponed = false;
-            if ((connEventCount & 0x1F) == 0x1F && enoughTimeForAdvHopCheck())
+            if ((conn->connEventCount & 0x1F) == 0x1F && enoughTimeForAdvHopCheck())
             {
                 bool interval_changed = false;
 
                 // occasionally check that hopIntervalTicks is correct
                 // do this by sniffing for an ad on 39 after 37
                 firstPacket = true;
-                aiInd = 0;
-                RadioWrapper_recvAdv3(200, rconf.hopIntervalTicks * 4, indicatePacket);
+                RadioWrapper_recvAdv3(200, conn->rconf.hopIntervalTicks * 4, indicatePacket);
 
                 // break out early if we cancelled
                 if (snifferState != ADVERT_HOP) continue;
@@ -338,27 +592,29 @@ static void radioTaskFunction(UArg arg0, UArg arg1)
                 if (!gotLegacy)
                     continue; // wrong advertising set, try again
 
-                // make sure hop interval didn't change too much (more than 5 us change)
+                // make sure hop interval didn't change too much (rejected as outlier)
+                // otherwise, follow any gradual drift
                 if (!firstPacket)
                 {
-                    int32_t delta_interval = rconf.hopIntervalTicks - (advInterval[0] * 2);
-                    if (delta_interval < 0) delta_interval = -delta_interval;
-                    if (delta_interval > 20) interval_changed = true;
+                    if (advIntervalOk)
+                        conn->rconf.hopIntervalTicks = est_value(&advIntervalEst) * 2;
+                    else
+                        interval_changed = true;
                 }
 
                 // return to ADVERT_SEEK if we got lost
                 if (!firstPacket && !interval_changed) {
-                    empty_hops = 0;
+                    conn->empty_hops = 0;
 
                     // DEBUG
-                    dprintf("hop confirmed");
+                    dtrace0(TRACE_HOP_CONFIRMED);
                 } else {
-                    empty_hops++;
+                    conn->empty_hops++;
                 }
 
                 firstPacket = false;
-                if (empty_hops >= 3) {
-                    dprintf("adv hop interval changed, retrying");
+                if (conn->empty_hops >= 3) {
+                    dtrace0(TRACE_HOP_CHANGED);
                     advHopSeekMode();
                     continue;
                 }
@@ -368,72 +624,137 @@ static void radioTaskFunction(UArg arg0, UArg arg1)
                 {
                     uint8_t chan;
                     PHY_Mode phy;
+                    uint32_t aa, crci;
                     uint32_t cur_t = RF_getCurrentTime();
-                    uint32_t etime = AuxAdvScheduler_next(cur_t, &chan, &phy);
+                    uint32_t etime = AuxAdvScheduler_next(cur_t, &chan, &phy, &aa, &crci);
                     if (etime - LISTEN_TICKS_MIN - cur_t >= 0x80000000)
                         continue; // pointless to listen for tiny period, may stall radio with etime in past
                     if (chan != 0xFF)
                     {
-                        RadioWrapper_recvFrames(phy, chan, BLE_ADV_AA, 0x555555, etime,
+                        auxListenAA = aa;
+                        auxListenCRCI = crci;
+                        RadioWrapper_recvFrames(phy, chan, aa, crci, etime,
                                 indicatePacket);
+                        auxListenAA = BLE_ADV_AA;
                         continue; // don't touch connEventCount
                     } else {
                         // we need to force cancel recvAdv3 eventually
                         DelayStopTrigger_trig((etime - RF_getCurrentTime()) >> 2);
-                        RadioWrapper_recvAdv3(rconf.hopIntervalTicks - 200, 8000, indicatePacket);
+                        RadioWrapper_recvAdv3(conn->rconf.hopIntervalTicks - 200, 8000, indicatePacket);
                     }
                 } else {
-                    RadioWrapper_recvAdv3(rconf.hopIntervalTicks - 200, 8000, indicatePacket);
+                    RadioWrapper_recvAdv3(conn->rconf.hopIntervalTicks - 200, 8000, indicatePacket);
                 }
             }
 
             // state might have changed to DATA, in which case we must not mess with
             // connEventCount
             if (snifferState == ADVERT_HOP && gotLegacy)
-                connEventCount++;
+                conn->connEventCount++;
         } else if (snifferState == PAUSED) {
             Task_sleep(100);
         } else if (snifferState == DATA) {
-            uint8_t chan = getCurrChan();
+            ConnCtx *c = scheduleConn();
+            uint32_t start, end, now;
+            uint8_t unmapped, chan;
+            bool gapListen;
+
+            if (!c)
+                continue; // last connection finished while scheduling
+
+            start = eventStart(c);
+            end = eventEnd(c);
+            now = RF_getCurrentTime();
+
+            // watch for more connections until the next event is due
+            gapListen = followConnections && activeConns() < connMax;
+            if (gapListen && (int32_t)(start - now) > GAP_LISTEN_MIN)
+            {
+                firstPacket = false;
+                RadioWrapper_recvFrames(PHY_1M, statChan >= 37 ? statChan : 37,
+                        BLE_ADV_AA, 0x555555, start - LISTEN_TICKS_MIN, indicatePacket);
+                continue;
+            }
+
+            if (gapListen && (int32_t)(end - start) > GAP_EVENT_MAX)
+                end = start + GAP_EVENT_MAX;
+
+            // not enough of the event left to be worth it
+            if ((int32_t)(end - now) < LISTEN_TICKS_MIN)
+            {
+                afterConnEvent(c, true);
+                continue;
+            }
+
+            // listen where the learned channel stats suggest
+            unmapped = getCurrUnmapped(c);
+            chan = map_learn_channel(&c->mapLearn, c->rconf.chanMap, unmapped,
+                    getCurrChan(c));
+
+            conn = c;
             firstPacket = true;
-            RadioWrapper_recvFrames(rconf.phy, chan, accessAddress, crcInit,
-                    nextHopTime, indicatePacket);
+            RadioWrapper_recvFrames(c->rconf.phy, chan, c->accessAddress,
+                    c->crcInit, end, indicatePacket);
 
-            if (!firstPacket) empty_hops = 0;
-            else empty_hops++;
+            // misses on channels never seen in use while others have been are
+            // likely map errors, so leave them to map learning
+            if (!firstPacket) c->empty_hops = 0;
+            else if (!map_learn_unproven(&c->mapLearn, chan)) c->empty_hops++;
+            c->conflictsLost = 0;
 
-            afterConnEvent(true);
+            if (map_learn_event(&c->mapLearn, &c->rconf.chanMap, unmapped, chan,
+                        !firstPacket, c->anchorRssi))
+                applyChanMap(c);
+
+            afterConnEvent(c, true);
         } else if (snifferState == INITIATING) {
             uint32_t connTime;
             PHY_Mode connPhy;
-            int status = RadioWrapper_initiate(statPHY, statChan, 0xFFFFFFFF,
+            uint8_t chan = statChan;
+            uint32_t timeout = 0xFFFFFFFF;
+            int status;
+
+            // long range advertising is only on one channel, see advHopSeekMode
+            if (initHop3 && statPHY == PHY_1M)
+            {
+                chan = initChan;
+                timeout = RF_getCurrentTime() + INIT_HOP_WINDOW_TICKS;
+            }
+
+            status = RadioWrapper_initiate(statPHY, chan, timeout,
                     indicatePacket, ourAddr, ourAddrRandom, peerAddr, peerAddrRandom,
                     connReqLLData, &connTime, &connPhy);
             if (snifferState != INITIATING)
                 continue; // initiating state was cancelled
+            if (status == -1 && timeout != 0xFFFFFFFF) {
+                initChan = initChan == 39 ? 37 : initChan + 1;
+                continue;
+            }
             if (status < 0) {
-                handleConnFinished();
+                handleConnFinished(conn);
                 continue;
             }
 
-            use_csa2 = (status >= 1) ? true : false;
-            handleConnReq(connPhy, 0, connReqLLData, status >= 2);
-            nextHopTime = connTime - AO_TARG + rconf.hopIntervalTicks;
+            conn = allocConn(*(uint32_t *)connReqLLData, true);
+            conn->use_csa2 = (status >= 1) ? true : false;
+            handleConnReq(conn, connPhy, 0, connReqLLData, status >= 2);
+            conn->nextHopTime = connTime - AO_TARG + conn->rconf.hopIntervalTicks;
             RadioWrapper_resetSeqStat();
 
             stateTransition(MASTER);
         } else if (snifferState == MASTER) {
             dataQueue_t txq, txq2;
             uint32_t numSent;
-            uint8_t chan = getCurrChan();
+            uint8_t chan = getCurrChan(conn);
             TXQueue_take(&txq);
             txq2 = txq; // copy the queue since TX will update current entry pointer
             firstPacket = false; // no need for anchor offset calcs, since we're master
 
-            uint32_t curHopTime = nextHopTime - rconf.hopIntervalTicks + AO_TARG;
+            uint32_t curHopTime = conn->nextHopTime - conn->rconf.hopIntervalTicks + AO_TARG;
 
-            int status = RadioWrapper_master(rconf.phy, chan, accessAddress,
-                    crcInit, nextHopTime, indicatePacket, &txq, curHopTime, &numSent);
+            int status = RadioWrapper_master(conn->rconf.phy, chan, conn->accessAddress,
+                    conn->crcInit, conn->nextHopTime, indicatePacket, &txq, curHopTime,
+                    &numSent);
 
             if (snifferState != MASTER)
             {
@@ -445,26 +766,22 @@ static void radioTaskFunction(UArg arg0, UArg arg1)
                 TXQueue_flush(numSent);
             }
 
-            if (status != 0) empty_hops++;
-            else empty_hops = 0;
-
-            // Sleep till next event (till anchor offset before next anchor point)
-            // 10us per tick for sleep, 0.25 us per radio tick
-            uint32_t rticksRemaining = nextHopTime - RF_getCurrentTime();
-            if (rticksRemaining < 0x7FFFFFFF && rticksRemaining > 2000)
-                Task_sleep(rticksRemaining / 40);
+            if (status != 0) conn->empty_hops++;
+            else conn->empty_hops = 0;
 
-            afterConnEvent(false);
+            // the next event is queued right away, to start on the radio timer
+            afterConnEvent(conn, false);
         } else if (snifferState == SLAVE) {
             dataQueue_t txq, txq2;
             uint32_t numSent;
-            uint8_t chan = getCurrChan();
+            uint8_t chan = getCurrChan(conn);
             TXQueue_take(&txq);
             txq2 = txq; // copy the queue since TX will update current entry pointer
             firstPacket = true; // for anchor offset calculations
 
-            int status = RadioWrapper_slave(rconf.phy, chan, accessAddress,
-                    crcInit, nextHopTime, indicatePacket, &txq, 0, &numSent);
+            int status = RadioWrapper_slave(conn->rconf.phy, chan, conn->accessAddress,
+                    conn->crcInit, conn->nextHopTime, indicatePacket, &txq,
+                    slaveStartTime(conn), &numSent);
 
             if (snifferState != SLAVE)
             {
@@ -476,30 +793,59 @@ static void radioTaskFunction(UArg arg0, UArg arg1)
                 TXQueue_flush(numSent);
             }
 
-            if (status != 0) empty_hops++;
-            else empty_hops = 0;
+            if (status != 0) conn->empty_hops++;
+            else conn->empty_hops = 0;
 
-            // Sleep till next event (till anchor offset before next anchor point)
-            // 10us per tick for sleep, 0.25 us per radio tick
-            uint32_t rticksRemaining = nextHopTime - RF_getCurrentTime();
-            if (rticksRemaining < 0x7FFFFFFF && rticksRemaining > 2000)
-                Task_sleep(rticksRemaining / 40);
+            // as for master, the radio waits out the time to the next window
+            afterConnEvent(conn, true);
+        } else if (snifferState == ACQUIRING) {
+            const AcqResult *r = acq_result();
+            uint32_t end;
+            uint8_t chan = acq_listen(RF_getCurrentTime(), &end);
 
-            afterConnEvent(true);
+            // CRCs can't be checked until we know CRCInit
+            if (acq_phase() == ACQ_CRCINIT)
+                RadioWrapper_recvFramesRawCrc(acqPhy, chan, r->accessAddress, end,
+                        acquireCallback);
+            else
+                RadioWrapper_recvFrames(acqPhy, chan, r->accessAddress, r->crcInit, end,
+                        acquireCallback);
+
+            if (snifferState != ACQUIRING)
+                continue;
+            if (acq_update(RF_getCurrentTime()))
+                handleAcquired(r);
         } else if (snifferState == ADVERTISING) {
-            // slightly "randomize" advertisement timing as per spec
-            uint32_t sleep_ms = s_advIntervalMs + (RF_getCurrentTime() & 0x7);
-            RadioWrapper_advertise3(indicatePacket, ourAddr, ourAddrRandom,
-                    s_advData, s_advLen, s_scanRspData, s_scanRspLen);
-            // don't sleep if we had a connection established
-            if (snifferState == ADVERTISING)
-                Task_sleep(sleep_ms * 100); // 100 kHz ticks
+            uint32_t when, now;
+            AdvSet *s = adv_sets_next(&when);
+
+            if (!s)
+            {
+                Task_sleep(100);
+                continue;
+            }
+
+            // sleep till the next set is due, 100 kHz ticks
+            now = RF_getCurrentTime();
+            if (when && (int32_t)(when - now) > 0)
+            {
+                Task_sleep((when - now) / 40 + 1);
+                continue;
+            }
+
+            if (s->extended)
+                RadioWrapper_advertiseExt3(indicatePacket, ourAddr, ourAddrRandom,
+                        s->adi, s->advData, s->advLen, s->auxChan);
+            else
+                RadioWrapper_advertise3(indicatePacket, ourAddr, ourAddrRandom,
+                        s->advData, s->advLen, s->scanRspData, s->scanRspLen);
+            adv_sets_done(s, RF_getCurrentTime());
         }
     }
 }
 
 // Channel Selection Algorithm #1
-static void computeMap1(uint64_t map)
+static void computeMap1(ConnCtx *c, uint64_t map)
 {
     uint8_t i, numUsedChannels = 0;
     uint8_t remapping_table[37];
@@ -518,10 +864,10 @@ static void computeMap1(uint64_t map)
     for (i = 0; i < 37; i++)
     {
         if (map & (1ULL << i))
-            mapping_table[i] = i;
+            c->mapping_table[i] = i;
         else {
             uint8_t remappingIndex = i % numUsedChannels;
-            mapping_table[i] = remapping_table[remappingIndex];
+            c->mapping_table[i] = remapping_table[remappingIndex];
         }
     }
 }
@@ -539,10 +885,213 @@ static inline bool isDataState(SnifferState state)
     }
 }
 
+bool isAdvFrame(const BLE_Frame *frame)
+{
+    return !isDataState(snifferState) || frame->channel >= 37;
+}
+
+// advertising PDUs saying when to listen next, which reactToPDU can't defer
+static bool givesNextListen(const BLE_Frame *frame)
+{
+    switch (frame->pData[0] & 0xF)
+    {
+    case CONNECT_IND: // also AUX_CONNECT_REQ
+    case 0x8: // AUX_CONNECT_RSP
+        return true;
+    case ADV_EXT_IND:
+        // periodic trains are only rescheduled from here, so the
+        // AuxAdvScheduler is never touched from two contexts at once
+        if (auxListenAA != BLE_ADV_AA && frame->channel < 37)
+            return true;
+        // AuxPtr and SyncInfo give when to listen next
+        if (frame->length < 4 || (frame->pData[2] & 0x3F) < 1)
+            return false;
+        return (frame->pData[3] & 0x30) != 0;
+    default:
+        return false;
+    }
+}
+
+bool isUrgentFrame(const BLE_Frame *frame)
+{
+    // data channel PDUs only adjust later connection events
+    if (!isAdvFrame(frame) || frame->length < 2)
+        return false;
+
+    // hops to 38 and 39 are timed from these
+    if (snifferState == ADVERT_SEEK || snifferState == ADVERT_HOP)
+        return true;
+
+    return givesNextListen(frame);
+}
+
+bool reactToUrgentPDU(const BLE_Frame *frame)
+{
+    if (snifferState == ADVERT_SEEK || snifferState == ADVERT_HOP)
+        reactToAdvTiming(frame);
+
+    if (!givesNextListen(frame))
+        return false;
+
+    reactToPDU(frame);
+    return true;
+}
+
+uint32_t frameAccessAddress(const BLE_Frame *frame)
+{
+    if (frame->channel >= 37)
+        return snifferState == STATIC ? statAA : BLE_ADV_AA;
+    if (isDataState(snifferState))
+        return conn->accessAddress;
+    if (snifferState == STATIC && frame->channel == statChan && auxListenAA == BLE_ADV_AA)
+        return statAA;
+    return auxListenAA;
+}
+
+// hop timing in ADVERT_SEEK/ADVERT_HOP, from the RF callback for every advertisement
+static void reactToAdvTiming(const BLE_Frame *frame)
+{
+    uint8_t pduType = frame->pData[0] & 0xF;
+
+    // make sure length is coherent
+    if (frame->length - 2 < frame->pData[1])
+        return;
+
+    /* for advertisements, jump along and track intervals if needed
+     *
+     * ADV_EXT_IND is excluded from triggering a hop for two reasons:
+     * 1. It's pointless, as the actual advertising data and connection
+     *    establishment occur on the aux channel, and 37/38/39 aux pointers
+     *    are just redundant.
+     * 2. For devices that do both legacy and extended advertising, the hop
+     *    period between 37/38/39 is different for the legacy and extended
+     *    advertising sets. They are advertised independently, not interleaved
+     *    in practice. We only want to get the hop interval for the legacy ads.
+     */
+    if (pduType == ADV_IND ||
+        pduType == ADV_DIRECT_IND ||
+        pduType == ADV_NONCONN_IND ||
+        pduType == ADV_SCAN_IND)
+    {
+        // advertisement interval tracking
+        if (firstPacket)
+        {
+            if (frame->channel == 37)
+                timestamp37 = frame->timestamp;
+            else if ((frame->channel == 39))
+            {
+                // microseconds from 37 to 39 advertisement
+                advIntervalOk = est_add(&advIntervalEst,
+                        (frame->timestamp*4 - timestamp37*4) >> 2);
+                firstPacket = false;
+            }
+        }
+
+        // Hop to 38 (with a delay) after we get an anchor advertisement on 37
+        if ( (frame->channel == 37) &&
+            ((snifferState == ADVERT_HOP) || (snifferState == ADVERT_SEEK)) )
+        {
+            /* Packet timestamps represent the start of the packet.
+             * I'm not sure if it's the time of the preamble or time of the access address.
+             *
+             * Regardless, the time it takes from advertisement start to advertisement
+             * end (frame duration) is approximately (frame->length + 8)*8 microseconds.
+             *
+             * The latency in 4 MHz radio ticks between end of transmission and now is:
+             * RF_getCurrentTime() - ((frame->timestamp << 2) + (frame->length + 8)*32)
+             * I've measured this to be typically around 165 us
+             *
+             * There's a 150 us inter-frame separation as per BLE spec.
+             * A scan request needs approximately 176 us of transmission time.
+             * A connection request needs approximately 352 us of transmission time.
+             *
+             * If endTrigger fires during receipt of a packet, it will still be received
+             * to completion.
+             *
+             * If nothing was received around T_IFS, an advertisement will be sent on the
+             * next channel in typically 200-300 us after T_IFS. This exact time (let's
+             * call it turnaround time) can be calculated as:
+             * hop interval - frame duration - 150 us T_IFS
+             *
+             * To be sure there's no scan request or conn request, we need to wait this
+             * long after the timestamp of our advertisement on 37:
+             * frame duration + 150 us T_IFS + 176 us scan request + 165 us latency
+             * = frame duration + 491 us
+             *
+             * If there's a connection request on 38, and there was no scan on 37, the
+             * connection request will start the following amount of time after 37 timestamp:
+             * frame duration + hop interval + 150 us T_IFS
+             *
+             * Our listener needs to be running on 38 before this. There's also software
+             * latency in the delay trigger, and latency in tuning/configuring the radio.
+             * Let's say this combined latency is 240 us. It's a bit tricky to measure, but
+             * it really does seem this long.
+             *
+             * When following connections, at latest, we must hop 240 us (aforementioned
+             * latency) before the scan or connect request on 38. That is at:
+             * timestamp_37 + frame duration + hop interval + 150 us T_IFS - 240 us latency
+             * = timestamp_37 + frame duration + hop interval - 90 us
+             *
+             * Usually, hop interval - 90 us > 491 us, so we can just use a fixed hop delay
+             * after the end of the advertisement on 37. Instead of setting the timer at 491
+             * us after the advert end, we set it at 530 us to give us some time to postpone
+             * the radio trigger.
+             */
+            uint32_t timeRemaining;
+
+            if (snifferState == ADVERT_SEEK) {
+                timeRemaining = 0;
+            } else {
+                // we do the math in 4 MHz radio ticks so that the timestamp integer overflow works
+                uint32_t targHopTime;
+
+                // we should hop around 530 us (2120 radio ticks) after frame end
+                // this should give us enough time to postpone hop if necessary
+                targHopTime = frame->timestamp*4 + (frame->length + 8)*32 + 2120;
+
+                timeRemaining = targHopTime - RF_getCurrentTime();
+                if (timeRemaining >= 0x80000000)
+                    timeRemaining = 0; // should not happen given typical latency
+                else
+                    timeRemaining >>= 2; // convert to microseconds from radio ticks
+            }
+
+            // Let them no we got a legacy adv on 37 (to increment connEventCount)
+            gotLegacy = true;
+
+            DelayHopTrigger_trig(timeRemaining);
+        }
+    }
+
+    // hop interval gets temporarily stretched by 400 us if a scan request is received,
+    // since the advertiser needs to respond
+    if (pduType == SCAN_REQ && frame->channel == 37 && snifferState == ADVERT_HOP && !postponed)
+    {
+        DelayHopTrigger_postpone(400);
+        postponed = true;
+    }
+}
+
+bool decryptDataPDU(BLE_Frame *frame, LLCryptoRetry *retry)
+{
+    retry->c = NULL;
+
+    // only sniffed connections, we don't encrypt as master or slave
+    if (snifferState != DATA || frame->channel >= 37 || frame->length < 2 ||
+            frame->length < frame->pData[1] + 2)
+        return false;
+
+    // no packets seen yet this event means it's the master's
+    if (!ll_crypto_rx(&conn->crypto, frame->pData, firstPacket, retry))
+        return false;
+    frame->length = frame->pData[1] + 2;
+    return true;
+}
+
 // change radio configuration based on a packet received
 void reactToPDU(const BLE_Frame *frame)
 {
-    if (!isDataState(snifferState) || frame->channel >= 37)
+    if (isAdvFrame(frame))
     {
         // Advertising PDU
         uint8_t pduType;
@@ -566,118 +1115,9 @@ void reactToPDU(const BLE_Frame *frame)
         if (frame->length - 2 < advLen)
             return;
 
-        /* for advertisements, jump along and track intervals if needed
-         *
-         * ADV_EXT_IND is excluded from triggering a hop for two reasons:
-         * 1. It's pointless, as the actual advertising data and connection
-         *    establishment occur on the aux channel, and 37/38/39 aux pointers
-         *    are just redundant.
-         * 2. For devices that do both legacy and extended advertising, the hop
-         *    period between 37/38/39 is different for the legacy and extended
-         *    advertising sets. They are advertised independently, not interleaved
-         *    in practice. We only want to get the hop interval for the legacy ads.
-         */
-        if (pduType == ADV_IND ||
-            pduType == ADV_DIRECT_IND ||
-            pduType == ADV_NONCONN_IND ||
-            pduType == ADV_SCAN_IND)
-        {
-            // advertisement interval tracking
-            if (firstPacket)
-            {
-                if (frame->channel == 37)
-                    timestamp37 = frame->timestamp;
-                else if ((frame->channel == 39))
-                {
-                    // microseconds from 37 to 39 advertisement
-                    advInterval[aiInd++] = (frame->timestamp*4 - timestamp37*4) >> 2;
-                    firstPacket = false;
-                }
-            }
-
-            // Hop to 38 (with a delay) after we get an anchor advertisement on 37
-            if ( (frame->channel == 37) &&
-                ((snifferState == ADVERT_HOP) || (snifferState == ADVERT_SEEK)) )
-            {
-                /* Packet timestamps represent the start of the packet.
-                 * I'm not sure if it's the time of the preamble or time of the access address.
-                 *
-                 * Regardless, the time it takes from advertisement start to advertisement
-                 * end (frame duration) is approximately (frame->length + 8)*8 microseconds.
-                 *
-                 * The latency in 4 MHz radio ticks between end of transmission and now is:
-                 * RF_getCurrentTime() - ((frame->timestamp << 2) + (frame->length + 8)*32)
-                 * I've measured this to be typically around 165 us
-                 *
-                 * There's a 150 us inter-frame separation as per BLE spec.
-                 * A scan request needs approximately 176 us of transmission time.
-                 * A connection request needs approximately 352 us of transmission time.
-                 *
-                 * If endTrigger fires during receipt of a packet, it will still be received
-                 * to completion.
-                 *
-                 * If nothing was received around T_IFS, an advertisement will be sent on the
-                 * next channel in typically 200-300 us after T_IFS. This exact time (let's
-                 * call it turnaround time) can be calculated as:
-                 * hop interval - frame duration - 150 us T_IFS
-                 *
-                 * To be sure there's no scan request or conn request, we need to wait this
-                 * long after the timestamp of our advertisement on 37:
-                 * frame duration + 150 us T_IFS + 176 us scan request + 165 us latency
-                 * = frame duration + 491 us
-                 *
-                 * If there's a connection request on 38, and there was no scan on 37, the
-                 * connection request will start the following amount of time after 37 timestamp:
-                 * frame duration + hop interval + 150 us T_IFS
-                 *
-                 * Our listener needs to be running on 38 before this. There's also software
-                 * latency in the delay trigger, and latency in tuning/configuring the radio.
-                 * Let's say this combined latency is 240 us. It's a bit tricky to measure, but
-                 * it really does seem this long.
-                 *
-                 * When following connections, at latest, we must hop 240 us (aforementioned
-                 * latency) before the scan or connect request on 38. That is at:
-                 * timestamp_37 + frame duration + hop interval + 150 us T_IFS - 240 us latency
-                 * = timestamp_37 + frame duration + hop interval - 90 us
-                 *
-                 * Usually, hop interval - 90 us > 491 us, so we can just use a fixed hop delay
-                 * after the end of the advertisement on 37. Instead of setting the timer at 491
-                 * us after the advert end, we set it at 530 us to give us some time to postpone
-                 * the radio trigger.
-                 */
-                uint32_t timeRemaining;
-
-                if (snifferState == ADVERT_SEEK) {
-                    timeRemaining = 0;
-                } else {
-                    // we do the math in 4 MHz radio ticks so that the timestamp integer overflow works
-                    uint32_t targHopTime;
-
-                    // we should hop around 530 us (2120 radio ticks) after frame end
-                    // this should give us enough time to postpone hop if necessary
-                    targHopTime = frame->timestamp*4 + (frame->length + 8)*32 + 2120;
-
-                    timeRemaining = targHopTime - RF_getCurrentTime();
-                    if (timeRemaining >= 0x80000000)
-                        timeRemaining = 0; // should not happen given typical latency
-                    else
-                        timeRemaining >>= 2; // convert to microseconds from radio ticks
-                }
-
-                // Let them no we got a legacy adv on 37 (to increment connEventCount)
-                gotLegacy = true;
-
-                DelayHopTrigger_trig(timeRemaining);
-            }
-        }
-
-        // hop interval gets temporarily stretched by 400 us if a scan request is received,
-        // since the advertiser needs to respond
-        if (pduType == SCAN_REQ && frame->channel == 37 && snifferState == ADVERT_HOP && !postponed)
-        {
-            DelayHopTrigger_postpone(400);
-            postponed = true;
-        }
+        // count new advertisers for the discovery sweep
+        if (snifferState == STATIC)
+            adv_sweep_frame(frame);
 
         /* for connectable advertisements, save advertisement headers to the cache
          * Connectable types are:
@@ -710,35 +1150,51 @@ void reactToPDU(const BLE_Frame *frame)
         if ((pduType == CONNECT_IND) && followConnections)
         {
             bool isAuxReq = frame->channel < 37;
+            ConnCtx *c;
+#if STATS_LATENCY
+            uint32_t startTime = RF_getCurrentTime();
+#endif
 
             // make sure body length is correct
             if (advLen != 34)
                 return;
 
+            // already following it, or no room for another connection
+            c = allocConn(*(uint32_t *)(frame->pData + 14), false);
+            if (!c)
+                return;
+
             if (snifferState == ADVERTISING) {
-                use_csa2 = ChSel ? true : false;
+                c->use_csa2 = ChSel ? true : false;
             } else {
                 // Use CSA#2 if both initiator and advertiser support it
                 // AUX_CONNECT_REQ always uses CSA#2, ChSel is RFU
-                use_csa2 = isAuxReq ? true : false;
+                c->use_csa2 = isAuxReq ? true : false;
                 if (!isAuxReq && ChSel)
                 {
                     // check if advertiser supports it
                     uint8_t adv_hdr = adv_cache_fetch(frame->pData + 8);
                     if (adv_hdr != 0xFF && (adv_hdr & 0x20))
-                        use_csa2 = true;
+                        c->use_csa2 = true;
                 }
             }
 
             // use_csa2 needs to be set before calling this
-            handleConnReq(frame->phy, frame->timestamp << 2, frame->pData + 14,
+            handleConnReq(c, frame->phy, frame->timestamp << 2, frame->pData + 14,
                     isAuxReq);
 
             if (snifferState == ADVERTISING)
                 stateTransition(SLAVE);
-            else
+            else if (snifferState != DATA)
                 stateTransition(DATA);
+
+            // the new connection's first event may come before the next one
+            // scheduled, so DATA state reschedules when stopped
             RadioWrapper_stop();
+
+#if STATS_LATENCY
+            stats_latency(latency.connReq, RF_getCurrentTime() - startTime);
+#endif
         }
     } else {
         reactToDataPDU(frame);
@@ -763,8 +1219,9 @@ static void reactToDataPDU(const BLE_Frame *frame)
     if (firstPacket)
     {
         // compute anchor point offset from start of receive window
-        anchorOffset[aoInd] = (frame->timestamp << 2) + rconf.hopIntervalTicks - nextHopTime;
-        aoInd = (aoInd + 1) & 0xF;
+        est_add(&conn->anchorOffsetEst, (int32_t)((frame->timestamp << 2) +
+                    conn->rconf.hopIntervalTicks - conn->nextHopTime));
+        conn->anchorRssi = frame->rssi;
         firstPacket = false;
     }
 
@@ -789,9 +1246,9 @@ static void reactToDataPDU(const BLE_Frame *frame)
     if (frame->length - 2 != datLen)
         return;
 
-    last_rconf = rconf_latest();
+    last_rconf = rconf_latest(&conn->rconfQueue);
     if (!last_rconf)
-        last_rconf = &rconf;
+        last_rconf = &conn->rconf;
 
     switch (opcode)
     {
@@ -803,7 +1260,7 @@ static void reactToDataPDU(const BLE_Frame *frame)
         next_rconf.phy = last_rconf->phy;
         next_rconf.slaveLatency = *(uint16_t *)(frame->pData + 6);
         nextInstant = *(uint16_t *)(frame->pData + 12);
-        rconf_enqueue(nextInstant, &next_rconf);
+        rconf_enqueue(&conn->rconfQueue, nextInstant, &next_rconf);
         break;
     case 0x01: // LL_CHANNEL_MAP_IND
         if (datLen != 8) break;
@@ -814,11 +1271,11 @@ static void reactToDataPDU(const BLE_Frame *frame)
         next_rconf.phy = last_rconf->phy;
         next_rconf.slaveLatency = last_rconf->slaveLatency;
         nextInstant = *(uint16_t *)(frame->pData + 8);
-        rconf_enqueue(nextInstant, &next_rconf);
+        rconf_enqueue(&conn->rconfQueue, nextInstant, &next_rconf);
         break;
     case 0x02: // LL_TERMINATE_IND
         if (datLen != 2) break;
-        handleConnFinished();
+        handleConnFinished(conn);
         break;
     case 0x18: // LL_PHY_UPDATE_IND
         if (datLen != 5) break;
@@ -843,7 +1300,7 @@ static void reactToDataPDU(const BLE_Frame *frame)
         }
         next_rconf.slaveLatency = last_rconf->slaveLatency;
         nextInstant = *(uint16_t *)(frame->pData + 5);
-        rconf_enqueue(nextInstant, &next_rconf);
+        rconf_enqueue(&conn->rconfQueue, nextInstant, &next_rconf);
         break;
     default:
         break;
@@ -858,7 +1315,7 @@ static void reactToAdvExtPDU(const BLE_Frame *frame, uint8_t advLen)
     uint8_t *pCTEInfo __attribute__((unused)) = NULL;
     uint8_t *pAdvDataInfo __attribute__((unused)) = NULL;
     uint8_t *pAuxPtr = NULL;
-    uint8_t *pSyncInfo __attribute__((unused)) = NULL;
+    uint8_t *pSyncInfo = NULL;
     uint8_t *pTxPower __attribute__((unused)) = NULL;
     uint8_t *pACAD __attribute__((unused)) = NULL;
     uint8_t ACADLen __attribute__((unused)) = 0;
@@ -868,6 +1325,11 @@ static void reactToAdvExtPDU(const BLE_Frame *frame, uint8_t advLen)
     uint8_t hdrBodyLen = 0;
     uint8_t advMode;
 
+    // AUX_SYNC_IND and its AUX_CHAIN_INDs use the periodic train's AA
+    bool onPeriodic = (auxListenAA != BLE_ADV_AA) && (frame->channel < 37);
+    uint32_t auxAA = onPeriodic ? auxListenAA : BLE_ADV_AA;
+    uint32_t auxCRCI = onPeriodic ? auxListenCRCI : 0x555555;
+
     // invalid if missing extended header length and AdvMode
     if (advLen < 1)
         return;
@@ -947,15 +1409,15 @@ static void reactToAdvExtPDU(const BLE_Frame *frame, uint8_t advLen)
     if (pAdvA && advMode == 1)
         adv_cache_store(pAdvA, frame->pData[0]);
 
-    /* TODO: handle periodic advertising
-     * It's more complicated than I initially realized
-     * It's sort of half way between data and advertising
-     * It uses a custom access address and channel map
-     * I suspect it uses CSA#2 for hopping, but the spec is not obvious on this
-     * There's also a procedure for sync transfer from a link layer (data) connection
-     * In short: I don't have time to implement it today.
-     * The scheduler will need to be reworked to deal with this all.
+    /* Periodic advertising: AUX_ADV_IND SyncInfo describes a train of
+     * AUX_SYNC_INDs with their own AA, channel map (hopped with CSA#2), and
+     * interval. We follow the train until it's missed too many times.
+     * Sync transfer from a connection (LL_PERIODIC_SYNC_IND) isn't handled.
      */
+    if (onPeriodic)
+        AuxAdvScheduler_periodicSeen(auxAA, frame->timestamp * 4);
+    else if (pSyncInfo)
+        AuxAdvScheduler_addPeriodic(pSyncInfo, frame->phy, frame->timestamp * 4);
 
     // Add AUX_ADV_INDs to the schedule
     if (pAuxPtr)
@@ -978,7 +1440,7 @@ static void reactToAdvExtPDU(const BLE_Frame *frame, uint8_t advLen)
         // wait for 4 ms (or 8 ms coded) on aux channel
         uint32_t auxPeriod = 4000 * 4;
         if (phy == PHY_CODED) auxPeriod = 8000 * 4;
-        AuxAdvScheduler_insert(chan, phy, radioTimeStart, auxPeriod);
+        AuxAdvScheduler_insert(chan, phy, auxAA, auxCRCI, radioTimeStart, auxPeriod);
 
         // schedule a scheduler invocation in 5 ms or sooner if needed
         uint32_t ticksToStart = radioTimeStart - RF_getCurrentTime();
@@ -990,24 +1452,69 @@ static void reactToAdvExtPDU(const BLE_Frame *frame, uint8_t advLen)
     }
 }
 
-static void handleConnReq(PHY_Mode phy, uint32_t connTime, uint8_t *llData,
-        bool isAuxReq)
+/* Context for a newly seen connection. Outside the DATA state any previous
+ * connection is dropped. In DATA, returns NULL if the access address is
+ * already being followed or connMax connections are, unless evict is set
+ * (for connections the host asks for), in which case the existing context
+ * for the access address or else the newest connection is taken over.
+ */
+static ConnCtx *allocConn(uint32_t aa, bool evict)
+{
+    ConnCtx *newest = NULL;
+    unsigned i, n = 0;
+
+    if (!isDataState(snifferState))
+    {
+        for (i = 0; i < CONN_MAX; i++)
+            conns[i].active = false;
+        conn = conns;
+        return conns;
+    }
+
+    for (i = 0; i < CONN_MAX; i++)
+    {
+        if (!conns[i].active)
+            continue;
+        if (conns[i].accessAddress == aa)
+            return evict ? conns + i : NULL;
+        if (!newest || (int32_t)(conns[i].serial - newest->serial) > 0)
+            newest = conns + i;
+        n++;
+    }
+
+    if (n >= connMax)
+        return evict ? newest : NULL;
+
+    for (i = 0; i < CONN_MAX; i++)
+    {
+        if (!conns[i].active)
+            return conns + i;
+    }
+
+    return NULL; // should not happen, connMax <= CONN_MAX
+}
+
+static void handleConnReq(ConnCtx *c, PHY_Mode phy, uint32_t connTime,
+        uint8_t *llData, bool isAuxReq)
 {
     uint16_t WinOffset, Interval;
 
-    accessAddress = *(uint32_t *)llData;
-    hopIncrement = llData[21] & 0x1F;
-    crcInit = (*(uint32_t *)(llData + 4)) & 0xFFFFFF;
+    // keep the scheduler off it until it's all set up
+    c->active = false;
+
+    c->accessAddress = *(uint32_t *)llData;
+    c->hopIncrement = llData[21] & 0x1F;
+    c->crcInit = (*(uint32_t *)(llData + 4)) & 0xFFFFFF;
 
     // start on the hop increment channel
-    curUnmapped = hopIncrement;
+    c->curUnmapped = c->hopIncrement;
 
-    rconf.chanMap = 0;
-    memcpy(&rconf.chanMap, llData + 16, 5);
-    if (use_csa2)
-        csa2_computeMapping(accessAddress, rconf.chanMap);
+    c->rconf.chanMap = 0;
+    memcpy(&c->rconf.chanMap, llData + 16, 5);
+    if (c->use_csa2)
+        csa2_computeMappingCtx(&c->csa2, c->accessAddress, c->rconf.chanMap);
     else
-        computeMap1(rconf.chanMap);
+        computeMap1(c, c->rconf.chanMap);
 
     /* see pg 2983 of BT5.2 core spec:
      *  transmitWindowDelay = 1.25 ms for CONNECT_IND
@@ -1025,19 +1532,87 @@ static void handleConnReq(PHY_Mode phy, uint32_t connTime, uint8_t *llData,
     transmitWindowDelay -= AO_TARG; // account for latency
     WinOffset = *(uint16_t *)(llData + 8);
     Interval = *(uint16_t *)(llData + 10);
-    nextHopTime = connTime + transmitWindowDelay + (WinOffset * 5000);
-    rconf.hopIntervalTicks = Interval * 5000; // 4 MHz clock, 1.25 ms per unit
-    nextHopTime += rconf.hopIntervalTicks;
-    rconf.phy = phy;
-    rconf.slaveLatency = *(uint16_t *)(llData + 12);
-    connEventCount = 0;
-    rconf_reset();
+    c->nextHopTime = connTime + transmitWindowDelay + (WinOffset * 5000);
+    c->rconf.hopIntervalTicks = Interval * 5000; // 4 MHz clock, 1.25 ms per unit
+    c->nextHopTime += c->rconf.hopIntervalTicks;
+    c->rconf.phy = phy;
+    c->rconf.slaveLatency = *(uint16_t *)(llData + 12);
+    c->connEventCount = 0;
+    c->empty_hops = 0;
+    c->conflictsLost = 0;
+    c->serial = connSerial++;
+    rconf_reset(&c->rconfQueue);
+    resetHopTable(c);
+    resetAnchorOffsetEst(c);
+    map_learn_reset(&c->mapLearn);
+    ll_crypto_reset(&c->crypto);
+
+    c->active = true;
 }
 
-static void handleConnFinished()
+// The host may hand us a connection some events after its CONNECT_IND,
+// so jump ahead to the first event whose anchor is still in the future
+static void skipPastConnEvents(ConnCtx *c)
 {
+    uint32_t anchor = c->nextHopTime - c->rconf.hopIntervalTicks + AO_TARG;
+    uint32_t now = RF_getCurrentTime();
+    uint32_t n;
+
+    if ((int32_t)(now - anchor) <= 0)
+        return;
+
+    n = (now - anchor) / c->rconf.hopIntervalTicks + 1;
+    c->connEventCount += n;
+    c->curUnmapped = (c->curUnmapped + (n % 37) * c->hopIncrement) % 37;
+    c->nextHopTime += n * c->rconf.hopIntervalTicks;
+    resetHopTable(c);
+}
+
+// frames only feed the acquisition engine until it has worked out the hopping
+static void acquireCallback(BLE_Frame *frame)
+{
+    if (acq_frame(frame))
+        RadioWrapper_stop();
+}
+
+// start following an acquired connection, treating its last seen event as
+// if it were the first event after a CONNECT_IND
+static void handleAcquired(const AcqResult *r)
+{
+    uint8_t llData[22];
+    ConnCtx *c;
+
+    memset(llData, 0, sizeof(llData)); // WinSize, WinOffset, Latency, Timeout
+    memcpy(llData, &r->accessAddress, 4);
+    memcpy(llData + 4, &r->crcInit, 3);
+    memcpy(llData + 10, &r->interval, 2);
+    memcpy(llData + 16, &r->chanMap, 5);
+    llData[21] = r->hopIncrement;
+
+    // the first anchor is 1.25 ms (transmitWindowDelay) after the request
+    c = allocConn(r->accessAddress, true);
+    c->use_csa2 = r->csa2;
+    handleConnReq(c, acqPhy, r->eventTime - 5000, llData, false);
+    if (c->use_csa2)
+        c->connEventCount = r->eventCounter;
+    else
+        c->curUnmapped = r->unmapped;
+    resetHopTable(c);
+    skipPastConnEvents(c);
+
+    stateTransition(DATA);
+}
+
+static void handleConnFinished(ConnCtx *c)
+{
+    c->active = false;
+
+    // carry on with any other connections being followed
+    if (isDataState(snifferState) && activeConns())
+        return;
+
     stateTransition(sniffDoneState);
-    accessAddress = BLE_ADV_AA;
+    statAA = BLE_ADV_AA;
     if (snifferState != PAUSED && advHopEnabled)
         advHopSeekMode();
 }
@@ -1049,8 +1624,8 @@ static void reactToTransmitted(dataQueue_t *pTXQ, uint32_t numEntries)
 
     f.timestamp = RF_getCurrentTime() >> 2;
     f.rssi = 0;
-    f.channel = getCurrChan();
-    f.phy = rconf.phy;
+    f.channel = getCurrChan(conn);
+    f.phy = conn->rconf.phy;
     f.pData = pduBody;
 
     // don't trip up anchor offset calculations
@@ -1088,7 +1663,7 @@ void setChanAAPHYCRCI(uint8_t chan, uint32_t aa, PHY_Mode phy, uint32_t crcInit)
     statChan = chan;
     statCRCI = crcInit & 0xFFFFFF;
     stateTransition(STATIC);
-    accessAddress = aa;
+    statAA = aa;
     advHopEnabled = false;
     RadioWrapper_stop();
 }
@@ -1098,6 +1673,13 @@ void setFollowConnections(bool follow)
     followConnections = follow;
 }
 
+void setConnMax(uint8_t n)
+{
+    if (n < 1 || n > CONN_MAX)
+        return;
+    connMax = n;
+}
+
 // The idea behind this mode is that most devices send a single advertisement
 // on channel 37, then a single ad on 38, then a single ad on 39, then repeat.
 // If we hop along with the target, we have a much better chance of catching
@@ -1105,8 +1687,9 @@ void setFollowConnections(bool follow)
 void advHopSeekMode()
 {
     lastAdvTicks = 0;
-    aiInd = 0;
-    connEventCount = 0;
+    resetAdvIntervalEst();
+    conn = conns;
+    conn->connEventCount = 0;
     stateTransition(ADVERT_SEEK);
     advHopEnabled = true;
     RadioWrapper_stop();
@@ -1120,6 +1703,13 @@ void pauseAfterSniffDone(bool do_pause)
         sniffDoneState = STATIC;
 }
 
+void setAdvSweep(uint8_t phyMask)
+{
+    adv_sweep_set(phyMask);
+    if (snifferState == STATIC)
+        RadioWrapper_stop();
+}
+
 void setAuxAdvEnabled(bool enable)
 {
     auxAdvEnabled = enable;
@@ -1138,12 +1728,63 @@ void sendMarker()
     frame.channel = 41; // indicates marker message
     frame.phy = PHY_1M;
     frame.pData = NULL;
+    frame.pEntry = NULL;
     frame.length = 0;
 
     // Does thread safe copying into queue
     indicatePacket(&frame);
 }
 
+/* Follow connection from a CONNECT_IND/AUX_CONNECT_REQ seen elsewhere
+ * connTime is when the request was sent (microseconds, our radio timebase)
+ */
+void followConn(PHY_Mode phy, uint32_t connTime, bool csa2, bool isAuxReq,
+        const void *llData)
+{
+    memcpy(followLLData, llData, 22);
+    followTime = connTime;
+    followPhy = phy;
+    followCsa2 = csa2;
+    followAux = isAuxReq;
+    followPending = true;
+    RadioWrapper_stop();
+}
+
+/* Acquire a connection already in progress (without its CONNECT_IND)
+ * chanMap must have at least two channels, as for a real connection
+ */
+void acquireConn(uint32_t aa, uint64_t chanMap, PHY_Mode phy)
+{
+    acqAA = aa;
+    acqChanMap = chanMap;
+    acqPhy = phy;
+    acqPending = true;
+    RadioWrapper_stop();
+}
+
+/* Report channel map learning for the oldest sniffed connection */
+unsigned getDataChanStats(uint8_t *dst)
+{
+    const ConnCtx *c = NULL;
+    unsigned i;
+
+    // only collected when sniffing, not as master or slave
+    if (snifferState != DATA)
+        return 0;
+
+    for (i = 0; i < CONN_MAX; i++)
+    {
+        if (conns[i].active && (!c || (int32_t)(conns[i].serial - c->serial) < 0))
+            c = conns + i;
+    }
+    if (!c)
+        return 0;
+
+    memcpy(dst, &c->accessAddress, 4);
+    memcpy(dst + 4, &c->rconf.chanMap, 5);
+    return 9 + map_learn_stats(&c->mapLearn, dst + 9);
+}
+
 /* Set Sniffle's MAC address for advertising/scanning/initiating */
 void setAddr(bool isRandom, void *addr)
 {
@@ -1152,8 +1793,10 @@ void setAddr(bool isRandom, void *addr)
 }
 
 /* Enter initiating state */
-void initiateConn(bool isRandom, void *_peerAddr, void *llData)
+void initiateConn(bool isRandom, void *_peerAddr, void *llData, bool hop3)
 {
+    initHop3 = hop3;
+    initChan = 37;
     peerAddrRandom = isRandom;
     memcpy(peerAddr, _peerAddr, 6);
     memcpy(connReqLLData, llData, 22);
@@ -1165,16 +1808,37 @@ void initiateConn(bool isRandom, void *_peerAddr, void *llData)
 /* Enter advertising state */
 void advertise(void *advData, uint8_t advLen, void *scanRspData, uint8_t scanRspLen)
 {
-    s_advLen = advLen;
-    s_scanRspLen = scanRspLen;
-    memcpy(s_advData, advData, advLen);
-    memcpy(s_scanRspData, scanRspData, scanRspLen);
+    adv_sets_config(0, false, s_advIntervalMs, advData, advLen, scanRspData, scanRspLen);
     stateTransition(ADVERTISING);
     RadioWrapper_stop();
 }
 
+bool advertiseSet(uint8_t idx, bool extended, uint16_t intervalMs, void *advData,
+        uint8_t advLen, void *scanRspData, uint8_t scanRspLen)
+{
+    if (!adv_sets_config(idx, extended, intervalMs, advData, advLen, scanRspData,
+                scanRspLen))
+        return false;
+    if (idx == 0)
+        s_advIntervalMs = intervalMs;
+
+    // connections made by legacy sets keep going
+    if (snifferState != ADVERTISING && snifferState != SLAVE)
+    {
+        stateTransition(ADVERTISING);
+        RadioWrapper_stop();
+    }
+    return true;
+}
+
+void removeAdvSet(uint8_t idx)
+{
+    adv_sets_remove(idx);
+}
+
 /* Set advertising interval (for advertising state) in milliseconds */
 void setAdvInterval(uint32_t intervalMs)
 {
     s_advIntervalMs = intervalMs;
+    adv_sets_setInterval(0, intervalMs);
 }
@@ -11,13 +11,37 @@
 #include <stdbool.h>
 
 #include "RadioWrapper.h"
+#include "ll_crypto.h"
 
 /* Create the RadioTask and creates all TI-RTOS objects */
 void RadioTask_init(void);
 
-/* Update radio state/configuration based on received PDU */
+/* Update radio state/configuration based on received PDU, other than
+ * the hop timing reactToUrgentPDU takes care of */
 void reactToPDU(const BLE_Frame *frame);
 
+/* Decrypt a data channel frame of a connection being sniffed in place, if
+ * its LTK was given, before reactToPDU. Returns true if it was decrypted.
+ * Otherwise retry is filled in for frames worth ll_crypto_retry on their
+ * queued copy; reactToPDU doesn't get to see those decrypted.
+ */
+bool decryptDataPDU(BLE_Frame *frame, LLCryptoRetry *retry);
+
+/* Check if frame is an advertising PDU (primary or secondary channel) */
+bool isAdvFrame(const BLE_Frame *frame);
+
+/* Check if frame must be reacted to from the RF callback rather than
+ * deferred, as timing of the following radio operations depends on it */
+bool isUrgentFrame(const BLE_Frame *frame);
+
+/* React to the time critical part of an urgent frame, from the RF callback:
+ * hop timing in ADVERT_SEEK/ADVERT_HOP, and all of reactToPDU for PDUs
+ * saying when to listen next. Returns true if reactToPDU was done. */
+bool reactToUrgentPDU(const BLE_Frame *frame);
+
+/* Access address a frame was received with (call before reactToPDU) */
+uint32_t frameAccessAddress(const BLE_Frame *frame);
+
 /* Stay on specified channel, PHY, access address, and initial CRC */
 void setChanAAPHYCRCI(uint8_t chan, uint32_t aa, PHY_Mode phy, uint32_t crcInit);
 
@@ -32,21 +56,56 @@ void advHopSeekMode(void);
 /* Enable/disable connection following */
 void setFollowConnections(bool follow);
 
+/* Follow up to n (1 to 4) connections at once, listening for more
+ * CONNECT_INDs in gaps between connection events while there's room */
+void setConnMax(uint8_t n);
+
+/* Sweep primary advertising channels (on PHYs in phyMask, from adv_sweep.h)
+ * in the STATIC state when sniffing advertisements, or stop if 0 */
+void setAdvSweep(uint8_t phyMask);
+
 /* Enable hopping to auxiliary advertisements */
 void setAuxAdvEnabled(bool enable);
 
 /* Send marker message indicating current radio time */
 void sendMarker(void);
 
+/* Follow connection from a CONNECT_IND/AUX_CONNECT_REQ seen elsewhere
+ * connTime is when the request was sent (microseconds, our radio timebase)
+ */
+void followConn(PHY_Mode phy, uint32_t connTime, bool csa2, bool isAuxReq,
+        const void *llData);
+
+/* Find the hopping of a connection already in progress, then follow it
+ * The channel map isn't inferred, so it must be given (0x1FFFFFFFFF for all)
+ */
+void acquireConn(uint32_t aa, uint64_t chanMap, PHY_Mode phy);
+
+/* Per data channel stats of the oldest connection being sniffed, for the
+ * stats message. Returns the length written, or 0 if none is followed.
+ *   Bytes 0-3:     access address
+ *   Bytes 4-8:     channel map in use (may differ from the last one seen)
+ *   Bytes 9+:      37 channels of map_learn_stats
+ */
+unsigned getDataChanStats(uint8_t *dst);
+
 /* Set Sniffle's MAC address for advertising/scanning/initiating */
 void setAddr(bool isRandom, void *addr);
 
-/* Enter initiating state */
-void initiateConn(bool isRandom, void *peerAddr, void *llData);
+/* Enter initiating state, cycling through 37/38/39 if hop3 (1M PHY only) */
+void initiateConn(bool isRandom, void *peerAddr, void *llData, bool hop3);
 
-/* Enter advertising state */
+/* Enter advertising state, with advertising set 0 */
 void advertise(void *advData, uint8_t advLen, void *scanRspData, uint8_t scanRspLen);
 
+/* Configure advertising set idx (see adv_sets.h), and advertise if not
+ * already. Returns false if the set index or data lengths are invalid. */
+bool advertiseSet(uint8_t idx, bool extended, uint16_t intervalMs, void *advData,
+        uint8_t advLen, void *scanRspData, uint8_t scanRspLen);
+
+/* Stop advertising set idx */
+void removeAdvSet(uint8_t idx);
+
 /* Set advertising interval (for advertising state) in milliseconds */
 void setAdvInterval(uint32_t intervalMs);
 
@@ -8,7 +8,9 @@
  * INCLUDES
  */
 #include <errno.h>
+#include <string.h>
 #include <ti/sysbios/knl/Task.h>
+#include <ti/sysbios/knl/Swi.h>
 
 // DriverLib
 #include <ti/drivers/rf/RF.h>
@@ -17,6 +19,8 @@
 #include "RadioWrapper.h"
 #include "ti_radio_config.h"
 #include "RadioTask.h"
+#include "PacketTask.h"
+#include "stats.h"
 
 #include DeviceFamily_constructPath(driverlib/rf_ble_mailbox.h)
 
@@ -27,8 +31,13 @@
 /* TX Configuration: */
 #define DATA_ENTRY_HEADER_SIZE 8    /* Constant header size of a Generic Data Entry */
 #define MAX_LENGTH             257  /* Max 8-bit length + two byte BLE header */
-#define NUM_DATA_ENTRIES       2    /* NOTE: Only two data entries supported at the moment */
-#define NUM_APPENDED_BYTES     6    /* Prepended length byte, appended RSSI, appended 4 byte timestamp*/
+#define NUM_APPENDED_BYTES     9    /* Prepended length byte, 3 byte CRC (if kept), appended RSSI, appended 4 byte timestamp*/
+
+/* Entries stay owned by PacketTask until sent over UART, so the queue must
+ * be deep enough to absorb bursts (eg. many packets per connection event). */
+#ifndef NUM_DATA_ENTRIES
+#define NUM_DATA_ENTRIES       16
+#endif
 
 /*********************************************************************
  * LOCAL VARIABLES
@@ -51,16 +60,56 @@ static PHY_Mode last_phy = PHY_1M;
 
 static RadioWrapper_Callback userCallback = NULL;
 
+/* Frames taken off the RF queue, waiting for the callback. The RF callback
+ * only unpacks frames into this ring, leaving filtering and reactToPDU to a
+ * lowest priority Swi, which still runs before RadioTask looks at the
+ * results. Only what indicateUrgent() picks out as time critical (eg.
+ * CONNECT_IND, AuxPtr, hop timing) is done in the RF callback.
+ * Deferred frames keep their data entry until handled, so the ring only gets
+ * half the entries, leaving the rest for the radio to keep receiving into.
+ * Once it's full, frames are dropped (counted in stats.deferDrops).
+ */
+#define DEFER_SIZE (NUM_DATA_ENTRIES / 2)
+#define DEFER_MASK (DEFER_SIZE - 1)
+
+#if DEFER_SIZE < 1 || (DEFER_SIZE & DEFER_MASK)
+#error "NUM_DATA_ENTRIES must be a power of 2, at least 2"
+#endif
+
+struct DeferredFrame
+{
+    BLE_Frame frame;
+    RadioWrapper_Callback callback;
+};
+
+static struct DeferredFrame deferred[DEFER_SIZE];
+static volatile uint32_t deferHead = 0;
+static volatile uint32_t deferTail = 0;
+static Swi_Struct deferSwi;
+
+// radio timer capture channel for RadioWrapper_captureEdges
+static RF_RatHandle captureHandle = -1;
+static RadioWrapper_CaptureCallback captureCallback = NULL;
+
 // In radio ticks (4 MHz)
 static uint32_t trigTime = 0;
 static uint32_t delay39 = 0;
 
 static bool trigTimeSet = false;
 
+// RF core counters for generic RX commands
+static rfc_bleGenericRxOutput_t rxOutput;
+
+// received CRCs are kept (after the PDU) for recvFramesRawCrc
+static bool keepCrc = false;
+
 /*********************************************************************
  * LOCAL FUNCTIONS
  */
 static void rx_int_callback(RF_Handle h, RF_CmdHandle ch, RF_EventMask e);
+static void deferSwiFxn(UArg arg0, UArg arg1);
+static int recvGeneric(PHY_Mode phy, uint32_t chan, uint32_t accessAddr,
+    uint32_t crcInit, uint32_t timeout, RadioWrapper_Callback callback, bool rawCrc);
 
 /*********************************************************************
  * PUBLIC FUNCTIONS
@@ -70,6 +119,13 @@ int RadioWrapper_init()
 {
     if(!configured)
     {
+        Swi_Params swiParams;
+
+        // lowest priority, so it never preempts the RF driver
+        Swi_Params_init(&swiParams);
+        swiParams.priority = 0;
+        Swi_construct(&deferSwi, deferSwiFxn, &swiParams, NULL);
+
         bleRfHandle = RF_open(&bleRfObject, &RF_prop,
                         (RF_RadioSetup*)&RF_cmdBle5RadioSetup, NULL);
 
@@ -108,6 +164,22 @@ int RadioWrapper_init()
 //  Status code (errno.h), 0 on success
 int RadioWrapper_recvFrames(PHY_Mode phy, uint32_t chan, uint32_t accessAddr,
     uint32_t crcInit, uint32_t timeout, RadioWrapper_Callback callback)
+{
+    return recvGeneric(phy, chan, accessAddr, crcInit, timeout, callback, false);
+}
+
+// Receive BLE packets regardless of CRC, keeping the received CRC
+//
+// Arguments are as for RadioWrapper_recvFrames. The 3 CRC bytes follow the
+// PDU in frames passed to the callback, and are included in the length.
+int RadioWrapper_recvFramesRawCrc(PHY_Mode phy, uint32_t chan, uint32_t accessAddr,
+    uint32_t timeout, RadioWrapper_Callback callback)
+{
+    return recvGeneric(phy, chan, accessAddr, 0x555555, timeout, callback, true);
+}
+
+static int recvGeneric(PHY_Mode phy, uint32_t chan, uint32_t accessAddr,
+    uint32_t crcInit, uint32_t timeout, RadioWrapper_Callback callback, bool rawCrc)
 {
     if((!configured) || (chan >= 40))
     {
@@ -128,10 +200,10 @@ int RadioWrapper_recvFrames(PHY_Mode phy, uint32_t chan, uint32_t accessAddr,
     RF_cmdBle5GenericRx.pParams->bRepeat = 0x01; // receive multiple packets
 
     RF_cmdBle5GenericRx.pParams->rxConfig.bAutoFlushIgnored = 1;
-    RF_cmdBle5GenericRx.pParams->rxConfig.bAutoFlushCrcErr = 1;
+    RF_cmdBle5GenericRx.pParams->rxConfig.bAutoFlushCrcErr = rawCrc ? 0 : 1;
     RF_cmdBle5GenericRx.pParams->rxConfig.bAutoFlushEmpty = 0;
     RF_cmdBle5GenericRx.pParams->rxConfig.bIncludeLenByte = 1;
-    RF_cmdBle5GenericRx.pParams->rxConfig.bIncludeCrc = 0;
+    RF_cmdBle5GenericRx.pParams->rxConfig.bIncludeCrc = rawCrc ? 1 : 0;
     RF_cmdBle5GenericRx.pParams->rxConfig.bAppendRssi = 1;
     RF_cmdBle5GenericRx.pParams->rxConfig.bAppendStatus = 0;
     RF_cmdBle5GenericRx.pParams->rxConfig.bAppendTimestamp = 1;
@@ -150,9 +222,20 @@ int RadioWrapper_recvFrames(PHY_Mode phy, uint32_t chan, uint32_t accessAddr,
     last_channel = chan;
     last_phy = phy;
 
+    /* RF core doesn't reset counters on its own */
+    memset(&rxOutput, 0, sizeof(rxOutput));
+    RF_cmdBle5GenericRx.pOutput = &rxOutput;
+
     /* Enter RX mode and stay in RX till timeout */
+    keepCrc = rawCrc;
     RF_runCmd(bleRfHandle, (RF_Op*)&RF_cmdBle5GenericRx, RF_PriorityNormal,
             &rx_int_callback, IRQ_RX_ENTRY_DONE);
+    keepCrc = false;
+
+    // CRC errors are expected when we don't know CRCInit
+    if (!rawCrc)
+        stats.crcErrors += rxOutput.nRxNok;
+    stats.rfBufFull += rxOutput.nRxBufFull;
 
     return 0;
 }
@@ -259,10 +342,19 @@ int RadioWrapper_recvAdv3(uint32_t delay1, uint32_t delay2, RadioWrapper_Callbac
     last_channel = 40;
     last_phy = PHY_1M;
 
+    // all three share counters
+    memset(&rxOutput, 0, sizeof(rxOutput));
+    sniff37.pOutput = &rxOutput;
+    sniff38.pOutput = &rxOutput;
+    sniff39.pOutput = &rxOutput;
+
     // run the command chain
     RF_runCmd(bleRfHandle, (RF_Op*)&sniff37, RF_PriorityNormal,
             &rx_int_callback, IRQ_RX_ENTRY_DONE);
 
+    stats.crcErrors += rxOutput.nRxNok;
+    stats.rfBufFull += rxOutput.nRxBufFull;
+
     return 0;
 }
 
@@ -357,10 +449,13 @@ int RadioWrapper_master(PHY_Mode phy, uint32_t chan, uint32_t accessAddr,
     last_phy = phy;
 
     /* Enter master mode, and stay till we're done */
+    memset(&output, 0, sizeof(output));
     RF_runCmd(bleRfHandle, (RF_Op*)&RF_cmdBle5Master, RF_PriorityNormal,
             &rx_int_callback, IRQ_RX_ENTRY_DONE);
 
     *numSent = output.nTxEntryDone;
+    stats.crcErrors += output.nRxNok;
+    stats.rfBufFull += output.nRxBufFull;
 
     switch (RF_cmdBle5Master.status)
     {
@@ -456,10 +551,13 @@ int RadioWrapper_slave(PHY_Mode phy, uint32_t chan, uint32_t accessAddr,
     last_phy = phy;
 
     /* Enter slave mode, and stay till we're done */
+    memset(&output, 0, sizeof(output));
     RF_runCmd(bleRfHandle, (RF_Op*)&RF_cmdBle5Slave, RF_PriorityNormal,
             &rx_int_callback, IRQ_RX_ENTRY_DONE);
 
     *numSent = output.nTxEntryDone;
+    stats.crcErrors += output.nRxNok;
+    stats.rfBufFull += output.nRxBufFull;
 
     switch (RF_cmdBle5Slave.status)
     {
@@ -729,38 +827,224 @@ int RadioWrapper_advertise3(RadioWrapper_Callback callback, const uint16_t *advA
     }
 }
 
+// time between primary channel PDUs of an extended advertising event, and
+// from the last one to the auxiliary PDU (radio ticks)
+#define EXT_PRIMARY_GAP 2400
+#define EXT_AUX_GAP     2400
+
+// ADV_EXT_IND extended header: flags, ADI, AuxPtr
+static uint8_t extIndPkt[2 + 6];
+
+// AUX_ADV_IND extended header: flags, AdvA, ADI, then data
+static uint8_t auxAdvPkt[2 + 9 + 245];
+
+static int advExtStatus(uint16_t status)
+{
+    switch (status)
+    {
+    case BLE_DONE_OK:
+    case BLE_DONE_ENDED:
+        return 0;
+    case BLE_DONE_STOPPED:
+        return -2;
+    default:
+        return -3;
+    }
+}
+
+/* Non-connectable, non-scannable extended advertising event on 37/38/39,
+ * with the data in an AUX_ADV_IND on auxChan (all on 1M PHY)
+ *
+ * Arguments:
+ *  callback    Function to call when a packet is received
+ *  advAddr     Our (advertiser) MAC address
+ *  advRandom   TxAdd for advertisement
+ *  adi         AdvDataInfo (DID and SID) of the advertising set
+ *  advData     Advertisement data
+ *  advLen      Advertisement data length (up to 245)
+ *  auxChan     Secondary channel for the AUX_ADV_IND (0 to 36)
+ *
+ * Returns:
+ *  -3 on misc error
+ *  -2 on advertiser being stopped
+ *  -1 on success (there's nothing to connect to)
+ */
+int RadioWrapper_advertiseExt3(RadioWrapper_Callback callback, const uint16_t *advAddr,
+    bool advRandom, uint16_t adi, const void *advData, uint8_t advLen, uint8_t auxChan)
+{
+    uint32_t startTime = RF_getCurrentTime() + 4000;
+    uint32_t auxTime = startTime + 2*EXT_PRIMARY_GAP + EXT_AUX_GAP;
+    int status;
+    uint8_t chan;
+
+    if (advLen > 245 || auxChan > 36)
+        return -3;
+
+    // the radio fills in AuxOffset from auxPtrTargetTime
+    extIndPkt[0] = 6;       // extended header length, AdvMode 0
+    extIndPkt[1] = 0;       // no data
+    extIndPkt[2] = 0x18;    // ADI, AuxPtr
+    extIndPkt[3] = adi & 0xFF;
+    extIndPkt[4] = adi >> 8;
+    extIndPkt[5] = auxChan; // 30 us offset units
+    extIndPkt[6] = 0;
+    extIndPkt[7] = 0;       // 1M PHY
+
+    auxAdvPkt[0] = 9;
+    auxAdvPkt[1] = advLen;
+    auxAdvPkt[2] = 0x09;    // AdvA, ADI
+    memcpy(auxAdvPkt + 3, advAddr, 6);
+    auxAdvPkt[9] = adi & 0xFF;
+    auxAdvPkt[10] = adi >> 8;
+    memcpy(auxAdvPkt + 11, advData, advLen);
+
+    RF_cmdBle5AdvExt.whitening.bOverride = 0x0;
+    RF_cmdBle5AdvExt.phyMode.mainMode = PHY_1M;
+    RF_cmdBle5AdvExt.startTrigger.triggerType = TRIG_ABSTIME;
+    RF_cmdBle5AdvExt.startTrigger.pastTrig = 1;
+    RF_cmdBle5AdvExt.pParams->advConfig.deviceAddrType = advRandom ? 1 : 0;
+    RF_cmdBle5AdvExt.pParams->auxPtrTargetType = TRIG_ABSTIME;
+    RF_cmdBle5AdvExt.pParams->auxPtrTargetTime = auxTime;
+    RF_cmdBle5AdvExt.pParams->pAdvPkt = extIndPkt;
+    RF_cmdBle5AdvExt.pParams->pDeviceAddress = (uint16_t *)advAddr;
+
+    last_phy = PHY_1M;
+    for (chan = 37; chan <= 39; chan++)
+    {
+        RF_cmdBle5AdvExt.channel = chan;
+        RF_cmdBle5AdvExt.startTime = startTime + (chan - 37) * EXT_PRIMARY_GAP;
+        last_channel = chan;
+
+        RF_runCmd(bleRfHandle, (RF_Op*)&RF_cmdBle5AdvExt, RF_PriorityNormal,
+                &rx_int_callback, IRQ_RX_ENTRY_DONE);
+
+        status = advExtStatus(RF_cmdBle5AdvExt.status);
+        if (status < 0)
+            return status;
+    }
+
+    RF_cmdBle5AdvAux.channel = auxChan;
+    RF_cmdBle5AdvAux.whitening.bOverride = 0x0;
+    RF_cmdBle5AdvAux.phyMode.mainMode = PHY_1M;
+    RF_cmdBle5AdvAux.startTrigger.triggerType = TRIG_ABSTIME;
+    RF_cmdBle5AdvAux.startTrigger.pastTrig = 1;
+    RF_cmdBle5AdvAux.startTime = auxTime;
+
+    RF_cmdBle5AdvAux.pParams->pRxQ = &dataQueue;
+    RF_cmdBle5AdvAux.pParams->rxConfig.bAutoFlushIgnored = 1;
+    RF_cmdBle5AdvAux.pParams->rxConfig.bAutoFlushCrcErr = 1;
+    RF_cmdBle5AdvAux.pParams->rxConfig.bAutoFlushEmpty = 0;
+    RF_cmdBle5AdvAux.pParams->rxConfig.bIncludeLenByte = 1;
+    RF_cmdBle5AdvAux.pParams->rxConfig.bIncludeCrc = 0;
+    RF_cmdBle5AdvAux.pParams->rxConfig.bAppendRssi = 1;
+    RF_cmdBle5AdvAux.pParams->rxConfig.bAppendStatus = 0;
+    RF_cmdBle5AdvAux.pParams->rxConfig.bAppendTimestamp = 1;
+    RF_cmdBle5AdvAux.pParams->advConfig.advFilterPolicy = 0x0;
+    RF_cmdBle5AdvAux.pParams->advConfig.deviceAddrType = advRandom ? 1 : 0;
+    RF_cmdBle5AdvAux.pParams->auxPtrTargetType = TRIG_NEVER; // no chain
+    RF_cmdBle5AdvAux.pParams->pAdvPkt = auxAdvPkt;
+    RF_cmdBle5AdvAux.pParams->pDeviceAddress = (uint16_t *)advAddr;
+    last_channel = auxChan;
+
+    RF_runCmd(bleRfHandle, (RF_Op*)&RF_cmdBle5AdvAux, RF_PriorityNormal,
+            &rx_int_callback, IRQ_RX_ENTRY_DONE);
+
+    status = advExtStatus(RF_cmdBle5AdvAux.status);
+    return status < 0 ? status : -1;
+}
+
 void RadioWrapper_stop()
 {
     // Gracefully stop any radio operations
     RF_runDirectCmd(bleRfHandle, 0x04020001);
 }
 
+void RadioWrapper_releaseEntry(rfc_dataEntryGeneral_t *pEntry)
+{
+    RFQueue_releaseEntry(pEntry);
+}
+
+void RadioWrapper_flush()
+{
+    unsigned key = Swi_disable();
+
+    // frames waiting for the deferred Swi, which can't be running as we're
+    // called from a task
+    while (deferTail != deferHead)
+    {
+        RFQueue_releaseEntry(deferred[deferTail & DEFER_MASK].frame.pEntry);
+        deferTail++;
+    }
+
+    // and frames the RF callback hasn't got to yet
+    while (RFQueue_getDataEntry()->status == DATA_ENTRY_FINISHED)
+        RFQueue_releaseEntry(RFQueue_takeEntry());
+
+    Swi_restore(key);
+}
+
+static void handleFrame(BLE_Frame *frame, RadioWrapper_Callback callback)
+{
+    if (callback) callback(frame);
+
+    /* Release right away unless the callback took ownership */
+    if (frame->pEntry) RFQueue_releaseEntry(frame->pEntry);
+}
+
+// the RF callback only ever adds to the ring, so it can run during a frame
+static void deferSwiFxn(UArg arg0, UArg arg1)
+{
+    unsigned key;
+
+    while (deferTail != deferHead)
+    {
+        struct DeferredFrame *d = deferred + (deferTail & DEFER_MASK);
+
+        handleFrame(&d->frame, d->callback);
+
+        key = Swi_disable();
+        deferTail++;
+        Swi_restore(key);
+    }
+}
+
 static void rx_int_callback(RF_Handle h, RF_CmdHandle ch, RF_EventMask e)
 {
     BLE_Frame frame;
     rfc_dataEntryGeneral_t *currentDataEntry;
     uint8_t *packetPointer;
-
-    if (e & RF_EventRxEntryDone)
+    uint8_t crcLen = keepCrc ? 3 : 0;
+    RadioWrapper_Callback callback;
+    struct DeferredFrame *d;
+#if STATS_LATENCY
+    uint32_t startTime = RF_getCurrentTime();
+#endif
+
+    if (!(e & RF_EventRxEntryDone))
+        return;
+
+    /* Several entries may have finished by the time we get called */
+    while (RFQueue_getDataEntry()->status == DATA_ENTRY_FINISHED)
     {
-        /* Get current unhandled data entry */
-        currentDataEntry = RFQueue_getDataEntry();
+        /* Take current unhandled data entry */
+        currentDataEntry = RFQueue_takeEntry();
         packetPointer = (uint8_t *)(&currentDataEntry->data);
 
-
         /* In the current radio configuration:
          * Byte 0:      Overall length (byte_2 + 2, redundant)
          * Byte 1:      Advertisement/data PDU header
          * Byte 2:      PDU body length (advert or data)
          * Bytes 3-8:   AdvA for legacy advertisements
+         * The CRC (if kept) and RSSI and timestamp follow the PDU.
          */
-        frame.length = packetPointer[2] + 2;
+        frame.length = packetPointer[2] + 2 + crcLen;
         frame.pData = packetPointer + 1;
+        frame.pEntry = currentDataEntry;
 
-        frame.rssi = (int8_t)packetPointer[3 + packetPointer[2]];
+        frame.rssi = (int8_t)packetPointer[1 + frame.length];
 
         /* 4 MHz clock, so divide by 4 to get microseconds */
-        memcpy(&frame.timestamp, packetPointer + 4 + packetPointer[2], 4);
+        memcpy(&frame.timestamp, packetPointer + 2 + frame.length, 4);
         frame.timestamp >>= 2;
 
         if (last_channel < 40)
@@ -776,10 +1060,78 @@ static void rx_int_callback(RF_Handle h, RF_CmdHandle ch, RF_EventMask e)
 
         frame.phy = last_phy;
 
-        if (userCallback) userCallback(&frame);
+        // only the time critical part here, the rest waits for the Swi
+        callback = userCallback ? indicateUrgent(&frame, userCallback) : NULL;
+        if (!callback)
+        {
+            RFQueue_releaseEntry(currentDataEntry);
+            continue;
+        }
+
+        if (deferHead - deferTail >= DEFER_SIZE)
+        {
+            stats.deferDrops++;
+            RFQueue_releaseEntry(currentDataEntry);
+            continue;
+        }
+
+        // the deferred Swi is lower priority, so can't see this half done
+        d = deferred + (deferHead & DEFER_MASK);
+        d->frame = frame;
+        d->callback = callback;
+        deferHead++;
+
+        Swi_post(Swi_handle(&deferSwi));
+    }
+
+#if STATS_LATENCY
+    stats_latency(latency.rfCallback, RF_getCurrentTime() - startTime);
+#endif
+}
+
+static void rat_capture_callback(RF_Handle h, RF_RatHandle rh, RF_EventMask e,
+        uint32_t compareCaptureTime)
+{
+    if (captureCallback) captureCallback(compareCaptureTime);
+}
+
+int RadioWrapper_captureEdges(RadioWrapper_CaptureCallback callback)
+{
+    RF_RatConfigCapture config;
 
-        RFQueue_nextEntry();
+    if(!configured)
+    {
+        return -EINVAL;
+    }
+
+    RadioWrapper_stopCapture();
+
+    RF_RatConfigCapture_init(&config);
+    config.callback = rat_capture_callback;
+    config.channel = RF_RatChannelAny;
+    config.source = RF_RatCaptureSourceRfcGpi0;
+    config.captureMode = RF_RatCaptureModeRising;
+    config.repeat = RF_RatCaptureRepeat;
+
+    captureCallback = callback;
+    captureHandle = RF_ratCapture(bleRfHandle, &config, NULL);
+    if (captureHandle < 0)
+    {
+        captureCallback = NULL;
+        return -EBUSY;
+    }
+
+    return 0;
+}
+
+void RadioWrapper_stopCapture()
+{
+    if (captureHandle >= 0)
+    {
+        RF_ratDisableChannel(bleRfHandle, captureHandle);
+        captureHandle = -1;
     }
+    captureCallback = NULL;
 }
 
 int RadioWrapper_close()
@@ -31,11 +31,17 @@ typedef struct
     uint8_t channel:6;
     PHY_Mode phy:2;
     uint8_t *pData;
+    rfc_dataEntryGeneral_t *pEntry; // RF queue entry holding pData, or NULL
 } BLE_Frame;
 
 // callback type for frame receipt
+// to keep pData valid after returning, the callback can take ownership of
+// pEntry by setting it to NULL, and must later release it
 typedef void (*RadioWrapper_Callback)(BLE_Frame *);
 
+// callback type for edge capture, given the radio time (ticks) of the edge
+typedef void (*RadioWrapper_CaptureCallback)(uint32_t ticks);
+
 int RadioWrapper_init(void);
 int RadioWrapper_close(void);
 
@@ -54,6 +60,11 @@ int RadioWrapper_close(void);
 int RadioWrapper_recvFrames(PHY_Mode phy, uint32_t chan, uint32_t accessAddr,
     uint32_t crcInit, uint32_t timeout, RadioWrapper_Callback callback);
 
+// Receive BLE packets without CRC checking (for unknown CRCInit)
+// The 3 received CRC bytes follow the PDU, and are counted in the length
+int RadioWrapper_recvFramesRawCrc(PHY_Mode phy, uint32_t chan, uint32_t accessAddr,
+    uint32_t timeout, RadioWrapper_Callback callback);
+
 // Sniff channel 37, wait for trigger, sniff 38, sniff 39
 // Waits delay1 radio ticks before going from 38 to 39
 // Waits delay2 radio ticks on 39 before ending
@@ -86,9 +97,29 @@ int RadioWrapper_advertise3(RadioWrapper_Callback callback, const uint16_t *advA
     bool advRandom, const void *advData, uint8_t advLen, const void *scanRspData,
     uint8_t scanRspLen);
 
+// Non-connectable extended advertising event, data in an AUX_ADV_IND on auxChan
+int RadioWrapper_advertiseExt3(RadioWrapper_Callback callback, const uint16_t *advAddr,
+    bool advRandom, uint16_t adi, const void *advData, uint8_t advLen, uint8_t auxChan);
+
 // Stop ongoing radio operations
 void RadioWrapper_stop();
 
+// Discard received frames not yet handed to the callback
+void RadioWrapper_flush();
+
+// Return an RF queue entry taken by a callback to the radio
+void RadioWrapper_releaseEntry(rfc_dataEntryGeneral_t *pEntry);
+
+// Timestamp rising edges on RFC_GPI0 in hardware, with a radio timer capture
+// channel. Edges are only caught while the radio is powered.
+//
+// Returns:
+//  Status code (errno.h), 0 on success
+int RadioWrapper_captureEdges(RadioWrapper_CaptureCallback callback);
+
+// Stop edge capture, if running
+void RadioWrapper_stopCapture(void);
+
 #ifdef __cplusplus
 }
 #endif
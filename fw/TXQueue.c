@@ -6,9 +6,10 @@
 
 #include "TXQueue.h"
 #include <stdlib.h>
+#include <string.h>
+#include "stats.h"
+#include "PacketTask.h"
 
-// size must be a power of 2
-#define TX_QUEUE_SIZE 8u
 #define TX_QUEUE_MASK (TX_QUEUE_SIZE - 1)
 
 #define PACKET_SIZE 256 // 255 bytes + one header byte for LLID
@@ -21,13 +22,24 @@ static rfc_dataEntryPointer_t queue_entries[TX_QUEUE_SIZE];
 static volatile uint32_t queue_head; // insert here
 static volatile uint32_t queue_tail; // take out item from here
 
+// cumulative counts reported to host, wrapping
+static volatile uint16_t num_accepted; // modified only by CommandTask
+static volatile uint16_t num_rejected; // modified only by CommandTask
+static volatile uint16_t num_sent;     // modified only by RadioTask
+static volatile uint8_t last_sent;     // modified only by RadioTask
+
 // only call this from a single thread (ie. CommandTask)
 // return true for success
 bool TXQueue_insert(uint8_t len, uint8_t llid, void *data)
 {
     // bail if we're full
     if ( ((queue_head - queue_tail) & TX_QUEUE_MASK) == TX_QUEUE_MASK )
+    {
+        stats.txQueueDrops++;
+        num_rejected++;
+        TXQueue_reportStatus(TXSTATUS_REJECTED);
         return false;
+    }
 
     uint32_t queue_head_ = queue_head & TX_QUEUE_MASK;
 
@@ -39,6 +51,7 @@ bool TXQueue_insert(uint8_t len, uint8_t llid, void *data)
     // only increment once entry is complete and ready
     // wraparound is safe due to our masking
     queue_head++;
+    num_accepted++;
 
     return true;
 }
@@ -82,4 +95,46 @@ void TXQueue_flush(uint32_t numEntries)
     if (numEntries > qsize) // should never happen
         numEntries = qsize;
     queue_tail += numEntries;
+
+    if (numEntries)
+    {
+        num_sent += numEntries;
+        last_sent = numEntries;
+        TXQueue_reportStatus(TXSTATUS_TRANSMITTED);
+    }
+}
+
+void TXQueue_resetCounters(void)
+{
+    num_accepted = 0;
+    num_rejected = 0;
+}
+
+// PacketTask turns this into a MESSAGE_TXSTATUS
+void TXQueue_reportStatus(uint8_t reason)
+{
+    BLE_Frame frame;
+    uint8_t buf[TX_STATUS_LEN];
+    uint16_t tmp;
+
+    buf[0] = TX_QUEUE_CAPACITY - ((queue_head - queue_tail) & TX_QUEUE_MASK);
+    tmp = num_accepted;
+    memcpy(buf + 1, &tmp, 2);
+    tmp = num_sent;
+    memcpy(buf + 3, &tmp, 2);
+    tmp = num_rejected;
+    memcpy(buf + 5, &tmp, 2);
+    buf[7] = last_sent;
+    buf[8] = reason;
+
+    frame.timestamp = 0;
+    frame.rssi = 0;
+    frame.channel = 44; // indicates TX status message
+    frame.phy = PHY_1M;
+    frame.pData = buf;
+    frame.pEntry = NULL;
+    frame.length = sizeof(buf);
+
+    // Does thread safe copying into queue
+    indicatePacket(&frame);
 }
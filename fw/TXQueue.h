@@ -14,8 +14,35 @@
 #include DeviceFamily_constructPath(driverlib/rf_data_entry.h)
 #include DeviceFamily_constructPath(driverlib/rf_mailbox.h)
 
+// size must be a power of 2, one slot is always kept empty
+#define TX_QUEUE_SIZE 8u
+#define TX_QUEUE_CAPACITY (TX_QUEUE_SIZE - 1)
+
 bool TXQueue_insert(uint8_t len, uint8_t llid, void *data);
 uint32_t TXQueue_take(dataQueue_t *pRFQueue);
 void TXQueue_flush(uint32_t numEntries);
 
+/* Report TX queue state to the host, so it can use free slots as credits.
+ * Sent automatically whenever PDUs are transmitted or an insert fails.
+ * Accepted minus queued (capacity minus free) gives PDUs completed.
+ *
+ * Message format (after message type byte):
+ * Byte 0:      free slots in TX queue
+ * Bytes 1-2:   PDUs accepted into queue since counter reset (wrapping)
+ * Bytes 3-4:   PDUs transmitted since boot (wrapping)
+ * Bytes 5-6:   PDUs rejected since counter reset (wrapping)
+ * Byte 7:      PDUs transmitted in the latest connection event
+ * Byte 8:      reason for report (TXSTATUS_*)
+ */
+#define TX_STATUS_LEN 9
+
+#define TXSTATUS_REQUESTED      0x00
+#define TXSTATUS_TRANSMITTED    0x01
+#define TXSTATUS_REJECTED       0x02
+
+void TXQueue_reportStatus(uint8_t reason);
+
+// zero accepted and rejected counters (call from CommandTask only)
+void TXQueue_resetCounters(void);
+
 #endif
@@ -0,0 +1,246 @@
+/*
+ * Written by Sultan Qasim Khan
+ * Copyright (c) 2020, NCC Group plc
+ * Released as open source under GPLv3
+ */
+
+#include <string.h>
+#include <xdc/std.h>
+#include <ti/sysbios/knl/Clock.h>
+#include <ti/sysbios/hal/Hwi.h>
+
+#include "adv_agg.h"
+#include "messenger.h"
+#include "timebase.h"
+#include "PacketTask.h"
+#include "RadioTask.h"
+
+/* Same table scheme as adv_header_cache: open addressing with linear
+ * probing, limited to a probe window, evicting the least recently used
+ * entry in the window when it's full. Updates happen in RF callback context,
+ * so PacketTask takes each entry's counts with interrupts disabled.
+ */
+#define AGG_SIZE_MASK (ADV_AGG_SIZE - 1)
+#define AGG_PROBE_MAX 8
+
+#if ADV_AGG_SIZE & AGG_SIZE_MASK
+#error "ADV_AGG_SIZE must be a power of 2"
+#endif
+
+struct AggEntry
+{
+    uint8_t mac[6];
+    uint8_t hdr;        // PDU type and TxAdd
+    uint8_t chans;      // channels seen on since last summary
+    bool valid;
+    int8_t rssiMin;
+    int8_t rssiMax;
+    uint16_t count;     // frames since last summary
+    int32_t rssiSum;
+    uint32_t lastSeen;
+    uint32_t payloadHash;
+    uint32_t lastUsed;
+};
+
+static struct AggEntry table[ADV_AGG_SIZE];
+static uint32_t useCounter = 0;
+static volatile bool active = false;
+
+// next entry to summarize, carried over when a summary is split
+static unsigned cursor = 0;
+
+static Clock_Struct aggClock;
+static bool clockConstructed = false;
+
+static inline uint32_t agg_hash(const uint8_t *mac, uint8_t hdr)
+{
+    return (mac[0] | (mac[1] << 8)) ^ (mac[2] << 3) ^ (hdr << 5);
+}
+
+// 32 bit FNV-1a over length and everything after AdvA
+static uint32_t payload_hash(const BLE_Frame *frame)
+{
+    uint32_t h = 2166136261u;
+    unsigned i;
+
+    h = (h ^ frame->pData[1]) * 16777619u;
+    for (i = 8; i < frame->length; i++)
+        h = (h ^ frame->pData[i]) * 16777619u;
+
+    return h;
+}
+
+// PacketTask builds the actual message when it gets to this frame
+static void indicateSummary()
+{
+    BLE_Frame frame;
+
+    frame.timestamp = 0;
+    frame.rssi = 0;
+    frame.channel = 47; // indicates advertiser summary
+    frame.phy = PHY_1M;
+    frame.pData = NULL;
+    frame.pEntry = NULL;
+    frame.length = 0;
+
+    indicatePacket(&frame);
+}
+
+static void aggClockFunc(UArg arg)
+{
+    indicateSummary();
+}
+
+void adv_agg_set(uint16_t periodMs)
+{
+    uint32_t ticks = (periodMs * 1000u) / Clock_tickPeriod;
+
+    if (!clockConstructed)
+    {
+        Clock_Params clockParams;
+        Clock_Params_init(&clockParams);
+        clockParams.startFlag = false;
+        Clock_construct(&aggClock, aggClockFunc, 1, &clockParams);
+        clockConstructed = true;
+    }
+
+    // RF callbacks stop touching the table once inactive
+    Clock_stop(Clock_handle(&aggClock));
+    active = false;
+    memset(table, 0, sizeof(table));
+    cursor = 0;
+
+    if (ticks)
+    {
+        active = true;
+        Clock_setPeriod(Clock_handle(&aggClock), ticks);
+        Clock_setTimeout(Clock_handle(&aggClock), ticks);
+        Clock_start(Clock_handle(&aggClock));
+    }
+}
+
+bool adv_agg_update(const BLE_Frame *frame)
+{
+    struct AggEntry *victim = NULL;
+    struct AggEntry *e;
+    uint32_t pos, hash;
+    uint8_t hdr;
+    int i;
+
+    if (!active || frame->channel < 37 || frame->length < 8)
+        return true;
+
+    switch (frame->pData[0] & 0xF)
+    {
+    case ADV_IND:
+    case ADV_DIRECT_IND:
+    case ADV_NONCONN_IND:
+    case ADV_SCAN_IND:
+    case SCAN_RSP:
+        break;
+    default:
+        return true;
+    }
+
+    hdr = frame->pData[0] & 0x4F;
+    pos = agg_hash(frame->pData + 2, hdr);
+    hash = payload_hash(frame);
+
+    for (i = 0; i < AGG_PROBE_MAX; i++)
+    {
+        e = table + ((pos + i) & AGG_SIZE_MASK);
+
+        if (!e->valid)
+        {
+            victim = e;
+            break;
+        }
+
+        if (e->hdr == hdr && !memcmp(frame->pData + 2, e->mac, 6))
+        {
+            bool changed = e->payloadHash != hash;
+            if (!e->count || frame->rssi < e->rssiMin)
+                e->rssiMin = frame->rssi;
+            if (!e->count || frame->rssi > e->rssiMax)
+                e->rssiMax = frame->rssi;
+            if (e->count < 0xFFFF)
+            {
+                e->count++;
+                e->rssiSum += frame->rssi;
+            }
+            e->chans |= 1 << (frame->channel - 37);
+            e->lastSeen = frame->timestamp;
+            e->payloadHash = hash;
+            e->lastUsed = ++useCounter;
+            return changed;
+        }
+
+        // unsigned difference handles counter wraparound
+        if (!victim || useCounter - e->lastUsed > useCounter - victim->lastUsed)
+            victim = e;
+    }
+
+    // new advertiser (unreported counts of an evicted one are lost)
+    memcpy(victim->mac, frame->pData + 2, 6);
+    victim->hdr = hdr;
+    victim->valid = true;
+    victim->count = 1;
+    victim->rssiMin = frame->rssi;
+    victim->rssiMax = frame->rssi;
+    victim->rssiSum = frame->rssi;
+    victim->chans = 1 << (frame->channel - 37);
+    victim->lastSeen = frame->timestamp;
+    victim->payloadHash = hash;
+    victim->lastUsed = ++useCounter;
+
+    return true;
+}
+
+unsigned adv_agg_buildMessage(uint8_t *dst)
+{
+    uint8_t *msg_ptr = dst;
+    unsigned scanned;
+
+    *msg_ptr++ = MESSAGE_ADVSUMMARY;
+
+    for (scanned = 0; scanned < ADV_AGG_SIZE; scanned++)
+    {
+        struct AggEntry *e = table + cursor;
+        struct AggEntry snap;
+        uint32_t key;
+        uint64_t ts64;
+
+        // rest of the table goes in another message
+        if (msg_ptr + ADVSUMMARY_REC_LEN > dst + ADVSUMMARY_MESSAGE_MAX)
+        {
+            indicateSummary();
+            break;
+        }
+        cursor = (cursor + 1) & AGG_SIZE_MASK;
+
+        key = Hwi_disable();
+        snap = *e;
+        e->count = 0;
+        e->chans = 0;
+        e->rssiSum = 0;
+        Hwi_restore(key);
+
+        if (!snap.valid || !snap.count)
+            continue;
+
+        memcpy(msg_ptr, snap.mac, 6);
+        msg_ptr += 6;
+        *msg_ptr++ = snap.hdr;
+        *msg_ptr++ = snap.chans;
+        memcpy(msg_ptr, &snap.count, sizeof(snap.count));
+        msg_ptr += sizeof(snap.count);
+        *msg_ptr++ = (uint8_t)snap.rssiMin;
+        *msg_ptr++ = (uint8_t)snap.rssiMax;
+        *msg_ptr++ = (uint8_t)(int8_t)(snap.rssiSum / snap.count);
+        ts64 = timebase_extend_us(snap.lastSeen);
+        memcpy(msg_ptr, &ts64, sizeof(ts64));
+        msg_ptr += sizeof(ts64);
+    }
+
+    return msg_ptr - dst;
+}
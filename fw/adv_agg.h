@@ -0,0 +1,51 @@
+/*
+ * Written by Sultan Qasim Khan
+ * Copyright (c) 2020, NCC Group plc
+ * Released as open source under GPLv3
+ */
+
+#ifndef ADV_AGG_H
+#define ADV_AGG_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "RadioWrapper.h"
+
+// number of advertiser entries tracked (power of 2)
+#ifndef ADV_AGG_SIZE
+#define ADV_AGG_SIZE 128
+#endif
+
+// length of each record, and maximum length of the summary message
+#define ADVSUMMARY_REC_LEN 21
+#define ADVSUMMARY_MESSAGE_MAX (1 + 24 * ADVSUMMARY_REC_LEN)
+
+/* In aggregation mode, legacy advertisements (anything with an AdvA on a
+ * primary channel) are tracked per AdvA and PDU type. A frame is only sent
+ * when its advertiser is new or its payload changed, and every periodMs a
+ * summary of the advertisers seen since the last one is sent.
+ *
+ * Summary message format:
+ * Byte 0:      MESSAGE_ADVSUMMARY
+ * Then for each advertiser seen since the last summary:
+ *   Bytes 0-5:     AdvA
+ *   Byte 6:        PDU header byte 0, masked to PDU type and TxAdd
+ *   Byte 7:        channels seen on (bit 0 for 37, 1 for 38, 2 for 39)
+ *   Bytes 8-9:     frames received (including those sent in full)
+ *   Bytes 10-12:   RSSI min, max and mean
+ *   Bytes 13-20:   timestamp of last frame (64 bit microseconds)
+ *
+ * Summaries of large tables are split over several messages.
+ */
+
+// periodMs of 0 disables aggregation, and clears the table
+void adv_agg_set(uint16_t periodMs);
+
+// record frame, returns true if it should be sent
+bool adv_agg_update(const BLE_Frame *frame);
+
+// dst must have room for ADVSUMMARY_MESSAGE_MAX bytes
+unsigned adv_agg_buildMessage(uint8_t *dst);
+
+#endif
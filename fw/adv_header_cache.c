@@ -1,42 +1,104 @@
 /*
  * Written by Sultan Qasim Khan
- * Copyright (c) 2018, NCC Group plc
+ * Copyright (c) 2018-2020, NCC Group plc
  * Released as open source under GPLv3
  */
 
 #include <string.h>
+#include <stdbool.h>
+#include <xdc/std.h>
+#include <ti/sysbios/hal/Hwi.h>
 #include "adv_header_cache.h"
+#include "stats.h"
 
-// cache size must be a power of 2
-#define HEADER_CACHE_SIZE 16
+/* Open addressing hash table with linear probing. A MAC can only live in
+ * the first CACHE_PROBE_MAX slots after its home slot. Entries are never
+ * removed, only replaced, so lookups can stop at the first empty slot. When
+ * every slot in the probe window is taken, the least recently used entry in
+ * the window is evicted. Stores are deferred from the RF callback, which can
+ * fetch in the middle of one, so both hold interrupts off.
+ */
 #define CACHE_SIZE_MASK (HEADER_CACHE_SIZE - 1)
+#define CACHE_PROBE_MAX 8
+
+#if HEADER_CACHE_SIZE & CACHE_SIZE_MASK
+#error "HEADER_CACHE_SIZE must be a power of 2"
+#endif
+
+struct CacheEntry
+{
+    uint8_t mac[6];
+    uint8_t hdr;
+    bool valid;
+    uint32_t lastUsed;
+};
+
+static struct CacheEntry cache[HEADER_CACHE_SIZE];
 
-static uint8_t macs[HEADER_CACHE_SIZE][6];
-static uint8_t headers[HEADER_CACHE_SIZE];
-static int cache_pos = 0;
+// incremented on each store or hit, so age is relative to cache activity
+static uint32_t useCounter = 0;
+
+// low order bytes (first in memory) are the most random part of a MAC
+static inline uint32_t cache_hash(const uint8_t *mac)
+{
+    return (mac[0] | (mac[1] << 8)) ^ (mac[2] << 3);
+}
 
 void adv_cache_store(const uint8_t *mac, uint8_t hdr)
 {
-    memcpy(macs[cache_pos], mac, 6);
-    headers[cache_pos] = hdr;
-    cache_pos = (cache_pos + 1) & CACHE_SIZE_MASK;
+    uint32_t pos = cache_hash(mac);
+    struct CacheEntry *victim = NULL;
+    struct CacheEntry *e;
+    unsigned key = Hwi_disable();
+    int i;
+
+    for (i = 0; i < CACHE_PROBE_MAX; i++)
+    {
+        e = cache + ((pos + i) & CACHE_SIZE_MASK);
+
+        // update in place if already present, or take an empty slot
+        if (!e->valid || !memcmp(mac, e->mac, 6))
+        {
+            victim = e;
+            break;
+        }
+
+        // unsigned difference handles counter wraparound
+        if (!victim || useCounter - e->lastUsed > useCounter - victim->lastUsed)
+            victim = e;
+    }
+
+    memcpy(victim->mac, mac, 6);
+    victim->hdr = hdr;
+    victim->valid = true;
+    victim->lastUsed = ++useCounter;
+    Hwi_restore(key);
 }
 
 uint8_t adv_cache_fetch(const uint8_t *mac)
 {
-    uint8_t pos = (cache_pos - 1) & CACHE_SIZE_MASK;
-    uint8_t hdr = 0xFF; // invalid since it sets RFU bits
+    uint32_t pos = cache_hash(mac);
+    struct CacheEntry *e;
+    unsigned key = Hwi_disable();
+    uint8_t hdr;
+    int i;
 
-    // work backwards fron newest to oldest
-    do
+    for (i = 0; i < CACHE_PROBE_MAX; i++)
     {
-        if (!memcmp(mac, macs[pos], 6))
-        {
-            hdr = headers[pos];
+        e = cache + ((pos + i) & CACHE_SIZE_MASK);
+        if (!e->valid)
             break;
+        if (!memcmp(mac, e->mac, 6))
+        {
+            e->lastUsed = ++useCounter;
+            hdr = e->hdr;
+            Hwi_restore(key);
+            stats.advCacheHits++;
+            return hdr;
         }
-        pos = (pos - 1) & CACHE_SIZE_MASK;
-    } while (pos != cache_pos);
+    }
 
-    return hdr;
+    Hwi_restore(key);
+    stats.advCacheMisses++;
+    return 0xFF; // invalid since it sets RFU bits
 }
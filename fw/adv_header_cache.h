@@ -9,7 +9,14 @@
 
 #include <stdint.h>
 
+// number of cached advertiser headers (power of 2)
+#ifndef HEADER_CACHE_SIZE
+#define HEADER_CACHE_SIZE 256
+#endif
+
 void adv_cache_store(const uint8_t *mac, uint8_t hdr);
+
+// returns 0xFF if MAC isn't cached
 uint8_t adv_cache_fetch(const uint8_t *mac);
 
 #endif
@@ -0,0 +1,122 @@
+/*
+ * Written by Sultan Qasim Khan
+ * Copyright (c) 2020, NCC Group plc
+ * Released as open source under GPLv3
+ */
+
+#include <string.h>
+
+#include "adv_sets.h"
+
+// 4 radio ticks per microsecond
+#define MS_TICKS 4000
+
+// advDelay of up to 10 ms added to each interval, as per spec
+#define ADV_DELAY_MAX_TICKS (10 * MS_TICKS)
+
+static AdvSet sets[ADV_SETS_MAX];
+
+// LCG for advDelay and secondary channels, no need for anything better
+static uint32_t randState = 1;
+
+static uint32_t nextRand(void)
+{
+    randState = randState * 1664525 + 1013904223;
+    return randState >> 8;
+}
+
+void adv_sets_reset(void)
+{
+    memset(sets, 0, sizeof(sets));
+}
+
+bool adv_sets_config(uint8_t idx, bool extended, uint16_t intervalMs,
+        const void *advData, uint8_t advLen, const void *scanRspData, uint8_t scanRspLen)
+{
+    AdvSet *s;
+
+    if (idx >= ADV_SETS_MAX)
+        return false;
+    if (advLen > (extended ? ADV_EXT_DATA_MAX : ADV_LEGACY_DATA_MAX))
+        return false;
+    if (scanRspLen > (extended ? 0 : ADV_LEGACY_DATA_MAX))
+        return false;
+
+    s = sets + idx;
+    s->active = false;
+    s->extended = extended;
+    s->intervalMs = intervalMs;
+    s->advLen = advLen;
+    memcpy(s->advData, advData, advLen);
+    s->scanRspLen = scanRspLen;
+    memcpy(s->scanRspData, scanRspData, scanRspLen);
+
+    // new data ID each time the data changes, SID is the set index
+    s->adi = (((s->adi & 0xFFF) + 1) & 0xFFF) | (idx << 12);
+    s->auxChan = nextRand() % 37;
+
+    // due straight away, and sent in order of index
+    s->nextTime = 0;
+    s->active = true;
+
+    return true;
+}
+
+void adv_sets_remove(uint8_t idx)
+{
+    if (idx < ADV_SETS_MAX)
+        sets[idx].active = false;
+}
+
+void adv_sets_setInterval(uint8_t idx, uint16_t intervalMs)
+{
+    if (idx < ADV_SETS_MAX)
+        sets[idx].intervalMs = intervalMs;
+}
+
+bool adv_sets_any(void)
+{
+    int i;
+
+    for (i = 0; i < ADV_SETS_MAX; i++)
+    {
+        if (sets[i].active)
+            return true;
+    }
+    return false;
+}
+
+AdvSet *adv_sets_next(uint32_t *when)
+{
+    AdvSet *soonest = NULL;
+    int i;
+
+    // nextTime of 0 means as soon as possible
+    for (i = 0; i < ADV_SETS_MAX; i++)
+    {
+        AdvSet *s = sets + i;
+        if (!s->active)
+            continue;
+        if (!soonest || (soonest->nextTime && (!s->nextTime ||
+                (int32_t)(s->nextTime - soonest->nextTime) < 0)))
+            soonest = s;
+    }
+
+    if (soonest)
+        *when = soonest->nextTime;
+    return soonest;
+}
+
+void adv_sets_done(AdvSet *s, uint32_t now)
+{
+    uint32_t interval = s->intervalMs * MS_TICKS;
+
+    // keep to the interval when we can, or start afresh if we fell behind
+    if (!s->nextTime || (int32_t)(now - (s->nextTime + interval)) >= 0)
+        s->nextTime = now;
+    s->nextTime += interval + nextRand() % ADV_DELAY_MAX_TICKS;
+    if (!s->nextTime)
+        s->nextTime = 1;
+
+    s->auxChan = nextRand() % 37;
+}
@@ -0,0 +1,59 @@
+/*
+ * Written by Sultan Qasim Khan
+ * Copyright (c) 2020, NCC Group plc
+ * Released as open source under GPLv3
+ */
+
+#ifndef ADV_SETS_H
+#define ADV_SETS_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Advertising sets for the advertising state. Each set has its own data
+ * and interval, and sets are interleaved by sending whichever is due
+ * soonest. Legacy sets advertise on 37/38/39 and accept connections (set 0
+ * is the one configured by COMMAND_ADVERTISE). Extended sets send
+ * ADV_EXT_IND on 37/38/39 pointing to an AUX_ADV_IND with their data, on a
+ * secondary channel that changes with each event. They are non-connectable
+ * and non-scannable.
+ */
+
+#define ADV_SETS_MAX 4
+
+#define ADV_LEGACY_DATA_MAX 31
+#define ADV_EXT_DATA_MAX    245
+
+typedef struct
+{
+    bool active;
+    bool extended;
+    uint16_t adi;           // DID and SID, for extended sets
+    uint16_t intervalMs;
+    uint32_t nextTime;      // radio ticks
+    uint8_t auxChan;
+    uint8_t advLen;
+    uint8_t advData[ADV_EXT_DATA_MAX];
+    uint8_t scanRspLen;
+    uint8_t scanRspData[ADV_LEGACY_DATA_MAX];
+} AdvSet;
+
+void adv_sets_reset(void);
+
+// returns false if the set index or data lengths are invalid
+bool adv_sets_config(uint8_t idx, bool extended, uint16_t intervalMs,
+        const void *advData, uint8_t advLen, const void *scanRspData, uint8_t scanRspLen);
+
+void adv_sets_remove(uint8_t idx);
+
+void adv_sets_setInterval(uint8_t idx, uint16_t intervalMs);
+
+bool adv_sets_any(void);
+
+// set due soonest and when it's due (radio ticks), or NULL if none active
+AdvSet *adv_sets_next(uint32_t *when);
+
+// schedule the next event of a set just sent at radio time now
+void adv_sets_done(AdvSet *s, uint32_t now);
+
+#endif
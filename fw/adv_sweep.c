@@ -0,0 +1,203 @@
+/*
+ * Written by Sultan Qasim Khan
+ * Copyright (c) 2020, NCC Group plc
+ * Released as open source under GPLv3
+ */
+
+#include <string.h>
+#include <xdc/std.h>
+#include <ti/sysbios/hal/Hwi.h>
+
+#include "adv_sweep.h"
+#include "RadioTask.h"
+
+/* Seen AdvAs use the same table scheme as adv_header_cache. Urgent frames
+ * add them from the RF callback and others from the deferred frame Swi, so
+ * inserts hold interrupts off. Each slot's count of new AdvAs only ever
+ * goes up, so RadioTask takes differences rather than resetting it.
+ */
+#define SEEN_SIZE_MASK (SWEEP_SEEN_SIZE - 1)
+#define SEEN_PROBE_MAX 8
+
+#if SWEEP_SEEN_SIZE & SEEN_SIZE_MASK
+#error "SWEEP_SEEN_SIZE must be a power of 2"
+#endif
+
+// 37, 38, 39 on 1M, then on coded
+#define SLOT_COUNT 6
+
+// 4 radio ticks per microsecond
+#define MS_TICKS 4000
+
+struct SeenEntry
+{
+    uint8_t mac[6];
+    bool valid;
+    uint32_t lastUsed;
+};
+
+static struct SeenEntry seen[SWEEP_SEEN_SIZE];
+static uint32_t useCounter = 0;
+
+static uint8_t slotMask = 0;
+static volatile int8_t curSlot = -1;
+static volatile uint16_t newCount[SLOT_COUNT];
+
+// RadioTask state
+static uint16_t dwellCount;     // newCount[curSlot] when its dwell started
+static uint32_t dwellStart;
+static uint32_t dwellEnd;
+static uint32_t rate[SLOT_COUNT]; // new AdvAs per second, 8 fractional bits
+
+static inline uint32_t seen_hash(const uint8_t *mac)
+{
+    return (mac[0] | (mac[1] << 8)) ^ (mac[2] << 3);
+}
+
+// returns true if mac wasn't in the table
+static bool seen_insert(const uint8_t *mac)
+{
+    uint32_t pos = seen_hash(mac);
+    struct SeenEntry *victim = NULL;
+    struct SeenEntry *e;
+    int i;
+
+    for (i = 0; i < SEEN_PROBE_MAX; i++)
+    {
+        e = seen + ((pos + i) & SEEN_SIZE_MASK);
+
+        if (e->valid && !memcmp(mac, e->mac, 6))
+        {
+            e->lastUsed = ++useCounter;
+            return false;
+        }
+
+        if (!e->valid)
+        {
+            victim = e;
+            break;
+        }
+
+        if (!victim || useCounter - e->lastUsed > useCounter - victim->lastUsed)
+            victim = e;
+    }
+
+    memcpy(victim->mac, mac, 6);
+    victim->valid = true;
+    victim->lastUsed = ++useCounter;
+    return true;
+}
+
+void adv_sweep_set(uint8_t phyMask)
+{
+    curSlot = -1;
+    slotMask = 0;
+    if (phyMask & SWEEP_PHY_1M)
+        slotMask |= 0x07;
+    if (phyMask & SWEEP_PHY_CODED)
+        slotMask |= 0x38;
+
+    memset(rate, 0, sizeof(rate));
+    if (!slotMask)
+    {
+        memset(seen, 0, sizeof(seen));
+        useCounter = 0;
+    }
+}
+
+bool adv_sweep_enabled(void)
+{
+    return slotMask != 0;
+}
+
+static uint32_t dwellMs(int slot)
+{
+    uint32_t maxRate = 0;
+    int i;
+
+    for (i = 0; i < SLOT_COUNT; i++)
+    {
+        if ((slotMask & (1 << i)) && rate[i] > maxRate)
+            maxRate = rate[i];
+    }
+
+    if (maxRate == 0)
+        return SWEEP_DWELL_DEFAULT_MS;
+    return SWEEP_DWELL_MIN_MS + (uint64_t)(SWEEP_DWELL_MAX_MS - SWEEP_DWELL_MIN_MS) *
+        rate[slot] / maxRate;
+}
+
+// fold the dwell just finished into its slot's rate, with weight 1/4
+static void endDwell(int slot)
+{
+    uint32_t ms = (dwellEnd - dwellStart) / MS_TICKS;
+    uint32_t found = (uint16_t)(newCount[slot] - dwellCount);
+    int32_t sample;
+
+    if (ms == 0)
+        return;
+    sample = (found * 1000 * 256) / ms;
+    rate[slot] += (sample - (int32_t)rate[slot]) / 4;
+}
+
+uint32_t adv_sweep_next(uint32_t now, uint8_t *chan, PHY_Mode *phy)
+{
+    int slot = curSlot;
+
+    // stay till the end of the dwell, even if interrupted by aux listening
+    if (slot < 0 || (int32_t)(now - dwellEnd) >= 0)
+    {
+        if (slot >= 0)
+            endDwell(slot);
+
+        do {
+            slot = (slot + 1) % SLOT_COUNT;
+        } while (!(slotMask & (1 << slot)));
+
+        dwellCount = newCount[slot];
+        dwellStart = now;
+        dwellEnd = now + dwellMs(slot) * MS_TICKS;
+        curSlot = slot;
+    }
+
+    *chan = 37 + (slot % 3);
+    *phy = slot < 3 ? PHY_1M : PHY_CODED;
+    return dwellEnd;
+}
+
+void adv_sweep_frame(const BLE_Frame *frame)
+{
+    const uint8_t *adva = NULL;
+    uint8_t pduType = frame->pData[0] & 0xF;
+    int slot = curSlot;
+
+    if (slot < 0)
+        return;
+
+    switch (pduType)
+    {
+    case ADV_IND:
+    case ADV_DIRECT_IND:
+    case ADV_NONCONN_IND:
+    case SCAN_RSP:
+    case ADV_SCAN_IND:
+        if (frame->length >= 8)
+            adva = frame->pData + 2;
+        break;
+    case ADV_EXT_IND:
+        // AdvA comes first in the extended header, if present
+        if (frame->length >= 10 && (frame->pData[2] & 0x3F) && (frame->pData[3] & 0x01))
+            adva = frame->pData + 4;
+        break;
+    default:
+        break;
+    }
+
+    if (adva)
+    {
+        unsigned key = Hwi_disable();
+        if (seen_insert(adva))
+            newCount[slot]++;
+        Hwi_restore(key);
+    }
+}
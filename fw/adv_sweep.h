@@ -0,0 +1,50 @@
+/*
+ * Written by Sultan Qasim Khan
+ * Copyright (c) 2020, NCC Group plc
+ * Released as open source under GPLv3
+ */
+
+#ifndef ADV_SWEEP_H
+#define ADV_SWEEP_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "RadioWrapper.h"
+
+/* Discovery sweep of the primary advertising channels, for the STATIC state.
+ *
+ * Each enabled (channel, PHY) slot is listened on in turn. How long is spent
+ * on a slot depends on how many AdvAs not seen before it has turned up per
+ * second recently, from SWEEP_DWELL_MIN_MS for slots finding nothing new to
+ * SWEEP_DWELL_MAX_MS for the most productive. Until anything new is found,
+ * every slot gets SWEEP_DWELL_DEFAULT_MS. AdvAs found on secondary channels
+ * count for the slot being listened on, as that's where their aux pointers
+ * were received.
+ */
+
+// number of AdvAs remembered as seen (power of 2)
+#ifndef SWEEP_SEEN_SIZE
+#define SWEEP_SEEN_SIZE 256
+#endif
+
+#define SWEEP_DWELL_MIN_MS      30
+#define SWEEP_DWELL_MAX_MS      400
+#define SWEEP_DWELL_DEFAULT_MS  120
+
+// PHYs to sweep primary channels on
+#define SWEEP_PHY_1M    0x01
+#define SWEEP_PHY_CODED 0x02
+
+// phyMask of 0 disables sweeping, and forgets seen AdvAs and rates
+void adv_sweep_set(uint8_t phyMask);
+
+bool adv_sweep_enabled(void);
+
+// slot to listen on at radio time now, returns when its dwell ends
+uint32_t adv_sweep_next(uint32_t now, uint8_t *chan, PHY_Mode *phy);
+
+// record an advertising frame, in RF callback context
+void adv_sweep_frame(const BLE_Frame *frame);
+
+#endif
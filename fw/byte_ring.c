@@ -0,0 +1,111 @@
+/*
+ * Written by Sultan Qasim Khan
+ * Copyright (c) 2020, NCC Group plc
+ * Released as open source under GPLv3
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include "byte_ring.h"
+
+/* Each record starts with a 4 byte header, and is padded to a multiple of
+ * 4 bytes. Records never wrap around the end of the buffer. If a record
+ * doesn't fit before the end, a padding record fills the rest.
+ */
+typedef struct
+{
+    uint16_t span;      // bytes to next record, including header
+    uint16_t len;       // payload length, RECORD_PAD for padding records
+} RecordHeader;
+
+#define RECORD_PAD 0xFFFF
+#define HDR_SIZE sizeof(RecordHeader)
+#define ALIGN4(x) (((x) + 3u) & ~3u)
+
+void ByteRing_init(ByteRing *ring, uint8_t *buf, uint32_t size)
+{
+    ring->buf = buf;
+    ring->size = size;
+    ring->head = 0;
+    ring->tail = 0;
+    ring->pending = 0;
+}
+
+void *ByteRing_reserve(ByteRing *ring, uint32_t len)
+{
+    uint32_t head = ring->head;
+    uint32_t tail = ring->tail;
+    uint32_t mask = ring->size - 1;
+    uint32_t off = head & mask;
+    uint32_t need = ALIGN4(len + HDR_SIZE);
+    uint32_t contig = ring->size - off;
+    uint32_t total = need;
+    RecordHeader *hdr;
+
+    if (len >= RECORD_PAD)
+        return NULL;
+
+    // skip to start of buffer if record won't fit before end
+    if (need > contig)
+        total += contig;
+
+    if ((head - tail) + total > ring->size)
+        return NULL;
+
+    if (need > contig)
+    {
+        hdr = (RecordHeader *)(ring->buf + off);
+        hdr->span = contig;
+        hdr->len = RECORD_PAD;
+        off = 0;
+    }
+
+    hdr = (RecordHeader *)(ring->buf + off);
+    hdr->span = need;
+    hdr->len = len;
+    ring->pending = total;
+
+    return ring->buf + off + HDR_SIZE;
+}
+
+void ByteRing_commit(ByteRing *ring)
+{
+    // wraparound of head is fine due to masking
+    ring->head += ring->pending;
+    ring->pending = 0;
+}
+
+void *ByteRing_peek(ByteRing *ring, uint32_t *len)
+{
+    uint32_t head = ring->head;
+    uint32_t tail = ring->tail;
+    RecordHeader *hdr;
+
+    while (tail != head)
+    {
+        hdr = (RecordHeader *)(ring->buf + (tail & (ring->size - 1)));
+        if (hdr->len != RECORD_PAD)
+        {
+            if (len) *len = hdr->len;
+            return (uint8_t *)hdr + HDR_SIZE;
+        }
+
+        // skip padding records
+        tail += hdr->span;
+        ring->tail = tail;
+    }
+
+    return NULL;
+}
+
+void ByteRing_pop(ByteRing *ring)
+{
+    uint32_t tail = ring->tail;
+    RecordHeader *hdr;
+
+    if (tail == ring->head)
+        return;
+
+    hdr = (RecordHeader *)(ring->buf + (tail & (ring->size - 1)));
+    ring->tail = tail + hdr->span;
+}
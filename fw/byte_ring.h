@@ -0,0 +1,40 @@
+/*
+ * Written by Sultan Qasim Khan
+ * Copyright (c) 2020, NCC Group plc
+ * Released as open source under GPLv3
+ */
+
+#ifndef BYTE_RING_H
+#define BYTE_RING_H
+
+#include <stdint.h>
+
+/* Ring buffer of variable length records, each stored contiguously.
+ * Producers must serialize reserve/commit pairs themselves (PacketTask holds
+ * interrupts disabled across reserve, copy and commit). The one consumer can
+ * peek and pop without a lock, as head and tail are each written by one side
+ * with single word stores.
+ */
+typedef struct
+{
+    uint8_t *buf;
+    uint32_t size;              // must be a power of 2 and multiple of 4
+    volatile uint32_t head;     // bytes committed by producers
+    volatile uint32_t tail;     // bytes released by consumer
+    uint32_t pending;           // bytes reserved but not yet committed
+} ByteRing;
+
+// buf must be 4 byte aligned
+void ByteRing_init(ByteRing *ring, uint8_t *buf, uint32_t size);
+
+// returns 4 byte aligned space for a len byte record, or NULL if full
+// record becomes visible to consumer once committed
+void *ByteRing_reserve(ByteRing *ring, uint32_t len);
+void ByteRing_commit(ByteRing *ring);
+
+// returns oldest record (and its length if len not NULL), or NULL if empty
+// record stays valid until popped
+void *ByteRing_peek(ByteRing *ring, uint32_t *len);
+void ByteRing_pop(ByteRing *ring);
+
+#endif
@@ -0,0 +1,87 @@
+/*
+ * Written by Sultan Qasim Khan
+ * Copyright (c) 2020, NCC Group plc
+ * Released as open source under GPLv3
+ */
+
+#include "cobs.h"
+
+uint32_t cobs_encode(uint8_t *dst, const uint8_t *src, uint32_t src_len)
+{
+    uint32_t code_idx = 0;
+    uint32_t dst_idx = 1;
+    uint8_t code = 1;
+    uint32_t i;
+
+    for (i = 0; i < src_len; i++)
+    {
+        if (src[i] == 0)
+        {
+            dst[code_idx] = code;
+            code_idx = dst_idx++;
+            code = 1;
+        } else {
+            dst[dst_idx++] = src[i];
+            code++;
+            if (code == 0xFF)
+            {
+                dst[code_idx] = code;
+                code_idx = dst_idx++;
+                code = 1;
+            }
+        }
+    }
+
+    dst[code_idx] = code;
+    return dst_idx;
+}
+
+uint32_t cobs_decode(uint8_t *dst, const uint8_t *src, uint32_t src_len, int *err)
+{
+    uint32_t src_idx = 0;
+    uint32_t dst_idx = 0;
+    uint8_t code, i;
+
+    while (src_idx < src_len)
+    {
+        code = src[src_idx++];
+        if (code == 0 || src_idx + code - 1 > src_len)
+        {
+            // zero inside frame or truncated block
+            if (err) *err = -1;
+            return dst_idx;
+        }
+
+        for (i = 1; i < code; i++)
+            dst[dst_idx++] = src[src_idx++];
+
+        // a maximal block isn't followed by an implicit zero,
+        // and neither is the last block
+        if (code != 0xFF && src_idx < src_len)
+            dst[dst_idx++] = 0;
+    }
+
+    if (err) *err = 0;
+    return dst_idx;
+}
+
+uint16_t crc16_ccitt(const uint8_t *src, uint32_t src_len)
+{
+    uint16_t crc = 0xFFFF;
+    uint32_t i;
+    int j;
+
+    for (i = 0; i < src_len; i++)
+    {
+        crc ^= (uint16_t)src[i] << 8;
+        for (j = 0; j < 8; j++)
+        {
+            if (crc & 0x8000)
+                crc = (crc << 1) ^ 0x1021;
+            else
+                crc <<= 1;
+        }
+    }
+
+    return crc;
+}
@@ -0,0 +1,25 @@
+/*
+ * Written by Sultan Qasim Khan
+ * Copyright (c) 2020, NCC Group plc
+ * Released as open source under GPLv3
+ */
+
+#ifndef COBS_H
+#define COBS_H
+
+#include <stdint.h>
+
+// worst case COBS encoded size (excluding the zero delimiter)
+#define COBS_ENC_MAX(len) ((len) + ((len) / 254) + 1)
+
+// cobs_encode returns encoded length, and never emits zero bytes
+// cobs_decode returns decoded length, and sets negative err (optional) on error
+// both assume dst buffer is large enough given src_len
+// neither function handles the zero delimiter byte
+uint32_t cobs_encode(uint8_t *dst, const uint8_t *src, uint32_t src_len);
+uint32_t cobs_decode(uint8_t *dst, const uint8_t *src, uint32_t src_len, int *err);
+
+// CRC-16/CCITT-FALSE (poly 0x1021, init 0xFFFF), used to check COBS frames
+uint16_t crc16_ccitt(const uint8_t *src, uint32_t src_len);
+
+#endif
@@ -7,62 +7,55 @@
 #include <stddef.h>
 #include "conf_queue.h"
 
-#define MODULO_MASK 0x7
-
-static struct RadioConfig configs[MODULO_MASK + 1];
-static uint16_t nextInstants[MODULO_MASK + 1];
-static uint32_t qhead = 0; // add configs to this index
-static uint32_t qtail = 0; // remove configs from this index
-
-static inline uint32_t rconf_qsize(void)
+static inline uint32_t rconf_qsize(const RConfQueue *q)
 {
-    return (qhead - qtail) & MODULO_MASK;
+    return (q->qhead - q->qtail) & RCONF_QUEUE_MASK;
 }
 
-void rconf_reset(void)
+void rconf_reset(RConfQueue *q)
 {
-    qhead = 0;
-    qtail = 0;
+    q->qhead = 0;
+    q->qtail = 0;
 }
 
-void rconf_enqueue(uint16_t nextInstant, const struct RadioConfig *conf)
+void rconf_enqueue(RConfQueue *q, uint16_t nextInstant, const struct RadioConfig *conf)
 {
-    if (rconf_qsize() == MODULO_MASK)
+    if (rconf_qsize(q) == RCONF_QUEUE_MASK)
         return; // full
 
-    nextInstants[qhead] = nextInstant;
-    configs[qhead] = *conf;
-    qhead = (qhead + 1) & MODULO_MASK;
+    q->nextInstants[q->qhead] = nextInstant;
+    q->configs[q->qhead] = *conf;
+    q->qhead = (q->qhead + 1) & RCONF_QUEUE_MASK;
 }
 
-bool rconf_dequeue(uint16_t connEventCount, struct RadioConfig *conf)
+bool rconf_dequeue(RConfQueue *q, uint16_t connEventCount, struct RadioConfig *conf)
 {
     // nothing to do if empty
-    if (!rconf_qsize())
+    if (!rconf_qsize(q))
         return false;
 
     // discard the past
-    if (((nextInstants[qtail] - connEventCount) & 0xFFFF) >= 0x8000) {
-        qtail = (qtail + 1) & MODULO_MASK;
+    if (((q->nextInstants[q->qtail] - connEventCount) & 0xFFFF) >= 0x8000) {
+        q->qtail = (q->qtail + 1) & RCONF_QUEUE_MASK;
         return false;
     }
 
     // wait on future events
-    if (connEventCount != nextInstants[qtail])
+    if (connEventCount != q->nextInstants[q->qtail])
         return false;
 
-    *conf = configs[qtail];
-    qtail = (qtail + 1) & MODULO_MASK;
+    *conf = q->configs[q->qtail];
+    q->qtail = (q->qtail + 1) & RCONF_QUEUE_MASK;
 
     return true;
 }
 
-const struct RadioConfig * rconf_latest(void)
+const struct RadioConfig * rconf_latest(const RConfQueue *q)
 {
-    uint32_t last_head = (qhead - 1) & MODULO_MASK;
+    uint32_t last_head = (q->qhead - 1) & RCONF_QUEUE_MASK;
 
-    if (!rconf_qsize())
+    if (!rconf_qsize(q))
         return NULL;
 
-    return configs + last_head;
+    return q->configs + last_head;
 }
@@ -10,9 +10,20 @@
 #include <stdint.h>
 #include "RadioTask.h"
 
-void rconf_reset(void);
-void rconf_enqueue(uint16_t nextInstant, const struct RadioConfig *conf);
-bool rconf_dequeue(uint16_t connEventCount, struct RadioConfig *conf);
-const struct RadioConfig * rconf_latest(void);
+#define RCONF_QUEUE_MASK 0x7
+
+// pending parameter updates of one connection, applied at their instants
+typedef struct
+{
+    struct RadioConfig configs[RCONF_QUEUE_MASK + 1];
+    uint16_t nextInstants[RCONF_QUEUE_MASK + 1];
+    uint32_t qhead; // add configs to this index
+    uint32_t qtail; // remove configs from this index
+} RConfQueue;
+
+void rconf_reset(RConfQueue *q);
+void rconf_enqueue(RConfQueue *q, uint16_t nextInstant, const struct RadioConfig *conf);
+bool rconf_dequeue(RConfQueue *q, uint16_t connEventCount, struct RadioConfig *conf);
+const struct RadioConfig * rconf_latest(const RConfQueue *q);
 
 #endif
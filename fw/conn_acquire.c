@@ -0,0 +1,521 @@
+/*
+ * Written by Sultan Qasim Khan
+ * Copyright (c) 2020, NCC Group plc
+ * Released as open source under GPLv3
+ */
+
+#include <string.h>
+
+#include "conn_acquire.h"
+#include "csa2.h"
+#include "trace.h"
+
+// all times here are in 4 MHz radio ticks
+#define ACQ_CRC_DWELL           (4 * 4000000)   // per channel while hunting for PDUs
+#define ACQ_INTERVAL_DWELL      (38 * 16000000) // 37 events at the longest interval
+#define ACQ_LISTEN_MIN          2000            // radio gets stuck on shorter listens
+
+// idle time after a PDU that marks the start of a new connection event
+#define ACQ_EVENT_GAP           4000
+
+#define ACQ_CRC_CANDS           8
+#define ACQ_INTERVAL_SAMPLES    4
+#define ACQ_OBS_MIN             3
+#define ACQ_OBS_MAX             16
+#define ACQ_CSA2_CANDS          32
+
+// valid hop intervals, in 1.25 ms units
+#define ACQ_INTERVAL_MIN        6
+#define ACQ_INTERVAL_MAX        3200
+
+typedef struct
+{
+    uint8_t chan;
+    uint32_t event;     // events since the reference event
+} AcqObs;
+
+static AcqPhase phase = ACQ_DONE;
+static AcqResult res;
+static PHY_Mode acqPhy;
+
+static uint8_t usedChans[37];
+static uint8_t numUsed;
+static uint8_t chanIdx;
+static bool dwellActive;
+static uint32_t dwellEnd;
+
+// end of the last PDU received on the current channel
+static bool haveLast;
+static uint32_t lastEnd;
+
+static uint32_t crcCands[ACQ_CRC_CANDS];
+static unsigned crcPos;
+static volatile bool crcFound;
+
+static bool haveVisit;
+static uint32_t lastVisit;
+static uint32_t gaps[ACQ_INTERVAL_SAMPLES];
+static volatile unsigned numGaps;
+static volatile bool visitedInDwell;
+static bool divided37;
+
+static uint8_t refChan;
+static uint32_t refTime;
+static uint32_t intervalTicks;
+static AcqObs obs[ACQ_OBS_MAX];
+static volatile unsigned numObs;
+static unsigned solvedObs;
+static uint32_t lastObsTime;
+
+// CSA#2 event counters for the reference event fitting the observations so far
+static CSA2_Context csa2Ctx;
+static uint16_t csa2Cands[ACQ_CSA2_CANDS];
+static unsigned numCsa2Cands;
+static unsigned csa2CheckedObs; // observations the candidates were checked against
+static uint32_t csa2Cursor;     // counters below this have been checked
+
+static void startCrcPhase(void)
+{
+    phase = ACQ_CRCINIT;
+    crcPos = 0;
+    crcFound = false;
+    memset(crcCands, 0xFF, sizeof(crcCands)); // not a valid 24 bit value
+    dwellActive = false;
+}
+
+static void startIntervalPhase(void)
+{
+    phase = ACQ_INTERVAL;
+    haveVisit = false;
+    numGaps = 0;
+    dwellActive = false;
+}
+
+static void startHopsPhase(void)
+{
+    phase = ACQ_HOPS;
+    intervalTicks = res.interval * 5000u;
+    obs[0].chan = refChan;
+    obs[0].event = 0;
+    numObs = 1;
+    solvedObs = 1;
+    lastObsTime = refTime;
+    numCsa2Cands = 0;
+    csa2CheckedObs = 0;
+    csa2Cursor = 0;
+    dwellActive = false;
+    chanIdx = (chanIdx + 1) % numUsed;
+}
+
+void acq_start(uint32_t accessAddress, uint64_t chanMap, PHY_Mode phy)
+{
+    unsigned i;
+
+    memset(&res, 0, sizeof(res));
+    res.accessAddress = accessAddress;
+    res.chanMap = chanMap & 0x1FFFFFFFFFULL;
+    acqPhy = phy;
+
+    numUsed = 0;
+    for (i = 0; i < 37; i++)
+    {
+        if (res.chanMap & (1ULL << i))
+            usedChans[numUsed++] = i;
+    }
+    chanIdx = 0;
+
+    // a map needs two channels to be valid
+    if (numUsed < 2)
+    {
+        phase = ACQ_DONE;
+        return;
+    }
+
+    csa2_computeMappingCtx(&csa2Ctx, res.accessAddress, res.chanMap);
+    startCrcPhase();
+}
+
+AcqPhase acq_phase(void)
+{
+    return phase;
+}
+
+static uint32_t dwellLength(void)
+{
+    switch (phase)
+    {
+    case ACQ_CRCINIT:
+        return ACQ_CRC_DWELL;
+    case ACQ_INTERVAL:
+        return ACQ_INTERVAL_DWELL;
+    default:
+        // long enough for a CSA#1 connection to come back to the channel
+        return intervalTicks * 38;
+    }
+}
+
+uint8_t acq_listen(uint32_t now, uint32_t *endTime)
+{
+    if (!dwellActive)
+    {
+        dwellEnd = now + dwellLength();
+        dwellActive = true;
+        haveLast = false;
+        visitedInDwell = false;
+    }
+
+    *endTime = dwellEnd;
+    return usedChans[chanIdx];
+}
+
+// on air time of a PDU of len bytes (header included)
+static uint32_t airTicks(uint16_t len)
+{
+    switch (acqPhy)
+    {
+    case PHY_1M:
+        return (len + 8) * 32;
+    case PHY_2M:
+        return (len + 9) * 16;
+    default:
+        // coded S=8, the worst case
+        return (376 + (len + 3) * 64) * 4;
+    }
+}
+
+// returns true if the frame is the first one of a connection event
+static bool newEvent(const BLE_Frame *frame)
+{
+    uint32_t start = frame->timestamp << 2;
+    bool isNew = !haveLast || (int32_t)(start - lastEnd) > ACQ_EVENT_GAP;
+
+    lastEnd = start + airTicks(frame->length);
+    haveLast = true;
+    return isNew;
+}
+
+bool acq_frame(const BLE_Frame *frame)
+{
+    uint32_t start = frame->timestamp << 2;
+
+    switch (phase)
+    {
+    case ACQ_CRCINIT:
+    {
+        uint32_t crc = 0, init;
+        unsigned len, i;
+
+        if (crcFound || frame->length < 5)
+            return false;
+
+        // data PDU header needs a coherent length, or it's probably noise
+        len = frame->length - 3;
+        if (frame->pData[1] != len - 2)
+            return false;
+
+        memcpy(&crc, frame->pData + len, 3);
+        init = acq_reverseCrc(crc, frame->pData, len);
+
+        for (i = 0; i < ACQ_CRC_CANDS; i++)
+        {
+            if (crcCands[i] == init)
+            {
+                res.crcInit = init;
+                crcFound = true;
+                return true;
+            }
+        }
+        crcCands[crcPos] = init;
+        crcPos = (crcPos + 1) % ACQ_CRC_CANDS;
+        return false;
+    }
+    case ACQ_INTERVAL:
+        if (!newEvent(frame) || numGaps >= ACQ_INTERVAL_SAMPLES)
+            return false;
+        if (haveVisit)
+            gaps[numGaps++] = start - lastVisit;
+        lastVisit = start;
+        haveVisit = true;
+        visitedInDwell = true;
+        return numGaps >= ACQ_INTERVAL_SAMPLES;
+    case ACQ_HOPS:
+    {
+        uint32_t event;
+
+        if (!newEvent(frame) || numObs >= ACQ_OBS_MAX)
+            return false;
+        // counted from the last observation, to keep drift and wraparound out of it
+        event = (start - lastObsTime + intervalTicks / 2) / intervalTicks;
+        if (event == 0)
+            return false;
+        event += obs[numObs - 1].event;
+        obs[numObs].chan = usedChans[chanIdx];
+        obs[numObs].event = event;
+        lastObsTime = start;
+        numObs++;
+        return true; // got what we came for, move on to the next channel
+    }
+    default:
+        return false;
+    }
+}
+
+static uint32_t gcd(uint32_t a, uint32_t b)
+{
+    while (b)
+    {
+        uint32_t t = a % b;
+        a = b;
+        b = t;
+    }
+    return a;
+}
+
+// returns false if the visits don't give a sensible interval
+static bool computeInterval(void)
+{
+    uint32_t g = 0;
+    unsigned i;
+
+    for (i = 0; i < ACQ_INTERVAL_SAMPLES; i++)
+        g = gcd(g, (gaps[i] + 2500) / 5000); // round to 1.25 ms units
+
+    /* Each channel comes up every 37 events with CSA#1 and no unused
+     * channels. Every other case gives irregular gaps between visits.
+     */
+    divided37 = (g % 37 == 0) && (g / 37 >= ACQ_INTERVAL_MIN);
+    if (divided37)
+        g /= 37;
+
+    if (g < ACQ_INTERVAL_MIN || g > ACQ_INTERVAL_MAX)
+        return false;
+
+    res.interval = g;
+    refChan = usedChans[chanIdx];
+    refTime = lastVisit;
+    return true;
+}
+
+// same remapping as RadioTask uses for CSA#1
+static void csa1Mapping(uint8_t *mapping)
+{
+    unsigned i;
+
+    for (i = 0; i < 37; i++)
+    {
+        if (res.chanMap & (1ULL << i))
+            mapping[i] = i;
+        else
+            mapping[i] = usedChans[i % numUsed];
+    }
+}
+
+// number of CSA#1 hop increment and starting channel pairs (up to 2) fitting
+static unsigned solveCSA1(uint8_t *hopOut, uint8_t *unmappedOut)
+{
+    uint8_t mapping[37];
+    unsigned hop, u, i, solutions = 0;
+
+    csa1Mapping(mapping);
+
+    for (hop = 5; hop <= 16; hop++)
+    {
+        for (u = 0; u < 37; u++)
+        {
+            for (i = 0; i < numObs; i++)
+            {
+                if (mapping[(u + (obs[i].event % 37) * hop) % 37] != obs[i].chan)
+                    break;
+            }
+            if (i < numObs)
+                continue;
+
+            *hopOut = hop;
+            *unmappedOut = u;
+            if (++solutions > 1)
+                return solutions;
+        }
+    }
+
+    return solutions;
+}
+
+// true if CSA#2 counter for the reference event fits observations from on
+static bool csa2Fits(uint32_t counter, unsigned from, unsigned count)
+{
+    unsigned i;
+
+    for (i = from; i < count; i++)
+    {
+        if (csa2_computeChannelCtx(&csa2Ctx, counter + obs[i].event) != obs[i].chan)
+            return false;
+    }
+
+    return true;
+}
+
+/* Number of CSA#2 event counters (up to 2) for the reference event fitting.
+ * Rather than searching all 65536 each time, the candidates found so far are
+ * narrowed down with the new observations, and the search only carries on
+ * past them while there's room for more. Until it has covered every counter,
+ * a full set of candidates stands for at least two solutions.
+ */
+static unsigned solveCSA2(uint16_t *counterOut)
+{
+    unsigned count = numObs;
+    unsigned i, n = 0;
+
+    for (i = 0; i < numCsa2Cands; i++)
+    {
+        if (csa2Fits(csa2Cands[i], csa2CheckedObs, count))
+            csa2Cands[n++] = csa2Cands[i];
+    }
+    numCsa2Cands = n;
+    csa2CheckedObs = count;
+
+    for (; csa2Cursor < 0x10000 && numCsa2Cands < ACQ_CSA2_CANDS; csa2Cursor++)
+    {
+        if (csa2Fits(csa2Cursor, 0, count))
+            csa2Cands[numCsa2Cands++] = csa2Cursor;
+    }
+
+    if (numCsa2Cands)
+        *counterOut = csa2Cands[0];
+    return numCsa2Cands > 2 ? 2 : numCsa2Cands;
+}
+
+// returns true if exactly one hopping scheme fits the observations
+static bool solveHops(void)
+{
+    uint8_t hop = 0, unmapped = 0;
+    uint16_t counter = 0;
+    unsigned n1, n2;
+    uint32_t last = obs[numObs - 1].event;
+
+    n1 = solveCSA1(&hop, &unmapped);
+    n2 = solveCSA2(&counter);
+
+    if (n1 + n2 == 1)
+    {
+        res.csa2 = n2 != 0;
+        res.hopIncrement = hop;
+        res.unmapped = (unmapped + (last % 37) * hop) % 37;
+        res.eventCounter = (counter + last) & 0xFFFF;
+        res.eventTime = lastObsTime;
+        return true;
+    }
+
+    if (n1 + n2 == 0 || numObs >= ACQ_OBS_MAX)
+    {
+        // the interval must be wrong, try 37x longer if we divided it
+        dtrace1(TRACE_ACQ_HOPS_FAILED, numObs);
+        if (divided37 && res.interval * 37 <= ACQ_INTERVAL_MAX)
+        {
+            divided37 = false;
+            res.interval *= 37;
+            startHopsPhase();
+        } else {
+            startIntervalPhase();
+        }
+    }
+
+    return false;
+}
+
+static void nextChannel(void)
+{
+    chanIdx = (chanIdx + 1) % numUsed;
+    dwellActive = false;
+}
+
+bool acq_update(uint32_t now)
+{
+    bool expired = dwellActive && (int32_t)(dwellEnd - now) < ACQ_LISTEN_MIN;
+
+    switch (phase)
+    {
+    case ACQ_CRCINIT:
+        if (crcFound)
+        {
+            // stay on this channel, it's in use
+            dtrace1(TRACE_ACQ_CRCINIT, res.crcInit);
+            startIntervalPhase();
+        } else if (expired) {
+            nextChannel();
+        }
+        break;
+    case ACQ_INTERVAL:
+        if (numGaps >= ACQ_INTERVAL_SAMPLES)
+        {
+            if (computeInterval())
+            {
+                dtrace1(TRACE_ACQ_INTERVAL, res.interval);
+                startHopsPhase();
+            } else {
+                startIntervalPhase();
+            }
+        } else if (expired && !visitedInDwell) {
+            // connection may be gone, or CRCInit wrong
+            startCrcPhase();
+        } else if (expired) {
+            dwellActive = false; // keep going with the visits so far
+        }
+        break;
+    case ACQ_HOPS:
+        if (numObs > solvedObs)
+        {
+            solvedObs = numObs;
+            nextChannel();
+            if (numObs >= ACQ_OBS_MIN && solveHops())
+            {
+                if (res.csa2)
+                    dtrace1(TRACE_ACQ_CSA2, res.eventCounter);
+                else
+                    dtrace1(TRACE_ACQ_CSA1, res.hopIncrement);
+                phase = ACQ_DONE;
+                return true;
+            }
+        } else if (expired) {
+            nextChannel();
+        }
+        break;
+    default:
+        break;
+    }
+
+    return false;
+}
+
+const AcqResult *acq_result(void)
+{
+    return &res;
+}
+
+/* BLE CRC LFSR run backwards, as in Ubertooth. The CRC is transmitted most
+ * significant bit first, so the received bytes hold the register bit reversed
+ * relative to how CRCInit is given in CONNECT_IND.
+ */
+uint32_t acq_reverseCrc(uint32_t crc, const uint8_t *pdu, unsigned len)
+{
+    uint32_t state = crc & 0xFFFFFF;
+    uint32_t init = 0;
+    unsigned i;
+    int j;
+
+    for (i = len; i-- > 0; )
+    {
+        for (j = 7; j >= 0; j--)
+        {
+            uint32_t top = state >> 23;
+            state = (state << 1) & 0xFFFFFF;
+            state |= top ^ ((pdu[i] >> j) & 1);
+            if (top)
+                state ^= 0xB4C000;
+        }
+    }
+
+    for (j = 0; j < 24; j++)
+        init |= ((state >> j) & 1) << (23 - j);
+
+    return init;
+}
@@ -0,0 +1,71 @@
+/*
+ * Written by Sultan Qasim Khan
+ * Copyright (c) 2020, NCC Group plc
+ * Released as open source under GPLv3
+ */
+
+#ifndef CONN_ACQUIRE_H
+#define CONN_ACQUIRE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "RadioWrapper.h"
+
+/* Acquisition of a connection already in progress, given its access address
+ * (the radio can't receive without one). It works in three phases:
+ *
+ * 1. CRCInit: listen on data channels without CRC checking, and run the CRC
+ *    of each PDU backwards to its initial value. Two PDUs agreeing on it
+ *    settle it.
+ * 2. Interval: stay on that channel and time the connection's visits to it.
+ *    With CSA#1 and all channels used, visits are always 37 events apart;
+ *    otherwise the GCD of the gaps between visits is the hop interval.
+ * 3. Hops: visit the other channels, noting the event (relative to a
+ *    reference event) each was used in, until only one CSA#1 hop increment
+ *    and starting channel, or one CSA#2 event counter, fits them all.
+ *
+ * The channel map is supplied rather than inferred. For CSA#1 the event
+ * counter can't be recovered, so instants in later LL control PDUs will be
+ * misapplied; CSA#2 connections recover it along with the hopping.
+ */
+typedef enum
+{
+    ACQ_CRCINIT,
+    ACQ_INTERVAL,
+    ACQ_HOPS,
+    ACQ_DONE
+} AcqPhase;
+
+typedef struct
+{
+    uint32_t accessAddress;
+    uint32_t crcInit;
+    uint64_t chanMap;
+    uint16_t interval;      // 1.25 ms units
+    bool csa2;
+    uint8_t hopIncrement;   // CSA#1 only
+    uint8_t unmapped;       // CSA#1 unmapped channel of the last observed event
+    uint16_t eventCounter;  // CSA#2 event counter of the last observed event
+    uint32_t eventTime;     // anchor of the last observed event (radio ticks)
+} AcqResult;
+
+void acq_start(uint32_t accessAddress, uint64_t chanMap, PHY_Mode phy);
+AcqPhase acq_phase(void);
+
+// channel to listen on next, and when to stop (radio ticks)
+uint8_t acq_listen(uint32_t now, uint32_t *endTime);
+
+// frame received on acquisition channel, returns true to end the listen early
+// in the CRCInit phase, the 3 CRC bytes are included at the end of the frame
+bool acq_frame(const BLE_Frame *frame);
+
+// advance phases after a listen, returns true once the connection is inferred
+bool acq_update(uint32_t now);
+
+const AcqResult *acq_result(void);
+
+// initial CRC value for a PDU given its received CRC (LSB first as received)
+uint32_t acq_reverseCrc(uint32_t crc, const uint8_t *pdu, unsigned len);
+
+#endif
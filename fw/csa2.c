@@ -6,11 +6,6 @@
 
 #include "csa2.h"
 
-static uint64_t csa2_chanMap;
-static uint8_t csa2_numUsedChannels;
-static uint8_t csa2_remapping_table[37];
-static uint16_t channelIdentifier;
-
 /* obtuse but elegant compile time generation of bit reversing table
  * http://graphics.stanford.edu/~seander/bithacks.html#BitReverseTable
  * Credit goes to Hallvard Furuseth
@@ -35,7 +30,7 @@ static inline uint16_t csa2_mam(uint16_t a, uint16_t b)
     return u & 0xFFFF;
 }
 
-static uint16_t csa2_eprn(uint16_t counter)
+static uint16_t csa2_eprn(uint16_t counter, uint16_t channelIdentifier)
 {
     uint16_t u = counter;
     u ^= channelIdentifier;
@@ -49,33 +44,38 @@ static uint16_t csa2_eprn(uint16_t counter)
     return u;
 }
 
-void csa2_computeMapping(uint32_t accessAddress, uint64_t map)
+void csa2_computeMappingCtx(CSA2_Context *ctx, uint32_t accessAddress, uint64_t map)
 {
     uint8_t i;
     uint16_t lower = accessAddress & 0xFFFF;
     uint16_t upper = accessAddress >> 16;
 
     // count bits for numUsedChannels and generate remapping table
-    csa2_numUsedChannels = 0;
+    ctx->numUsedChannels = 0;
     for (i = 0; i < 37; i++)
     {
         if (map & (1ULL << i))
         {
-            csa2_remapping_table[csa2_numUsedChannels] = i;
-            csa2_numUsedChannels += 1;
+            ctx->remappingTable[ctx->numUsedChannels] = i;
+            ctx->numUsedChannels += 1;
         }
     }
 
-    channelIdentifier = lower ^ upper;
-    csa2_chanMap = map;
+    ctx->channelIdentifier = lower ^ upper;
+    ctx->chanMap = map;
 }
 
-uint8_t csa2_computeChannel(uint32_t connEventCounter)
+uint8_t csa2_computeChannelCtx(const CSA2_Context *ctx, uint32_t connEventCounter)
 {
-    uint16_t e_prn = csa2_eprn(connEventCounter & 0xFFFF);
+    uint16_t e_prn = csa2_eprn(connEventCounter & 0xFFFF, ctx->channelIdentifier);
     uint8_t mod_eprn = e_prn % 37;
 
-    if (csa2_chanMap & (1ULL << mod_eprn))
+    if (ctx->chanMap & (1ULL << mod_eprn))
         return mod_eprn;
-    return csa2_remapping_table[(csa2_numUsedChannels * e_prn) >> 16];
+    return ctx->remappingTable[(ctx->numUsedChannels * e_prn) >> 16];
+}
+
+uint8_t csa2_computeUnmappedCtx(const CSA2_Context *ctx, uint32_t connEventCounter)
+{
+    return csa2_eprn(connEventCounter & 0xFFFF, ctx->channelIdentifier) % 37;
 }
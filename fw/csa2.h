@@ -9,7 +9,19 @@
 
 #include <stdint.h>
 
-void csa2_computeMapping(uint32_t accessAddress, uint64_t map);
-uint8_t csa2_computeChannel(uint32_t connEventCounter);
+// hopping state for one access address and channel map
+typedef struct
+{
+    uint64_t chanMap;
+    uint8_t numUsedChannels;
+    uint8_t remappingTable[37];
+    uint16_t channelIdentifier;
+} CSA2_Context;
+
+void csa2_computeMappingCtx(CSA2_Context *ctx, uint32_t accessAddress, uint64_t map);
+uint8_t csa2_computeChannelCtx(const CSA2_Context *ctx, uint32_t connEventCounter);
+
+// channel before remapping to the used channels
+uint8_t csa2_computeUnmappedCtx(const CSA2_Context *ctx, uint32_t connEventCounter);
 
 #endif
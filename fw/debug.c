@@ -20,11 +20,16 @@ void dprintf(const char *fmt, ...)
     frame.channel = 40; // indicates debug message
     frame.phy = PHY_1M;
     frame.pData = (uint8_t *)buf;
+    frame.pEntry = NULL;
 
     va_start (args, fmt);
     frame.length = vsnprintf(buf, sizeof(buf), fmt, args);
     va_end(args);
 
+    // vsnprintf returns the untruncated length
+    if (frame.length >= sizeof(buf))
+        frame.length = sizeof(buf) - 1;
+
     // Does thread safe copying into queue
     indicatePacket(&frame);
 }
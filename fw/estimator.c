@@ -0,0 +1,83 @@
+/*
+ * Written by Sultan Qasim Khan
+ * Copyright (c) 2020, NCC Group plc
+ * Released as open source under GPLv3
+ */
+
+#include "estimator.h"
+
+// no outlier rejection until this many samples are in
+#define EST_WARMUP 3
+#define EST_REJECT_MULT 4
+#define EST_MAX_REJECTS 4
+
+// samples are clamped to keep fixed point arithmetic from overflowing
+#define EST_SAMPLE_MAX ((1 << (27 - EST_FRAC_BITS)) - 1)
+
+void est_init(Estimator *e, uint8_t shift, int32_t minTol)
+{
+    e->value = 0;
+    e->deviation = 0;
+    e->minTol = minTol;
+    e->count = 0;
+    e->rejects = 0;
+    e->shift = shift;
+}
+
+bool est_add(Estimator *e, int32_t sample)
+{
+    int32_t fpSample;
+    int32_t err;
+    int32_t absErr;
+    int32_t n;
+
+    if (sample > EST_SAMPLE_MAX)
+        sample = EST_SAMPLE_MAX;
+    else if (sample < -EST_SAMPLE_MAX)
+        sample = -EST_SAMPLE_MAX;
+
+    fpSample = sample * (1 << EST_FRAC_BITS);
+    err = fpSample - e->value;
+    absErr = err < 0 ? -err : err;
+
+    if (e->count >= EST_WARMUP && absErr > EST_REJECT_MULT * e->deviation +
+            e->minTol * (1 << EST_FRAC_BITS))
+    {
+        if (++e->rejects < EST_MAX_REJECTS)
+            return false;
+        e->count = 0;
+    }
+    e->rejects = 0;
+
+    if (e->count == 0)
+    {
+        e->value = fpSample;
+        e->deviation = 0;
+        e->count = 1;
+        return true;
+    }
+
+    // cumulative average during warm up, EWMA afterwards
+    if (e->count < (1 << e->shift))
+        n = e->count + 1;
+    else
+        n = 1 << e->shift;
+
+    e->value += err / n;
+    e->deviation += (absErr - e->deviation) / n;
+    if (e->count < 0xFFFF)
+        e->count++;
+
+    return true;
+}
+
+void est_offset(Estimator *e, int32_t delta)
+{
+    e->value += delta * (1 << EST_FRAC_BITS);
+}
+
+bool est_stable(const Estimator *e, uint16_t minCount, int32_t maxDeviation)
+{
+    return e->count >= minCount &&
+        e->deviation <= maxDeviation * (1 << EST_FRAC_BITS);
+}
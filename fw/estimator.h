@@ -0,0 +1,50 @@
+/*
+ * Written by Sultan Qasim Khan
+ * Copyright (c) 2020, NCC Group plc
+ * Released as open source under GPLv3
+ */
+
+#ifndef ESTIMATOR_H
+#define ESTIMATOR_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Streaming estimator: an EWMA with outlier rejection.
+ * The first 2^shift samples are averaged cumulatively for a quick lock, after
+ * which each new sample has weight 1/2^shift. A sample is rejected as an
+ * outlier if its error exceeds four times the smoothed absolute deviation
+ * plus minTol. Several outliers in a row mean the true value has moved, so
+ * the estimator restarts from the latest sample.
+ */
+// value and deviation are fixed point with EST_FRAC_BITS fractional bits
+#define EST_FRAC_BITS 8
+
+typedef struct
+{
+    int32_t value;      // current estimate (fixed point)
+    int32_t deviation;  // smoothed absolute deviation (fixed point)
+    int32_t minTol;     // minimum outlier rejection tolerance
+    uint16_t count;     // accepted samples (saturating)
+    uint8_t rejects;    // consecutive rejected samples
+    uint8_t shift;
+} Estimator;
+
+void est_init(Estimator *e, uint8_t shift, int32_t minTol);
+
+// returns false if sample was rejected as an outlier
+bool est_add(Estimator *e, int32_t sample);
+
+// adjust estimate after applying a correction of delta to the measured quantity
+void est_offset(Estimator *e, int32_t delta);
+
+// true once at least minCount samples agree within maxDeviation
+bool est_stable(const Estimator *e, uint16_t minCount, int32_t maxDeviation);
+
+// estimate, rounded to an integer
+static inline int32_t est_value(const Estimator *e)
+{
+    return (e->value + (1 << (EST_FRAC_BITS - 1))) >> EST_FRAC_BITS;
+}
+
+#endif
@@ -0,0 +1,31 @@
+#!/usr/bin/env python3
+
+# Written by Sultan Qasim Khan
+# Copyright (c) 2020, NCC Group plc
+# Released as open source under GPLv3
+
+# Generates the host trace format table from trace_fmt.def
+
+import re, sys
+from ast import literal_eval
+
+TRACE_RE = re.compile(r'^\s*TRACE_FMT\(\s*(\w+)\s*,\s*("(?:[^"\\]|\\.)*")\s*\)', re.M)
+
+def main():
+    if len(sys.argv) != 3:
+        print("Usage: %s trace_fmt.def trace_fmt.py" % sys.argv[0], file=sys.stderr)
+        sys.exit(1)
+
+    with open(sys.argv[1]) as f:
+        formats = TRACE_RE.findall(f.read())
+
+    with open(sys.argv[2], "w") as f:
+        f.write("# Generated from fw/trace_fmt.def by fw/gen_trace_fmt.py, do not edit\n\n")
+        f.write("# (name, printf style format), indexed by trace format ID\n")
+        f.write("TRACE_FORMATS = [\n")
+        for name, fmt in formats:
+            f.write("    (%r, %r),\n" % (name, literal_eval(fmt)))
+        f.write("]\n")
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,158 @@
+/*
+ * Written by Sultan Qasim Khan
+ * Copyright (c) 2020, NCC Group plc
+ * Released as open source under GPLv3
+ */
+
+#include <string.h>
+#include <xdc/std.h>
+#include <ti/sysbios/hal/Hwi.h>
+
+#include "hop_table.h"
+
+#define HOP_TABLE_MASK (HOP_TABLE_SIZE - 1)
+
+// entries computed per call of hop_table_fill, to keep idle passes short
+#define FILL_CHUNK 8
+
+typedef struct
+{
+    uint8_t chans[HOP_TABLE_SIZE];
+
+    // table holds channels for events [tableStart, tableStart + tableCount)
+    // entry for event e is at index e & HOP_TABLE_MASK
+    volatile uint32_t tableStart;
+    volatile uint32_t tableCount;
+
+    // bumped on every reset so a preempted fill can't store stale channels
+    volatile uint32_t generation;
+
+    bool csa2;
+    CSA2_Context csa2Ctx;
+    uint32_t baseEvent;
+    uint8_t baseUnmapped;
+    uint8_t hopInc;
+    uint8_t csa1_mapping[37];
+} HopTable;
+
+static HopTable tables[HOP_TABLE_COUNT];
+
+// table to extend on the next idle pass
+static unsigned fillNext = 0;
+
+static uint8_t computeChannel(const HopTable *ht, uint32_t eventCounter)
+{
+    uint32_t unmapped;
+
+    if (ht->csa2)
+        return csa2_computeChannelCtx(&ht->csa2Ctx, eventCounter);
+
+    // counter is kept 32 bit since 2^16 isn't a multiple of 37
+    unmapped = (ht->baseUnmapped + ht->hopInc * ((eventCounter - ht->baseEvent) % 37)) % 37;
+    return ht->csa1_mapping[unmapped];
+}
+
+void hop_table_resetCSA1(unsigned t, uint32_t eventCounter, uint8_t curUnmapped,
+        uint8_t hopIncrement, const uint8_t *mapping)
+{
+    HopTable *ht = tables + t;
+    unsigned key = Hwi_disable();
+    ht->csa2 = false;
+    ht->baseEvent = eventCounter;
+    ht->baseUnmapped = curUnmapped;
+    ht->hopInc = hopIncrement;
+    memcpy(ht->csa1_mapping, mapping, sizeof(ht->csa1_mapping));
+    ht->tableStart = eventCounter;
+    ht->tableCount = 0;
+    ht->generation++;
+    Hwi_restore(key);
+}
+
+void hop_table_resetCSA2(unsigned t, uint32_t eventCounter, const CSA2_Context *ctx)
+{
+    HopTable *ht = tables + t;
+    unsigned key = Hwi_disable();
+    ht->csa2 = true;
+    ht->csa2Ctx = *ctx;
+    ht->tableStart = eventCounter;
+    ht->tableCount = 0;
+    ht->generation++;
+    Hwi_restore(key);
+}
+
+uint8_t hop_table_getChannel(unsigned t, uint32_t eventCounter)
+{
+    HopTable *ht = tables + t;
+    uint32_t ev = eventCounter;
+    uint32_t d;
+    uint8_t chan;
+    unsigned key;
+
+    key = Hwi_disable();
+    d = ev - ht->tableStart;
+    if (d < ht->tableCount)
+    {
+        chan = ht->chans[ev & HOP_TABLE_MASK];
+        ht->tableStart = ev;
+        ht->tableCount -= d;
+        Hwi_restore(key);
+        return chan;
+    }
+
+    // table ran dry (or lookup is out of order), restart it here
+    ht->tableStart = ev;
+    ht->tableCount = 0;
+    Hwi_restore(key);
+
+    return computeChannel(ht, ev);
+}
+
+// returns false if the table was already full
+static bool fillTable(HopTable *ht)
+{
+    uint8_t chans[FILL_CHUNK];
+    uint32_t first;
+    uint32_t gen;
+    unsigned n, i, key;
+
+    key = Hwi_disable();
+    n = HOP_TABLE_SIZE - ht->tableCount;
+    first = ht->tableStart + ht->tableCount;
+    gen = ht->generation;
+    Hwi_restore(key);
+
+    if (n == 0)
+        return false;
+    if (n > FILL_CHUNK)
+        n = FILL_CHUNK;
+
+    // computed with interrupts enabled, radio activity may preempt us
+    for (i = 0; i < n; i++)
+        chans[i] = computeChannel(ht, first + i);
+
+    // publish only if nothing changed while we were computing
+    key = Hwi_disable();
+    if (gen == ht->generation && ht->tableStart + ht->tableCount == first)
+    {
+        for (i = 0; i < n; i++)
+            ht->chans[(first + i) & HOP_TABLE_MASK] = chans[i];
+        ht->tableCount += n;
+    }
+    Hwi_restore(key);
+
+    return true;
+}
+
+void hop_table_fill(void)
+{
+    unsigned i;
+
+    // one chunk per pass, for the next table that needs it
+    for (i = 0; i < HOP_TABLE_COUNT; i++)
+    {
+        HopTable *ht = tables + fillNext;
+        fillNext = (fillNext + 1) % HOP_TABLE_COUNT;
+        if (fillTable(ht))
+            break;
+    }
+}
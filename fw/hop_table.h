@@ -0,0 +1,37 @@
+/*
+ * Written by Sultan Qasim Khan
+ * Copyright (c) 2020, NCC Group plc
+ * Released as open source under GPLv3
+ */
+
+#ifndef HOP_TABLE_H
+#define HOP_TABLE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "csa2.h"
+
+// number of connection events of lookahead (power of 2)
+#define HOP_TABLE_SIZE 64
+
+// number of independent tables, one per followed connection
+#define HOP_TABLE_COUNT 4
+
+/* Start a new hop schedule for table t at connection event eventCounter.
+ * Call whenever the channel map or hop state changes. For CSA#1, the
+ * schedule begins on unmapped channel curUnmapped and uses the supplied
+ * 37 entry mapping table. For CSA#2, the supplied context is copied.
+ */
+void hop_table_resetCSA1(unsigned t, uint32_t eventCounter, uint8_t curUnmapped,
+        uint8_t hopIncrement, const uint8_t *mapping);
+void hop_table_resetCSA2(unsigned t, uint32_t eventCounter, const CSA2_Context *ctx);
+
+// channel for the given event; computed directly if not yet in the table
+// looking up an event discards the table entries for all prior events
+uint8_t hop_table_getChannel(unsigned t, uint32_t eventCounter);
+
+// extend the tables in the background (called by the Idle task)
+void hop_table_fill(void);
+
+#endif
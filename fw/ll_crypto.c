@@ -0,0 +1,262 @@
+/*
+ * Written by Sultan Qasim Khan
+ * Copyright (c) 2020, NCC Group plc
+ * Released as open source under GPLv3
+ */
+
+#include <string.h>
+#include <ll_crypto.h>
+#include <sw_aes128.h>
+
+#include <ti/drivers/AESCCM.h>
+#include <ti/drivers/cryptoutils/cryptokey/CryptoKeyPlaintext.h>
+
+#include <xdc/std.h>
+#include <ti/sysbios/hal/Hwi.h>
+
+#include "ti_drivers_config.h"
+#include "trace.h"
+
+// LL control PDU opcodes
+#define LL_ENC_REQ          0x03
+#define LL_ENC_RSP          0x04
+#define LL_START_ENC_REQ    0x05
+#define LL_PAUSE_ENC_RSP    0x0B
+
+#define MIC_LEN 4
+
+// give up on a key that never decrypts anything after this many PDUs
+#define FAILURES_MAX 16
+
+static AESCCM_Handle ccmHandle = NULL;
+
+static uint8_t ltk[16];
+static volatile bool haveLTK = false;
+
+void ll_crypto_init(void)
+{
+    AESCCM_Params params;
+
+    AESCCM_init();
+    AESCCM_Params_init(&params);
+
+    // polling, so whichever of the RX path and PacketTask finds the hardware
+    // busy fails the attempt rather than waiting
+    params.returnBehavior = AESCCM_RETURN_BEHAVIOR_POLLING;
+    params.timeout = 0;
+
+    ccmHandle = AESCCM_open(CONFIG_AESCCM_0, &params);
+}
+
+void ll_crypto_setLTK(const void *key)
+{
+    haveLTK = false;
+    if (key)
+    {
+        memcpy(ltk, key, 16);
+        haveLTK = true;
+    }
+}
+
+void ll_crypto_reset(LLCrypto *c)
+{
+    memset(c, 0, sizeof(*c));
+}
+
+// SK = e(LTK, SKDs || SKDm), with the little endian SKDs made MSB first
+static void deriveSessionKey(LLCrypto *c, const uint8_t *skds)
+{
+    // static to avoid making the callback stack huge
+    static uint8_t roundKeys[AES_ROUND_KEY_SIZE];
+    uint8_t skd[16];
+    unsigned i;
+
+    for (i = 0; i < 8; i++)
+    {
+        skd[i] = skds[7 - i];
+        skd[8 + i] = c->skdm[7 - i];
+    }
+
+    // a one-off, not worth setting up the hardware for
+    aes_key_schedule_128(ltk, roundKeys);
+    aes_encrypt_128(roundKeys, skd, c->sk);
+}
+
+// decrypt the payload of PDU into out, returns true if the MIC was valid
+static bool tryDecrypt(const LLCrypto *c, uint8_t *pdu, uint8_t *out, uint64_t ctr,
+        bool fromMaster)
+{
+    CryptoKey cryptoKey;
+    AESCCM_Operation op;
+    uint8_t nonce[13];
+    uint8_t aad = pdu[0] & 0xE3; // NESN, SN and MD aren't authenticated
+    unsigned len = pdu[1] - MIC_LEN;
+    unsigned i;
+
+    // 39 bit packet counter (LSO first), direction bit, then IV
+    for (i = 0; i < 5; i++)
+        nonce[i] = ctr >> (i * 8);
+    nonce[4] = (nonce[4] & 0x7F) | (fromMaster ? 0x80 : 0);
+    memcpy(nonce + 5, c->iv, 8);
+
+    CryptoKeyPlaintext_initKey(&cryptoKey, (uint8_t *)c->sk, 16);
+    AESCCM_Operation_init(&op);
+    op.key = &cryptoKey;
+    op.aad = &aad;
+    op.aadLength = 1;
+    op.input = pdu + 2;
+    op.output = out;
+    op.inputLength = len;
+    op.nonce = nonce;
+    op.nonceLength = sizeof(nonce);
+    op.mac = pdu + 2 + len;
+    op.macLength = MIC_LEN;
+
+    return AESCCM_oneStepDecrypt(ccmHandle, &op) == AESCCM_STATUS_SUCCESS;
+}
+
+// follow encryption setup and teardown in readable LL control PDUs
+static void trackControl(LLCrypto *c, const uint8_t *ctl, unsigned len)
+{
+    switch (ctl[0])
+    {
+    case LL_ENC_REQ:
+        // Rand, EDIV, SKDm, IVm
+        if (len < 23)
+            break;
+        memcpy(c->skdm, ctl + 11, 8);
+        memcpy(c->iv, ctl + 19, 4);
+        c->gotEncReq = true;
+        c->keyReady = false;
+        break;
+    case LL_ENC_RSP:
+        // SKDs, IVs
+        if (len < 13 || !c->gotEncReq || !haveLTK)
+            break;
+        memcpy(c->iv + 4, ctl + 9, 4);
+        deriveSessionKey(c, ctl + 1);
+        c->keyReady = true;
+        break;
+    case LL_START_ENC_REQ:
+        if (!c->keyReady)
+            break;
+        c->active = true;
+        c->succeeded = false;
+        c->failures = 0;
+        c->ctr[0] = 0;
+        c->ctr[1] = 0;
+        dtrace0(TRACE_CRYPTO_START);
+        break;
+    case LL_PAUSE_ENC_RSP:
+        // the master's reply to this is unencrypted
+        c->active = false;
+        c->gotEncReq = false;
+        c->keyReady = false;
+        break;
+    default:
+        break;
+    }
+}
+
+// replace the ciphertext and MIC of a decrypted PDU with its plaintext
+static void usePlain(LLCrypto *c, uint8_t *pdu, const uint8_t *plain)
+{
+    pdu[1] -= MIC_LEN;
+    memcpy(pdu + 2, plain, pdu[1]);
+    c->failures = 0;
+    c->succeeded = true;
+}
+
+bool ll_crypto_rx(LLCrypto *c, uint8_t *pdu, bool eventStart,
+        LLCryptoRetry *retry)
+{
+    // static to avoid making the Swi stack huge
+    static uint8_t plain[255];
+    bool guess = eventStart || !c->lastFromMaster;
+    bool decrypted = false;
+
+    c->lastFromMaster = guess;
+    retry->c = NULL;
+
+    // empty PDUs aren't encrypted and don't count, and CTEInfo isn't handled
+    if (c->active && ccmHandle && pdu[1] > MIC_LEN && !(pdu[0] & 0x20))
+    {
+        // one attempt here, ll_crypto_retry tries the rest
+        if (tryDecrypt(c, pdu, plain, c->ctr[guess], guess))
+        {
+            c->ctr[guess]++;
+            usePlain(c, pdu, plain);
+            decrypted = true;
+        } else {
+            retry->c = c;
+            retry->fromMaster = guess;
+        }
+    }
+
+    if ((pdu[0] & 0x3) == 0x3 && pdu[1] >= 1 && (decrypted || !c->active))
+        trackControl(c, pdu + 2, pdu[1]);
+
+    return decrypted;
+}
+
+bool ll_crypto_retry(const LLCryptoRetry *retry, uint8_t *pdu)
+{
+    // not shared with ll_crypto_rx, which can preempt us
+    static uint8_t plain[255];
+    LLCrypto *c = retry->c;
+    LLCrypto snap;
+    uint64_t ctr = 0;
+    bool fromMaster = retry->fromMaster;
+    bool decrypted = false;
+    unsigned key, d, i;
+
+    // the RX path carries on with the real state while we work on a copy
+    key = Hwi_disable();
+    snap = *c;
+    Hwi_restore(key);
+
+    if (!snap.active)
+        return false;
+
+    // guessed direction first, then the other
+    for (d = 0; d < 2 && !decrypted; d++)
+    {
+        uint64_t next;
+
+        fromMaster = d ? !retry->fromMaster : retry->fromMaster;
+        next = snap.ctr[fromMaster];
+
+        // the next counter (again, in case the hardware was busy or it has
+        // moved on since), a retransmission, then after missed packets
+        for (i = 0; i < LL_CRYPTO_CTR_AHEAD + 2; i++)
+        {
+            if (i == 1 && next == 0)
+                continue;
+            ctr = (i == 0) ? next : (i == 1) ? next - 1 : next + i - 1;
+
+            if (tryDecrypt(&snap, pdu, plain, ctr, fromMaster))
+            {
+                decrypted = true;
+                break;
+            }
+        }
+    }
+
+    key = Hwi_disable();
+    if (decrypted)
+    {
+        if (ctr >= c->ctr[fromMaster])
+            c->ctr[fromMaster] = ctr + 1;
+        usePlain(c, pdu, plain);
+        if ((pdu[0] & 0x3) == 0x3 && pdu[1] >= 1)
+            trackControl(c, pdu + 2, pdu[1]);
+    } else if (c->active && !c->succeeded && ++c->failures >= FAILURES_MAX) {
+        // probably the wrong LTK, stop wasting time on it
+        c->active = false;
+        c->keyReady = false;
+        dtrace0(TRACE_CRYPTO_FAILED);
+    }
+    Hwi_restore(key);
+
+    return decrypted;
+}
@@ -0,0 +1,71 @@
+/*
+ * Written by Sultan Qasim Khan
+ * Copyright (c) 2020, NCC Group plc
+ * Released as open source under GPLv3
+ */
+
+#ifndef LL_CRYPTO_H
+#define LL_CRYPTO_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Link layer decryption of a sniffed connection, given its LTK.
+ *
+ * The session key is derived from the LTK and SKDm/SKDs exchanged in
+ * LL_ENC_REQ/LL_ENC_RSP, and encryption starts after LL_START_ENC_REQ, with
+ * a packet counter per direction. Sniffed packets may be missed or
+ * retransmitted, and their direction is only a guess, so a few counters
+ * each way are tried until the MIC checks out. Only the predicted counter and
+ * direction are tried on the RX path, the rest later by ll_crypto_retry.
+ */
+
+// packets missed in a row we can still recover from
+#define LL_CRYPTO_CTR_AHEAD 3
+
+typedef struct
+{
+    uint8_t skdm[8];        // from LL_ENC_REQ, as received
+    uint8_t iv[8];          // IVm then IVs, as received
+    uint8_t sk[16];         // session key, MSB first
+    bool gotEncReq;
+    bool keyReady;          // session key derived, waiting for LL_START_ENC_REQ
+    bool active;            // PDUs are encrypted
+    bool lastFromMaster;    // direction of last PDU
+    bool succeeded;         // decrypted anything since encryption started
+    uint8_t failures;       // consecutive PDUs that failed to decrypt
+    uint64_t ctr[2];        // next new packet counter, [1] for master to slave
+} LLCrypto;
+
+// a PDU ll_crypto_rx couldn't decrypt with the predicted counter
+typedef struct
+{
+    LLCrypto *c;            // NULL if there's nothing to retry
+    bool fromMaster;        // direction guessed
+} LLCryptoRetry;
+
+// open the AES hardware
+void ll_crypto_init(void);
+
+// LTK (MSB first) for connections to decrypt, NULL to stop decrypting
+void ll_crypto_setLTK(const void *ltk);
+
+void ll_crypto_reset(LLCrypto *c);
+
+/* Handle a data channel PDU (header, length, payload) received in a
+ * connection event, decrypting it in place with the predicted packet counter
+ * and direction if possible, and tracking encryption setup. eventStart is
+ * true for the first PDU of an event, always sent by the master. Returns true
+ * if it was decrypted, in which case the 4 byte MIC is removed and the length
+ * byte updated. Otherwise retry is filled in if the PDU is encrypted.
+ */
+bool ll_crypto_rx(LLCrypto *c, uint8_t *pdu, bool eventStart,
+        LLCryptoRetry *retry);
+
+/* Try the other packet counters and direction on a copy of a PDU that
+ * ll_crypto_rx couldn't decrypt, off the RX path. Only one task may call it.
+ * Returns true if it was decrypted, as for ll_crypto_rx.
+ */
+bool ll_crypto_retry(const LLCryptoRetry *retry, uint8_t *pdu);
+
+#endif
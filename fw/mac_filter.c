@@ -0,0 +1,297 @@
+/*
+ * Written by Sultan Qasim Khan
+ * Copyright (c) 2020, NCC Group plc
+ * Released as open source under GPLv3
+ */
+
+#include <string.h>
+#include <xdc/std.h>
+#include <ti/sysbios/hal/Hwi.h>
+
+#include "mac_filter.h"
+#include "rpa_resolver.h"
+
+/* MACs are kept in an open addressing hash table with linear probing,
+ * sized to stay at most half full. Lookups run in RF callback context, so
+ * modifications are done with interrupts disabled.
+ */
+#define MAC_SLOTS (MAC_FILTER_MAX * 2) // must be a power of 2
+#define MAC_SLOT_MASK (MAC_SLOTS - 1)
+
+static uint8_t mac_slots[MAC_SLOTS][6];
+static bool mac_used[MAC_SLOTS];
+static unsigned mac_count = 0;
+
+static RPA_Key irks[IRK_FILTER_MAX];
+static volatile unsigned irk_count = 0;
+
+/* Resolution results for recently seen RPAs, keyed by prand+hash (the whole
+ * RPA), so the RX path only runs AES on first sight of an address. Both
+ * resolved and unresolved results are kept. Direct mapped, so a colliding
+ * address simply replaces the older entry. Size must be a power of 2.
+ */
+#define RPA_CACHE_SIZE 64
+#define RPA_CACHE_MASK (RPA_CACHE_SIZE - 1)
+#define RPA_UNRESOLVED 0xFF
+
+// RPAs re-checked per batch when an IRK is added
+#define RECHECK_BATCH 16
+
+struct RpaCacheEntry
+{
+    uint8_t rpa[6];
+    uint8_t irkIdx; // RPA_UNRESOLVED if no IRK matches
+    bool valid;
+};
+
+static struct RpaCacheEntry rpa_cache[RPA_CACHE_SIZE];
+
+// 32 bit FNV-1a
+static uint32_t mac_hash(const uint8_t *mac)
+{
+    uint32_t h = 2166136261u;
+    int i;
+
+    for (i = 0; i < 6; i++)
+    {
+        h ^= mac[i];
+        h *= 16777619u;
+    }
+
+    return h;
+}
+
+// returns slot index holding mac, or -1 if absent
+static int mac_find(const uint8_t *mac)
+{
+    uint32_t pos = mac_hash(mac) & MAC_SLOT_MASK;
+
+    // table is never full, so there's always an empty slot to stop at
+    while (mac_used[pos])
+    {
+        if (!memcmp(mac_slots[pos], mac, 6))
+            return pos;
+        pos = (pos + 1) & MAC_SLOT_MASK;
+    }
+
+    return -1;
+}
+
+void mac_filter_clear(void)
+{
+    unsigned key = Hwi_disable();
+    memset(mac_used, 0, sizeof(mac_used));
+    mac_count = 0;
+    Hwi_restore(key);
+}
+
+bool mac_filter_add(const uint8_t *mac)
+{
+    uint32_t pos;
+    unsigned key;
+
+    if (mac_find(mac) >= 0)
+        return true;
+    if (mac_count >= MAC_FILTER_MAX)
+        return false;
+
+    pos = mac_hash(mac) & MAC_SLOT_MASK;
+    while (mac_used[pos])
+        pos = (pos + 1) & MAC_SLOT_MASK;
+
+    key = Hwi_disable();
+    memcpy(mac_slots[pos], mac, 6);
+    mac_used[pos] = true;
+    mac_count++;
+    Hwi_restore(key);
+
+    return true;
+}
+
+bool mac_filter_remove(const uint8_t *mac)
+{
+    int hole = mac_find(mac);
+    uint32_t pos, home;
+    unsigned key;
+
+    if (hole < 0)
+        return false;
+
+    key = Hwi_disable();
+    mac_used[hole] = false;
+    mac_count--;
+
+    // backward shift deletion: move entries up to fill the hole, so that
+    // probe sequences stay unbroken without tombstones
+    pos = (hole + 1) & MAC_SLOT_MASK;
+    while (mac_used[pos])
+    {
+        home = mac_hash(mac_slots[pos]) & MAC_SLOT_MASK;
+
+        // can the entry at pos legally move to the hole?
+        if (((pos - home) & MAC_SLOT_MASK) >= ((pos - hole) & MAC_SLOT_MASK))
+        {
+            memcpy(mac_slots[hole], mac_slots[pos], 6);
+            mac_used[hole] = true;
+            mac_used[pos] = false;
+            hole = pos;
+        }
+        pos = (pos + 1) & MAC_SLOT_MASK;
+    }
+    Hwi_restore(key);
+
+    return true;
+}
+
+static void rpa_cache_clear(void)
+{
+    unsigned i;
+
+    for (i = 0; i < RPA_CACHE_SIZE; i++)
+        rpa_cache[i].valid = false;
+}
+
+// check cached unresolved RPAs against a newly added IRK in batches
+static void rpa_cache_recheck(unsigned irkIdx)
+{
+    uint8_t rpas[RECHECK_BATCH][6];
+    const uint8_t *pRpas[RECHECK_BATCH];
+    unsigned slots[RECHECK_BATCH];
+    unsigned pos = 0;
+    unsigned i, n, key;
+    uint32_t matches;
+
+    while (pos < RPA_CACHE_SIZE)
+    {
+        // copy out a batch, since the RX path may replace entries meanwhile
+        n = 0;
+        key = Hwi_disable();
+        for (; pos < RPA_CACHE_SIZE && n < RECHECK_BATCH; pos++)
+        {
+            if (!rpa_cache[pos].valid || rpa_cache[pos].irkIdx != RPA_UNRESOLVED)
+                continue;
+            memcpy(rpas[n], rpa_cache[pos].rpa, 6);
+            pRpas[n] = rpas[n];
+            slots[n] = pos;
+            n++;
+        }
+        Hwi_restore(key);
+
+        if (n == 0)
+            break;
+
+        matches = rpa_match_batch(irks + irkIdx, pRpas, n);
+
+        key = Hwi_disable();
+        for (i = 0; i < n; i++)
+        {
+            struct RpaCacheEntry *e = rpa_cache + slots[i];
+            if ((matches & (1UL << i)) && e->valid && !memcmp(e->rpa, rpas[i], 6))
+                e->irkIdx = irkIdx;
+        }
+        Hwi_restore(key);
+    }
+}
+
+void irk_filter_clear(void)
+{
+    unsigned key = Hwi_disable();
+    irk_count = 0;
+    rpa_cache_clear();
+    Hwi_restore(key);
+}
+
+bool irk_filter_add(const uint8_t *irk)
+{
+    unsigned i, key;
+
+    for (i = 0; i < irk_count; i++)
+    {
+        if (!memcmp(irks[i].irk, irk, 16))
+            return true;
+    }
+
+    if (irk_count >= IRK_FILTER_MAX)
+        return false;
+
+    // slot past the end isn't read by lookups, so no need to lock yet
+    rpa_key_init(irks + irk_count, irk);
+
+    key = Hwi_disable();
+    irk_count++;
+    Hwi_restore(key);
+
+    // previously unresolved RPAs may belong to the new IRK
+    rpa_cache_recheck(irk_count - 1);
+
+    return true;
+}
+
+bool irk_filter_remove(const uint8_t *irk)
+{
+    unsigned i, j, key;
+
+    for (i = 0; i < irk_count; i++)
+    {
+        if (!memcmp(irks[i].irk, irk, 16))
+            break;
+    }
+
+    if (i == irk_count)
+        return false;
+
+    // move last entry into the gap, and fix up cached IRK indices
+    key = Hwi_disable();
+    irk_count--;
+    if (i != irk_count)
+        irks[i] = irks[irk_count];
+    for (j = 0; j < RPA_CACHE_SIZE; j++)
+    {
+        if (rpa_cache[j].irkIdx == i)
+            rpa_cache[j].valid = false;
+        else if (rpa_cache[j].irkIdx == irk_count)
+            rpa_cache[j].irkIdx = i;
+    }
+    Hwi_restore(key);
+
+    return true;
+}
+
+bool mac_filter_active(void)
+{
+    return mac_count || irk_count;
+}
+
+static bool rpa_resolves(const uint8_t *rpa)
+{
+    struct RpaCacheEntry *e = rpa_cache + (mac_hash(rpa) & RPA_CACHE_MASK);
+    unsigned key;
+    int idx;
+
+    if (!rpa_is_rpa(rpa))
+        return false;
+
+    if (e->valid && !memcmp(e->rpa, rpa, 6))
+        return e->irkIdx != RPA_UNRESOLVED;
+
+    idx = rpa_resolve(irks, irk_count, rpa);
+
+    key = Hwi_disable();
+    memcpy(e->rpa, rpa, 6);
+    e->irkIdx = (idx < 0) ? RPA_UNRESOLVED : idx;
+    e->valid = true;
+    Hwi_restore(key);
+
+    return idx >= 0;
+}
+
+bool mac_filter_check(const uint8_t *mac, bool isRandom)
+{
+    if (!mac_filter_active())
+        return true;
+
+    if (mac_count && mac_find(mac) >= 0)
+        return true;
+
+    return irk_count && isRandom && rpa_resolves(mac);
+}
@@ -0,0 +1,37 @@
+/*
+ * Written by Sultan Qasim Khan
+ * Copyright (c) 2020, NCC Group plc
+ * Released as open source under GPLv3
+ */
+
+#ifndef MAC_FILTER_H
+#define MAC_FILTER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// maximum number of entries in each table
+#define MAC_FILTER_MAX 32
+#define IRK_FILTER_MAX 8
+
+/* The filter is active whenever either table has entries. An address passes
+ * if it's in the MAC table, or is an RPA resolving with an IRK in the table.
+ * Table modifications should come from a single thread (ie. CommandTask).
+ */
+
+// return false if table full (add) or entry not found (remove)
+void mac_filter_clear(void);
+bool mac_filter_add(const uint8_t *mac);
+bool mac_filter_remove(const uint8_t *mac);
+
+// IRKs are MSB first
+void irk_filter_clear(void);
+bool irk_filter_add(const uint8_t *irk);
+bool irk_filter_remove(const uint8_t *irk);
+
+bool mac_filter_active(void);
+
+// returns true if address passes filter (always true if filter inactive)
+bool mac_filter_check(const uint8_t *mac, bool isRandom);
+
+#endif
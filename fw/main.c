@@ -19,12 +19,24 @@
 #include "CommandTask.h"
 #include "DelayHopTrigger.h"
 #include "DelayStopTrigger.h"
+#include "rpa_resolver.h"
+#include "ll_crypto.h"
+#include "timebase.h"
 
 int main(void)
 {
     /* Call board init functions. */
     Board_init();
 
+    /* Set up hardware AES for RPA resolution */
+    rpa_resolver_init();
+
+    /* and for LL decryption */
+    ll_crypto_init();
+
+    /* Track radio time wraparound for 64 bit timestamps */
+    timebase_init();
+
     /* Initialize the tasks */
     RadioTask_init();
     PacketTask_init();
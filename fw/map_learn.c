@@ -0,0 +1,104 @@
+/*
+ * Written by Sultan Qasim Khan
+ * Copyright (c) 2020, NCC Group plc
+ * Released as open source under GPLv3
+ */
+
+#include <string.h>
+
+#include "map_learn.h"
+#include "trace.h"
+
+void map_learn_reset(MapLearn *m)
+{
+    memset(m, 0, sizeof(*m));
+}
+
+uint8_t map_learn_channel(const MapLearn *m, uint64_t map, uint8_t unmapped,
+        uint8_t mapped)
+{
+    if (!(map & (1ULL << unmapped)) &&
+            m->chans[unmapped].remapMisses >= MAP_LEARN_PROBE_MISSES)
+        return unmapped;
+    return mapped;
+}
+
+bool map_learn_unproven(const MapLearn *m, uint8_t chan)
+{
+    return m->anyHits && m->chans[chan].hits == 0;
+}
+
+bool map_learn_event(MapLearn *m, uint64_t *map, uint8_t unmapped, uint8_t chan,
+        bool hit, int8_t rssi)
+{
+    ChanStat *s = &m->chans[chan];
+    ChanStat *u = &m->chans[unmapped];
+    uint64_t bit = 1ULL << unmapped;
+
+    if (hit)
+    {
+        m->anyHits = true;
+        if (s->hits < 0xFFFF)
+            s->hits++;
+        // EWMA with weight 1/8, starting from the first sample
+        if (s->hits == 1)
+            s->rssi = rssi * 16;
+        else
+            s->rssi += (rssi * 16 - s->rssi) / 8;
+    } else if (s->misses < 0xFFFF) {
+        s->misses++;
+    }
+
+    // listened for on a remapped channel
+    if (chan != unmapped)
+    {
+        if (hit)
+            u->remapMisses = 0;
+        else if (u->remapMisses < 0xFF)
+            u->remapMisses++;
+        return false;
+    }
+
+    // listened for on the unmapped channel, in the map or probing
+    if (hit)
+    {
+        u->directMisses = 0;
+        u->remapMisses = 0;
+        if (*map & bit)
+            return false;
+        *map |= bit;
+        dtrace1(TRACE_MAP_ADD, unmapped);
+        return true;
+    }
+
+    if (!(*map & bit))
+    {
+        // probe failed, go back to the remapped channel for a while
+        u->remapMisses = 0;
+        return false;
+    }
+
+    // a valid map needs two channels
+    if (++u->directMisses < MAP_LEARN_DROP_MISSES || __builtin_popcountll(*map) <= 2)
+        return false;
+    u->directMisses = 0;
+    *map &= ~bit;
+    dtrace1(TRACE_MAP_DROP, unmapped);
+    return true;
+}
+
+unsigned map_learn_stats(const MapLearn *m, uint8_t *dst)
+{
+    unsigned i;
+
+    for (i = 0; i < 37; i++)
+    {
+        const ChanStat *s = &m->chans[i];
+        memcpy(dst, &s->hits, 2);
+        memcpy(dst + 2, &s->misses, 2);
+        dst[4] = (uint8_t)(int8_t)(s->rssi / 16);
+        dst += 5;
+    }
+
+    return MAP_LEARN_STATS_LEN;
+}
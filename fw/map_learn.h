@@ -0,0 +1,68 @@
+/*
+ * Written by Sultan Qasim Khan
+ * Copyright (c) 2020, NCC Group plc
+ * Released as open source under GPLv3
+ */
+
+#ifndef MAP_LEARN_H
+#define MAP_LEARN_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Per data channel statistics for a followed connection, used to correct
+ * its channel map when ours has diverged (eg. a missed LL_CHANNEL_MAP_IND).
+ *
+ * Both hopping algorithms pick an unmapped channel for each event, used as
+ * is if it's in the map, or else remapped to a used channel. So:
+ * - repeated misses listening on an unmapped channel in our map mean the
+ *   connection no longer uses it, and it's dropped from the map
+ * - repeated misses listening on the remapped channel for an unmapped
+ *   channel outside our map mean the remapping may be wrong, so the next
+ *   event on it is listened for on the unmapped channel itself, which is
+ *   added to the map if the connection turns up there
+ */
+
+// consecutive misses on an unmapped channel in the map before dropping it
+#define MAP_LEARN_DROP_MISSES 3
+
+// consecutive misses on a remapped channel before trying the unmapped one
+#define MAP_LEARN_PROBE_MISSES 2
+
+typedef struct
+{
+    uint16_t hits;          // events listened for on this channel with packets
+    uint16_t misses;        // and without
+    int16_t rssi;           // mean RSSI of hits, 4 fractional bits
+    uint8_t directMisses;   // as an unmapped channel, listened for directly
+    uint8_t remapMisses;    // as an unmapped channel, listened for remapped
+} ChanStat;
+
+typedef struct
+{
+    ChanStat chans[37];
+    bool anyHits;
+} MapLearn;
+
+void map_learn_reset(MapLearn *m);
+
+// channel to listen on for an event whose unmapped channel maps to mapped
+uint8_t map_learn_channel(const MapLearn *m, uint64_t map, uint8_t unmapped,
+        uint8_t mapped);
+
+// true if chan has never had packets, but other channels have
+bool map_learn_unproven(const MapLearn *m, uint8_t chan);
+
+// record the outcome of listening on chan, returns true if map was changed
+bool map_learn_event(MapLearn *m, uint64_t *map, uint8_t unmapped, uint8_t chan,
+        bool hit, int8_t rssi);
+
+/* Stats for each data channel, 5 bytes each:
+ *   Bytes 0-1:     hits
+ *   Bytes 2-3:     misses
+ *   Byte 4:        mean RSSI of hits (signed)
+ */
+#define MAP_LEARN_STATS_LEN (37 * 5)
+unsigned map_learn_stats(const MapLearn *m, uint8_t *dst);
+
+#endif
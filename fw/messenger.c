@@ -5,13 +5,49 @@
  */
 
 #include <stdbool.h>
+#include <string.h>
 #include <ti/drivers/UART.h>
+#include <ti/sysbios/BIOS.h>
+#include <ti/sysbios/knl/Semaphore.h>
+#include <ti/sysbios/hal/Hwi.h>
 #include "ti_drivers_config.h"
 #include "messenger.h"
 #include "base64.h"
+#include "cobs.h"
+#include "stats.h"
 
 UART_Handle uart;
 
+// base64 output is larger than COBS output, so size TX buffers for it
+// 2 bytes for resync CRLF, 2 bytes for CRLF
+#define B64_ENC_MAX(len) ((((len) + 2) / 3) * 4)
+#define TX_BUF_SIZE (B64_ENC_MAX(MESSAGE_MAX) + 4)
+
+// while one buffer is on the wire, the others can be filled
+#define NUM_TX_BUFS 3
+
+static uint8_t tx_bufs[NUM_TX_BUFS][TX_BUF_SIZE];
+static size_t tx_lens[NUM_TX_BUFS];
+static unsigned tx_fill_idx = 0;            // only touched by sender
+static volatile unsigned tx_send_idx = 0;   // buffer on the wire
+static volatile unsigned tx_queued = 0;     // filled buffers not yet sent
+static Semaphore_Handle txFreeSem;          // counts free buffers
+
+static void uart_write_cb(UART_Handle h, void *buf, size_t count);
+
+// received bytes are read from the UART in chunks and parsed from here
+#define RX_BUF_SIZE 256
+static uint8_t rx_buf[RX_BUF_SIZE];
+static size_t rx_pos = 0;
+static size_t rx_len = 0;
+
+// framing used for received commands, and requested for sent messages
+static volatile uint8_t rx_framing = MESSENGER_FRAMING_BASE64;
+static volatile uint8_t tx_framing = MESSENGER_FRAMING_BASE64;
+
+// framing of the last message actually sent (only touched by sender)
+static uint8_t sent_framing = MESSENGER_FRAMING_BASE64;
+
 int messenger_init()
 {
     UART_init();
@@ -19,37 +55,146 @@ int messenger_init()
     UART_Params_init(&uartParams);
     uartParams.baudRate = 2000000;
     uartParams.readMode = UART_MODE_BLOCKING;
-    uartParams.writeMode = UART_MODE_BLOCKING;
+    uartParams.writeMode = UART_MODE_CALLBACK;
+    uartParams.writeCallback = uart_write_cb;
     uartParams.writeDataMode = UART_DATA_BINARY;
     uartParams.readDataMode = UART_DATA_BINARY;
-    uartParams.readReturnMode = UART_RETURN_FULL;
+    uartParams.readReturnMode = UART_RETURN_PARTIAL;
     uartParams.readEcho = UART_ECHO_OFF;
     uart = UART_open(CONFIG_UART_0, &uartParams);
     if (!uart)
         return -1;
 
+    txFreeSem = Semaphore_create(NUM_TX_BUFS, NULL, NULL);
+
     return 0;
 }
 
-// keep doing small inefficient reads till we hit a CRLF
-// sorry, gotos appear to be the most elegant and correct approach here
+// blocks till at least one byte is available in rx_buf
+static void _rx_fill()
+{
+    int ret;
+
+    // partial return mode hands back whatever arrived before the line idled
+    do {
+        ret = UART_read(uart, rx_buf, sizeof(rx_buf));
+    } while (ret <= 0);
+
+    rx_pos = 0;
+    rx_len = ret;
+}
+
+static void _rx_read(uint8_t *dst, size_t len)
+{
+    size_t n;
+
+    while (len)
+    {
+        if (rx_pos == rx_len)
+            _rx_fill();
+        n = rx_len - rx_pos;
+        if (n > len)
+            n = len;
+        memcpy(dst, rx_buf + rx_pos, n);
+        rx_pos += n;
+        dst += n;
+        len -= n;
+    }
+}
+
+// discard everything up to and including the next CRLF
 static void _recv_crlf()
 {
-    bool done = false;
-    uint8_t b = 0;
+    uint8_t prev = 0;
+    uint8_t *lf;
+    size_t idx;
 
-    while (!done)
+    while (1)
     {
-        UART_read(uart, &b, 1);
-        while (b == '\r')
+        if (rx_pos == rx_len)
+            _rx_fill();
+
+        lf = memchr(rx_buf + rx_pos, '\n', rx_len - rx_pos);
+        if (!lf)
         {
-            UART_read(uart, &b, 1);
-            if (b == '\n')
-                done = true;
+            // CR may be the last byte of this chunk
+            prev = rx_buf[rx_len - 1];
+            rx_pos = rx_len;
+            continue;
         }
+
+        idx = lf - rx_buf;
+        if (idx > rx_pos)
+            prev = rx_buf[idx - 1];
+        rx_pos = idx + 1;
+        if (prev == '\r')
+            return;
+        prev = '\n';
     }
 }
 
+// COBS frame is followed by a zero delimiter, payload ends with CRC16
+static int _recv_cobs(uint8_t *dst_buf)
+{
+    uint32_t enc_len = 0;
+    uint32_t dec_len;
+    bool overflow = false;
+    int dec_stat;
+    uint16_t crc;
+    uint8_t *delim;
+    size_t n, copy;
+
+    // 2 bytes for CRC
+    static uint8_t cobs_buf[COBS_ENC_MAX(MESSAGE_MAX + 2)];
+
+    // copy buffered chunks up to the zero delimiter
+    while (1)
+    {
+        if (rx_pos == rx_len)
+            _rx_fill();
+
+        delim = memchr(rx_buf + rx_pos, 0, rx_len - rx_pos);
+        n = (delim ? (size_t)(delim - rx_buf) : rx_len) - rx_pos;
+        copy = n;
+        if (copy > sizeof(cobs_buf) - enc_len)
+        {
+            copy = sizeof(cobs_buf) - enc_len;
+            overflow = true;
+        }
+        memcpy(cobs_buf + enc_len, rx_buf + rx_pos, copy);
+        enc_len += copy;
+        rx_pos += n;
+
+        if (delim)
+        {
+            rx_pos++; // consume delimiter
+            break;
+        }
+    }
+
+    if (overflow)
+        return -2;
+
+    // empty frames are used for resynchronization
+    if (enc_len == 0)
+        return 0;
+
+    // decoding in place is safe, since output never outruns input
+    dec_len = cobs_decode(cobs_buf, cobs_buf, enc_len, &dec_stat);
+    if (dec_stat < 0)
+        return -1;
+    if (dec_len < 2 || dec_len - 2 > MESSAGE_MAX)
+        return -2;
+
+    dec_len -= 2;
+    crc = cobs_buf[dec_len] | (cobs_buf[dec_len + 1] << 8);
+    if (crc != crc16_ccitt(cobs_buf, dec_len))
+        return -3;
+
+    memcpy(dst_buf, cobs_buf, dec_len);
+    return dec_len;
+}
+
 // this function is NOT reentrant!
 int messenger_recv(uint8_t *dst_buf)
 {
@@ -59,9 +204,12 @@ int messenger_recv(uint8_t *dst_buf)
     // 2 bytes for CRLF
     static uint8_t b64_buf[((MESSAGE_MAX * 4) / 3) + 2];
 
+    if (rx_framing == MESSENGER_FRAMING_COBS)
+        return _recv_cobs(dst_buf);
+
     // first byte of b64 decoded data indicates number of 4 byte chunks
     // read 2 extra bytes for CRLF
-    UART_read(uart, b64_buf, 6);
+    _rx_read(b64_buf, 6);
 
     dec_len = base64_decode(dst_buf, b64_buf, 4, &dec_stat);
     if (dec_stat < 0)
@@ -80,7 +228,7 @@ int messenger_recv(uint8_t *dst_buf)
 
     if (word_cnt > 1)
     {
-        UART_read(uart, b64_buf + 6, (word_cnt - 1) << 2);
+        _rx_read(b64_buf + 6, (word_cnt - 1) << 2);
     }
 
     // make sure CRLF terminator is present
@@ -105,26 +253,82 @@ int messenger_recv(uint8_t *dst_buf)
     return dec_len;
 }
 
+// called in interrupt context once a buffer has gone out
+static void uart_write_cb(UART_Handle h, void *buf, size_t count)
+{
+    stats.uartBytes += count;
+    tx_send_idx = (tx_send_idx + 1) % NUM_TX_BUFS;
+    tx_queued--;
+
+    // keep the wire busy if more buffers were filled meanwhile
+    if (tx_queued)
+        UART_write(uart, tx_bufs[tx_send_idx], tx_lens[tx_send_idx]);
+
+    Semaphore_post(txFreeSem);
+}
+
+// only one task may send messages
+// returns once the message is encoded and queued, not once it's sent
 void messenger_send(const uint8_t *src_buf, unsigned src_len)
 {
-    uint32_t enc_len, bytes_remaining, bytes_sent;
+    uint32_t enc_len, pre_len;
+    uint8_t framing = tx_framing;
+    uint8_t *tx_buf;
+    unsigned key;
+    bool start;
 
-    // 2 bytes for CRLF
-    static uint8_t b64_buf[((MESSAGE_MAX * 4) / 3) + 2];
+    // 2 bytes for CRC
+    static uint8_t raw_buf[MESSAGE_MAX + 2];
+
+    if (src_len > MESSAGE_MAX)
+        return;
+
+    // wait for a free buffer to encode into
+    Semaphore_pend(txFreeSem, BIOS_WAIT_FOREVER);
+    tx_buf = tx_bufs[tx_fill_idx];
 
-    enc_len = base64_encode(b64_buf, src_buf, src_len);
-    b64_buf[enc_len] = '\r';
-    b64_buf[enc_len + 1] = '\n';
+    /* On a framing change, first emit the new mode's terminator by itself,
+     * so the host can discard anything left over from the old mode.
+     */
+    pre_len = (framing != sent_framing) ? 1 : 0;
+    sent_framing = framing;
 
-    bytes_remaining = enc_len + 2; // two byte CRLF
-    bytes_sent = 0;
-    while (bytes_remaining)
+    if (framing == MESSENGER_FRAMING_COBS)
     {
-        // sometimes, even in blocking mode, UART_write returns before the
-        // complete buffer was sent, due to some queues being full
-        int sent = UART_write(uart, b64_buf + bytes_sent, bytes_remaining);
-        if (sent < 0) return; // error, shouldn't happen
-        bytes_remaining -= sent;
-        bytes_sent += sent;
+        uint16_t crc = crc16_ccitt(src_buf, src_len);
+        memcpy(raw_buf, src_buf, src_len);
+        raw_buf[src_len] = crc & 0xFF;
+        raw_buf[src_len + 1] = crc >> 8;
+
+        // 1 byte for resync delimiter, 1 byte for delimiter
+        tx_buf[0] = 0;
+        enc_len = cobs_encode(tx_buf + pre_len, raw_buf, src_len + 2);
+        tx_buf[pre_len + enc_len] = 0;
+        tx_lens[tx_fill_idx] = pre_len + enc_len + 1;
+    } else {
+        pre_len <<= 1;
+        tx_buf[0] = '\r';
+        tx_buf[1] = '\n';
+        enc_len = base64_encode(tx_buf + pre_len, src_buf, src_len);
+        tx_buf[pre_len + enc_len] = '\r';
+        tx_buf[pre_len + enc_len + 1] = '\n';
+        tx_lens[tx_fill_idx] = pre_len + enc_len + 2; // two byte CRLF
     }
+
+    tx_fill_idx = (tx_fill_idx + 1) % NUM_TX_BUFS;
+
+    // start transmission ourselves if the write callback chain is idle
+    key = Hwi_disable();
+    start = (tx_queued == 0);
+    tx_queued++;
+    Hwi_restore(key);
+
+    if (start)
+        UART_write(uart, tx_bufs[tx_send_idx], tx_lens[tx_send_idx]);
+}
+
+void messenger_set_framing(uint8_t framing)
+{
+    rx_framing = framing;
+    tx_framing = framing;
 }
@@ -7,17 +7,34 @@
 #ifndef MESSENGER_H
 #define MESSENGER_H
 
-// 300 byte message length limit
-#define MESSAGE_MAX 300
+// 1024 byte message length limit (big enough for several frames in a batch)
+#define MESSAGE_MAX 1024
 
 // message types sent by sniffer
 #define MESSAGE_BLEFRAME 0x10
 #define MESSAGE_DEBUG 0x11
 #define MESSAGE_MARKER 0x12
 #define MESSAGE_STATE 0x13
+#define MESSAGE_BATCH 0x14
+#define MESSAGE_STATS 0x15
+#define MESSAGE_TXSTATUS 0x16
+#define MESSAGE_CMDACK 0x17
+#define MESSAGE_BLEFRAMEX 0x18
+#define MESSAGE_SYNC 0x19
+#define MESSAGE_ADVSUMMARY 0x1A
+#define MESSAGE_TRACE 0x1B
+#define MESSAGE_FLUSHACK 0x1C
+#define MESSAGE_BLEFRAMEC 0x1D
+
+// UART framing modes (base64 is the default after reset)
+#define MESSENGER_FRAMING_BASE64 0
+#define MESSENGER_FRAMING_COBS 1
 
 int messenger_init();
 int messenger_recv(uint8_t *dst_buf);
 void messenger_send(const uint8_t *src_buf, unsigned src_len);
 
+// takes effect for the next command received and the next message sent
+void messenger_set_framing(uint8_t framing);
+
 #endif
@@ -0,0 +1,209 @@
+/*
+ * Written by Sultan Qasim Khan
+ * Copyright (c) 2020, NCC Group plc
+ * Released as open source under GPLv3
+ */
+
+#include <string.h>
+#include <xdc/std.h>
+#include <ti/sysbios/hal/Hwi.h>
+
+#include "pdu_filter.h"
+#include "RadioTask.h"
+
+typedef struct
+{
+    uint8_t adType;
+    uint8_t offset;
+    uint8_t len;
+    uint8_t value[PDU_FILTER_VALUE_MAX];
+} AdPattern;
+
+typedef struct
+{
+    uint16_t pduTypes;
+    uint8_t minLen;
+    uint8_t maxLen;
+    uint8_t chanMask;
+    uint8_t phyMask;
+    uint8_t numAd;
+    AdPattern ad[PDU_FILTER_AD_MAX];
+} PduRule;
+
+/* Checks run in RF callback context. New rules are filled in past the end
+ * of the table before the count is bumped, so readers never see a partly
+ * written rule.
+ */
+static PduRule rules[PDU_FILTER_MAX];
+static volatile unsigned rule_count = 0;
+
+void pdu_filter_clear(void)
+{
+    rule_count = 0;
+}
+
+bool pdu_filter_add(const uint8_t *rule, unsigned len)
+{
+    PduRule *r;
+    unsigned i, pos;
+    uint32_t key;
+
+    if (rule_count >= PDU_FILTER_MAX || len < 7)
+        return false;
+
+    r = &rules[rule_count];
+    memcpy(&r->pduTypes, rule, 2);
+    r->minLen = rule[2];
+    r->maxLen = rule[3];
+    r->chanMask = rule[4];
+    r->phyMask = rule[5];
+    r->numAd = rule[6];
+
+    if (r->numAd > PDU_FILTER_AD_MAX || r->minLen > r->maxLen)
+        return false;
+
+    pos = 7;
+    for (i = 0; i < r->numAd; i++)
+    {
+        AdPattern *p = &r->ad[i];
+        if (pos + 3 > len)
+            return false;
+        p->adType = rule[pos];
+        p->offset = rule[pos + 1];
+        p->len = rule[pos + 2];
+        pos += 3;
+        if (p->len > PDU_FILTER_VALUE_MAX || pos + p->len > len)
+            return false;
+        memcpy(p->value, rule + pos, p->len);
+        pos += p->len;
+    }
+
+    if (pos != len)
+        return false;
+
+    key = Hwi_disable();
+    rule_count++;
+    Hwi_restore(key);
+
+    return true;
+}
+
+bool pdu_filter_active(void)
+{
+    return rule_count != 0;
+}
+
+static bool patternMatch(const AdPattern *p, const uint8_t *data, unsigned len)
+{
+    unsigned i;
+
+    if (p->offset != PDUFILT_AD_ANYWHERE)
+        return p->offset + p->len <= len &&
+            memcmp(data + p->offset, p->value, p->len) == 0;
+
+    if (p->len == 0)
+        return true;
+    for (i = 0; i + p->len <= len; i += p->len)
+    {
+        if (memcmp(data + i, p->value, p->len) == 0)
+            return true;
+    }
+    return false;
+}
+
+// look for an AD structure satisfying the pattern
+static bool adMatch(const AdPattern *p, const uint8_t *ad, unsigned adLen)
+{
+    unsigned i = 0;
+
+    // each AD structure is length (of type and data), type, data
+    while (i + 2 <= adLen)
+    {
+        uint8_t l = ad[i];
+        if (l == 0 || i + 1 + l > adLen)
+            break;
+        if (ad[i + 1] == p->adType && patternMatch(p, ad + i + 2, l - 1))
+            return true;
+        i += l + 1;
+    }
+
+    return false;
+}
+
+static bool ruleMatch(const PduRule *r, const BLE_Frame *frame,
+        uint8_t pduType, uint8_t chanBit, const uint8_t *ad, unsigned adLen)
+{
+    uint8_t advLen = frame->pData[1];
+    unsigned i;
+
+    if (r->pduTypes && !(r->pduTypes & (1 << pduType)))
+        return false;
+    if (advLen < r->minLen || advLen > r->maxLen)
+        return false;
+    if (r->chanMask && !(r->chanMask & chanBit))
+        return false;
+    if (r->phyMask && !(r->phyMask & (1 << frame->phy)))
+        return false;
+
+    for (i = 0; i < r->numAd; i++)
+    {
+        if (!adMatch(&r->ad[i], ad, adLen))
+            return false;
+    }
+
+    return true;
+}
+
+bool pdu_filter_check(const BLE_Frame *frame)
+{
+    unsigned count = rule_count;
+    const uint8_t *ad = NULL;
+    unsigned adLen = 0;
+    uint8_t pduType, advLen, chanBit;
+    unsigned i;
+
+    if (!count)
+        return true;
+
+    // make sure it has a coherent header at least
+    if (frame->length < 2 || frame->length - 2 < frame->pData[1])
+        return false;
+
+    pduType = frame->pData[0] & 0xF;
+    advLen = frame->pData[1];
+    chanBit = frame->channel >= 37 ? 1 << (frame->channel - 37) : PDUFILT_CHAN_AUX;
+
+    // locate advertising data, if the PDU type has any
+    switch (pduType)
+    {
+    case ADV_IND:
+    case ADV_NONCONN_IND:
+    case ADV_SCAN_IND:
+    case SCAN_RSP:
+        // after AdvA
+        if (advLen >= 6)
+        {
+            ad = frame->pData + 8;
+            adLen = advLen - 6;
+        }
+        break;
+    case ADV_EXT_IND:
+        // after extended header (common extended advertising payload)
+        if (advLen >= 1 && 1 + (frame->pData[2] & 0x3F) <= advLen)
+        {
+            ad = frame->pData + 3 + (frame->pData[2] & 0x3F);
+            adLen = advLen - 1 - (frame->pData[2] & 0x3F);
+        }
+        break;
+    default:
+        break;
+    }
+
+    for (i = 0; i < count; i++)
+    {
+        if (ruleMatch(&rules[i], frame, pduType, chanBit, ad, adLen))
+            return true;
+    }
+
+    return false;
+}
@@ -0,0 +1,58 @@
+/*
+ * Written by Sultan Qasim Khan
+ * Copyright (c) 2020, NCC Group plc
+ * Released as open source under GPLv3
+ */
+
+#ifndef PDU_FILTER_H
+#define PDU_FILTER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "RadioWrapper.h"
+
+// maximum number of rules, AD patterns per rule, and pattern value length
+#define PDU_FILTER_MAX 8
+#define PDU_FILTER_AD_MAX 4
+#define PDU_FILTER_VALUE_MAX 16
+
+// bits of rule channel mask
+#define PDUFILT_CHAN_37     0x01
+#define PDUFILT_CHAN_38     0x02
+#define PDUFILT_CHAN_39     0x04
+#define PDUFILT_CHAN_AUX    0x08 // secondary advertising channels
+
+// AD pattern offset to match value anywhere in the AD data, in steps of
+// the value length (eg. a UUID in a list of service UUIDs)
+#define PDUFILT_AD_ANYWHERE 0xFF
+
+/* Rule format (all conditions must match, zero masks match anything):
+ * Bytes 0-1:   PDU type mask (little endian, bit n for PDU type n)
+ * Byte 2:      minimum advertising payload length
+ * Byte 3:      maximum advertising payload length
+ * Byte 4:      channel mask (PDUFILT_CHAN_*)
+ * Byte 5:      PHY mask (bit n for PHY_Mode n)
+ * Byte 6:      number of AD patterns
+ * Then for each AD pattern:
+ *   Byte 0:    AD type
+ *   Byte 1:    offset into AD data, or PDUFILT_AD_ANYWHERE
+ *   Byte 2:    value length (0 to just require the AD type)
+ *   Bytes 3+:  value
+ *
+ * The filter is active whenever there are rules. An advertising frame
+ * passes if it matches any rule. Rules should be changed from a single
+ * thread (ie. CommandTask).
+ */
+
+void pdu_filter_clear(void);
+
+// returns false if the rule is malformed or the table is full
+bool pdu_filter_add(const uint8_t *rule, unsigned len);
+
+bool pdu_filter_active(void);
+
+// returns true if advertising frame passes filter (always if inactive)
+bool pdu_filter_check(const BLE_Frame *frame);
+
+#endif
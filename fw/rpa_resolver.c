@@ -9,10 +9,41 @@
 #include <rpa_resolver.h>
 #include <sw_aes128.h>
 
-static uint8_t last_irk[16] = {0};
-static uint8_t last_roundKeys[176] = {0};
-static uint32_t last_prand;
-static uint32_t last_hash;
+#include <ti/drivers/AESECB.h>
+#include <ti/drivers/cryptoutils/cryptokey/CryptoKeyPlaintext.h>
+
+#include "ti_drivers_config.h"
+
+// max RPAs encrypted per hardware operation (limits stack usage)
+#define HW_BATCH_MAX 4
+
+static AESECB_Handle aesHandle = NULL;
+
+void rpa_resolver_init(void)
+{
+    AESECB_Params params;
+
+    AESECB_init();
+    AESECB_Params_init(&params);
+
+    // polling is usable from RF callback (Swi) context, and we never wait
+    // for the crypto resource to become available
+    params.returnBehavior = AESECB_RETURN_BEHAVIOR_POLLING;
+    params.timeout = 0;
+
+    aesHandle = AESECB_open(CONFIG_AESECB_0, &params);
+}
+
+void rpa_key_init(RPA_Key *key, const void *irk)
+{
+    memcpy(key->irk, irk, 16);
+    aes_key_schedule_128(irk, key->roundKeys);
+}
+
+bool rpa_is_rpa(const void *addr)
+{
+    return (((const uint8_t *)addr)[5] & 0xC0) == 0x40;
+}
 
 /* On Android, keys can be found in /data/misc/bluedroid/bt_config.conf
  * The LE_LOCAL_KEY_IRK is the device's own IRK (LSB first)
@@ -34,56 +65,91 @@ static uint32_t last_hash;
  * Computed hash matches hash portion of RPA, so we have a match
  */
 
-static uint32_t BLE_ah(const void *irk, uint32_t prand)
+// r_ (input to AES) is big endian, three least significant bytes are prand
+static void load_prand(uint8_t *block, const uint8_t *rpa)
 {
-    uint8_t r_[16] = {0};
-    uint8_t res[16];
-
-    // r_ (input to AES) is big endian
-    // three least significant bytes are prand
-    r_[15] = prand & 0xFF;
-    r_[14] = (prand & 0xFF00) >> 8;
-    r_[13] = (prand & 0xFF0000) >> 16;
-
-    // I use software AES to avoid changing global state of hardware and to
-    // minimize the overhead of setting up hardware for one-off operations
-    if (memcmp(irk, last_irk, 16) != 0)
-    {
-        aes_key_schedule_128(irk, last_roundKeys);
-        memcpy(last_irk, irk, 16);
-        last_prand = 0xFFFFFFFF; // invalidate cached hash
-    } else if (prand == last_prand) {
-        return last_hash;
-    }
-
-    aes_encrypt_128(last_roundKeys, r_, res);
+    memset(block, 0, 13);
+    block[15] = rpa[3];
+    block[14] = rpa[4];
+    block[13] = rpa[5];
+}
 
-    // hash is 3 LSB of the big endian AES result
-    return res[15] | (res[14] << 8) | (res[13] << 16);
+// hash is 3 LSB of the big endian AES result
+static bool hash_ok(const uint8_t *res, const uint8_t *rpa)
+{
+    return res[15] == rpa[0] && res[14] == rpa[1] && res[13] == rpa[2];
 }
 
-// returns true on RPA matching IRK
-bool rpa_match(const void *irk, const void *rpa)
+// encrypt n prand blocks in a single hardware operation
+static bool hw_encrypt(const RPA_Key *key, uint8_t (*in)[16], uint8_t (*out)[16],
+        unsigned n)
 {
-    bool valid;
-    const uint8_t *rpa8 = (const uint8_t *)rpa;
-    uint32_t hash = 0;
-    uint32_t prand = 0;
+    CryptoKey cryptoKey;
+    AESECB_Operation op;
 
-    // make sure it's an RPA
-    if ((rpa8[5] & 0xC0) != 0x40)
+    if (aesHandle == NULL)
         return false;
 
-    memcpy(&hash, rpa8, 3);
-    memcpy(&prand, rpa8 + 3, 3);
+    CryptoKeyPlaintext_initKey(&cryptoKey, (uint8_t *)key->irk, 16);
+    AESECB_Operation_init(&op);
+    op.key = &cryptoKey;
+    op.input = (uint8_t *)in;
+    op.output = (uint8_t *)out;
+    op.inputLength = n * 16;
+
+    return AESECB_oneStepEncrypt(aesHandle, &op) == AESECB_STATUS_SUCCESS;
+}
+
+uint32_t rpa_match_batch(const RPA_Key *key, const uint8_t * const *rpas,
+        unsigned n)
+{
+    uint8_t in[HW_BATCH_MAX][16];
+    uint8_t out[HW_BATCH_MAX][16];
+    uint32_t matches = 0;
+    unsigned base, i, chunk;
+
+    if (n > RPA_BATCH_MAX)
+        n = RPA_BATCH_MAX;
+
+    for (base = 0; base < n; base += chunk)
+    {
+        chunk = n - base;
+        if (chunk > HW_BATCH_MAX)
+            chunk = HW_BATCH_MAX;
+
+        for (i = 0; i < chunk; i++)
+            load_prand(in[i], rpas[base + i]);
+
+        // fall back to software if the hardware is unavailable or busy
+        if (!hw_encrypt(key, in, out, chunk))
+        {
+            for (i = 0; i < chunk; i++)
+                aes_encrypt_128(key->roundKeys, in[i], out[i]);
+        }
+
+        for (i = 0; i < chunk; i++)
+        {
+            if (rpa_is_rpa(rpas[base + i]) && hash_ok(out[i], rpas[base + i]))
+                matches |= 1UL << (base + i);
+        }
+    }
+
+    return matches;
+}
+
+int rpa_resolve(const RPA_Key *keys, unsigned numKeys, const void *rpa)
+{
+    const uint8_t *rpa8 = (const uint8_t *)rpa;
+    unsigned i;
 
-    valid = (hash == BLE_ah(irk, prand));
+    if (!rpa_is_rpa(rpa))
+        return -1;
 
-    if (valid)
+    for (i = 0; i < numKeys; i++)
     {
-        last_prand = prand;
-        last_hash = hash;
+        if (rpa_match_batch(keys + i, &rpa8, 1))
+            return i;
     }
 
-    return valid;
+    return -1;
 }
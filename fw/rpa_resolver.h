@@ -7,9 +7,35 @@
 #ifndef RPA_RESOLVER_H
 #define RPA_RESOLVER_H
 
+#include <stdint.h>
 #include <stdbool.h>
+#include <sw_aes128.h>
 
-// returns true on RPA matching IRK
-bool rpa_match(const void *irk, const void *rpa);
+// max RPAs resolved by a single rpa_match_batch call
+#define RPA_BATCH_MAX 32
+
+// IRK (MSB first) with round keys for software fallback
+typedef struct
+{
+    uint8_t irk[16];
+    uint8_t roundKeys[AES_ROUND_KEY_SIZE];
+} RPA_Key;
+
+// open the AES hardware; software AES is used if this isn't called
+void rpa_resolver_init(void);
+
+// prepare key for resolution
+void rpa_key_init(RPA_Key *key, const void *irk);
+
+// returns true if random address is resolvable
+bool rpa_is_rpa(const void *addr);
+
+// resolve up to RPA_BATCH_MAX RPAs against one key
+// bit i of the result is set if rpas[i] matches
+uint32_t rpa_match_batch(const RPA_Key *key, const uint8_t * const *rpas,
+        unsigned n);
+
+// returns index of first key matching rpa, or -1 if none match
+int rpa_resolve(const RPA_Key *keys, unsigned numKeys, const void *rpa);
 
 #endif
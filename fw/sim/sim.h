@@ -0,0 +1,46 @@
+/*
+ * Written by Sultan Qasim Khan
+ * Copyright (c) 2020, NCC Group plc
+ * Released as open source under GPLv3
+ */
+
+#ifndef SIM_H
+#define SIM_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <RadioWrapper.h>
+
+/* A frame sent over the simulated air, as recorded in a capture */
+typedef struct
+{
+    uint64_t time;      // start of packet, radio ticks
+    uint32_t aa;
+    uint8_t chan;
+    PHY_Mode phy;
+    int8_t rssi;
+    uint16_t len;       // PDU length, including the 2 byte header
+    uint8_t *pdu;
+    uint8_t crc[3];
+    bool captured;      // set once handed to firmware
+} SimFrame;
+
+/* Frames to replay, sorted by time (sim_radio.c) */
+void sim_radio_setAir(SimFrame *frames, unsigned count);
+
+/* Frames and messages the firmware sent to the host (sim_host.c) */
+typedef struct
+{
+    uint32_t frames;    // MESSAGE_BLEFRAME(X), including batched ones
+    uint32_t advFrames; // of those, on primary advertising channels
+    uint32_t messages;  // all UART messages
+    uint32_t bytes;     // before framing
+} SimHostCounters;
+
+extern SimHostCounters sim_host;
+
+/* Print firmware debug and state messages to stderr */
+extern bool sim_verbose;
+
+#endif
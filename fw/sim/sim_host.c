@@ -0,0 +1,289 @@
+/*
+ * Written by Sultan Qasim Khan
+ * Copyright (c) 2020, NCC Group plc
+ * Released as open source under GPLv3
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <xdc/runtime/System.h>
+#include <ti/drivers/PIN.h>
+#include <ti/drivers/pin/PINCC26XX.h>
+#include <ti/drivers/AESECB.h>
+#include <ti/drivers/AESCCM.h>
+#include <ti/drivers/cryptoutils/cryptokey/CryptoKeyPlaintext.h>
+
+#include <messenger.h>
+#include <sw_aes128.h>
+
+#include "sim.h"
+
+/* Host side of the simulation: the messages the firmware would send over
+ * UART are counted (and printed if verbose) instead, and the drivers it
+ * uses are stood in for. AES is done in software.
+ */
+
+SimHostCounters sim_host;
+bool sim_verbose = false;
+
+static const char *stateNames[] = {
+    "STATIC", "ADVERT_SEEK", "ADVERT_HOP", "DATA", "PAUSED", "INITIATING",
+    "MASTER", "SLAVE", "ADVERTISING", "SCANNING", "ACQUIRING"
+};
+
+// length of a MESSAGE_BLEFRAMEX header, from its FRAMEFMT flags
+static unsigned framexHeaderLen(uint8_t flags)
+{
+    unsigned len = 2 + 2 + 2; // type, flags, length, rssi and channel
+
+    len += flags & 0x01 ? 8 : 4; // FRAMEFMT_TS64
+    if (flags & 0x02) len += 2; // FRAMEFMT_ORIGLEN
+    if (flags & 0x04) len += 4; // FRAMEFMT_AA
+    if (flags & 0x10) len += 2; // FRAMEFMT_SEQ
+    return len;
+}
+
+static void countFrame(uint8_t chanPhy)
+{
+    sim_host.frames++;
+    if ((chanPhy & 0x3F) >= 37)
+        sim_host.advFrames++;
+}
+
+static void handleMessage(const uint8_t *msg, unsigned len)
+{
+    if (len < 1)
+        return;
+
+    switch (msg[0])
+    {
+    case MESSAGE_BLEFRAME:
+        if (len >= 9)
+            countFrame(msg[8]);
+        break;
+    case MESSAGE_BLEFRAMEX:
+        if (len >= 2 && len >= framexHeaderLen(msg[1]))
+            countFrame(msg[framexHeaderLen(msg[1]) - 1]);
+        break;
+    case MESSAGE_BLEFRAMEC:
+        if (len >= 2)
+            countFrame(msg[1]);
+        break;
+    case MESSAGE_BATCH:
+    {
+        unsigned pos = 1;
+
+        while (pos + 2 <= len)
+        {
+            unsigned rlen = msg[pos] | (msg[pos + 1] << 8);
+
+            if (pos + 2 + rlen > len)
+                break;
+            handleMessage(msg + pos + 2, rlen);
+            pos += 2 + rlen;
+        }
+        break;
+    }
+    case MESSAGE_DEBUG:
+        if (sim_verbose)
+            fprintf(stderr, "debug: %.*s\n", (int)len - 1, msg + 1);
+        break;
+    case MESSAGE_STATE:
+        if (sim_verbose && len >= 2)
+            fprintf(stderr, "state: %s\n", msg[1] < sizeof(stateNames) / sizeof(stateNames[0]) ?
+                    stateNames[msg[1]] : "?");
+        break;
+    default:
+        break;
+    }
+}
+
+int messenger_init()
+{
+    return 0;
+}
+
+// no commands come from the host, configuration is done by sim_main.c
+int messenger_recv(uint8_t *dst_buf)
+{
+    return -1;
+}
+
+void messenger_send(const uint8_t *src_buf, unsigned src_len)
+{
+    sim_host.messages++;
+    sim_host.bytes += src_len;
+    handleMessage(src_buf, src_len);
+}
+
+void messenger_set_framing(uint8_t framing)
+{
+}
+
+void System_abort(const char *str)
+{
+    fprintf(stderr, "abort: %s", str);
+    exit(1);
+}
+
+/* ---------- pins ---------- */
+
+PIN_Handle PIN_open(PIN_State *state, const PIN_Config *pinList)
+{
+    return state;
+}
+
+int PIN_setOutputValue(PIN_Handle handle, PIN_Id pinId, uint32_t val)
+{
+    return 0;
+}
+
+void PIN_close(PIN_Handle handle)
+{
+}
+
+int PINCC26XX_setMux(PIN_Handle handle, PIN_Id pinId, int32_t nMux)
+{
+    return 0;
+}
+
+/* ---------- crypto ---------- */
+
+int_fast16_t CryptoKeyPlaintext_initKey(CryptoKey *keyHandle, uint8_t *key,
+        size_t keyLength)
+{
+    keyHandle->keyMaterial = key;
+    keyHandle->keyLength = keyLength;
+    return 0;
+}
+
+void AESECB_init(void)
+{
+}
+
+void AESECB_Params_init(AESECB_Params *params)
+{
+    params->returnBehavior = AESECB_RETURN_BEHAVIOR_BLOCKING;
+}
+
+AESECB_Handle AESECB_open(unsigned index, const AESECB_Params *params)
+{
+    static int handle;
+    return &handle;
+}
+
+void AESECB_Operation_init(AESECB_Operation *op)
+{
+    memset(op, 0, sizeof(*op));
+}
+
+int_fast16_t AESECB_oneStepEncrypt(AESECB_Handle handle, AESECB_Operation *op)
+{
+    uint8_t roundkeys[AES_ROUND_KEY_SIZE];
+    size_t i;
+
+    if (op->key->keyLength != 16 || op->inputLength % AES_BLOCK_SIZE)
+        return AESECB_STATUS_ERROR;
+
+    aes_key_schedule_128(op->key->keyMaterial, roundkeys);
+    for (i = 0; i < op->inputLength; i += AES_BLOCK_SIZE)
+        aes_encrypt_128(roundkeys, op->input + i, op->output + i);
+    return AESECB_STATUS_SUCCESS;
+}
+
+void AESCCM_init(void)
+{
+}
+
+void AESCCM_Params_init(AESCCM_Params *params)
+{
+    params->returnBehavior = AESCCM_RETURN_BEHAVIOR_BLOCKING;
+}
+
+AESCCM_Handle AESCCM_open(unsigned index, const AESCCM_Params *params)
+{
+    static int handle;
+    return &handle;
+}
+
+void AESCCM_Operation_init(AESCCM_Operation *op)
+{
+    memset(op, 0, sizeof(*op));
+}
+
+// CCM as in RFC 3610, for aadLength < 0xFF00
+int_fast16_t AESCCM_oneStepDecrypt(AESCCM_Handle handle, AESCCM_Operation *op)
+{
+    uint8_t roundkeys[AES_ROUND_KEY_SIZE];
+    uint8_t ctr[AES_BLOCK_SIZE], s[AES_BLOCK_SIZE];
+    uint8_t x[AES_BLOCK_SIZE], b[AES_BLOCK_SIZE];
+    unsigned L = 15 - op->nonceLength;
+    size_t i, j, blk;
+    uint8_t diff = 0;
+
+    if (op->key->keyLength != 16 || op->nonceLength < 7 || op->nonceLength > 13 ||
+            op->macLength < 4 || op->macLength > 16 || op->aadLength >= 0xFF00)
+        return AESCCM_STATUS_ERROR;
+
+    aes_key_schedule_128(op->key->keyMaterial, roundkeys);
+
+    // decrypt with counter blocks A_1, A_2, ...
+    memset(ctr, 0, sizeof(ctr));
+    ctr[0] = L - 1;
+    memcpy(ctr + 1, op->nonce, op->nonceLength);
+    for (i = 0, blk = 1; i < op->inputLength; i += AES_BLOCK_SIZE, blk++)
+    {
+        ctr[14] = blk >> 8;
+        ctr[15] = blk;
+        aes_encrypt_128(roundkeys, ctr, s);
+        for (j = 0; j < AES_BLOCK_SIZE && i + j < op->inputLength; j++)
+            op->output[i + j] = op->input[i + j] ^ s[j];
+    }
+
+    // CBC-MAC over B_0, the AAD, then the plaintext
+    memset(b, 0, sizeof(b));
+    b[0] = (op->aadLength ? 0x40 : 0) | (((op->macLength - 2) / 2) << 3) | (L - 1);
+    memcpy(b + 1, op->nonce, op->nonceLength);
+    for (i = 0; i < L; i++)
+        b[15 - i] = op->inputLength >> (i * 8);
+    aes_encrypt_128(roundkeys, b, x);
+
+    if (op->aadLength)
+    {
+        size_t pos = 2;
+
+        memset(b, 0, sizeof(b));
+        b[0] = op->aadLength >> 8;
+        b[1] = op->aadLength;
+        for (i = 0; i < op->aadLength; i++)
+        {
+            b[pos++] = op->aad[i];
+            if (pos == AES_BLOCK_SIZE || i + 1 == op->aadLength)
+            {
+                for (j = 0; j < AES_BLOCK_SIZE; j++)
+                    x[j] ^= b[j];
+                aes_encrypt_128(roundkeys, x, x);
+                memset(b, 0, sizeof(b));
+                pos = 0;
+            }
+        }
+    }
+
+    for (i = 0; i < op->inputLength; i += AES_BLOCK_SIZE)
+    {
+        for (j = 0; j < AES_BLOCK_SIZE && i + j < op->inputLength; j++)
+            x[j] ^= op->output[i + j];
+        aes_encrypt_128(roundkeys, x, x);
+    }
+
+    // MAC is encrypted with counter block A_0
+    ctr[14] = 0;
+    ctr[15] = 0;
+    aes_encrypt_128(roundkeys, ctr, s);
+    for (i = 0; i < op->macLength; i++)
+        diff |= op->mac[i] ^ x[i] ^ s[i];
+
+    return diff ? AESCCM_STATUS_MAC_INVALID : AESCCM_STATUS_SUCCESS;
+}
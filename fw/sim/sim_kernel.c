@@ -0,0 +1,509 @@
+/*
+ * Written by Sultan Qasim Khan
+ * Copyright (c) 2020, NCC Group plc
+ * Released as open source under GPLv3
+ */
+
+// for ucontext
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ucontext.h>
+
+#include <xdc/std.h>
+#include <ti/sysbios/BIOS.h>
+#include <ti/sysbios/knl/Task.h>
+#include <ti/sysbios/knl/Semaphore.h>
+#include <ti/sysbios/knl/Clock.h>
+#include <ti/sysbios/hal/Hwi.h>
+
+#include "sim_kernel.h"
+
+// host stacks, much bigger than the firmware's, since libc calls need room
+#define SIM_STACK_SIZE (256 * 1024)
+#define SIM_TASKS_MAX 8
+
+// task switches without time moving on before we call it a livelock
+#define SIM_STUCK_SWITCHES 1000000
+
+#define NEVER UINT64_MAX
+
+const uint32_t Clock_tickPeriod = 10;
+#define TICKS_PER_CLOCK (Clock_tickPeriod * 4)
+
+typedef struct SemObj
+{
+    int count;
+    bool binary;
+} SemObj;
+
+typedef struct
+{
+    ucontext_t ctx;
+    Task_Handle handle;
+    Task_FuncPtr fxn;
+    UArg arg0;
+    UArg arg1;
+    int priority;
+    bool ready;
+    bool done;
+    uint64_t wakeTime;  // NEVER if not waiting on time
+    SemObj *pendSem;    // non-NULL while pending
+    bool waiting;       // in sim_waitUntil
+    bool wokenEarly;
+} TaskObj;
+
+typedef struct
+{
+    SimTimer timer;
+    Clock_FuncPtr fxn;
+    UArg arg;
+    uint32_t timeout;
+    uint32_t period;
+} ClockObj;
+
+static TaskObj *tasks[SIM_TASKS_MAX];
+static unsigned numTasks = 0;
+static TaskObj *current = NULL;
+static unsigned lastPicked = 0;
+static ucontext_t schedCtx;
+
+static uint64_t now = 0;
+static SimTimer *timers = NULL;
+
+uint64_t sim_now(void)
+{
+    return now;
+}
+
+/* ---------- timers ---------- */
+
+void sim_timerStart(SimTimer *t, uint64_t when, SimTimerFxn fxn, UArg arg)
+{
+    if (!t->active)
+    {
+        t->next = timers;
+        timers = t;
+    }
+    t->when = when;
+    t->fxn = fxn;
+    t->arg = arg;
+    t->active = true;
+}
+
+void sim_timerStop(SimTimer *t)
+{
+    SimTimer **pp;
+
+    if (!t->active)
+        return;
+
+    for (pp = &timers; *pp; pp = &(*pp)->next)
+    {
+        if (*pp == t)
+        {
+            *pp = t->next;
+            break;
+        }
+    }
+    t->active = false;
+}
+
+static uint64_t nextTimerTime(void)
+{
+    uint64_t next = NEVER;
+    SimTimer *t;
+
+    for (t = timers; t; t = t->next)
+        if (t->when < next)
+            next = t->when;
+    return next;
+}
+
+// fire one due timer, returns false if none was due
+static bool fireTimer(void)
+{
+    SimTimer *t, *due = NULL;
+
+    for (t = timers; t; t = t->next)
+        if (t->when <= now && (!due || t->when < due->when))
+            due = t;
+
+    if (!due)
+        return false;
+
+    // may restart itself from its function
+    sim_timerStop(due);
+    due->fxn(due->arg);
+    return true;
+}
+
+/* ---------- tasks ---------- */
+
+static void block(void)
+{
+    current->ready = false;
+    swapcontext(&current->ctx, &schedCtx);
+}
+
+static void taskEntry(void)
+{
+    current->fxn(current->arg0, current->arg1);
+
+    // firmware tasks never return, but don't fall off the stack if one does
+    current->done = true;
+    block();
+}
+
+void Task_Params_init(Task_Params *params)
+{
+    memset(params, 0, sizeof(*params));
+    params->priority = 1;
+}
+
+void Task_construct(Task_Struct *obj, Task_FuncPtr fxn, const Task_Params *params,
+        Error_Block *eb)
+{
+    TaskObj *t;
+
+    if (numTasks == SIM_TASKS_MAX)
+    {
+        fprintf(stderr, "sim: too many tasks\n");
+        exit(1);
+    }
+
+    t = calloc(1, sizeof(TaskObj));
+    getcontext(&t->ctx);
+    t->ctx.uc_stack.ss_sp = malloc(SIM_STACK_SIZE);
+    t->ctx.uc_stack.ss_size = SIM_STACK_SIZE;
+    t->ctx.uc_link = NULL;
+    makecontext(&t->ctx, taskEntry, 0);
+
+    t->handle = obj;
+    t->fxn = fxn;
+    t->arg0 = params ? params->arg0 : 0;
+    t->arg1 = params ? params->arg1 : 0;
+    t->priority = params ? params->priority : 1;
+    t->ready = true;
+    t->wakeTime = NEVER;
+
+    obj->priv = t;
+    tasks[numTasks++] = t;
+}
+
+Task_Handle Task_self(void)
+{
+    return current ? current->handle : NULL;
+}
+
+void Task_yield(void)
+{
+    if (!current)
+        return;
+    swapcontext(&current->ctx, &schedCtx);
+}
+
+bool sim_waitUntil(uint64_t when)
+{
+    if (!current)
+    {
+        fprintf(stderr, "sim: blocking outside a task\n");
+        exit(1);
+    }
+
+    if (when <= now)
+        return true;
+
+    current->wakeTime = when;
+    current->waiting = true;
+    current->wokenEarly = false;
+    block();
+    return !current->wokenEarly;
+}
+
+void sim_wake(Task_Handle task)
+{
+    TaskObj *t = (TaskObj *)task->priv;
+
+    if (!t->waiting)
+        return;
+
+    t->waiting = false;
+    t->wokenEarly = true;
+    t->wakeTime = NEVER;
+    t->ready = true;
+}
+
+void Task_sleep(uint32_t ticks)
+{
+    if (ticks == 0)
+        Task_yield();
+    else
+        sim_waitUntil(now + (uint64_t)ticks * TICKS_PER_CLOCK);
+}
+
+// wake tasks whose time is up, whether sleeping or pend timeouts
+static void wakeTimedOut(void)
+{
+    unsigned i;
+
+    for (i = 0; i < numTasks; i++)
+    {
+        TaskObj *t = tasks[i];
+
+        if (t->ready || t->done || t->wakeTime > now)
+            continue;
+
+        // pendSem stays set, so Semaphore_pend sees it timed out
+        t->waiting = false;
+        t->wakeTime = NEVER;
+        t->ready = true;
+    }
+}
+
+static TaskObj *pickTask(void)
+{
+    TaskObj *best = NULL;
+    unsigned i, idx = 0;
+
+    // round robin among equal priorities, starting after the last one
+    for (i = 1; i <= numTasks; i++)
+    {
+        unsigned j = (lastPicked + i) % numTasks;
+        TaskObj *t = tasks[j];
+
+        if (!t->ready || t->done)
+            continue;
+        if (!best || t->priority > best->priority)
+        {
+            best = t;
+            idx = j;
+        }
+    }
+
+    if (best)
+        lastPicked = idx;
+    return best;
+}
+
+void sim_run(uint64_t endTime)
+{
+    uint64_t lastTime = now;
+    unsigned switches = 0;
+
+    while (now <= endTime)
+    {
+        TaskObj *t;
+        uint64_t next;
+        unsigned i;
+
+        if (fireTimer())
+            continue;
+
+        t = pickTask();
+        if (t)
+        {
+            if (now != lastTime)
+            {
+                lastTime = now;
+                switches = 0;
+            } else if (++switches > SIM_STUCK_SWITCHES) {
+                fprintf(stderr, "sim: no progress at radio time %llu\n",
+                        (unsigned long long)now);
+                exit(1);
+            }
+
+            current = t;
+            swapcontext(&schedCtx, &t->ctx);
+            current = NULL;
+            continue;
+        }
+
+        // nothing to do now, so skip ahead to when there is
+        next = nextTimerTime();
+        for (i = 0; i < numTasks; i++)
+            if (!tasks[i]->done && tasks[i]->wakeTime < next)
+                next = tasks[i]->wakeTime;
+
+        if (next == NEVER || next > endTime)
+            break;
+
+        now = next;
+        wakeTimedOut();
+    }
+}
+
+/* ---------- semaphores ---------- */
+
+void Semaphore_Params_init(Semaphore_Params *params)
+{
+    params->mode = Semaphore_Mode_COUNTING;
+}
+
+void Semaphore_construct(Semaphore_Struct *obj, int count,
+        const Semaphore_Params *params)
+{
+    SemObj *s = calloc(1, sizeof(SemObj));
+
+    s->binary = params && params->mode == Semaphore_Mode_BINARY;
+    s->count = s->binary && count > 1 ? 1 : count;
+    obj->priv = s;
+}
+
+Semaphore_Handle Semaphore_create(int count, const Semaphore_Params *params,
+        Error_Block *eb)
+{
+    Semaphore_Struct *obj = malloc(sizeof(Semaphore_Struct));
+
+    Semaphore_construct(obj, count, params);
+    return obj;
+}
+
+Semaphore_Handle Semaphore_handle(Semaphore_Struct *obj)
+{
+    return obj;
+}
+
+bool Semaphore_pend(Semaphore_Handle sem, uint32_t timeout)
+{
+    SemObj *s = (SemObj *)sem->priv;
+
+    if (s->count > 0)
+    {
+        s->count--;
+        return true;
+    }
+
+    if (timeout == BIOS_NO_WAIT || !current)
+        return false;
+
+    current->pendSem = s;
+    current->wakeTime = timeout == BIOS_WAIT_FOREVER ? NEVER :
+        now + (uint64_t)timeout * TICKS_PER_CLOCK;
+    block();
+
+    // Semaphore_post clears pendSem when it hands us the count
+    if (current->pendSem)
+    {
+        current->pendSem = NULL;
+        return false;
+    }
+    return true;
+}
+
+void Semaphore_post(Semaphore_Handle sem)
+{
+    SemObj *s = (SemObj *)sem->priv;
+    TaskObj *best = NULL;
+    unsigned i;
+
+    for (i = 0; i < numTasks; i++)
+    {
+        TaskObj *t = tasks[i];
+
+        if (t->pendSem == s && !t->ready && (!best || t->priority > best->priority))
+            best = t;
+    }
+
+    if (best)
+    {
+        best->pendSem = NULL;
+        best->wakeTime = NEVER;
+        best->ready = true;
+    } else if (!s->binary || s->count == 0) {
+        s->count++;
+    }
+}
+
+int Semaphore_getCount(Semaphore_Handle sem)
+{
+    return ((SemObj *)sem->priv)->count;
+}
+
+void Semaphore_reset(Semaphore_Handle sem, int count)
+{
+    ((SemObj *)sem->priv)->count = count;
+}
+
+/* ---------- clocks ---------- */
+
+static void clockFire(UArg arg)
+{
+    ClockObj *c = (ClockObj *)arg;
+
+    if (c->period)
+        sim_timerStart(&c->timer, c->timer.when + (uint64_t)c->period * TICKS_PER_CLOCK,
+                clockFire, arg);
+    c->fxn(c->arg);
+}
+
+void Clock_Params_init(Clock_Params *params)
+{
+    memset(params, 0, sizeof(*params));
+}
+
+void Clock_construct(Clock_Struct *obj, Clock_FuncPtr fxn, uint32_t timeout,
+        const Clock_Params *params)
+{
+    ClockObj *c = calloc(1, sizeof(ClockObj));
+
+    c->fxn = fxn;
+    c->timeout = timeout;
+    if (params)
+    {
+        c->period = params->period;
+        c->arg = params->arg;
+    }
+    obj->priv = c;
+
+    if (params && params->startFlag)
+        Clock_start(obj);
+}
+
+Clock_Handle Clock_handle(Clock_Struct *obj)
+{
+    return obj;
+}
+
+void Clock_start(Clock_Handle clk)
+{
+    ClockObj *c = (ClockObj *)clk->priv;
+
+    sim_timerStop(&c->timer);
+    sim_timerStart(&c->timer, now + (uint64_t)c->timeout * TICKS_PER_CLOCK,
+            clockFire, (UArg)c);
+}
+
+void Clock_stop(Clock_Handle clk)
+{
+    sim_timerStop(&((ClockObj *)clk->priv)->timer);
+}
+
+void Clock_setPeriod(Clock_Handle clk, uint32_t period)
+{
+    ((ClockObj *)clk->priv)->period = period;
+}
+
+void Clock_setTimeout(Clock_Handle clk, uint32_t timeout)
+{
+    ((ClockObj *)clk->priv)->timeout = timeout;
+}
+
+uint32_t Clock_getTicks(void)
+{
+    return now / TICKS_PER_CLOCK;
+}
+
+/* ---------- interrupts ---------- */
+
+// nothing preempts anything, so there's nothing to lock out
+UInt Hwi_disable(void)
+{
+    return 0;
+}
+
+void Hwi_restore(UInt key)
+{
+}
@@ -0,0 +1,53 @@
+/*
+ * Written by Sultan Qasim Khan
+ * Copyright (c) 2020, NCC Group plc
+ * Released as open source under GPLv3
+ */
+
+#ifndef SIM_KERNEL_H
+#define SIM_KERNEL_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <xdc/std.h>
+#include <ti/sysbios/knl/Task.h>
+
+/* Cooperative stand-in for TI-RTOS, running on virtual time.
+ *
+ * Tasks only switch when the running one blocks (Semaphore_pend,
+ * Task_sleep, sim_waitUntil), and then the highest priority ready task
+ * runs. When no task is ready, time jumps to the next timer or wakeup.
+ * Clock functions and timers run between tasks, like Swis would.
+ *
+ * Time is kept in 4 MHz radio ticks, 64 bits so it never wraps.
+ */
+
+typedef void (*SimTimerFxn)(UArg arg);
+
+typedef struct SimTimer
+{
+    uint64_t when;
+    SimTimerFxn fxn;
+    UArg arg;
+    bool active;
+    struct SimTimer *next;
+} SimTimer;
+
+/* Current virtual time (radio ticks) */
+uint64_t sim_now(void);
+
+/* Call fxn(arg) at virtual time when (or right away if already past) */
+void sim_timerStart(SimTimer *t, uint64_t when, SimTimerFxn fxn, UArg arg);
+void sim_timerStop(SimTimer *t);
+
+/* Block the calling task until virtual time when, or until sim_wake()
+ * Returns false if woken early. */
+bool sim_waitUntil(uint64_t when);
+
+/* Wake a task blocked in sim_waitUntil (no effect otherwise) */
+void sim_wake(Task_Handle task);
+
+/* Run tasks until virtual time passes endTime, or nothing is left to run */
+void sim_run(uint64_t endTime);
+
+#endif
@@ -0,0 +1,420 @@
+/*
+ * Written by Sultan Qasim Khan
+ * Copyright (c) 2020, NCC Group plc
+ * Released as open source under GPLv3
+ */
+
+// for getopt
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <RadioTask.h>
+#include <PacketTask.h>
+#include <DelayHopTrigger.h>
+#include <DelayStopTrigger.h>
+#include <rpa_resolver.h>
+#include <ll_crypto.h>
+#include <timebase.h>
+#include <adv_sweep.h>
+#include <stats.h>
+
+#include "sim.h"
+#include "sim_kernel.h"
+
+/* Replays a capture (pcap, DLT_BLUETOOTH_LE_LL_WITH_PHDR, as written by the
+ * Python tools) through RadioTask and PacketTask on simulated radio time,
+ * then reports how much of it the firmware would have caught.
+ */
+
+#define LINKTYPE_BLE_LL_PHDR 256
+#define BLE_ADV_AA 0x8E89BED6
+
+// time for the firmware to settle before the first frame
+#define LEAD_IN_TICKS (10 * 1000 * 4)
+
+// keep running a little after the last frame, for queued messages
+#define LEAD_OUT_TICKS (1000 * 1000 * 4)
+
+#define CONNS_MAX 64
+
+typedef struct
+{
+    uint32_t aa;
+    uint64_t connTime;
+    uint64_t firstCapture;
+    uint32_t frames;
+    uint32_t captured;
+} ConnReport;
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+        "Usage: %s [options] capture.pcap\n"
+        "  -c CHAN  primary advertising channel to stay on (default 37)\n"
+        "  -m MAC   filter to advertiser MAC, hopping along with its advertisements\n"
+        "  -k LTK   long term key of a connection, to decrypt it (hex, MSB first)\n"
+        "  -n N     follow up to N connections at once\n"
+        "  -a       only sniff advertisements, don't follow connections\n"
+        "  -e       follow extended (auxiliary) advertising\n"
+        "  -w       sweep primary advertising channels\n"
+        "  -v       print firmware debug and state messages\n", prog);
+}
+
+static uint8_t rfToBleChan(uint8_t rf)
+{
+    if (rf == 0)
+        return 37;
+    if (rf == 12)
+        return 38;
+    if (rf == 39)
+        return 39;
+    return rf < 12 ? rf - 1 : rf - 2;
+}
+
+static uint32_t rd32(const uint8_t *p, bool swap)
+{
+    uint32_t v = p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+    return swap ? __builtin_bswap32(v) : v;
+}
+
+// returns number of frames loaded into *frames, or -1 on error
+static int loadPcap(const char *path, SimFrame **frames)
+{
+    FILE *f = fopen(path, "rb");
+    uint8_t hdr[24], rec[16];
+    uint8_t buf[512];
+    SimFrame *out = NULL;
+    unsigned count = 0, cap = 0;
+    uint64_t firstUs = 0;
+    bool swap, nanos;
+
+    if (!f)
+    {
+        perror(path);
+        return -1;
+    }
+
+    if (fread(hdr, 1, sizeof(hdr), f) != sizeof(hdr))
+        goto bad;
+
+    switch (rd32(hdr, false))
+    {
+    case 0xA1B2C3D4: swap = false; nanos = false; break;
+    case 0xD4C3B2A1: swap = true; nanos = false; break;
+    case 0xA1B23C4D: swap = false; nanos = true; break;
+    case 0x4D3CB2A1: swap = true; nanos = true; break;
+    default: goto bad;
+    }
+
+    if (rd32(hdr + 20, swap) != LINKTYPE_BLE_LL_PHDR)
+    {
+        fprintf(stderr, "%s: not a DLT_BLUETOOTH_LE_LL_WITH_PHDR capture\n", path);
+        fclose(f);
+        return -1;
+    }
+
+    while (fread(rec, 1, sizeof(rec), f) == sizeof(rec))
+    {
+        uint64_t us = rd32(rec, swap) * 1000000ull + rd32(rec + 4, swap) /
+            (nanos ? 1000 : 1);
+        uint32_t incl = rd32(rec + 8, swap);
+        uint32_t orig = rd32(rec + 12, swap);
+        SimFrame *fr;
+        unsigned avail;
+
+        if (incl > sizeof(buf))
+        {
+            fseek(f, incl, SEEK_CUR);
+            continue;
+        }
+        if (fread(buf, 1, incl, f) != incl)
+            break;
+
+        // 10 byte RF header, access address, at least a PDU header
+        if (incl < 10 + 4 + 2)
+            continue;
+
+        // snapped frames (incl < orig) have no CRC
+        avail = incl - 14;
+        if (incl == orig)
+            avail = avail >= 3 ? avail - 3 : 0;
+        if (avail < 2)
+            continue;
+
+        if (count == cap)
+        {
+            cap = cap ? cap * 2 : 4096;
+            out = realloc(out, cap * sizeof(SimFrame));
+        }
+        if (!count)
+            firstUs = us;
+
+        fr = out + count++;
+        memset(fr, 0, sizeof(*fr));
+        fr->time = (us - firstUs) * 4 + LEAD_IN_TICKS;
+        fr->chan = rfToBleChan(buf[0]);
+        fr->rssi = (int8_t)buf[1];
+        fr->aa = rd32(buf + 10, false);
+        fr->phy = PHY_1M; // the RF header doesn't say
+
+        // body length comes from the header, zero filling what was snapped
+        fr->len = buf[15] + 2;
+        fr->pdu = calloc(fr->len, 1);
+        memcpy(fr->pdu, buf + 14, avail < fr->len ? avail : fr->len);
+        if (incl == orig && avail == fr->len)
+            memcpy(fr->crc, buf + 14 + fr->len, 3);
+    }
+
+    fclose(f);
+    *frames = out;
+    return count;
+
+bad:
+    fprintf(stderr, "%s: not a pcap file\n", path);
+    fclose(f);
+    return -1;
+}
+
+static bool parseHex(const char *s, uint8_t *out, unsigned n, bool colons)
+{
+    unsigned i;
+
+    for (i = 0; i < n; i++)
+    {
+        unsigned byte;
+
+        if (sscanf(s, "%2x", &byte) != 1)
+            return false;
+        out[i] = byte;
+        s += 2;
+        if (colons && i + 1 < n && *s++ != ':')
+            return false;
+    }
+    return *s == '\0';
+}
+
+static unsigned findConns(const SimFrame *air, unsigned count, ConnReport *conns)
+{
+    unsigned numConns = 0;
+    unsigned i, j;
+
+    for (i = 0; i < count; i++)
+    {
+        const SimFrame *f = air + i;
+        uint32_t aa;
+
+        // CONNECT_IND or AUX_CONNECT_REQ
+        if (f->aa != BLE_ADV_AA || (f->pdu[0] & 0xF) != 0x5 || f->len != 36)
+            continue;
+
+        aa = f->pdu[14] | (f->pdu[15] << 8) | (f->pdu[16] << 16) |
+            ((uint32_t)f->pdu[17] << 24);
+        for (j = 0; j < numConns; j++)
+            if (conns[j].aa == aa)
+                break;
+        if (j < numConns || numConns == CONNS_MAX)
+            continue;
+
+        conns[numConns].aa = aa;
+        conns[numConns].connTime = f->time;
+        conns[numConns].firstCapture = 0;
+        conns[numConns].frames = 0;
+        conns[numConns].captured = 0;
+        numConns++;
+    }
+
+    for (i = 0; i < count; i++)
+    {
+        const SimFrame *f = air + i;
+
+        for (j = 0; j < numConns; j++)
+        {
+            if (f->aa != conns[j].aa || f->time < conns[j].connTime)
+                continue;
+            conns[j].frames++;
+            if (f->captured)
+            {
+                if (!conns[j].captured)
+                    conns[j].firstCapture = f->time;
+                conns[j].captured++;
+            }
+        }
+    }
+
+    return numConns;
+}
+
+static double pct(uint32_t n, uint32_t d)
+{
+    return d ? 100.0 * n / d : 0.0;
+}
+
+static void report(const SimFrame *air, unsigned count)
+{
+    static ConnReport conns[CONNS_MAX];
+    uint32_t advTotal = 0, advCaptured = 0;
+    uint32_t auxTotal = 0, auxCaptured = 0;
+    uint32_t dataTotal = 0, dataCaptured = 0;
+    unsigned numConns, followed = 0;
+    unsigned i;
+
+    for (i = 0; i < count; i++)
+    {
+        const SimFrame *f = air + i;
+
+        if (f->chan >= 37)
+        {
+            advTotal++;
+            advCaptured += f->captured;
+        } else if (f->aa == BLE_ADV_AA) {
+            auxTotal++;
+            auxCaptured += f->captured;
+        } else {
+            dataTotal++;
+            dataCaptured += f->captured;
+        }
+    }
+
+    printf("Replayed %u frames over %.3f s\n", count,
+            count ? (air[count - 1].time - air[0].time) / 4e6 : 0.0);
+    printf("Captured by radio:\n");
+    printf("  primary advertising  %7u / %-7u %6.2f%%\n", advCaptured, advTotal,
+            pct(advCaptured, advTotal));
+    printf("  aux advertising      %7u / %-7u %6.2f%%\n", auxCaptured, auxTotal,
+            pct(auxCaptured, auxTotal));
+    printf("  data channel         %7u / %-7u %6.2f%%\n", dataCaptured, dataTotal,
+            pct(dataCaptured, dataTotal));
+    printf("Sent to host: %u frames (%u advertising), %u messages, %u bytes\n",
+            sim_host.frames, sim_host.advFrames, sim_host.messages, sim_host.bytes);
+    printf("Firmware drops: %u RF buffer full, %u queue full, %u RSSI, %u MAC, %u PDU filter\n",
+            stats.rfBufFull, stats.queueDrops, stats.rssiRejects, stats.macRejects,
+            stats.pduRejects);
+
+    numConns = findConns(air, count, conns);
+    if (!numConns)
+        return;
+
+    printf("Connections:\n");
+    for (i = 0; i < numConns; i++)
+    {
+        const ConnReport *c = conns + i;
+
+        if (c->captured)
+            followed++;
+        printf("  AA 0x%08X  %7u / %-7u %6.2f%%", c->aa, c->captured, c->frames,
+                pct(c->captured, c->frames));
+        if (c->captured)
+            printf("  first after %.3f ms", (c->firstCapture - c->connTime) / 4e3);
+        printf("\n");
+    }
+    printf("Followed %u of %u connections\n", followed, numConns);
+}
+
+int main(int argc, char **argv)
+{
+    SimFrame *air = NULL;
+    uint8_t mac[6], ltk[16];
+    bool macFilt = false, haveLTK = false;
+    bool advOnly = false, auxAdv = false, sweep = false;
+    int chan = 37, connMax = 1;
+    int count, opt, i;
+
+    while ((opt = getopt(argc, argv, "c:m:k:n:aewvh")) != -1)
+    {
+        switch (opt)
+        {
+        case 'c':
+            chan = atoi(optarg);
+            if (chan < 37 || chan > 39)
+            {
+                fprintf(stderr, "Channel must be 37, 38, or 39\n");
+                return 1;
+            }
+            break;
+        case 'm':
+            if (!parseHex(optarg, mac, 6, true))
+            {
+                fprintf(stderr, "Bad MAC address: %s\n", optarg);
+                return 1;
+            }
+            macFilt = true;
+            break;
+        case 'k':
+            if (!parseHex(optarg, ltk, 16, false))
+            {
+                fprintf(stderr, "Bad LTK: %s\n", optarg);
+                return 1;
+            }
+            haveLTK = true;
+            break;
+        case 'n':
+            connMax = atoi(optarg);
+            break;
+        case 'a':
+            advOnly = true;
+            break;
+        case 'e':
+            auxAdv = true;
+            break;
+        case 'w':
+            sweep = true;
+            break;
+        case 'v':
+            sim_verbose = true;
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    if (optind + 1 != argc)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    count = loadPcap(argv[optind], &air);
+    if (count < 0)
+        return 1;
+    sim_radio_setAir(air, count);
+
+    // as in main.c
+    rpa_resolver_init();
+    ll_crypto_init();
+    timebase_init();
+    RadioTask_init();
+    PacketTask_init();
+    DelayHopTrigger_init();
+    DelayStopTrigger_init();
+
+    // then as the host would configure it (MAC is sent LSB first)
+    setChanAAPHYCRCI(chan, BLE_ADV_AA, PHY_1M, 0x555555);
+    setFollowConnections(!advOnly);
+    setAuxAdvEnabled(auxAdv);
+    setConnMax(connMax);
+    if (haveLTK)
+        ll_crypto_setLTK(ltk);
+    if (macFilt)
+    {
+        uint8_t macLE[6];
+
+        for (i = 0; i < 6; i++)
+            macLE[i] = mac[5 - i];
+        setMacFilt(true, macLE);
+        if (!advOnly)
+            advHopSeekMode();
+    }
+    if (sweep)
+        setAdvSweep(SWEEP_PHY_1M);
+
+    sim_run(count ? air[count - 1].time + LEAD_OUT_TICKS : LEAD_IN_TICKS);
+
+    report(air, count);
+
+    return 0;
+}
@@ -0,0 +1,417 @@
+/*
+ * Written by Sultan Qasim Khan
+ * Copyright (c) 2020, NCC Group plc
+ * Released as open source under GPLv3
+ */
+
+#include <errno.h>
+#include <string.h>
+
+#include <ti/sysbios/knl/Task.h>
+#include <ti/drivers/rf/RF.h>
+
+#include <RadioWrapper.h>
+#include <PacketTask.h>
+#include <DelayHopTrigger.h>
+#include <DelayStopTrigger.h>
+#include <stats.h>
+
+#include "sim.h"
+#include "sim_kernel.h"
+
+/* Simulated radio, replaying frames from the air instead of an RF core.
+ *
+ * A frame is received if we're listening on its channel, PHY and access
+ * address when it starts, and is handed to the callback once it's over,
+ * plus the RF callback latency. CRCs aren't checked, a frame on the right
+ * access address is taken to have the right CRCInit.
+ *
+ * Transmitting roles (master, slave, initiator, advertiser) only pass time.
+ */
+
+// from measurements noted in RadioWrapper.c and RadioTask.c
+#define RETUNE_TICKS (160 * 4)
+#define RX_LATENCY_TICKS (165 * 4)
+
+// same as the RF data queue
+#define NUM_DATA_ENTRIES 16
+#define DATA_ENTRY_SIZE 300
+
+#define BLE_ADV_AA 0x8E89BED6
+
+// time (advertising events) taken by the transmitting roles we don't simulate
+#define ADV_EVENT_TICKS (3 * 1000 * 4)
+
+typedef enum
+{
+    LISTEN_DONE,
+    LISTEN_STOPPED,
+    LISTEN_TRIGGERED
+} ListenResult;
+
+static SimFrame *air = NULL;
+static unsigned airCount = 0;
+static unsigned airPos = 0;
+
+static Task_Handle radioTask = NULL;
+static volatile bool radioBusy = false;
+static volatile bool stopReq = false;
+
+// recvAdv3 state, for trigAdv3
+static volatile bool trigArmed = false;
+static volatile bool trigReq = false;
+
+static union
+{
+    rfc_dataEntryGeneral_t entry;
+    uint8_t raw[DATA_ENTRY_SIZE];
+} entries[NUM_DATA_ENTRIES];
+static bool entryUsed[NUM_DATA_ENTRIES];
+
+static SimTimer hopTimer;
+static SimTimer stopTimer;
+
+void sim_radio_setAir(SimFrame *frames, unsigned count)
+{
+    air = frames;
+    airCount = count;
+    airPos = 0;
+}
+
+uint32_t RF_getCurrentTime(void)
+{
+    return (uint32_t)sim_now();
+}
+
+// absolute 32 bit radio time to 64 bit, ending now if it already passed
+static uint64_t deadline(uint32_t timeout)
+{
+    uint32_t delta;
+
+    if (timeout == 0xFFFFFFFF)
+        return UINT64_MAX;
+
+    delta = timeout - (uint32_t)sim_now();
+    if (delta >= 0x80000000)
+        return sim_now();
+    return sim_now() + delta;
+}
+
+static uint64_t airTicks(const SimFrame *f)
+{
+    // preamble, access address, PDU and CRC (4 MHz ticks)
+    switch (f->phy)
+    {
+    case PHY_2M:
+        return (2 + 4 + f->len + 3) * 4 * 4;
+    case PHY_CODED:
+        // S=8 coding, with 80 us preamble and 376 us of AA, CI and TERM fields
+        return (80 + 376 + (f->len + 3) * 64) * 4;
+    default:
+        return (1 + 4 + f->len + 3) * 8 * 4;
+    }
+}
+
+static rfc_dataEntryGeneral_t *takeEntry(void)
+{
+    unsigned i;
+
+    for (i = 0; i < NUM_DATA_ENTRIES; i++)
+    {
+        if (!entryUsed[i])
+        {
+            entryUsed[i] = true;
+            return &entries[i].entry;
+        }
+    }
+    return NULL;
+}
+
+static void deliver(SimFrame *f, uint8_t chan, RadioWrapper_Callback callback,
+        bool rawCrc)
+{
+    rfc_dataEntryGeneral_t *entry = takeEntry();
+    uint8_t *packetPointer;
+    BLE_Frame frame;
+
+    if (!entry)
+    {
+        stats.rfBufFull++;
+        return;
+    }
+
+    // laid out as the RF core would, see rx_int_callback
+    packetPointer = &entry->data;
+    frame.length = f->len + (rawCrc ? 3 : 0);
+    packetPointer[0] = frame.length;
+    memcpy(packetPointer + 1, f->pdu, f->len);
+    if (rawCrc)
+        memcpy(packetPointer + 1 + f->len, f->crc, 3);
+
+    frame.pData = packetPointer + 1;
+    frame.pEntry = entry;
+    frame.rssi = f->rssi;
+    frame.timestamp = (uint32_t)f->time >> 2;
+    frame.channel = chan;
+    frame.phy = f->phy;
+
+    f->captured = true;
+
+    // as rx_int_callback then the deferred Swi would, without the wait
+    if (callback)
+        callback = indicateUrgent(&frame, callback);
+    if (callback) callback(&frame);
+
+    /* Release right away unless the callback took ownership */
+    if (frame.pEntry) RadioWrapper_releaseEntry(frame.pEntry);
+}
+
+static bool hears(const SimFrame *f, PHY_Mode phy, uint8_t chan, uint32_t aa)
+{
+    return f->chan == chan && f->phy == phy && f->aa == aa;
+}
+
+// receive on chan till end, or till stopped (or triggered, if armed)
+static ListenResult listen(PHY_Mode phy, uint8_t chan, uint32_t aa, uint64_t end,
+        RadioWrapper_Callback callback, bool rawCrc)
+{
+    uint64_t start = sim_now() + RETUNE_TICKS;
+    unsigned i;
+
+    // anything that started before we were ready is gone for good
+    while (airPos < airCount && air[airPos].time < start)
+        airPos++;
+    i = airPos;
+
+    while (1)
+    {
+        SimFrame *f = NULL;
+        uint64_t wake;
+
+        for (; i < airCount && air[i].time < end; i++)
+        {
+            if (hears(air + i, phy, chan, aa))
+            {
+                f = air + i;
+                break;
+            }
+        }
+
+        // a frame that starts in time is still received in full
+        wake = f ? f->time + airTicks(f) + RX_LATENCY_TICKS : end;
+
+        if (stopReq)
+            return LISTEN_STOPPED;
+        if (trigArmed && trigReq)
+            return LISTEN_TRIGGERED;
+
+        if (!sim_waitUntil(wake))
+            continue; // stopped or triggered
+
+        if (!f)
+            return LISTEN_DONE;
+
+        deliver(f, chan, callback, rawCrc);
+        i++;
+    }
+}
+
+static int recvGeneric(PHY_Mode phy, uint32_t chan, uint32_t accessAddr,
+    uint32_t timeout, RadioWrapper_Callback callback, bool rawCrc)
+{
+    if (chan >= 40)
+        return -EINVAL;
+
+    radioBusy = true;
+    listen(phy, chan, accessAddr, deadline(timeout), callback, rawCrc);
+    radioBusy = false;
+    stopReq = false;
+
+    return 0;
+}
+
+// pass time in a role we don't simulate, returns true if stopped
+static bool idleUntil(uint64_t end)
+{
+    bool stopped;
+
+    radioBusy = true;
+    while (!stopReq && !sim_waitUntil(end));
+    stopped = stopReq;
+    radioBusy = false;
+    stopReq = false;
+
+    return stopped;
+}
+
+int RadioWrapper_init(void)
+{
+    radioTask = Task_self();
+    return 0;
+}
+
+int RadioWrapper_close(void)
+{
+    return 0;
+}
+
+int RadioWrapper_recvFrames(PHY_Mode phy, uint32_t chan, uint32_t accessAddr,
+    uint32_t crcInit, uint32_t timeout, RadioWrapper_Callback callback)
+{
+    return recvGeneric(phy, chan, accessAddr, timeout, callback, false);
+}
+
+int RadioWrapper_recvFramesRawCrc(PHY_Mode phy, uint32_t chan, uint32_t accessAddr,
+    uint32_t timeout, RadioWrapper_Callback callback)
+{
+    return recvGeneric(phy, chan, accessAddr, timeout, callback, true);
+}
+
+int RadioWrapper_recvAdv3(uint32_t delay1, uint32_t delay2, RadioWrapper_Callback callback)
+{
+    ListenResult r;
+
+    radioBusy = true;
+    trigReq = false;
+    trigArmed = true;
+
+    r = listen(PHY_1M, 37, BLE_ADV_AA, UINT64_MAX, callback, false);
+    trigArmed = false;
+    if (r == LISTEN_TRIGGERED)
+        r = listen(PHY_1M, 38, BLE_ADV_AA, sim_now() + delay1, callback, false);
+    if (r == LISTEN_DONE)
+        listen(PHY_1M, 39, BLE_ADV_AA, sim_now() + delay2, callback, false);
+
+    radioBusy = false;
+    stopReq = false;
+
+    return 0;
+}
+
+void RadioWrapper_trigAdv3()
+{
+    if (!trigArmed)
+        return;
+    trigReq = true;
+    if (radioTask)
+        sim_wake(radioTask);
+}
+
+int RadioWrapper_master(PHY_Mode phy, uint32_t chan, uint32_t accessAddr,
+    uint32_t crcInit, uint32_t timeout, RadioWrapper_Callback callback,
+    dataQueue_t *txQueue, uint32_t startTime, uint32_t *numSent)
+{
+    *numSent = 0;
+    idleUntil(deadline(timeout));
+    return 0;
+}
+
+int RadioWrapper_slave(PHY_Mode phy, uint32_t chan, uint32_t accessAddr,
+    uint32_t crcInit, uint32_t timeout, RadioWrapper_Callback callback,
+    dataQueue_t *txQueue, uint32_t startTime, uint32_t *numSent)
+{
+    *numSent = 0;
+    idleUntil(deadline(timeout));
+    return 0;
+}
+
+void RadioWrapper_resetSeqStat(void)
+{
+}
+
+int RadioWrapper_initiate(PHY_Mode phy, uint32_t chan, uint32_t timeout,
+    RadioWrapper_Callback callback, const uint16_t *initAddr, bool initRandom,
+    const uint16_t *peerAddr, bool peerRandom, const void *connReqData,
+    uint32_t *connTime, PHY_Mode *connPhy)
+{
+    *connTime = RF_getCurrentTime();
+    *connPhy = PHY_1M;
+    idleUntil(timeout == 0xFFFFFFFF ? sim_now() + ADV_EVENT_TICKS : deadline(timeout));
+    return -1;
+}
+
+int RadioWrapper_advertise3(RadioWrapper_Callback callback, const uint16_t *advAddr,
+    bool advRandom, const void *advData, uint8_t advLen, const void *scanRspData,
+    uint8_t scanRspLen)
+{
+    return idleUntil(sim_now() + ADV_EVENT_TICKS) ? -2 : -1;
+}
+
+int RadioWrapper_advertiseExt3(RadioWrapper_Callback callback, const uint16_t *advAddr,
+    bool advRandom, uint16_t adi, const void *advData, uint8_t advLen, uint8_t auxChan)
+{
+    return idleUntil(sim_now() + ADV_EVENT_TICKS) ? -2 : -1;
+}
+
+void RadioWrapper_stop()
+{
+    if (!radioBusy)
+        return;
+    stopReq = true;
+    if (radioTask)
+        sim_wake(radioTask);
+}
+
+// frames are handed over as they're received, so none are ever waiting
+void RadioWrapper_flush()
+{
+}
+
+void RadioWrapper_releaseEntry(rfc_dataEntryGeneral_t *pEntry)
+{
+    unsigned i;
+
+    for (i = 0; i < NUM_DATA_ENTRIES; i++)
+        if (pEntry == &entries[i].entry)
+            entryUsed[i] = false;
+}
+
+// no sync pulses arrive in a replay
+int RadioWrapper_captureEdges(RadioWrapper_CaptureCallback callback)
+{
+    return 0;
+}
+
+void RadioWrapper_stopCapture(void)
+{
+}
+
+/* ---------- delay triggers, on the virtual clock ---------- */
+
+static void hopTick(UArg arg)
+{
+    RadioWrapper_trigAdv3();
+}
+
+static void stopTick(UArg arg)
+{
+    RadioWrapper_stop();
+}
+
+void DelayHopTrigger_init(void)
+{
+}
+
+void DelayHopTrigger_trig(uint32_t delay_us)
+{
+    if (delay_us == 0)
+        RadioWrapper_trigAdv3();
+    else
+        sim_timerStart(&hopTimer, sim_now() + delay_us * 4, hopTick, 0);
+}
+
+void DelayHopTrigger_postpone(uint32_t delay_us)
+{
+    if (!hopTimer.active)
+        return;
+    sim_timerStart(&hopTimer, hopTimer.when + delay_us * 4, hopTick, 0);
+}
+
+void DelayStopTrigger_init(void)
+{
+}
+
+void DelayStopTrigger_trig(uint32_t delay_us)
+{
+    sim_timerStart(&stopTimer, sim_now() + (uint64_t)delay_us * 4, stopTick, 0);
+}
@@ -0,0 +1,14 @@
+/*
+ * Written by Sultan Qasim Khan
+ * Copyright (c) 2020, NCC Group plc
+ * Released as open source under GPLv3
+ */
+
+/* Host simulation stand-in for DeviceFamily */
+
+#ifndef TI_DEVICES_DEVICEFAMILY_H
+#define TI_DEVICES_DEVICEFAMILY_H
+
+#define DeviceFamily_constructPath(x) <ti/devices/x>
+
+#endif
@@ -0,0 +1,14 @@
+/*
+ * Written by Sultan Qasim Khan
+ * Copyright (c) 2020, NCC Group plc
+ * Released as open source under GPLv3
+ */
+
+/* Host simulation stand-in for driverlib IOC */
+
+#ifndef TI_DEVICES_DRIVERLIB_IOC_H
+#define TI_DEVICES_DRIVERLIB_IOC_H
+
+#define IOID_21 21
+
+#endif
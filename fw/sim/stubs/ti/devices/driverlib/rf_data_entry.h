@@ -0,0 +1,49 @@
+/*
+ * Written by Sultan Qasim Khan
+ * Copyright (c) 2020, NCC Group plc
+ * Released as open source under GPLv3
+ */
+
+/* Host simulation stand-in for RF data entries */
+
+#ifndef TI_DEVICES_DRIVERLIB_RF_DATA_ENTRY_H
+#define TI_DEVICES_DRIVERLIB_RF_DATA_ENTRY_H
+
+#include <stdint.h>
+#include <ti/devices/driverlib/rf_mailbox.h>
+
+#define DATA_ENTRY_PENDING      0
+#define DATA_ENTRY_ACTIVE       1
+#define DATA_ENTRY_BUSY         2
+#define DATA_ENTRY_FINISHED     3
+#define DATA_ENTRY_UNFINISHED   4
+
+#define DATA_ENTRY_TYPE_GEN     0
+#define DATA_ENTRY_TYPE_PTR     2
+
+typedef struct
+{
+    uint8_t type:2;
+    uint8_t lenSz:2;
+    uint8_t irqIntv:4;
+} rfc_dataEntryConfig_t;
+
+typedef struct
+{
+    uint8_t *pNextEntry;
+    uint8_t status;
+    rfc_dataEntryConfig_t config;
+    uint16_t length;
+    uint8_t data;
+} rfc_dataEntryGeneral_t;
+
+typedef struct
+{
+    uint8_t *pNextEntry;
+    uint8_t status;
+    rfc_dataEntryConfig_t config;
+    uint16_t length;
+    uint8_t *pData;
+} rfc_dataEntryPointer_t;
+
+#endif
@@ -0,0 +1,20 @@
+/*
+ * Written by Sultan Qasim Khan
+ * Copyright (c) 2020, NCC Group plc
+ * Released as open source under GPLv3
+ */
+
+/* Host simulation stand-in for the RF mailbox definitions */
+
+#ifndef TI_DEVICES_DRIVERLIB_RF_MAILBOX_H
+#define TI_DEVICES_DRIVERLIB_RF_MAILBOX_H
+
+#include <stdint.h>
+
+typedef struct
+{
+    uint8_t *pCurrEntry;
+    uint8_t *pLastEntry;
+} dataQueue_t;
+
+#endif
@@ -0,0 +1,57 @@
+/*
+ * Written by Sultan Qasim Khan
+ * Copyright (c) 2020, NCC Group plc
+ * Released as open source under GPLv3
+ */
+
+/* Host simulation AESCCM driver, backed by sw_aes128 */
+
+#ifndef TI_DRIVERS_AESCCM_H
+#define TI_DRIVERS_AESCCM_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <ti/drivers/cryptoutils/cryptokey/CryptoKey.h>
+
+#define AESCCM_STATUS_SUCCESS       0
+#define AESCCM_STATUS_ERROR         (-1)
+#define AESCCM_STATUS_MAC_INVALID   (-3)
+
+typedef enum
+{
+    AESCCM_RETURN_BEHAVIOR_CALLBACK = 1,
+    AESCCM_RETURN_BEHAVIOR_BLOCKING = 2,
+    AESCCM_RETURN_BEHAVIOR_POLLING = 4
+} AESCCM_ReturnBehavior;
+
+typedef struct
+{
+    AESCCM_ReturnBehavior returnBehavior;
+    uint32_t timeout;
+} AESCCM_Params;
+
+typedef struct
+{
+    CryptoKey *key;
+    uint8_t *aad;
+    uint8_t *input;
+    uint8_t *output;
+    uint8_t *nonce;
+    uint8_t *mac;
+    size_t aadLength;
+    size_t inputLength;
+    uint8_t nonceLength;
+    uint8_t macLength;
+    bool nonceInternallyGenerated;
+} AESCCM_Operation;
+
+typedef void *AESCCM_Handle;
+
+void AESCCM_init(void);
+void AESCCM_Params_init(AESCCM_Params *params);
+AESCCM_Handle AESCCM_open(unsigned index, const AESCCM_Params *params);
+void AESCCM_Operation_init(AESCCM_Operation *op);
+int_fast16_t AESCCM_oneStepDecrypt(AESCCM_Handle handle, AESCCM_Operation *op);
+
+#endif
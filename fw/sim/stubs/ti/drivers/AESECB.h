@@ -0,0 +1,48 @@
+/*
+ * Written by Sultan Qasim Khan
+ * Copyright (c) 2020, NCC Group plc
+ * Released as open source under GPLv3
+ */
+
+/* Host simulation AESECB driver, backed by sw_aes128 */
+
+#ifndef TI_DRIVERS_AESECB_H
+#define TI_DRIVERS_AESECB_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <ti/drivers/cryptoutils/cryptokey/CryptoKey.h>
+
+#define AESECB_STATUS_SUCCESS   0
+#define AESECB_STATUS_ERROR     (-1)
+
+typedef enum
+{
+    AESECB_RETURN_BEHAVIOR_CALLBACK = 1,
+    AESECB_RETURN_BEHAVIOR_BLOCKING = 2,
+    AESECB_RETURN_BEHAVIOR_POLLING = 4
+} AESECB_ReturnBehavior;
+
+typedef struct
+{
+    AESECB_ReturnBehavior returnBehavior;
+    uint32_t timeout;
+} AESECB_Params;
+
+typedef struct
+{
+    CryptoKey *key;
+    uint8_t *input;
+    uint8_t *output;
+    size_t inputLength;
+} AESECB_Operation;
+
+typedef void *AESECB_Handle;
+
+void AESECB_init(void);
+void AESECB_Params_init(AESECB_Params *params);
+AESECB_Handle AESECB_open(unsigned index, const AESECB_Params *params);
+void AESECB_Operation_init(AESECB_Operation *op);
+int_fast16_t AESECB_oneStepEncrypt(AESECB_Handle handle, AESECB_Operation *op);
+
+#endif
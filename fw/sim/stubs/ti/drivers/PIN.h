@@ -0,0 +1,40 @@
+/*
+ * Written by Sultan Qasim Khan
+ * Copyright (c) 2020, NCC Group plc
+ * Released as open source under GPLv3
+ */
+
+/* Host simulation stand-in for the PIN driver (pins do nothing) */
+
+#ifndef TI_DRIVERS_PIN_H
+#define TI_DRIVERS_PIN_H
+
+#include <stdint.h>
+
+typedef uint32_t PIN_Config;
+typedef uint32_t PIN_Id;
+
+typedef struct
+{
+    int unused;
+} PIN_State;
+
+typedef PIN_State *PIN_Handle;
+
+#define PIN_GPIO_OUTPUT_EN  (1u << 24)
+#define PIN_GPIO_LOW        0
+#define PIN_GPIO_HIGH       (1u << 25)
+#define PIN_PUSHPULL        0
+#define PIN_DRVSTR_MAX      (1u << 26)
+#define PIN_INPUT_EN        (1u << 27)
+#define PIN_NOPULL          0
+#define PIN_PULLDOWN        (1u << 28)
+#define PIN_IRQ_DIS         0
+#define PIN_IRQ_POSEDGE     (1u << 29)
+#define PIN_TERMINATE       0xFE
+
+PIN_Handle PIN_open(PIN_State *state, const PIN_Config *pinList);
+int PIN_setOutputValue(PIN_Handle handle, PIN_Id pinId, uint32_t val);
+void PIN_close(PIN_Handle handle);
+
+#endif
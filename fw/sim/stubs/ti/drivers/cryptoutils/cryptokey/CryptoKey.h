@@ -0,0 +1,20 @@
+/*
+ * Written by Sultan Qasim Khan
+ * Copyright (c) 2020, NCC Group plc
+ * Released as open source under GPLv3
+ */
+
+/* Host simulation stand-in for CryptoKey */
+
+#ifndef TI_DRIVERS_CRYPTOUTILS_CRYPTOKEY_CRYPTOKEY_H
+#define TI_DRIVERS_CRYPTOUTILS_CRYPTOKEY_CRYPTOKEY_H
+
+#include <stdint.h>
+
+typedef struct
+{
+    const uint8_t *keyMaterial;
+    uint16_t keyLength;
+} CryptoKey;
+
+#endif
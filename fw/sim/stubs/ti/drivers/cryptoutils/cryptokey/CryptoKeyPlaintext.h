@@ -0,0 +1,18 @@
+/*
+ * Written by Sultan Qasim Khan
+ * Copyright (c) 2020, NCC Group plc
+ * Released as open source under GPLv3
+ */
+
+/* Host simulation stand-in for CryptoKeyPlaintext */
+
+#ifndef TI_DRIVERS_CRYPTOUTILS_CRYPTOKEY_CRYPTOKEYPLAINTEXT_H
+#define TI_DRIVERS_CRYPTOUTILS_CRYPTOKEY_CRYPTOKEYPLAINTEXT_H
+
+#include <stddef.h>
+#include <ti/drivers/cryptoutils/cryptokey/CryptoKey.h>
+
+int_fast16_t CryptoKeyPlaintext_initKey(CryptoKey *keyHandle, uint8_t *key,
+        size_t keyLength);
+
+#endif
@@ -0,0 +1,19 @@
+/*
+ * Written by Sultan Qasim Khan
+ * Copyright (c) 2020, NCC Group plc
+ * Released as open source under GPLv3
+ */
+
+/* Host simulation stand-in for the CC26xx PIN driver extensions */
+
+#ifndef TI_DRIVERS_PIN_PINCC26XX_H
+#define TI_DRIVERS_PIN_PINCC26XX_H
+
+#include <stdint.h>
+#include <ti/drivers/PIN.h>
+
+#define PINCC26XX_MUX_RFC_GPI0  0x2E
+
+int PINCC26XX_setMux(PIN_Handle handle, PIN_Id pinId, int32_t nMux);
+
+#endif
@@ -0,0 +1,20 @@
+/*
+ * Written by Sultan Qasim Khan
+ * Copyright (c) 2020, NCC Group plc
+ * Released as open source under GPLv3
+ */
+
+/* Host simulation stand-in for the RF driver (see sim_radio.c) */
+
+#ifndef TI_DRIVERS_RF_RF_H
+#define TI_DRIVERS_RF_RF_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <ti/devices/DeviceFamily.h>
+#include DeviceFamily_constructPath(driverlib/rf_mailbox.h)
+
+/* Virtual radio time, in 4 MHz ticks */
+uint32_t RF_getCurrentTime(void);
+
+#endif
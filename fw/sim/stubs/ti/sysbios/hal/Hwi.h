@@ -0,0 +1,17 @@
+/*
+ * Written by Sultan Qasim Khan
+ * Copyright (c) 2020, NCC Group plc
+ * Released as open source under GPLv3
+ */
+
+/* Host simulation stand-in for TI-RTOS Hwi (nothing preempts) */
+
+#ifndef TI_SYSBIOS_HAL_HWI_H
+#define TI_SYSBIOS_HAL_HWI_H
+
+#include <xdc/std.h>
+
+UInt Hwi_disable(void);
+void Hwi_restore(UInt key);
+
+#endif
@@ -0,0 +1,43 @@
+/*
+ * Written by Sultan Qasim Khan
+ * Copyright (c) 2020, NCC Group plc
+ * Released as open source under GPLv3
+ */
+
+/* Host simulation Clock API (see sim_kernel.c) */
+
+#ifndef TI_SYSBIOS_KNL_CLOCK_H
+#define TI_SYSBIOS_KNL_CLOCK_H
+
+#include <xdc/std.h>
+
+typedef void (*Clock_FuncPtr)(UArg arg);
+
+typedef struct
+{
+    uint32_t period;
+    bool startFlag;
+    UArg arg;
+} Clock_Params;
+
+typedef struct Clock_Object
+{
+    void *priv;
+} Clock_Struct;
+
+typedef Clock_Struct *Clock_Handle;
+
+/* microseconds per Clock tick, as in sniffle.cfg */
+extern const uint32_t Clock_tickPeriod;
+
+void Clock_Params_init(Clock_Params *params);
+void Clock_construct(Clock_Struct *obj, Clock_FuncPtr fxn, uint32_t timeout,
+        const Clock_Params *params);
+Clock_Handle Clock_handle(Clock_Struct *obj);
+void Clock_start(Clock_Handle clk);
+void Clock_stop(Clock_Handle clk);
+void Clock_setPeriod(Clock_Handle clk, uint32_t period);
+void Clock_setTimeout(Clock_Handle clk, uint32_t timeout);
+uint32_t Clock_getTicks(void);
+
+#endif
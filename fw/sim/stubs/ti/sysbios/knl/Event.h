@@ -0,0 +1,14 @@
+/*
+ * Written by Sultan Qasim Khan
+ * Copyright (c) 2020, NCC Group plc
+ * Released as open source under GPLv3
+ */
+
+/* Host simulation stand-in for TI-RTOS Event (unused) */
+
+#ifndef TI_SYSBIOS_KNL_EVENT_H
+#define TI_SYSBIOS_KNL_EVENT_H
+
+
+
+#endif
@@ -0,0 +1,41 @@
+/*
+ * Written by Sultan Qasim Khan
+ * Copyright (c) 2020, NCC Group plc
+ * Released as open source under GPLv3
+ */
+
+/* Host simulation Semaphore API (see sim_kernel.c) */
+
+#ifndef TI_SYSBIOS_KNL_SEMAPHORE_H
+#define TI_SYSBIOS_KNL_SEMAPHORE_H
+
+#include <xdc/std.h>
+#include <xdc/runtime/Error.h>
+
+#define Semaphore_Mode_COUNTING 0
+#define Semaphore_Mode_BINARY 1
+
+typedef struct
+{
+    int mode;
+} Semaphore_Params;
+
+typedef struct Semaphore_Object
+{
+    void *priv;
+} Semaphore_Struct;
+
+typedef Semaphore_Struct *Semaphore_Handle;
+
+void Semaphore_Params_init(Semaphore_Params *params);
+Semaphore_Handle Semaphore_create(int count, const Semaphore_Params *params,
+        Error_Block *eb);
+void Semaphore_construct(Semaphore_Struct *obj, int count,
+        const Semaphore_Params *params);
+Semaphore_Handle Semaphore_handle(Semaphore_Struct *obj);
+bool Semaphore_pend(Semaphore_Handle sem, uint32_t timeout);
+void Semaphore_post(Semaphore_Handle sem);
+int Semaphore_getCount(Semaphore_Handle sem);
+void Semaphore_reset(Semaphore_Handle sem, int count);
+
+#endif
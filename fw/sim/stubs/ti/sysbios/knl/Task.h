@@ -0,0 +1,40 @@
+/*
+ * Written by Sultan Qasim Khan
+ * Copyright (c) 2020, NCC Group plc
+ * Released as open source under GPLv3
+ */
+
+/* Host simulation Task API (see sim_kernel.c) */
+
+#ifndef TI_SYSBIOS_KNL_TASK_H
+#define TI_SYSBIOS_KNL_TASK_H
+
+#include <xdc/std.h>
+#include <xdc/runtime/Error.h>
+
+typedef void (*Task_FuncPtr)(UArg arg0, UArg arg1);
+
+typedef struct
+{
+    size_t stackSize; /* ignored, simulated tasks get a big host stack */
+    int priority;
+    void *stack;
+    UArg arg0;
+    UArg arg1;
+} Task_Params;
+
+typedef struct Task_Object
+{
+    void *priv;
+} Task_Struct;
+
+typedef Task_Struct *Task_Handle;
+
+void Task_Params_init(Task_Params *params);
+void Task_construct(Task_Struct *obj, Task_FuncPtr fxn, const Task_Params *params,
+        Error_Block *eb);
+Task_Handle Task_self(void);
+void Task_sleep(uint32_t ticks);
+void Task_yield(void);
+
+#endif
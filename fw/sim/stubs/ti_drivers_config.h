@@ -0,0 +1,19 @@
+/*
+ * Written by Sultan Qasim Khan
+ * Copyright (c) 2020, NCC Group plc
+ * Released as open source under GPLv3
+ */
+
+/* Host simulation stand-in for the SysConfig generated board config */
+
+#ifndef TI_DRIVERS_CONFIG_H
+#define TI_DRIVERS_CONFIG_H
+
+#include <ti/drivers/PIN.h>
+
+#define CONFIG_PIN_RLED     6
+#define CONFIG_PIN_GLED     7
+#define CONFIG_AESECB_0     0
+#define CONFIG_AESCCM_0     0
+
+#endif
@@ -0,0 +1,19 @@
+/*
+ * Written by Sultan Qasim Khan
+ * Copyright (c) 2020, NCC Group plc
+ * Released as open source under GPLv3
+ */
+
+/* Host simulation stand-in for xdc.runtime.Error */
+
+#ifndef XDC_RUNTIME_ERROR_H
+#define XDC_RUNTIME_ERROR_H
+
+typedef struct
+{
+    int unused;
+} Error_Block;
+
+#define Error_init(eb) ((void)(eb))
+
+#endif
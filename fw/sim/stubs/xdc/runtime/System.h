@@ -0,0 +1,14 @@
+/*
+ * Written by Sultan Qasim Khan
+ * Copyright (c) 2020, NCC Group plc
+ * Released as open source under GPLv3
+ */
+
+/* Host simulation stand-in for xdc.runtime.System */
+
+#ifndef XDC_RUNTIME_SYSTEM_H
+#define XDC_RUNTIME_SYSTEM_H
+
+void System_abort(const char *str);
+
+#endif
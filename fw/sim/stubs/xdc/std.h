@@ -0,0 +1,21 @@
+/*
+ * Written by Sultan Qasim Khan
+ * Copyright (c) 2020, NCC Group plc
+ * Released as open source under GPLv3
+ */
+
+/* Host simulation stand-in for the XDCtools standard types */
+
+#ifndef XDC_STD_H
+#define XDC_STD_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef uintptr_t UArg;
+typedef int Int;
+typedef unsigned UInt;
+typedef void *Ptr;
+
+#endif
@@ -0,0 +1,118 @@
+/*
+ * Written by Sultan Qasim Khan
+ * Copyright (c) 2020, NCC Group plc
+ * Released as open source under GPLv3
+ */
+
+#include <stddef.h>
+#include <string.h>
+#include <stdbool.h>
+#include <xdc/std.h>
+#include <ti/sysbios/knl/Clock.h>
+
+#include "stats.h"
+#include "messenger.h"
+#include "PacketTask.h"
+#include "RadioTask.h"
+
+StatsCounters stats;
+LatencyHists latency;
+
+static Clock_Struct statsClock;
+static bool clockConstructed = false;
+
+static uint8_t *addSection(uint8_t *dst, uint8_t id, const void *data, uint8_t len)
+{
+    *dst++ = id;
+    *dst++ = len;
+    memcpy(dst, data, len);
+    return dst + len;
+}
+
+unsigned stats_buildMessage(uint8_t *dst)
+{
+    uint8_t *msg_ptr = dst;
+    unsigned len;
+
+    *msg_ptr++ = MESSAGE_STATS;
+
+    // everything before rxFrames, in struct order
+    msg_ptr = addSection(msg_ptr, STATS_SECT_COUNTERS, &stats,
+            offsetof(StatsCounters, rxFrames));
+    msg_ptr = addSection(msg_ptr, STATS_SECT_RXCHAN, stats.rxFrames,
+            sizeof(stats.rxFrames));
+
+#if STATS_LATENCY
+    msg_ptr = addSection(msg_ptr, STATS_SECT_LAT_RX2UART, latency.rxToUart,
+            sizeof(latency.rxToUart));
+    msg_ptr = addSection(msg_ptr, STATS_SECT_LAT_RFCB, latency.rfCallback,
+            sizeof(latency.rfCallback));
+    msg_ptr = addSection(msg_ptr, STATS_SECT_LAT_CONNREQ, latency.connReq,
+            sizeof(latency.connReq));
+#endif
+
+    // built in place, header filled in after
+    len = getDataChanStats(msg_ptr + 2);
+    if (len)
+    {
+        msg_ptr[0] = STATS_SECT_DATACHAN;
+        msg_ptr[1] = len;
+        msg_ptr += len + 2;
+    }
+
+    return msg_ptr - dst;
+}
+
+void stats_latency(uint32_t *hist, uint32_t ticks)
+{
+    unsigned bucket = ticks ? 31 - __builtin_clz(ticks) : 0;
+
+    if (bucket >= LATENCY_BUCKETS)
+        bucket = LATENCY_BUCKETS - 1;
+    hist[bucket]++;
+}
+
+// PacketTask builds the actual message when it gets to this frame
+static void indicateStats()
+{
+    BLE_Frame frame;
+
+    frame.timestamp = 0;
+    frame.rssi = 0;
+    frame.channel = 43; // indicates stats message
+    frame.phy = PHY_1M;
+    frame.pData = NULL;
+    frame.pEntry = NULL;
+    frame.length = 0;
+
+    indicatePacket(&frame);
+}
+
+static void statsClockFunc(UArg arg)
+{
+    indicateStats();
+}
+
+void stats_request(uint16_t periodMs)
+{
+    uint32_t ticks = (periodMs * 1000u) / Clock_tickPeriod;
+
+    if (!clockConstructed)
+    {
+        Clock_Params clockParams;
+        Clock_Params_init(&clockParams);
+        clockParams.startFlag = false;
+        Clock_construct(&statsClock, statsClockFunc, 1, &clockParams);
+        clockConstructed = true;
+    }
+
+    Clock_stop(Clock_handle(&statsClock));
+    indicateStats();
+
+    if (ticks)
+    {
+        Clock_setPeriod(Clock_handle(&statsClock), ticks);
+        Clock_setTimeout(Clock_handle(&statsClock), ticks);
+        Clock_start(Clock_handle(&statsClock));
+    }
+}
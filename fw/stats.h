@@ -0,0 +1,80 @@
+/*
+ * Written by Sultan Qasim Khan
+ * Copyright (c) 2020, NCC Group plc
+ * Released as open source under GPLv3
+ */
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+
+// counters are cumulative since boot, host should look at deltas
+// they're updated without locking, and may be slightly off under contention
+typedef struct
+{
+    uint32_t queueDrops;    // PacketTask queue full
+    uint32_t rssiRejects;   // below minimum RSSI
+    uint32_t macRejects;    // failed MAC/RPA filter
+    uint32_t crcErrors;     // reported by RF core, never seen by software
+    uint32_t rfBufFull;     // RF core had no free data entry
+    uint32_t txQueueDrops;  // TXQueue full
+    uint32_t cmdErrors;     // malformed or invalid commands
+    uint32_t uartBytes;     // bytes written to UART
+    uint32_t advCacheHits;  // advertiser header cache lookups found
+    uint32_t advCacheMisses; // advertiser header cache lookups not found
+    uint32_t pduRejects;    // failed PDU/AD filter
+    uint32_t aggSuppressed; // repeated advertisements left to summaries
+    uint32_t deferDrops;    // RX frames dropped in the RF callback, defer ring full
+    uint32_t rxFrames[40];  // frames received on each channel, before filtering
+} StatsCounters;
+
+extern StatsCounters stats;
+
+// latency instrumentation is left out unless built with STATS_LATENCY=1
+#ifndef STATS_LATENCY
+#define STATS_LATENCY 0
+#endif
+
+/* Latency histograms, in radio ticks (4 MHz). Bucket n counts durations
+ * from 2^n up to 2^(n+1) ticks, except that bucket 0 also takes 0 ticks and
+ * the last bucket takes everything longer.
+ */
+#define LATENCY_BUCKETS 24
+
+typedef struct
+{
+    uint32_t rxToUart[LATENCY_BUCKETS];   // RF callback to messenger_send returning
+    uint32_t rfCallback[LATENCY_BUCKETS]; // RX callback execution time
+    uint32_t connReq[LATENCY_BUCKETS];    // reactToPDU handling a CONNECT_IND
+} LatencyHists;
+
+extern LatencyHists latency;
+
+// count a duration in a histogram
+void stats_latency(uint32_t *hist, uint32_t ticks);
+
+// section IDs in stats message
+#define STATS_SECT_COUNTERS 0x00
+#define STATS_SECT_RXCHAN   0x01
+#define STATS_SECT_LAT_RX2UART  0x02
+#define STATS_SECT_LAT_RFCB     0x03
+#define STATS_SECT_LAT_CONNREQ  0x04
+#define STATS_SECT_DATACHAN     0x05    // left out when not following
+
+// maximum length of the stats message (including message type byte)
+#define STATS_MESSAGE_MAX 768
+
+/* Stats message format:
+ * Byte 0:      MESSAGE_STATS
+ * Then for each section:
+ *   Byte 0:    section ID
+ *   Byte 1:    section data length
+ *   Bytes 2+:  section data
+ */
+unsigned stats_buildMessage(uint8_t *dst);
+
+// queue a stats message to be sent now, then every periodMs (0 for once)
+void stats_request(uint16_t periodMs);
+
+#endif
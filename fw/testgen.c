@@ -0,0 +1,105 @@
+/*
+ * Written by Sultan Qasim Khan
+ * Copyright (c) 2020, NCC Group plc
+ * Released as open source under GPLv3
+ */
+
+#include <string.h>
+#include <xdc/std.h>
+#include <ti/sysbios/knl/Clock.h>
+
+#include "testgen.h"
+#include "timebase.h"
+#include "PacketTask.h"
+
+// generator runs every millisecond, injecting up to this many frames
+#define TESTGEN_BURST_MAX 32
+
+static Clock_Struct genClock;
+static bool clockConstructed = false;
+
+static uint16_t genLen;
+static uint32_t genRate;
+static uint32_t genCount;
+static uint32_t genSeq;
+
+// thousandths of a frame owed, so rates needn't be a multiple of 1000
+static uint32_t genAcc;
+
+static void injectFrame(void)
+{
+    BLE_Frame frame;
+    uint8_t buf[TESTGEN_MAX_LEN];
+    unsigned i;
+
+    buf[0] = 0x0E;
+    buf[1] = genLen - 2;
+    memcpy(buf + 2, &genSeq, sizeof(genSeq));
+    for (i = 6; i < genLen; i++)
+        buf[i] = genSeq + i;
+
+    // same time base as received frames
+    frame.timestamp = (uint32_t)timebase_now() >> 2;
+    frame.rssi = -40;
+    frame.channel = TESTGEN_CHANNEL;
+    frame.phy = PHY_1M;
+    frame.pData = buf;
+    frame.pEntry = NULL;
+    frame.length = genLen;
+
+    indicatePacket(&frame);
+    genSeq++;
+}
+
+static void genClockFunc(UArg arg)
+{
+    unsigned burst;
+
+    genAcc += genRate;
+    if (genAcc > 1000u * TESTGEN_BURST_MAX)
+        genAcc = 1000u * TESTGEN_BURST_MAX;
+
+    for (burst = 0; genAcc >= 1000 && burst < TESTGEN_BURST_MAX; burst++)
+    {
+        if (genCount && genSeq >= genCount)
+        {
+            Clock_stop(Clock_handle(&genClock));
+            return;
+        }
+        injectFrame();
+        genAcc -= 1000;
+    }
+}
+
+bool testgen_start(uint16_t len, uint32_t rate, uint32_t count)
+{
+    uint32_t ticks = 1000u / Clock_tickPeriod;
+
+    if (rate && (len < TESTGEN_MIN_LEN || len > TESTGEN_MAX_LEN))
+        return false;
+
+    if (!clockConstructed)
+    {
+        Clock_Params clockParams;
+        Clock_Params_init(&clockParams);
+        clockParams.startFlag = false;
+        Clock_construct(&genClock, genClockFunc, 1, &clockParams);
+        clockConstructed = true;
+    }
+
+    Clock_stop(Clock_handle(&genClock));
+    if (!rate)
+        return true;
+
+    genLen = len;
+    genRate = rate;
+    genCount = count;
+    genSeq = 0;
+    genAcc = 0;
+
+    Clock_setPeriod(Clock_handle(&genClock), ticks);
+    Clock_setTimeout(Clock_handle(&genClock), ticks);
+    Clock_start(Clock_handle(&genClock));
+
+    return true;
+}
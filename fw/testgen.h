@@ -0,0 +1,32 @@
+/*
+ * Written by Sultan Qasim Khan
+ * Copyright (c) 2020, NCC Group plc
+ * Released as open source under GPLv3
+ */
+
+#ifndef TESTGEN_H
+#define TESTGEN_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// frames without an RF queue entry are copied into PacketTask's queue,
+// which only takes up to 128 bytes of them
+#define TESTGEN_MIN_LEN 6
+#define TESTGEN_MAX_LEN 128
+
+// synthetic frames are sent with this channel, and skip all filtering
+#define TESTGEN_CHANNEL 63
+
+/* Synthetic frame body:
+ * Byte 0:      0x0E (data PDU header, LLID 2, so it looks harmless)
+ * Byte 1:      length of rest of body
+ * Bytes 2-5:   sequence number (little endian, from 0 each run)
+ * Bytes 6+:    sequence number + offset, for each byte
+ */
+
+// inject rate frames per second of len bytes straight into indicatePacket,
+// stopping after count frames (0 for no limit), or now if rate is 0
+bool testgen_start(uint16_t len, uint32_t rate, uint32_t count);
+
+#endif
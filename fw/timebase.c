@@ -0,0 +1,183 @@
+/*
+ * Written by Sultan Qasim Khan
+ * Copyright (c) 2020, NCC Group plc
+ * Released as open source under GPLv3
+ */
+
+#include <string.h>
+#include <xdc/std.h>
+#include <ti/sysbios/knl/Clock.h>
+#include <ti/sysbios/hal/Hwi.h>
+#include <ti/drivers/PIN.h>
+#include <ti/drivers/pin/PINCC26XX.h>
+#include <ti/drivers/rf/RF.h>
+#include <ti/devices/DeviceFamily.h>
+#include DeviceFamily_constructPath(driverlib/ioc.h)
+
+#include "timebase.h"
+#include "PacketTask.h"
+#include "RadioWrapper.h"
+
+// DIO for sync pulses, free on the LaunchPad headers
+#ifndef SYNC_PIN
+#define SYNC_PIN IOID_21
+#endif
+
+// radio time wraps every ~18 minutes, so check well within that
+#define WRAP_CHECK_MS 60000
+
+static uint32_t lastTicks = 0;
+static uint32_t tickWraps = 0;
+static Clock_Struct wrapClock;
+
+static PIN_State syncPinState;
+static PIN_Handle syncPinHandle = NULL;
+static Clock_Struct syncClock;
+static bool syncClockConstructed = false;
+static bool syncLevel = false;
+static uint32_t syncCount = 0;
+
+// routed to the radio timer for capture, rather than interrupting
+static const PIN_Config syncInTable[] = {
+    SYNC_PIN | PIN_INPUT_EN | PIN_PULLDOWN | PIN_IRQ_DIS,
+    PIN_TERMINATE
+};
+
+static const PIN_Config syncOutTable[] = {
+    SYNC_PIN | PIN_GPIO_OUTPUT_EN | PIN_GPIO_LOW | PIN_PUSHPULL | PIN_DRVSTR_MAX,
+    PIN_TERMINATE
+};
+
+uint64_t timebase_now(void)
+{
+    unsigned key = Hwi_disable();
+    uint32_t t = RF_getCurrentTime();
+    uint64_t ret;
+
+    if (t < lastTicks)
+        tickWraps++;
+    lastTicks = t;
+    ret = ((uint64_t)tickWraps << 32) | t;
+
+    Hwi_restore(key);
+    return ret;
+}
+
+// 64 bit radio time for a tick count from within the last ~18 minutes
+static uint64_t extendTicks(uint32_t ticks)
+{
+    uint64_t now = timebase_now();
+
+    return now - (uint32_t)((uint32_t)now - ticks);
+}
+
+uint64_t timebase_extend_us(uint32_t us)
+{
+    uint64_t now = timebase_now() >> 2;
+
+    // timestamp is in the past, so subtract its (wrapping) 30 bit age
+    return now - (((uint32_t)now - us) & 0x3FFFFFFF);
+}
+
+static void wrapClockFunc(UArg arg)
+{
+    timebase_now();
+}
+
+void timebase_init(void)
+{
+    Clock_Params clockParams;
+    Clock_Params_init(&clockParams);
+    clockParams.period = (WRAP_CHECK_MS * 1000u) / Clock_tickPeriod;
+    clockParams.startFlag = true;
+    Clock_construct(&wrapClock, wrapClockFunc, clockParams.period, &clockParams);
+}
+
+// PacketTask turns this into a MESSAGE_SYNC
+static void reportPulse(uint64_t ticks)
+{
+    BLE_Frame frame;
+    uint8_t buf[SYNC_MESSAGE_LEN];
+    uint64_t us = ticks >> 2;
+
+    memcpy(buf, &syncCount, 4);
+    memcpy(buf + 4, &us, 8);
+    syncCount++;
+
+    frame.timestamp = 0;
+    frame.rssi = 0;
+    frame.channel = 46; // indicates sync pulse
+    frame.phy = PHY_1M;
+    frame.pData = buf;
+    frame.pEntry = NULL;
+    frame.length = sizeof(buf);
+
+    indicatePacket(&frame);
+}
+
+// edge time was captured by the radio timer, so callback latency doesn't matter
+static void syncCaptureCallback(uint32_t ticks)
+{
+    reportPulse(extendTicks(ticks));
+}
+
+// toggles every half period, rising edges are the pulses
+// timestamped just after being driven, so only Hwis can get in between
+static void syncClockFunc(UArg arg)
+{
+    syncLevel = !syncLevel;
+    PIN_setOutputValue(syncPinHandle, SYNC_PIN, syncLevel);
+    if (syncLevel)
+        reportPulse(timebase_now());
+}
+
+bool timebase_setSync(uint8_t mode, uint16_t periodMs)
+{
+    if (mode > SYNC_OUTPUT)
+        return false;
+    if (mode == SYNC_OUTPUT && periodMs < 2)
+        return false;
+
+    if (!syncClockConstructed)
+    {
+        Clock_Params clockParams;
+        Clock_Params_init(&clockParams);
+        clockParams.startFlag = false;
+        Clock_construct(&syncClock, syncClockFunc, 1, &clockParams);
+        syncClockConstructed = true;
+    }
+
+    Clock_stop(Clock_handle(&syncClock));
+    RadioWrapper_stopCapture();
+    if (syncPinHandle)
+    {
+        PIN_close(syncPinHandle);
+        syncPinHandle = NULL;
+    }
+    syncLevel = false;
+    syncCount = 0;
+
+    if (mode == SYNC_INPUT)
+    {
+        syncPinHandle = PIN_open(&syncPinState, syncInTable);
+        if (!syncPinHandle)
+            return false;
+        PINCC26XX_setMux(syncPinHandle, SYNC_PIN, PINCC26XX_MUX_RFC_GPI0);
+        if (RadioWrapper_captureEdges(syncCaptureCallback) != 0)
+        {
+            PIN_close(syncPinHandle);
+            syncPinHandle = NULL;
+            return false;
+        }
+    } else if (mode == SYNC_OUTPUT) {
+        uint32_t ticks = (periodMs * 500u) / Clock_tickPeriod;
+        syncPinHandle = PIN_open(&syncPinState, syncOutTable);
+        if (!syncPinHandle)
+            return false;
+        Clock_setPeriod(Clock_handle(&syncClock), ticks);
+        Clock_setTimeout(Clock_handle(&syncClock), ticks);
+        Clock_start(Clock_handle(&syncClock));
+    }
+
+    return true;
+}
@@ -0,0 +1,34 @@
+/*
+ * Written by Sultan Qasim Khan
+ * Copyright (c) 2020, NCC Group plc
+ * Released as open source under GPLv3
+ */
+
+#ifndef TIMEBASE_H
+#define TIMEBASE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// sync pulse pin modes
+#define SYNC_OFF                0
+#define SYNC_INPUT              1 // timestamp rising edges from another sniffer
+#define SYNC_OUTPUT             2 // generate pulses, and timestamp them
+
+// 4 byte pulse count, 8 byte microsecond timestamp
+#define SYNC_MESSAGE_LEN        12
+
+// starts a clock that keeps wraparound tracking current
+void timebase_init(void);
+
+// radio time (4 MHz ticks) extended to 64 bits
+uint64_t timebase_now(void);
+
+// 64 bit microsecond time for a BLE_Frame.timestamp taken within the
+// last ~17 minutes (frame timestamps are 32 bit ticks >> 2, so 30 bits)
+uint64_t timebase_extend_us(uint32_t us);
+
+// configure the sync pulse pin, output pulses every periodMs
+bool timebase_setSync(uint8_t mode, uint16_t periodMs);
+
+#endif
@@ -0,0 +1,127 @@
+/*
+ * Written by Sultan Qasim Khan
+ * Copyright (c) 2020, NCC Group plc
+ * Released as open source under GPLv3
+ */
+
+#include <string.h>
+#include <xdc/std.h>
+#include <ti/sysbios/hal/Hwi.h>
+
+#include "trace.h"
+#include "messenger.h"
+#include "timebase.h"
+#include "PacketTask.h"
+
+#define RING_MASK (TRACE_RING_SIZE - 1)
+
+#if TRACE_RING_SIZE & RING_MASK
+#error "TRACE_RING_SIZE must be a power of 2"
+#endif
+
+typedef struct
+{
+    uint8_t id;
+    uint8_t nargs;
+    uint32_t timestamp;
+    uint32_t args[TRACE_ARGS_MAX];
+} TraceRecord;
+
+static TraceRecord ring[TRACE_RING_SIZE];
+static volatile unsigned head = 0;  // next record to write
+static volatile unsigned tail = 0;  // next record to send
+static uint16_t lost = 0;
+
+/* A trace frame is in PacketTask's queue, no need to queue another. If it
+ * was dropped because the queue was full, PacketTask picks up the records
+ * next time it goes idle instead.
+ */
+static bool indicated = false;
+
+// PacketTask builds the actual message when it gets to this frame
+static void indicateTrace()
+{
+    BLE_Frame frame;
+
+    frame.timestamp = 0;
+    frame.rssi = 0;
+    frame.channel = 48; // indicates trace message
+    frame.phy = PHY_1M;
+    frame.pData = NULL;
+    frame.pEntry = NULL;
+    frame.length = 0;
+
+    indicatePacket(&frame);
+}
+
+void trace_emit(TraceFormat id, unsigned nargs, uint32_t a0, uint32_t a1,
+        uint32_t a2)
+{
+    TraceRecord *r;
+    uint32_t ts = (uint32_t)timebase_now() >> 2;
+    unsigned key;
+    bool notify;
+
+    if (nargs > TRACE_ARGS_MAX)
+        nargs = TRACE_ARGS_MAX;
+
+    key = Hwi_disable();
+    if (head - tail >= TRACE_RING_SIZE)
+    {
+        if (lost < 0xFFFF)
+            lost++;
+    } else {
+        r = ring + (head & RING_MASK);
+        r->id = id;
+        r->nargs = nargs;
+        r->timestamp = ts;
+        r->args[0] = a0;
+        r->args[1] = a1;
+        r->args[2] = a2;
+        head++;
+    }
+    notify = !indicated;
+    indicated = true;
+    Hwi_restore(key);
+
+    if (notify)
+        indicateTrace();
+}
+
+bool trace_pending(void)
+{
+    return head != tail || lost;
+}
+
+unsigned trace_buildMessage(uint8_t *dst)
+{
+    uint8_t *msg_ptr = dst;
+    TraceRecord r;
+    unsigned key;
+
+    *msg_ptr++ = MESSAGE_TRACE;
+
+    // anything traced from here on needs another message
+    key = Hwi_disable();
+    indicated = false;
+    memcpy(msg_ptr, &lost, sizeof(lost));
+    lost = 0;
+    Hwi_restore(key);
+    msg_ptr += sizeof(uint16_t);
+
+    // producers only touch head, so no lock is needed to read the ring
+    while (tail != head)
+    {
+        r = ring[tail & RING_MASK];
+        tail++;
+
+        *msg_ptr++ = r.id;
+        *msg_ptr++ = r.nargs;
+        memcpy(msg_ptr, &r.timestamp, sizeof(r.timestamp));
+        msg_ptr += sizeof(r.timestamp);
+        memcpy(msg_ptr, r.args, r.nargs * sizeof(uint32_t));
+        msg_ptr += r.nargs * sizeof(uint32_t);
+    }
+
+    return msg_ptr - dst;
+}
@@ -0,0 +1,60 @@
+/*
+ * Written by Sultan Qasim Khan
+ * Copyright (c) 2020, NCC Group plc
+ * Released as open source under GPLv3
+ */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Deferred debug prints. Rather than formatting text where it's logged like
+ * dprintf, a trace call only stores a format ID, timestamp, and raw arguments
+ * in a small ring. PacketTask later sends the ring contents to the host,
+ * which formats them with the table generated from trace_fmt.def.
+ *
+ * Trace message format:
+ * Byte 0:      MESSAGE_TRACE
+ * Bytes 1-2:   records lost to a full ring since the last trace message
+ * Then for each record:
+ *   Byte 0:        format ID
+ *   Byte 1:        number of arguments (n)
+ *   Bytes 2-5:     timestamp (microseconds, as in BLE frames)
+ *   Bytes 6+:      n 32 bit arguments
+ */
+
+#define TRACE_FMT(id, fmt) id,
+typedef enum
+{
+#include "trace_fmt.def"
+    TRACE_FMT_COUNT
+} TraceFormat;
+#undef TRACE_FMT
+
+#define TRACE_ARGS_MAX 3
+
+// number of records buffered (power of 2)
+#ifndef TRACE_RING_SIZE
+#define TRACE_RING_SIZE 32
+#endif
+
+#define TRACE_MESSAGE_MAX (3 + TRACE_RING_SIZE * (6 + 4 * TRACE_ARGS_MAX))
+
+// safe to call from any context
+void trace_emit(TraceFormat id, unsigned nargs, uint32_t a0, uint32_t a1,
+        uint32_t a2);
+
+#define dtrace0(id)             trace_emit(id, 0, 0, 0, 0)
+#define dtrace1(id, a)          trace_emit(id, 1, a, 0, 0)
+#define dtrace2(id, a, b)       trace_emit(id, 2, a, b, 0)
+#define dtrace3(id, a, b, c)    trace_emit(id, 3, a, b, c)
+
+// true if there are records (or losses) waiting to be sent
+bool trace_pending(void);
+
+// dst must have room for TRACE_MESSAGE_MAX bytes
+unsigned trace_buildMessage(uint8_t *dst);
+
+#endif
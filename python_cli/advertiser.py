@@ -15,8 +15,14 @@ hw = None
 def main():
     aparse = argparse.ArgumentParser(description="Connection initiator test script for Sniffle BLE5 sniffer")
     aparse.add_argument("-s", "--serport", default="/dev/ttyACM0", help="Sniffer serial port name")
+    aparse.add_argument("-e", "--extadv", default=0, type=int,
+            help="Also send EXTADV extended advertising sets (up to 3), interleaved with the legacy one")
     args = aparse.parse_args()
 
+    if not (0 <= args.extadv <= 3):
+        print("Up to 3 extended advertising sets are supported!", file=sys.stderr)
+        return
+
     global hw
     hw = SniffleHW(args.serport)
 
@@ -59,6 +65,15 @@ def main():
     # now enter advertiser mode
     hw.cmd_advertise(advData, scanRspData)
 
+    # extended sets have room for much more data, eg. a long name
+    for i in range(1, args.extadv + 1):
+        extName = b'NCC Goat extended advertising set %d ' % i + b'-' * 150
+        extData = advData[:3] + bytes([len(extName) + 1, 0x09]) + extName
+        hw.cmd_adv_set(i, extData, intervalMs=300, extended=True)
+
+    # drain serial port on a separate thread, so output can't stall it
+    hw.start_reader()
+
     while True:
         msg = hw.recv_and_decode()
         print_message(msg)
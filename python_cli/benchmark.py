@@ -0,0 +1,151 @@
+#!/usr/bin/env python3
+
+# Written by Sultan Qasim Khan
+# Copyright (c) 2020, NCC Group plc
+# Released as open source under GPLv3
+
+import argparse, sys
+from time import time, process_time
+from struct import unpack
+from sniffle_hw import SniffleHW, BLE_ADV_AA, PacketMessage, StatsMessage, \
+        FRAMING_BASE64, FRAMING_COBS, TESTGEN_CHANNEL, FRAMEFMT_COMPACT
+from packet_decoder import DPacketMessage
+import fast_reader
+
+class Results:
+    def __init__(self):
+        self.received = 0
+        self.max_seq = -1
+        self.reordered = 0
+        self.first_time = None
+        self.last_time = None
+        self.decode_cpu = 0.
+
+    def add(self, pkt, decode_cpu):
+        now = time()
+        if self.first_time is None:
+            self.first_time = now
+        self.last_time = now
+        self.received += 1
+        self.decode_cpu += decode_cpu
+
+        seq, = unpack("<L", pkt.body[2:6])
+        if seq < self.max_seq:
+            self.reordered += 1
+        else:
+            self.max_seq = seq
+
+def read_stats(hw):
+    hw.cmd_stats(0)
+    while True:
+        msg = hw.recv_and_decode()
+        if isinstance(msg, StatsMessage):
+            return msg
+
+def counter_delta(before, after, name):
+    return after.counters.get(name, 0) - before.counters.get(name, 0)
+
+def main():
+    aparse = argparse.ArgumentParser(description=
+            "Firmware to host throughput benchmark for Sniffle, using synthetic frames")
+    aparse.add_argument("-s", "--serport", default="/dev/ttyACM0", help="Sniffer serial port name")
+    aparse.add_argument("-l", "--length", default=64, type=int,
+            help="Synthetic frame length in bytes (6 to 128)")
+    aparse.add_argument("-r", "--rate", default=2000, type=int,
+            help="Synthetic frames per second")
+    aparse.add_argument("-d", "--duration", default=5., type=float,
+            help="Seconds to generate frames for")
+    aparse.add_argument("-c", "--cobs", action="store_const", default=False, const=True,
+            help="Use COBS framing instead of base64")
+    aparse.add_argument("-b", "--batch", default=0, type=int,
+            help="Batch messages up to BATCH bytes (0 to disable)")
+    aparse.add_argument("-x", "--compact", action="store_const", default=False, const=True,
+            help="Use compact (delta timestamp) frame headers")
+    aparse.add_argument("-f", "--fast", action="store_const", default=False, const=True,
+            help="Use the native bulk receive path (libsniffle_fast.so)")
+    args = aparse.parse_args()
+
+    if args.fast and not fast_reader.available():
+        print("libsniffle_fast.so not built, see sniffle_fast.c", file=sys.stderr)
+        return
+
+    hw = SniffleHW(args.serport)
+
+    # framing can't be part of a transaction
+    hw.cmd_framing(FRAMING_COBS if args.cobs else FRAMING_BASE64)
+
+    # keep real traffic out of the way: stay on 37, reject every advertisement by RSSI
+    with hw.transaction():
+        hw.cmd_chan_aa_phy(37, BLE_ADV_AA, 0)
+        hw.cmd_follow(False)
+        hw.cmd_rssi(127)
+        hw.cmd_mac()
+        hw.cmd_auxadv(False)
+        hw.cmd_batching(args.batch)
+        hw.cmd_frame_format(FRAMEFMT_COMPACT if args.compact else 0)
+    hw.mark_and_flush()
+
+    reader = fast_reader.FastReader(hw) if args.fast else None
+    res = Results()
+
+    before = read_stats(hw)
+    count = int(args.rate * args.duration)
+    cpu_start = process_time()
+    hw.cmd_testgen(args.length, args.rate, count)
+
+    # stats message is queued after any remaining synthetic frames, so it marks the end
+    stop_time = time() + args.duration + 0.5
+    stop_sent = False
+    after = None
+    while after is None:
+        if reader:
+            t0 = process_time()
+            msgs = reader.read_messages()
+            per_msg = (process_time() - t0) / max(len(msgs), 1)
+        else:
+            mtype, mbody, _ = hw.recv_msg()
+            t0 = process_time()
+            msgs = [hw.decode_msg(mtype, mbody)]
+            per_msg = None
+
+        for msg in msgs:
+            if isinstance(msg, PacketMessage) and msg.chan == TESTGEN_CHANNEL:
+                t1 = process_time()
+                DPacketMessage.decode(msg)
+                cpu = (process_time() - t1) + (per_msg if per_msg is not None else t1 - t0)
+                res.add(msg, cpu)
+            elif isinstance(msg, StatsMessage) and stop_sent:
+                after = msg
+
+        if not stop_sent and (time() >= stop_time or res.max_seq + 1 >= count):
+            hw.cmd_testgen(0, 0)
+            hw.cmd_stats(0)
+            stop_sent = True
+
+    cpu_total = process_time() - cpu_start
+
+    elapsed = (res.last_time - res.first_time) if res.received > 1 else 0.
+    generated = res.max_seq + 1
+    lost = generated - res.received
+    fw_drops = counter_delta(before, after, "queue_drops")
+    uart_bytes = counter_delta(before, after, "uart_bytes")
+
+    print("Frame length:      %d bytes, requested %d frames/s" % (args.length, args.rate))
+    print("Framing:           %s, batching %s" % ("COBS" if args.cobs else "base64",
+        "%d bytes" % args.batch if args.batch else "off"))
+    print("Frame headers:     %s" % ("compact" if args.compact else "full"))
+    print("Receive path:      %s" % ("native" if reader else "Python"))
+    print("Frames received:   %d of %d generated (%.2f%% lost)" % (res.received, generated,
+        100. * lost / generated if generated else 0.))
+    print("Firmware drops:    %d (PacketTask queue full)" % fw_drops)
+    if res.reordered:
+        print("Out of order:      %d" % res.reordered)
+    if elapsed:
+        print("Throughput:        %.0f frames/s, %.0f UART bytes/s" % (
+            (res.received - 1) / elapsed, uart_bytes / elapsed))
+    if res.received:
+        print("Host CPU:          %.1f us/frame decoding, %.1f us/frame total" % (
+            1E6 * res.decode_cpu / res.received, 1E6 * cpu_total / res.received))
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,86 @@
+# Written by Sultan Qasim Khan
+# Copyright (c) 2020, NCC Group plc
+# Released as open source under GPLv3
+
+from collections import deque
+
+class ClockSync:
+    """
+    Maps radio time (64 bit microseconds) of several sniffers onto that of a
+    reference sniffer, using edges of a shared sync pulse (see
+    SniffleHW.cmd_sync). The reference pulses every period seconds, and
+    timestamps each edge in software right after driving it. The others
+    capture edges on their radio timers in hardware, while their radios are
+    on. Pulses are paired up by host arrival time, which
+    only needs to be accurate to well under half a period, and offset plus
+    drift come from a least squares fit over the last few pairs.
+    """
+    def __init__(self, ref, period=1.0, window=16):
+        self.ref = ref
+        self.period = period
+        self.window = window
+        self.ref_pulses = deque(maxlen=window * 2)
+        self.pairs = {}
+        self.fits = {}
+
+    def add_pulse(self, src, msg):
+        if src is self.ref:
+            self.ref_pulses.append((msg.host_time, msg.ts_radio))
+            return
+
+        # find the reference edge this one was the same as
+        best = None
+        for host_time, ts_ref in self.ref_pulses:
+            dt = abs(host_time - msg.host_time)
+            if dt < self.period * 0.4 and (best is None or dt < best[0]):
+                best = (dt, ts_ref)
+        if best is None:
+            return
+
+        pairs = self.pairs.setdefault(src, deque(maxlen=self.window))
+        pairs.append((msg.ts_radio, best[1]))
+        self._fit(src, pairs)
+
+    def _fit(self, src, pairs):
+        # centre values so float precision isn't lost on large timestamps
+        x0, y0 = pairs[-1]
+        n = len(pairs)
+        if n == 1:
+            self.fits[src] = (x0, y0, 1.0)
+            return
+        xs = [x - x0 for x, _ in pairs]
+        ys = [y - y0 for _, y in pairs]
+        mx = sum(xs) / n
+        my = sum(ys) / n
+        sxx = sum((x - mx) ** 2 for x in xs)
+        sxy = sum((x - mx) * (y - my) for x, y in zip(xs, ys))
+        slope = sxy / sxx if sxx else 1.0
+        self.fits[src] = (x0 + mx, y0 + my, slope)
+
+    def synced(self, src):
+        return src is self.ref or src in self.fits
+
+    # src radio time to reference radio time (None if not yet synced)
+    def to_ref(self, src, ts):
+        if src is self.ref:
+            return ts
+        fit = self.fits.get(src)
+        if fit is None:
+            return None
+        x0, y0, slope = fit
+        return y0 + (ts - x0) * slope
+
+    # reference radio time to src radio time (None if not yet synced)
+    def from_ref(self, src, ts):
+        if src is self.ref:
+            return ts
+        fit = self.fits.get(src)
+        if fit is None:
+            return None
+        x0, y0, slope = fit
+        return x0 + (ts - y0) / slope
+
+    # drift of src relative to reference, in parts per million
+    def drift_ppm(self, src):
+        fit = self.fits.get(src)
+        return None if fit is None else (1.0 / fit[2] - 1.0) * 1E6
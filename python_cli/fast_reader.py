@@ -0,0 +1,188 @@
+# Written by Sultan Qasim Khan
+# Copyright (c) 2020, NCC Group plc
+# Released as open source under GPLv3
+
+# Optional native bulk receive path for SniffleHW. The parser in
+# sniffle_fast.c must be built first (see top of that file); without it,
+# FastReader falls back to SniffleHW.recv_msg.
+
+import ctypes, os
+from struct import pack
+from sniffle_hw import FRAMING_COBS, FRAMEFMT_TS64, FRAMEFMT_ORIGLEN, FRAMEFMT_AA, \
+        FRAMEFMT_SEQ
+
+try:
+    import numpy
+except ImportError:
+    numpy = None
+
+# keep in sync with SniffleRec in sniffle_fast.c
+class FastRecord(ctypes.Structure):
+    _fields_ = [
+        ("ts", ctypes.c_uint32),
+        ("data_off", ctypes.c_uint32),
+        ("length", ctypes.c_uint16),
+        ("mtype", ctypes.c_uint8),
+        ("rssi", ctypes.c_int8),
+        ("chan", ctypes.c_uint8),
+        ("phy", ctypes.c_uint8),
+        ("flags", ctypes.c_uint8),
+        ("reserved", ctypes.c_uint8),
+        ("ts_high", ctypes.c_uint32),
+        ("aa", ctypes.c_uint32),
+        ("orig_len", ctypes.c_uint16),
+        ("seq", ctypes.c_uint16)]
+
+# keep in sync with SniffleState in sniffle_fast.c
+class FastState(ctypes.Structure):
+    _fields_ = [
+        ("frame_ts", ctypes.c_uint32),
+        ("frame_ts_valid", ctypes.c_uint8)]
+
+if numpy is not None:
+    RECORD_DTYPE = numpy.dtype([
+        ("ts", "<u4"), ("data_off", "<u4"), ("length", "<u2"), ("mtype", "u1"),
+        ("rssi", "i1"), ("chan", "u1"), ("phy", "u1"), ("flags", "u1"),
+        ("reserved", "u1"), ("ts_high", "<u4"), ("aa", "<u4"), ("orig_len", "<u2"),
+        ("seq", "<u2")])
+
+def _load_lib():
+    path = os.path.join(os.path.dirname(os.path.abspath(__file__)), "libsniffle_fast.so")
+    try:
+        lib = ctypes.CDLL(path)
+    except OSError:
+        return None
+    lib.sniffle_parse.restype = ctypes.c_int
+    lib.sniffle_parse.argtypes = [ctypes.POINTER(FastState), ctypes.c_char_p,
+            ctypes.c_size_t, ctypes.c_int,
+            ctypes.POINTER(FastRecord), ctypes.c_int, ctypes.c_void_p, ctypes.c_size_t,
+            ctypes.POINTER(ctypes.c_size_t), ctypes.POINTER(ctypes.c_size_t),
+            ctypes.POINTER(ctypes.c_uint32)]
+    return lib
+
+_lib = _load_lib()
+
+def available():
+    return _lib is not None
+
+class RecordBatch:
+    def __init__(self, recs, count, data):
+        self.recs = recs
+        self.count = count
+        self.data = data
+
+    def __len__(self):
+        return self.count
+
+    def body(self, i):
+        r = self.recs[i]
+        return self.data[r.data_off:r.data_off + r.length]
+
+    # structured array view (copied), or None if numpy is unavailable
+    def as_numpy(self):
+        if numpy is None:
+            return None
+        return numpy.frombuffer(self.recs, dtype=RECORD_DTYPE, count=self.count).copy()
+
+class FastReader:
+    def __init__(self, hw, max_recs=512, data_cap=65536):
+        self.hw = hw
+        self.rx = bytearray()
+        self.errors = 0
+        self.max_recs = max_recs
+        self.data_cap = data_cap
+        if _lib:
+            self.state = FastState()
+            self.recs = (FastRecord * max_recs)()
+            self.data = ctypes.create_string_buffer(data_cap)
+
+    # Read whatever the serial port has (blocking for at least one byte),
+    # and return a RecordBatch of the complete messages in it.
+    # Record storage is reused by the next call. Returns None if the
+    # receive was cancelled.
+    def read_records(self):
+        if not _lib:
+            raise RuntimeError("libsniffle_fast.so not built")
+        ser = self.hw.ser
+        while True:
+            # frames left over when the last call ran out of room come first
+            if self.rx:
+                batch = self._parse()
+                if batch:
+                    return batch
+
+            chunk = ser.read(max(ser.in_waiting, 1))
+            if self.hw.recv_cancelled:
+                self.hw.recv_cancelled = False
+                return None
+            self.rx += chunk
+
+    def _parse(self):
+        consumed = ctypes.c_size_t()
+        used = ctypes.c_size_t()
+        errs = ctypes.c_uint32()
+        n = _lib.sniffle_parse(ctypes.byref(self.state), bytes(self.rx), len(self.rx),
+                FRAMING_COBS if self.hw.framing == FRAMING_COBS else 0,
+                self.recs, self.max_recs, self.data, self.data_cap,
+                ctypes.byref(consumed), ctypes.byref(used), ctypes.byref(errs))
+        del self.rx[:consumed.value]
+
+        # garbage left over from the old framing is expected
+        if not self.hw.framing_resync:
+            self.errors += errs.value
+        if n == 0:
+            return None
+        self.hw.framing_resync = False
+        return RecordBatch(self.recs, n, self.data.raw[:used.value])
+
+    # (type, body, raw) tuples as from SniffleHW.recv_msg, used by its reader
+    # thread. Returns [(-1, None, b'')] if the receive was cancelled.
+    def read_raw(self):
+        batch = self.read_records()
+        if batch is None:
+            return [(-1, None, b'')]
+
+        msgs = []
+        for i in range(batch.count):
+            r = batch.recs[i]
+            body = batch.body(i)
+            mtype = r.mtype
+            if mtype == 0x10:
+                # rebuild the header PacketMessage parses
+                body = pack("<LHbB", r.ts, r.length, r.rssi, r.chan | (r.phy << 6)) + body
+            elif mtype in (0x18, 0x1D):
+                # as MESSAGE_BLEFRAMEX, compact ones with their full timestamp
+                mtype = 0x18
+                hdr = bytearray([r.flags])
+                if r.flags & FRAMEFMT_TS64:
+                    hdr += pack("<LL", r.ts, r.ts_high)
+                else:
+                    hdr += pack("<L", r.ts)
+                hdr += pack("<H", r.length)
+                if r.flags & FRAMEFMT_ORIGLEN:
+                    hdr += pack("<H", r.orig_len)
+                if r.flags & FRAMEFMT_AA:
+                    hdr += pack("<L", r.aa)
+                if r.flags & FRAMEFMT_SEQ:
+                    hdr += pack("<H", r.seq)
+                hdr += pack("<bB", r.rssi, r.chan | (r.phy << 6))
+                body = bytes(hdr) + body
+            msgs.append((mtype, body, b''))
+        return msgs
+
+    # Same objects as SniffleHW.recv_and_decode, but a batch at a time.
+    # Uses the native parser when built, and the pure Python path otherwise.
+    def read_messages(self):
+        if not _lib:
+            msg = self.hw.recv_and_decode()
+            return [] if msg is None else [msg]
+
+        msgs = []
+        for mtype, body, _ in self.read_raw():
+            if mtype == -1:
+                break
+            try:
+                msgs.append(self.hw.decode_msg(mtype, body))
+            except ValueError:
+                self.errors += 1
+        return msgs
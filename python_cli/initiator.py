@@ -17,8 +17,8 @@ _aa = 0
 def main():
     aparse = argparse.ArgumentParser(description="Connection initiator test script for Sniffle BLE5 sniffer")
     aparse.add_argument("-s", "--serport", default="/dev/ttyACM0", help="Sniffer serial port name")
-    aparse.add_argument("-c", "--advchan", default=37, choices=[37, 38, 39], type=int,
-            help="Advertising channel to listen on")
+    aparse.add_argument("-c", "--advchan", default=40, choices=[37, 38, 39], type=int,
+            help="Advertising channel to listen on (default cycles through all three)")
     aparse.add_argument("-r", "--rssi", default=-80, type=int,
             help="Filter packets by minimum RSSI")
     aparse.add_argument("-m", "--mac", default=None, help="Specify target MAC address")
@@ -42,6 +42,11 @@ def main():
         print("IRK only works on RPAs, not public addresses!", file=sys.stderr)
         return
 
+    # cycle through primary channels when initiating, unless told otherwise
+    hop3 = args.advchan == 40 and not args.longrange
+    if args.advchan == 40:
+        args.advchan = 37
+
     # set the advertising channel (and return to ad-sniffing mode)
     hw.cmd_chan_aa_phy(args.advchan, BLE_ADV_AA, 2 if args.longrange else 0)
 
@@ -80,7 +85,10 @@ def main():
 
     # now enter initiator mode
     global _aa
-    _aa = hw.initiate_conn(macBytes, not args.public)
+    _aa = hw.initiate_conn(macBytes, not args.public, hop3)
+
+    # drain serial port on a separate thread, so output can't stall it
+    hw.start_reader()
 
     while True:
         msg = hw.recv_and_decode()
@@ -122,7 +130,7 @@ def print_packet(pkt):
     global msg_ctr
     MCMASK = 3
     if (msg_ctr & MCMASK) == MCMASK:
-        hw.cmd_transmit(3, b'\x12') # LL_PING_REQ
+        hw.queue_transmit(3, b'\x12') # LL_PING_REQ
     msg_ctr += 1
 
     # also test sending LL_CONNECTION_UPDATE_IND
@@ -133,7 +141,7 @@ def print_packet(pkt):
         # Latency = 0x0003
         # Timeout = 0x0080
         # Instant = 0x0080
-        hw.cmd_transmit(3, b'\x00\x04\x08\x00\x30\x00\x03\x00\x80\x00\x80\x00')
+        hw.queue_transmit(3, b'\x00\x04\x08\x00\x30\x00\x03\x00\x80\x00\x80\x00')
         print("sent change!")
 
 if __name__ == "__main__":
@@ -0,0 +1,256 @@
+#!/usr/bin/env python3
+
+# Written by Sultan Qasim Khan
+# Copyright (c) 2020, NCC Group plc
+# Released as open source under GPLv3
+
+import argparse, sys, heapq
+from time import time
+from queue import Queue, Empty
+from collections import deque
+from pcap import PcapngBleWriter
+from sniffle_hw import SniffleHW, BLE_ADV_AA, PacketMessage, DebugMessage, StateMessage, \
+        SnifferState, SyncMessage, FRAMEFMT_TS64, FRAMEFMT_SEQ, SYNC_INPUT, SYNC_OUTPUT, \
+        TS_MASK
+from clock_sync import ClockSync
+from packet_decoder import DPacketMessage, AdvIndMessage, AdvDirectIndMessage, \
+        ConnectIndMessage
+
+# how long to hold packets back so streams from all sniffers can be merged in order
+REORDER_SECS = 0.25
+
+# copies of a packet from different sniffers are expected within this window
+DEDUP_SECS = 0.01
+
+# much tighter window once radio clocks are synced with pulses
+SYNC_DEDUP_SECS = 0.00005
+
+class Radio:
+    def __init__(self, idx, port, role):
+        self.idx = idx
+        self.port = port
+        self.role = role # advertising channel number, or "follow"
+        self.hw = SniffleHW(port)
+        self.busy = False
+        self.iface = 0
+
+    def __str__(self):
+        return "r%d" % self.idx
+
+class Coordinator:
+    def __init__(self, radios, pcwriter=None, quiet=False, sync_ms=0):
+        self.radios = radios
+        self.sync_ms = sync_ms
+        self.sync = ClockSync(radios[0], sync_ms / 1000.) if sync_ms else None
+        self.pcwriter = pcwriter
+        self.quiet = quiet
+        self.merged = Queue()
+        self.heap = []
+        self.seq = 0
+        self.recent = {}
+        self.recent_order = deque()
+        self.followed = set()
+        self.adv_chsel = {}
+        self.duplicates = 0
+
+    def configure(self, rssi, mac):
+        for r in self.radios:
+            chan = 37 if r.role == "follow" else r.role
+            with r.hw.transaction():
+                # pinned radios must stay on their channel, so the
+                # coordinator decides who follows connections
+                r.hw.cmd_chan_aa_phy(chan, BLE_ADV_AA, 0)
+                r.hw.cmd_pause_done(False)
+                r.hw.cmd_follow(False)
+                r.hw.cmd_rssi(rssi)
+                if mac:
+                    r.hw.cmd_mac(mac, False)
+                else:
+                    r.hw.cmd_mac()
+                r.hw.cmd_auxadv(False)
+                r.hw.cmd_frame_format(FRAMEFMT_TS64 | FRAMEFMT_SEQ)
+            r.hw.mark_and_flush()
+            if self.pcwriter:
+                r.iface = self.pcwriter.add_interface("%s %s" % (r.port, r.role))
+
+        # first radio drives the sync pulse, the rest are wired to it
+        if self.sync:
+            for r in self.radios[1:]:
+                r.hw.cmd_sync(SYNC_INPUT)
+            self.radios[0].hw.cmd_sync(SYNC_OUTPUT, self.sync_ms)
+
+        for r in self.radios:
+            r.hw.start_dispatch(lambda msg, r=r: self.merged.put((r, msg)))
+
+    def run(self):
+        while True:
+            try:
+                r, msg = self.merged.get(timeout=0.05)
+                self.handle(r, msg)
+            except Empty:
+                pass
+
+            # emit everything old enough that no sniffer can still report earlier packets
+            cutoff = time() - REORDER_SECS
+            while self.heap and self.heap[0][0] < cutoff:
+                _, _, r, dpkt = heapq.heappop(self.heap)
+                self.emit(r, dpkt)
+
+    def handle(self, r, msg):
+        if isinstance(msg, PacketMessage):
+            # each sniffer numbers its own frames
+            if msg.lost and not self.quiet:
+                print("[%s] LOST: %d frames (%d total)\n" % (r, msg.lost,
+                    r.hw.decoder_state.seq_lost))
+
+            dpkt = DPacketMessage.decode(msg)
+            dpkt.ts_epoch = self.merged_time(r, dpkt)
+            # only connectable legacy advertisements define ChSel
+            if isinstance(dpkt, (AdvIndMessage, AdvDirectIndMessage)):
+                self.adv_chsel[bytes(dpkt.AdvA)] = dpkt.ChSel
+
+            # hand off right away, rather than after reordering delay
+            if isinstance(dpkt, ConnectIndMessage) and dpkt.aa not in self.followed:
+                self.handoff(r, dpkt)
+
+            heapq.heappush(self.heap, (dpkt.ts_epoch, self.seq, r, dpkt))
+            self.seq += 1
+        elif isinstance(msg, StateMessage):
+            r.busy = msg.new_state in (SnifferState.DATA, SnifferState.SLAVE,
+                    SnifferState.MASTER)
+            if not self.quiet:
+                print("[%s] %s\n" % (r, msg))
+        elif isinstance(msg, SyncMessage):
+            if self.sync:
+                self.sync.add_pulse(r, msg)
+        elif isinstance(msg, DebugMessage):
+            print("[%s] %s\n" % (r, msg))
+
+    # packet time on the reference radio's clock when synced, else host estimate
+    def merged_time(self, r, dpkt):
+        if not (self.sync and self.sync.synced(r)):
+            return dpkt.ts_epoch
+        ds = self.radios[0].hw.decoder_state
+        ts_ref = self.sync.to_ref(r, dpkt.ts_radio)
+        return ds.first_epoch_time + ds.time_offset + ts_ref / 1000000.
+
+    # request timestamp in the target's radio timebase
+    def target_ts(self, seen_by, target, dpkt):
+        if self.sync and self.sync.synced(seen_by) and self.sync.synced(target):
+            ts = self.sync.from_ref(target, self.sync.to_ref(seen_by, dpkt.ts_radio))
+            return int(ts) & TS_MASK
+        return target.hw.radio_ts(dpkt.ts_epoch)
+
+    def is_duplicate(self, dpkt):
+        key = (dpkt.aa, dpkt.chan, bytes(dpkt.body))
+        ts = dpkt.ts_epoch
+        window = DEDUP_SECS
+        if self.sync and all(self.sync.synced(r) for r in self.radios):
+            window = SYNC_DEDUP_SECS
+
+        while self.recent_order and self.recent_order[0][0] < ts - DEDUP_SECS:
+            old_ts, old_key = self.recent_order.popleft()
+            if self.recent.get(old_key) == old_ts:
+                del self.recent[old_key]
+
+        last = self.recent.get(key)
+        self.recent[key] = ts
+        self.recent_order.append((ts, key))
+        return last is not None and abs(ts - last) < window
+
+    def emit(self, r, dpkt):
+        if self.is_duplicate(dpkt):
+            self.duplicates += 1
+            return
+        if self.pcwriter:
+            self.pcwriter.write_packet(int(dpkt.ts_epoch * 1000000), dpkt.aa, dpkt.chan,
+                    dpkt.rssi, dpkt.body, r.iface, orig_len=dpkt.orig_len,
+                    decrypted=dpkt.decrypted)
+        if not self.quiet:
+            print("[%s] %s\n" % (r, dpkt))
+
+    # an idle follower is best placed, otherwise the radio that saw the request
+    def pick_follower(self, seen_by):
+        for r in self.radios:
+            if r.role == "follow" and not r.busy:
+                return r
+        if not seen_by.busy:
+            return seen_by
+        return None
+
+    def handoff(self, seen_by, dpkt):
+        target = self.pick_follower(seen_by)
+        if target is None:
+            print("[%s] No free radio to follow connection 0x%08X\n" % (seen_by, dpkt.aa),
+                    file=sys.stderr)
+            return
+
+        # AUX_CONNECT_REQ always uses CSA#2, CONNECT_IND if both sides support it
+        aux = dpkt.chan < 37
+        csa2 = aux or (dpkt.ChSel and self.adv_chsel.get(bytes(dpkt.AdvA), 0))
+
+        target.hw.decoder_state.cur_aa = dpkt.aa
+        target.hw.cmd_follow_conn(dpkt.body[14:36], self.target_ts(seen_by, target, dpkt),
+                dpkt.phy, csa2, aux)
+        target.busy = True
+        self.followed.add(dpkt.aa)
+        if not self.quiet:
+            print("[%s] Following connection 0x%08X seen by %s\n" % (target, dpkt.aa, seen_by))
+
+def main():
+    aparse = argparse.ArgumentParser(description=
+            "Merged capture from several Sniffle sniffers, pinned to advertising channels")
+    aparse.add_argument("-s", "--serport", action="append", required=True,
+            help="Sniffer serial port name (repeat for each sniffer)")
+    aparse.add_argument("-R", "--roles", default=None,
+            help="Comma separated role per sniffer: 37, 38, 39, or follow "
+            "(default: 37,38,39, then follow)")
+    aparse.add_argument("-r", "--rssi", default=-80, type=int,
+            help="Filter packets by minimum RSSI")
+    aparse.add_argument("-m", "--mac", default=None, help="Filter packets by advertiser MAC")
+    aparse.add_argument("-o", "--output", default=None, help="PCAPNG output file name")
+    aparse.add_argument("-S", "--sync", default=0, type=int,
+            help="Sync radio clocks with a pulse every SYNC ms, driven by the first "
+            "sniffer on its sync pin (DIO21), and wired to the others")
+    aparse.add_argument("-q", "--quiet", action="store_const", default=False, const=True,
+            help="Don't print packets")
+    args = aparse.parse_args()
+
+    if args.roles:
+        roles = args.roles.split(",")
+        if len(roles) != len(args.serport):
+            print("Need one role per sniffer!", file=sys.stderr)
+            return
+    else:
+        roles = (["37", "38", "39"] + ["follow"] * len(args.serport))[:len(args.serport)]
+    for i, role in enumerate(roles):
+        if role not in ("37", "38", "39", "follow"):
+            print("Invalid role: %s" % role, file=sys.stderr)
+            return
+        if role != "follow":
+            roles[i] = int(role)
+
+    macBytes = None
+    if args.mac:
+        try:
+            macBytes = [int(h, 16) for h in reversed(args.mac.split(":"))]
+            if len(macBytes) != 6:
+                raise Exception("Wrong length!")
+        except:
+            print("MAC must be 6 colon-separated hex bytes", file=sys.stderr)
+            return
+
+    pcwriter = PcapngBleWriter(args.output) if args.output else None
+    radios = [Radio(i, p, roles[i]) for i, p in enumerate(args.serport)]
+    coord = Coordinator(radios, pcwriter, args.quiet, args.sync)
+    coord.configure(args.rssi, macBytes)
+
+    try:
+        coord.run()
+    finally:
+        if pcwriter:
+            pcwriter.close()
+        print("Dropped %d duplicate packets" % coord.duplicates, file=sys.stderr)
+
+if __name__ == "__main__":
+    main()
@@ -29,17 +29,29 @@ def str_mac2(mac, is_random):
     return "%s (%s)" % (str_mac(mac), _str_atype(mac, is_random))
 
 class DPacketMessage(PacketMessage):
+    # fields are decoded from the body when first used, not up front
+    __slots__ = ()
     pdutype = "RFU"
 
     # copy constructor, deliberately no call to super()
     def __init__(self, pkt: PacketMessage):
         self.ts = pkt.ts
         self.ts_epoch = pkt.ts_epoch
+        self.ts_radio = pkt.ts_radio
+        self.orig_len = pkt.orig_len
         self.aa = pkt.aa
         self.rssi = pkt.rssi
         self.chan = pkt.chan
         self.phy = pkt.phy
         self.body = pkt.body
+        self.decrypted = pkt.decrypted
+        self.seq = pkt.seq
+        self.lost = pkt.lost
+
+    # zero copy view of the body, for slicing without copying
+    @property
+    def view(self):
+        return memoryview(self.body)
 
     def hexdump(self):
         hexstr = " ".join(["%02X" % b for b in self.body])
@@ -61,12 +73,23 @@ class DPacketMessage(PacketMessage):
             return DataMessage.decode(pkt)
 
 class AdvertMessage(DPacketMessage):
-    def __init__(self, pkt: PacketMessage):
-        super().__init__(pkt)
-        self.ChSel = (self.body[0] >> 5) & 1
-        self.TxAdd = (self.body[0] >> 6) & 1
-        self.RxAdd = (self.body[0] >> 7) & 1
-        self.ad_length = self.body[1]
+    __slots__ = ()
+
+    @property
+    def ChSel(self):
+        return (self.body[0] >> 5) & 1
+
+    @property
+    def TxAdd(self):
+        return (self.body[0] >> 6) & 1
+
+    @property
+    def RxAdd(self):
+        return (self.body[0] >> 7) & 1
+
+    @property
+    def ad_length(self):
+        return self.body[1]
 
     def str_adtype(self):
         atstr = "Ad Type: %s\n" % self.pdutype
@@ -82,28 +105,32 @@ class AdvertMessage(DPacketMessage):
     @staticmethod
     def decode(pkt: PacketMessage):
         pdu_type = pkt.body[0] & 0xF
-        type_classes = [
-                AdvIndMessage,          # 0
-                AdvDirectIndMessage,    # 1
-                AdvNonconnIndMessage,   # 2
-                ScanReqMessage,         # 3
-                ScanRspMessage,         # 4
-                ConnectIndMessage,      # 5
-                AdvScanIndMessage,      # 6
-                AdvExtIndMessage]       # 7
-        if pdu_type < len(type_classes):
-            tc = type_classes[pdu_type]
+        if pkt.orig_len > len(pkt.body):
+            tc = AdvertMessage # snapped, too short to decode fields
+        elif pdu_type < len(_adv_classes):
+            tc = _adv_classes[pdu_type]
         else:
             tc = AdvertMessage
         return tc(pkt)
 
 class DataMessage(DPacketMessage):
-    def __init__(self, pkt: PacketMessage):
-        super().__init__(pkt)
-        self.NESN = (self.body[0] >> 2) & 1
-        self.SN = (self.body[0] >> 3) & 1
-        self.MD = (self.body[0] >> 4) & 1
-        self.data_length = self.body[1]
+    __slots__ = ()
+
+    @property
+    def NESN(self):
+        return (self.body[0] >> 2) & 1
+
+    @property
+    def SN(self):
+        return (self.body[0] >> 3) & 1
+
+    @property
+    def MD(self):
+        return (self.body[0] >> 4) & 1
+
+    @property
+    def data_length(self):
+        return self.body[1]
 
     def str_datatype(self):
         dtstr = "LLID: %s\n" % self.pdutype
@@ -118,58 +145,56 @@ class DataMessage(DPacketMessage):
 
     @staticmethod
     def decode(pkt: PacketMessage):
-        LLID = pkt.body[0] & 0x3
-        type_classes = [
-                DataMessage,        # 0 (RFU)
-                LlDataMessage,      # 1
-                LlDataContMessage,  # 2
-                LlControlMessage]   # 3
-        return type_classes[LLID](pkt)
+        return _data_classes[pkt.body[0] & 0x3](pkt)
 
 class LlDataMessage(DataMessage):
+    __slots__ = ()
     pdutype = "LL DATA"
 
 class LlDataContMessage(DataMessage):
+    __slots__ = ()
     pdutype = "LL DATA CONT"
 
 class LlControlMessage(DataMessage):
+    __slots__ = ()
     pdutype = "LL CONTROL"
 
-    def __init__(self, pkt: PacketMessage):
-        super().__init__(pkt)
-        self.opcode = self.body[2]
+    control_opcodes = [
+            "LL_CONNECTION_UPDATE_IND",
+            "LL_CHANNEL_MAP_IND",
+            "LL_TERMINATE_IND",
+            "LL_ENC_REQ",
+            "LL_ENC_RSP",
+            "LL_START_ENC_REQ",
+            "LL_START_ENC_RSP",
+            "LL_UNKNOWN_RSP",
+            "LL_FEATURE_REQ",
+            "LL_FEATURE_RSP",
+            "LL_PAUSE_ENC_REQ",
+            "LL_PAUSE_ENC_RSP",
+            "LL_VERSION_IND",
+            "LL_REJECT_IND",
+            "LL_SLAVE_FEATURE_REQ",
+            "LL_CONNECTION_PARAM_REQ",
+            "LL_CONNECTION_PARAM_RSP",
+            "LL_REJECT_EXT_IND",
+            "LL_PING_REQ",
+            "LL_PING_RSP",
+            "LL_LENGTH_REQ",
+            "LL_LENGTH_RSP",
+            "LL_PHY_REQ",
+            "LL_PHY_RSP",
+            "LL_PHY_UPDATE_IND",
+            "LL_MIN_USED_CHANNELS_IND"
+            ]
+
+    @property
+    def opcode(self):
+        return self.body[2]
 
     def str_opcode(self):
-        control_opcodes = [
-                "LL_CONNECTION_UPDATE_IND",
-                "LL_CHANNEL_MAP_IND",
-                "LL_TERMINATE_IND",
-                "LL_ENC_REQ",
-                "LL_ENC_RSP",
-                "LL_START_ENC_REQ",
-                "LL_START_ENC_RSP",
-                "LL_UNKNOWN_RSP",
-                "LL_FEATURE_REQ",
-                "LL_FEATURE_RSP",
-                "LL_PAUSE_ENC_REQ",
-                "LL_PAUSE_ENC_RSP",
-                "LL_VERSION_IND",
-                "LL_REJECT_IND",
-                "LL_SLAVE_FEATURE_REQ",
-                "LL_CONNECTION_PARAM_REQ",
-                "LL_CONNECTION_PARAM_RSP",
-                "LL_REJECT_EXT_IND",
-                "LL_PING_REQ",
-                "LL_PING_RSP",
-                "LL_LENGTH_REQ",
-                "LL_LENGTH_RSP",
-                "LL_PHY_REQ",
-                "LL_PHY_RSP",
-                "LL_PHY_UPDATE_IND",
-                "LL_MIN_USED_CHANNELS_IND"
-                ]
-        if self.opcode < len(control_opcodes):
-            return "Opcode: %s" % control_opcodes[self.opcode]
+        if self.opcode < len(self.control_opcodes):
+            return "Opcode: %s" % self.control_opcodes[self.opcode]
         else:
             return "Opcode: RFU (0x%02X)" % self.opcode
 
@@ -181,9 +206,11 @@ class LlControlMessage(DataMessage):
             self.hexdump()])
 
 class AdvaMessage(AdvertMessage):
-    def __init__(self, pkt: PacketMessage):
-        super().__init__(pkt)
-        self.AdvA = self.body[2:8]
+    __slots__ = ()
+
+    @property
+    def AdvA(self):
+        return self.body[2:8]
 
     def str_adva(self):
         return "AdvA: %s" % str_mac2(self.AdvA, self.TxAdd)
@@ -196,24 +223,32 @@ class AdvaMessage(AdvertMessage):
             self.hexdump()])
 
 class AdvIndMessage(AdvaMessage):
+    __slots__ = ()
     pdutype = "ADV_IND"
 
 class AdvNonconnIndMessage(AdvaMessage):
+    __slots__ = ()
     pdutype = "ADV_NONCONN_IND"
 
 class ScanRspMessage(AdvaMessage):
+    __slots__ = ()
     pdutype = "SCAN_RSP"
 
 class AdvScanIndMessage(AdvaMessage):
+    __slots__ = ()
     pdutype = "ADV_SCAN_IND"
 
 class AdvDirectIndMessage(AdvertMessage):
+    __slots__ = ()
     pdutype = "ADV_DIRECT_IND"
 
-    def __init__(self, pkt: PacketMessage):
-        super().__init__(pkt)
-        self.AdvA = self.body[2:8]
-        self.TargetA = self.body[8:14]
+    @property
+    def AdvA(self):
+        return self.body[2:8]
+
+    @property
+    def TargetA(self):
+        return self.body[8:14]
 
     def str_ata(self):
         return "AdvA: %s TargetA: %s" % (str_mac2(self.AdvA, self.TxAdd), str_mac2(self.TargetA, self.RxAdd))
@@ -226,12 +261,16 @@ class AdvDirectIndMessage(AdvertMessage):
             self.hexdump()])
 
 class ScanReqMessage(AdvertMessage):
+    __slots__ = ()
     pdutype = "SCAN_REQ"
 
-    def __init__(self, pkt: PacketMessage):
-        super().__init__(pkt)
-        self.ScanA = self.body[2:8]
-        self.AdvA = self.body[8:14]
+    @property
+    def ScanA(self):
+        return self.body[2:8]
+
+    @property
+    def AdvA(self):
+        return self.body[8:14]
 
     def str_asa(self):
         return "ScanA: %s AdvA: %s" % (str_mac2(self.ScanA, self.TxAdd), str_mac2(self.AdvA, self.RxAdd))
@@ -244,15 +283,23 @@ class ScanReqMessage(AdvertMessage):
             self.hexdump()])
 
 class ConnectIndMessage(AdvertMessage):
+    __slots__ = ()
     pdutype = "CONNECT_IND"
 
     def __init__(self, pkt: PacketMessage):
         super().__init__(pkt)
-        self.InitA = self.body[2:8]
-        self.AdvA = self.body[8:14]
+        # replaces the advertising AA, so it can't wait
         self.aa = struct.unpack('<L', self.body[14:18])[0]
         # TODO: decode the rest
 
+    @property
+    def InitA(self):
+        return self.body[2:8]
+
+    @property
+    def AdvA(self):
+        return self.body[8:14]
+
     def str_aia(self):
         return "InitA: %s AdvA: %s AA: 0x%08X" % (
                 str_mac2(self.InitA, self.TxAdd), str_mac2(self.AdvA, self.RxAdd), self.aa)
@@ -265,6 +312,8 @@ class ConnectIndMessage(AdvertMessage):
             self.hexdump()])
 
 class AuxPtr:
+    __slots__ = ('chan', 'phy', 'offsetUsec')
+
     def __init__(self, ptr):
         self.chan = ptr[0] & 0x3F
         self.phy = ptr[2] >> 5
@@ -278,11 +327,13 @@ class AuxPtr:
         return "AuxPtr Chan: %d PHY: %s Delay: %d us" % (
             self.chan, phy_names[self.phy], self.offsetUsec)
 
-class AdvExtIndMessage(AdvertMessage):
-    pdutype = "ADV_EXT_IND"
+# common extended advertising header fields, parsed when first needed
+class _ExtHeader:
+    __slots__ = ('AdvMode', 'AdvA', 'TargetA', 'CTEInfo', 'AdvDataInfo', 'AuxPtr',
+            'SyncInfo', 'TxPower', 'ACAD')
 
-    def __init__(self, pkt: PacketMessage):
-        super().__init__(pkt)
+    def __init__(self, body):
+        self.AdvMode = None
         self.AdvA = None
         self.TargetA = None
         self.CTEInfo = None
@@ -293,48 +344,72 @@ class AdvExtIndMessage(AdvertMessage):
         self.ACAD = None
 
         try:
-            if len(self.body) < 3:
+            if len(body) < 3:
                 raise ValueError("Extended advertisement too short!")
-            self.AdvMode = self.body[2] >> 6 # Neither, Connectable, Scannable, or RFU
-            hdrBodyLen = self.body[2] & 0x3F
+            self.AdvMode = body[2] >> 6 # Neither, Connectable, Scannable, or RFU
+            hdrBodyLen = body[2] & 0x3F
 
-            if len(self.body) < hdrBodyLen + 1:
+            if len(body) < hdrBodyLen + 1:
                 raise ValueError("Inconistent header length!")
 
-            hdrFlags = self.body[3]
+            hdrFlags = body[3]
             hdrPos = 4
-            dispMsgs = []
 
             if hdrFlags & 0x01:
-                self.AdvA = self.body[hdrPos:hdrPos+6]
+                self.AdvA = body[hdrPos:hdrPos+6]
                 hdrPos += 6
             if hdrFlags & 0x02:
-                self.TargetA = self.body[hdrPos:hdrPos+6]
+                self.TargetA = body[hdrPos:hdrPos+6]
                 hdrPos += 6
             if hdrFlags & 0x04:
-                self.CTEInfo = self.body[hdrPos]
+                self.CTEInfo = body[hdrPos]
                 hdrPos += 1
             if hdrFlags & 0x08:
-                self.AdvDataInfo = self.body[hdrPos:hdrPos+2]
+                self.AdvDataInfo = body[hdrPos:hdrPos+2]
                 hdrPos += 2
             if hdrFlags & 0x10:
-                self.AuxPtr = AuxPtr(self.body[hdrPos:hdrPos+3])
+                self.AuxPtr = AuxPtr(body[hdrPos:hdrPos+3])
                 hdrPos += 3
             if hdrFlags & 0x20:
                 # TODO decode this nicely
-                self.SyncInfo = self.body[hdrPos:hdrPos+18]
+                self.SyncInfo = body[hdrPos:hdrPos+18]
                 hdrPos += 18
             if hdrFlags & 0x40:
-                self.TxPower = struct.unpack("b", self.body[hdrPos:hdrPos+1])[0]
+                self.TxPower = struct.unpack("b", body[hdrPos:hdrPos+1])[0]
                 hdrPos += 1
             if hdrPos - 3 < hdrBodyLen:
                 ACADLen = hdrBodyLen - (hdrPos - 3)
-                self.ACAD = self.body[hdrPos:hdrPos+ACADLen]
+                self.ACAD = body[hdrPos:hdrPos+ACADLen]
                 hdrPos += ACADLen
         except Exception as e:
             # TODO: nicer error handling
             print("Parse error!", repr(e))
 
+def _ext_field(name):
+    def get(self):
+        if self._hdr is None:
+            self._hdr = _ExtHeader(self.body)
+        return getattr(self._hdr, name)
+    return property(get)
+
+class AdvExtIndMessage(AdvertMessage):
+    __slots__ = ('_hdr',)
+    pdutype = "ADV_EXT_IND"
+
+    def __init__(self, pkt: PacketMessage):
+        super().__init__(pkt)
+        self._hdr = None
+
+    AdvMode = _ext_field('AdvMode')
+    AdvA = _ext_field('AdvA')
+    TargetA = _ext_field('TargetA')
+    CTEInfo = _ext_field('CTEInfo')
+    AdvDataInfo = _ext_field('AdvDataInfo')
+    AuxPtr = _ext_field('AuxPtr')
+    SyncInfo = _ext_field('SyncInfo')
+    TxPower = _ext_field('TxPower')
+    ACAD = _ext_field('ACAD')
+
     def str_aext(self):
         amodes = ["Non-connectable, non-scannable",
                 "Connectable", "Scannable", "RFU"]
@@ -371,3 +446,47 @@ class AdvExtIndMessage(AdvertMessage):
             self.str_adtype(),
             self.str_aext(),
             self.hexdump()])
+
+_adv_classes = [
+        AdvIndMessage,          # 0
+        AdvDirectIndMessage,    # 1
+        AdvNonconnIndMessage,   # 2
+        ScanReqMessage,         # 3
+        ScanRspMessage,         # 4
+        ConnectIndMessage,      # 5
+        AdvScanIndMessage,      # 6
+        AdvExtIndMessage]       # 7
+
+_data_classes = [
+        DataMessage,        # 0 (RFU)
+        LlDataMessage,      # 1
+        LlDataContMessage,  # 2
+        LlControlMessage]   # 3
+
+# where AdvA is in each legacy advertising PDU type, if it has one
+_adva_offsets = [2, 2, 2, 8, 2, 8, 2]
+
+def classify(pkt: PacketMessage):
+    """
+    Fast path for callers that only want the PDU type and advertiser address,
+    without building a decoded message. Returns (pdutype, AdvA or None).
+    """
+    body = pkt.body
+    if pkt.aa != BLE_ADV_AA:
+        return _data_classes[body[0] & 0x3].pdutype, None
+
+    pdu_type = body[0] & 0xF
+    if pdu_type >= len(_adv_classes):
+        return AdvertMessage.pdutype, None
+    pdutype = _adv_classes[pdu_type].pdutype
+
+    if pdu_type < len(_adva_offsets):
+        pos = _adva_offsets[pdu_type]
+    elif len(body) >= 4 and body[2] & 0x3F and body[3] & 0x01:
+        pos = 4 # extended header with AdvA first
+    else:
+        return pdutype, None
+
+    if len(body) < pos + 6:
+        return pdutype, None
+    return pdutype, body[pos:pos+6]
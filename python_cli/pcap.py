@@ -30,6 +30,8 @@ SOFTWARE.
 
 from io import BytesIO
 from struct import pack
+from time import time
+import os
 
 class PcapBleWriter(object):
     """
@@ -63,7 +65,7 @@ class PcapBleWriter(object):
         )
         self.output.write(header)
 
-    def write_packet_header(self, ts_sec, ts_usec, packet_size):
+    def write_packet_header(self, ts_sec, ts_usec, packet_size, orig_size=None):
         """
         Write packet header
         """
@@ -72,11 +74,11 @@ class PcapBleWriter(object):
             ts_sec,
             ts_usec,
             packet_size,
-            packet_size
+            packet_size if orig_size is None else orig_size
         )
         self.output.write(pkt_header)
 
-    def payload(self, aa, packet, chan, rssi):
+    def payload(self, aa, packet, chan, rssi, decrypted=False):
         """
         Generate payload with specific header.
         """
@@ -87,11 +89,21 @@ class PcapBleWriter(object):
             -128,
             0,
             aa,
-            0xC13
+            0xC1B if decrypted else 0xC13
         )
         payload_data = pack('<I', aa) + packet + pack('<BBB', 0, 0, 0)
         return payload_header + payload_data
 
+    def snapped_payload(self, aa, packet, chan, rssi, orig_len, decrypted=False):
+        """
+        Generate payload, and its original length if packet was snapped.
+        Snapped payloads stop where the packet data does, as there's no CRC.
+        """
+        payload = self.payload(aa, packet, chan, rssi, decrypted)
+        if orig_len is None or orig_len <= len(packet):
+            return payload, len(payload)
+        return payload[:-3], len(payload) + orig_len - len(packet)
+
     @staticmethod
     def _ble_to_rf_chan(chan):
         if chan == 37:
@@ -105,7 +117,7 @@ class PcapBleWriter(object):
         else:
             return chan + 2
 
-    def write_packet(self, ts_usec, aa, chan, rssi, packet):
+    def write_packet(self, ts_usec, aa, chan, rssi, packet, orig_len=None, decrypted=False):
         """
         Add packet to PCAP output.
 
@@ -113,13 +125,164 @@ class PcapBleWriter(object):
         """
         ts_s = ts_usec // 1000000
         ts_u = int(ts_usec - ts_s*1000000)
-        payload = self.payload(aa, packet, self._ble_to_rf_chan(chan), rssi)
-        self.write_packet_header(ts_s, ts_u, len(payload))
+        payload, orig_size = self.snapped_payload(aa, packet, self._ble_to_rf_chan(chan),
+                rssi, orig_len, decrypted)
+        self.write_packet_header(ts_s, ts_u, len(payload), orig_size)
         self.output.write(payload)
 
+    def flush(self):
+        """
+        Push written packets out to the reader, eg. through a FIFO.
+        """
+        self.output.flush()
+
     def close(self):
         """
         Close PCAP.
         """
         if not isinstance(self.output, BytesIO):
             self.output.close()
+
+class PcapngBleWriter(PcapBleWriter):
+    """
+    PCAPNG BLE Link-layer with PHDR, buffered, with optional file rotation.
+
+    Each interface (eg. one per sniffer or PHY) gets its own IDB. When
+    rotating, output files are named <base>_<nnnnn><ext>, each starting
+    with a fresh SHB and all IDBs, and only the newest max_files are kept
+    (0 to keep all).
+    """
+    BLOCK_SHB = 0x0A0D0D0A
+    BLOCK_IDB = 0x00000001
+    BLOCK_EPB = 0x00000006
+
+    OPT_ENDOFOPT = 0
+    OPT_COMMENT = 1
+    OPT_SHB_USERAPPL = 4
+    OPT_IF_NAME = 2
+
+    def __init__(self, output, rotate_bytes=0, rotate_secs=0, max_files=0,
+            buf_size=1 << 20, flush_secs=1.0):
+        self.base_name = output
+        self.rotate_bytes = rotate_bytes
+        self.rotate_secs = rotate_secs
+        self.max_files = max_files
+        self.buf_size = buf_size
+        self.flush_secs = flush_secs
+        self.interfaces = []
+        self.file_names = []
+        self.file_num = 0
+        self.buf = []
+        self.buf_len = 0
+        self.output = None
+        self._open_next()
+
+    @staticmethod
+    def _option(code, value):
+        pad = (-len(value)) & 3
+        return pack('<HH', code, len(value)) + value + b'\x00' * pad
+
+    @classmethod
+    def _block(cls, btype, body):
+        body += b'\x00' * ((-len(body)) & 3)
+        blen = len(body) + 12
+        return pack('<II', btype, blen) + body + pack('<I', blen)
+
+    def _options(self, opts):
+        if not opts:
+            return b''
+        return b''.join(self._option(c, v) for c, v in opts) + \
+                self._option(self.OPT_ENDOFOPT, b'')
+
+    def _idb(self, name):
+        opts = [(self.OPT_IF_NAME, name.encode('utf-8'))]
+        return self._block(self.BLOCK_IDB, pack('<HHI', self.DLT, 0, 0) +
+                self._options(opts))
+
+    def _file_name(self):
+        if not (self.rotate_bytes or self.rotate_secs):
+            return self.base_name
+        root, ext = os.path.splitext(self.base_name)
+        return "%s_%05d%s" % (root, self.file_num, ext or '.pcapng')
+
+    def _open_next(self):
+        if self.output:
+            self._flush()
+            self.output.close()
+
+        name = self._file_name()
+        self.file_num += 1
+        self.output = open(name, 'wb')
+        self.file_names.append(name)
+        if self.max_files and len(self.file_names) > self.max_files:
+            try:
+                os.remove(self.file_names.pop(0))
+            except OSError:
+                pass
+
+        self.file_bytes = 0
+        self.file_start = time()
+        self.last_flush = self.file_start
+        self.write_header()
+        for name in self.interfaces:
+            self._append(self._idb(name))
+
+    def _append(self, data):
+        self.buf.append(data)
+        self.buf_len += len(data)
+        self.file_bytes += len(data)
+
+    def _flush(self):
+        if self.buf:
+            self.output.write(b''.join(self.buf))
+            self.output.flush()
+            self.buf = []
+            self.buf_len = 0
+        self.last_flush = time()
+
+    def write_header(self):
+        """
+        Write PCAPNG section header block.
+        """
+        opts = [(self.OPT_SHB_USERAPPL, b'Sniffle')]
+        self._append(self._block(self.BLOCK_SHB, pack('<IHHq', 0x1A2B3C4D, 1, 0, -1) +
+                self._options(opts)))
+
+    def add_interface(self, name):
+        """
+        Add an interface, returning its ID for write_packet.
+        """
+        self.interfaces.append(name)
+        self._append(self._idb(name))
+        return len(self.interfaces) - 1
+
+    def write_packet(self, ts_usec, aa, chan, rssi, packet, iface=0, comment=None,
+            orig_len=None, decrypted=False):
+        """
+        Add packet to PCAPNG output, with optional comment string.
+        """
+        if not self.interfaces:
+            self.add_interface("sniffle")
+
+        now = time()
+        if (self.rotate_bytes and self.file_bytes >= self.rotate_bytes) or \
+                (self.rotate_secs and now - self.file_start >= self.rotate_secs):
+            self._open_next()
+
+        payload, orig_size = self.snapped_payload(aa, packet, self._ble_to_rf_chan(chan),
+                rssi, orig_len, decrypted)
+        ts = int(ts_usec)
+        opts = [(self.OPT_COMMENT, comment.encode('utf-8'))] if comment else None
+        self._append(self._block(self.BLOCK_EPB, pack('<IIIII', iface, ts >> 32,
+                ts & 0xFFFFFFFF, len(payload), orig_size) + payload +
+                b'\x00' * ((-len(payload)) & 3) + self._options(opts)))
+
+        if self.buf_len >= self.buf_size or now - self.last_flush >= self.flush_secs:
+            self._flush()
+
+    def close(self):
+        """
+        Flush and close PCAPNG.
+        """
+        self._flush()
+        self.output.close()
@@ -5,13 +5,14 @@
 # Released as open source under GPLv3
 
 import argparse, sys, signal
-from sniffle_hw import SniffleHW, BLE_ADV_AA, PacketMessage, DebugMessage
+from sniffle_hw import SniffleHW, BLE_ADV_AA, PacketMessage, DebugMessage, AdvSummaryMessage
 from packet_decoder import *
 
 # global variables
 hw = None
 advertisers = {}
 done_scan = False
+aggregate = False
 
 def sigint_handler(sig, frame):
     global done_scan
@@ -36,6 +37,11 @@ def main():
             help="Capture BT5 extended (auxiliary) advertising")
     aparse.add_argument("-l", "--longrange", action="store_const", default=False, const=True,
             help="Use long range (coded) PHY for primary advertising")
+    aparse.add_argument("-w", "--sweep", action="store_const", default=False, const=True,
+            help="Sweep all primary advertising channels (and the long range PHY if -l), "
+            "dwelling where new advertisers turn up")
+    aparse.add_argument("-a", "--aggregate", action="store_const", default=False, const=True,
+            help="Have the sniffer summarize repeated advertisements, to reduce UART traffic")
     args = aparse.parse_args()
 
     # Sanity check argument combinations
@@ -61,6 +67,14 @@ def main():
     # configure BT5 extended (aux/secondary) advertising
     hw.cmd_auxadv(args.extadv)
 
+    # rotate between primary channels, rather than sitting on one
+    hw.cmd_sweep(args.sweep, args.longrange)
+
+    # only get full advertisements when they change, with summaries every second
+    global aggregate
+    aggregate = args.aggregate
+    hw.cmd_adv_agg(1000 if aggregate else 0)
+
     # zero timestamps and flush old packets
     hw.mark_and_flush()
 
@@ -69,12 +83,17 @@ def main():
 
     print("Starting scanner. Press CTRL-C to stop scanning and show results.")
 
+    # drain serial port on a separate thread, so output can't stall it
+    hw.start_reader()
+
     while not done_scan:
         msg = hw.recv_and_decode()
         if isinstance(msg, DebugMessage):
             print(msg)
         elif isinstance(msg, PacketMessage):
             handle_packet(msg)
+        elif isinstance(msg, AdvSummaryMessage):
+            handle_summary(msg)
 
     print("\n\nScan Results:")
     for a in sorted(advertisers.keys(), key=lambda k: advertisers[k].rssi, reverse=True):
@@ -113,13 +132,26 @@ def handle_packet(pkt):
             advertisers[adva] = Advertiser()
             print("Found %s..." % adva)
 
-        advertisers[adva].rssi = dpkt.rssi
-        advertisers[adva].hits += 1
+        # summaries count every frame, including those sent in full
+        if not aggregate:
+            advertisers[adva].rssi = dpkt.rssi
+            advertisers[adva].hits += 1
 
         if isinstance(dpkt, ScanRspMessage):
             advertisers[adva].scan_rsp = dpkt
         else:
             advertisers[adva].adv = dpkt
 
+def handle_summary(msg):
+    for rec in msg.records:
+        adva = str_mac2(rec.AdvA, rec.TxAdd)
+
+        if not adva in advertisers:
+            advertisers[adva] = Advertiser()
+            print("Found %s..." % adva)
+
+        advertisers[adva].rssi = rec.rssi_avg
+        advertisers[adva].hits += rec.count
+
 if __name__ == "__main__":
     main()
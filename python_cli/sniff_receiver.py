@@ -5,8 +5,9 @@
 # Released as open source under GPLv3
 
 import argparse, sys
-from pcap import PcapBleWriter
-from sniffle_hw import SniffleHW, BLE_ADV_AA, PacketMessage, DebugMessage, StateMessage
+from pcap import PcapBleWriter, PcapngBleWriter
+from sniffle_hw import SniffleHW, BLE_ADV_AA, PacketMessage, DebugMessage, StateMessage, StatsMessage, \
+        FRAMEFMT_AA, FRAMEFMT_SEQ, FRAMEFMT_COMPACT, CONN_MAX
 from packet_decoder import DPacketMessage, AdvaMessage, AdvDirectIndMessage, AdvExtIndMessage, ConnectIndMessage
 from binascii import unhexlify
 
@@ -16,6 +17,10 @@ hw = None
 # global variable for pcap writer
 pcwriter = None
 
+# pcapng interface per PHY, and sniffer state comment for the next packet
+_pcap_ifaces = None
+_pcap_comment = None
+
 # if true, filter on the first advertiser MAC seen
 # triggered through "-m top" option
 # should be paired with an RSSI filter
@@ -36,13 +41,36 @@ def main():
     aparse.add_argument("-i", "--irk", default=None, help="Filter packets by advertiser IRK")
     aparse.add_argument("-a", "--advonly", action="store_const", default=False, const=True,
             help="Sniff only advertisements, don't follow connections")
+    aparse.add_argument("-n", "--conns", default=1, type=int,
+            help="Follow up to CONNS (1 to %d) connections at once" % CONN_MAX)
+    aparse.add_argument("-A", "--acquire", default=None,
+            help="Find and follow the connection with access address ACQUIRE (hex), "
+            "already in progress")
+    aparse.add_argument("--acquire-map", default="1FFFFFFFFF",
+            help="Channel map (hex) of the connection to acquire")
+    aparse.add_argument("-k", "--ltk", default=None,
+            help="Decrypt connections encrypted with this LTK (hex, MSB first)")
     aparse.add_argument("-e", "--extadv", action="store_const", default=False, const=True,
             help="Capture BT5 extended (auxiliary) advertising")
     aparse.add_argument("-H", "--hop", action="store_const", default=False, const=True,
             help="Hop primary advertising channels in extended mode")
     aparse.add_argument("-l", "--longrange", action="store_const", default=False, const=True,
             help="Use long range (coded) PHY for primary advertising")
-    aparse.add_argument("-o", "--output", default=None, help="PCAP output file name")
+    aparse.add_argument("-o", "--output", default=None,
+            help="PCAP output file name (PCAPNG if it ends in .pcapng or rotating)")
+    aparse.add_argument("--rotate-size", default=0, type=int,
+            help="Start a new PCAPNG output file every ROTATE_SIZE megabytes")
+    aparse.add_argument("--rotate-time", default=0, type=int,
+            help="Start a new PCAPNG output file every ROTATE_TIME seconds")
+    aparse.add_argument("--rotate-files", default=0, type=int,
+            help="Only keep the newest ROTATE_FILES output files when rotating")
+    aparse.add_argument("-S", "--stats", default=0, type=int,
+            help="Print firmware drop/activity counters every STATS milliseconds")
+    aparse.add_argument("--snaplen", default=0, type=int,
+            help="Only capture the first SNAPLEN bytes of data channel PDUs "
+            "(LL control PDUs are always captured in full)")
+    aparse.add_argument("--snaplen-adv", default=0, type=int,
+            help="Only capture the first SNAPLEN_ADV bytes of advertising PDUs")
     args = aparse.parse_args()
 
     # Sanity check argument combinations
@@ -62,6 +90,40 @@ def main():
     if args.advchan != 40 and args.hop:
         print("Don't specify an advertising channel if you want advertising channel hopping!", file=sys.stderr)
         return
+    if not (1 <= args.conns <= CONN_MAX):
+        print("Can follow 1 to %d connections at once!" % CONN_MAX, file=sys.stderr)
+        return
+    if args.acquire:
+        try:
+            acq_aa = int(args.acquire, 16)
+            acq_map = int(args.acquire_map, 16)
+            if acq_aa >> 32 or acq_map >> 37 or bin(acq_map).count("1") < 2:
+                raise ValueError()
+        except ValueError:
+            print("Access address must be 32 bit hex, and channel map 2 to 37 channels in hex",
+                    file=sys.stderr)
+            return
+
+    # parsed before configuring, so a bad one can't leave a half sent transaction
+    macBytes = None
+    if args.mac and args.mac != "top":
+        try:
+            macBytes = [int(h, 16) for h in reversed(args.mac.split(":"))]
+            if len(macBytes) != 6:
+                raise Exception("Wrong length!")
+        except:
+            print("MAC must be 6 colon-separated hex bytes", file=sys.stderr)
+            return
+
+    ltk = None
+    if args.ltk:
+        try:
+            ltk = unhexlify(args.ltk)
+            if len(ltk) != 16:
+                raise ValueError()
+        except ValueError:
+            print("LTK must be 16 bytes of hex", file=sys.stderr)
+            return
 
     global hw
     hw = SniffleHW(args.serport)
@@ -73,69 +135,117 @@ def main():
     else:
         _allow_hop3 = False
 
-    # set the advertising channel (and return to ad-sniffing mode)
-    hw.cmd_chan_aa_phy(args.advchan, BLE_ADV_AA, 2 if args.longrange else 0)
+    # apply configuration as one firmware transaction
+    with hw.transaction():
+        # set the advertising channel (and return to ad-sniffing mode)
+        hw.cmd_chan_aa_phy(args.advchan, BLE_ADV_AA, 2 if args.longrange else 0)
 
-    # set whether or not to pause after sniffing
-    hw.cmd_pause_done(args.pause)
+        # set whether or not to pause after sniffing
+        hw.cmd_pause_done(args.pause)
 
-    # set up whether or not to follow connections
-    hw.cmd_follow(not args.advonly)
+        # set up whether or not to follow connections
+        hw.cmd_follow(not args.advonly)
 
-    # configure RSSI filter
-    global _rssi_min
-    _rssi_min = args.rssi
-    hw.cmd_rssi(args.rssi)
+        # with several connections, frames need to say which one they're from
+        # and numbered frames show where any got lost on the way to us
+        # (compact headers are only used for frames without an access address)
+        hw.cmd_conn_max(args.conns)
+        hw.cmd_frame_format(FRAMEFMT_SEQ | FRAMEFMT_COMPACT |
+                (FRAMEFMT_AA if args.conns > 1 else 0))
 
-    # disable 37/38/39 hop in extended mode unless overridden
-    if args.extadv and not args.hop:
-        _allow_hop3 = False
+        # configure RSSI filter
+        global _rssi_min
+        _rssi_min = args.rssi
+        hw.cmd_rssi(args.rssi)
 
-    # configure MAC filter
-    global _delay_top_mac
-    if args.mac is None and args.irk is None:
-        hw.cmd_mac()
-    elif args.irk:
-        hw.cmd_irk(unhexlify(args.irk), _allow_hop3)
-    elif args.mac == "top":
-        hw.cmd_mac()
-        _delay_top_mac = True
-    else:
-        try:
-            macBytes = [int(h, 16) for h in reversed(args.mac.split(":"))]
-            if len(macBytes) != 6:
-                raise Exception("Wrong length!")
-        except:
-            print("MAC must be 6 colon-separated hex bytes", file=sys.stderr)
-            return
-        hw.cmd_mac(macBytes, _allow_hop3)
+        # disable 37/38/39 hop in extended mode unless overridden
+        if args.extadv and not args.hop:
+            _allow_hop3 = False
+
+        # configure MAC filter
+        global _delay_top_mac
+        if args.mac is None and args.irk is None:
+            hw.cmd_mac()
+        elif args.irk:
+            hw.cmd_irk(unhexlify(args.irk), _allow_hop3)
+        elif args.mac == "top":
+            hw.cmd_mac()
+            _delay_top_mac = True
+        else:
+            hw.cmd_mac(macBytes, _allow_hop3)
 
-    # configure BT5 extended (aux/secondary) advertising
-    hw.cmd_auxadv(args.extadv)
+        # configure BT5 extended (aux/secondary) advertising
+        hw.cmd_auxadv(args.extadv)
+
+        # capture only PDU headers (and the start of the payload) if asked to
+        hw.cmd_snaplen(args.snaplen_adv, args.snaplen)
+
+        # decrypt encrypted connections on the sniffer, if we know the key
+        hw.cmd_ltk(ltk)
+
+        # look for a connection already in progress, rather than its CONNECT_IND
+        if args.acquire:
+            hw.cmd_acquire(acq_aa, acq_map, 2 if args.longrange else 0)
 
     # zero timestamps and flush old packets
     hw.mark_and_flush()
 
-    global pcwriter
-    if not (args.output is None):
+    # no CONNECT_IND will tell the decoder the access address
+    if args.acquire:
+        hw.decoder_state.cur_aa = acq_aa
+
+    global pcwriter, _pcap_ifaces
+    if args.output is None:
+        pass
+    elif args.output.endswith(".pcapng") or args.rotate_size or args.rotate_time:
+        pcwriter = PcapngBleWriter(args.output, args.rotate_size << 20,
+                args.rotate_time, args.rotate_files)
+        _pcap_ifaces = [pcwriter.add_interface(n) for n in ["1M", "2M", "Coded"]]
+    else:
         pcwriter = PcapBleWriter(args.output)
 
-    while True:
-        msg = hw.recv_and_decode()
-        print_message(msg)
+    # periodic firmware statistics
+    if args.stats:
+        hw.cmd_stats(args.stats)
+
+    # drain serial port on a separate thread, so output can't stall it
+    hw.start_reader()
+    try:
+        while True:
+            msg = hw.recv_and_decode()
+            print_message(msg)
+    finally:
+        # PCAPNG output is buffered
+        if pcwriter:
+            pcwriter.close()
 
 def print_message(msg):
+    global _pcap_comment
     if isinstance(msg, PacketMessage):
         print_packet(msg)
     elif isinstance(msg, DebugMessage):
         print(msg)
     elif isinstance(msg, StateMessage):
         print(msg)
+        _pcap_comment = str(msg)
+    elif isinstance(msg, StatsMessage):
+        print(msg)
     print()
 
 def print_packet(pkt):
-    if pcwriter:
-        pcwriter.write_packet(int(pkt.ts_epoch * 1000000), pkt.aa, pkt.chan, pkt.rssi, pkt.body)
+    global _pcap_comment
+    if pkt.lost:
+        print("LOST: %d frames before this one (%d total)\n" % (pkt.lost,
+            hw.decoder_state.seq_lost))
+
+    if _pcap_ifaces:
+        pcwriter.write_packet(int(pkt.ts_epoch * 1000000), pkt.aa, pkt.chan, pkt.rssi,
+                pkt.body, _pcap_ifaces[min(pkt.phy, 2)], _pcap_comment, pkt.orig_len,
+                pkt.decrypted)
+        _pcap_comment = None
+    elif pcwriter:
+        pcwriter.write_packet(int(pkt.ts_epoch * 1000000), pkt.aa, pkt.chan, pkt.rssi, pkt.body,
+                pkt.orig_len, pkt.decrypted)
 
     # Further decode and print the packet
     dpkt = DPacketMessage.decode(pkt)
@@ -0,0 +1,169 @@
+#!/usr/bin/env python3
+
+# Written by Sultan Qasim Khan
+# Copyright (c) 2020, NCC Group plc
+# Released as open source under GPLv3
+
+# Wireshark extcap interface, for live capture straight from the sniffer.
+# Symlink or copy this into Wireshark's personal extcap directory (see
+# Help > About Wireshark > Folders), then pick "Sniffle" as the interface.
+
+import argparse, signal, sys
+from binascii import unhexlify
+from pcap import PcapBleWriter
+from sniffle_hw import SniffleHW, BLE_ADV_AA, PacketMessage
+from packet_decoder import DPacketMessage, classify
+
+EXTCAP_VERSION = "1.0"
+IFACE = "sniffle"
+
+# extcap config arguments: (call, display, type, default, tooltip)
+_config = [
+    ("--serport", "Serial port", "string", "/dev/ttyACM0", "Sniffer serial port name"),
+    ("--advchan", "Advertising channel", "selector", "40",
+        "Advertising channel to listen on, or hop all three"),
+    ("--rssi", "Minimum RSSI", "integer", "-80", "Filter packets by minimum RSSI"),
+    ("--mac", "Advertiser MAC", "string", "", "Filter packets by advertiser MAC"),
+    ("--irk", "Advertiser IRK", "string", "", "Filter packets by advertiser IRK (hex)"),
+    ("--ltk", "LTK", "string", "", "Decrypt connections encrypted with this LTK (hex, MSB first)"),
+    ("--advonly", "Advertisements only", "boolflag", "false",
+        "Sniff only advertisements, don't follow connections"),
+    ("--extadv", "Extended advertising", "boolflag", "false",
+        "Capture BT5 extended (auxiliary) advertising"),
+    ("--hop", "Hop primary channels", "boolflag", "false",
+        "Hop primary advertising channels in extended mode (needs a MAC or IRK)"),
+    ("--longrange", "Long range", "boolflag", "false",
+        "Use long range (coded) PHY for primary advertising"),
+]
+
+_advchans = [("40", "All (hop)"), ("37", "37"), ("38", "38"), ("39", "39")]
+
+def extcap_interfaces():
+    print("extcap {version=%s}{help=https://github.com/nccgroup/Sniffle}" % EXTCAP_VERSION)
+    print("interface {value=%s}{display=Sniffle BLE5 sniffer}" % IFACE)
+
+def extcap_dlts():
+    print("dlt {number=%d}{name=DLT_BLUETOOTH_LE_LL_WITH_PHDR}{display=Bluetooth LE LL}" %
+            PcapBleWriter.DLT)
+
+def extcap_config():
+    for i, (call, disp, typ, default, tip) in enumerate(_config):
+        print("arg {number=%d}{call=%s}{display=%s}{type=%s}{default=%s}{tooltip=%s}" % (
+            i, call, disp, typ, default, tip))
+        if typ == "selector":
+            for val, vdisp in _advchans:
+                print("value {arg=%d}{value=%s}{display=%s}{default=%s}" % (
+                    i, val, vdisp, "true" if val == default else "false"))
+
+def configure(hw, args):
+    if args.hop and not (args.mac or args.irk):
+        raise ValueError("Primary adv. channel hop requires a MAC address or IRK specified!")
+    if args.longrange and not args.extadv:
+        raise ValueError("Long-range PHY only supported in extended advertising!")
+    if args.longrange and args.hop:
+        raise ValueError("Primary ad channel hopping unsupported on long range PHY!")
+    if args.mac and args.irk:
+        raise ValueError("IRK and MAC filters are mutually exclusive!")
+    if args.advchan != 40 and args.hop:
+        raise ValueError("Don't specify an advertising channel if you want advertising channel hopping!")
+
+    # same meaning as in sniff_receiver.py
+    hop3 = args.advchan == 40 and not (args.extadv and not args.hop)
+    chan = 37 if args.advchan == 40 else args.advchan
+
+    ltk = unhexlify(args.ltk) if args.ltk else None
+    if ltk is not None and len(ltk) != 16:
+        raise ValueError("LTK must be 16 bytes of hex")
+
+    with hw.transaction():
+        hw.cmd_chan_aa_phy(chan, BLE_ADV_AA, 2 if args.longrange else 0)
+        hw.cmd_pause_done(False)
+        hw.cmd_follow(not args.advonly)
+        hw.cmd_rssi(args.rssi)
+        if args.irk:
+            hw.cmd_irk(unhexlify(args.irk), hop3)
+        elif args.mac:
+            macBytes = [int(h, 16) for h in reversed(args.mac.split(":"))]
+            if len(macBytes) != 6:
+                raise ValueError("MAC must be 6 colon-separated hex bytes")
+            hw.cmd_mac(macBytes, hop3)
+        else:
+            hw.cmd_mac()
+        hw.cmd_auxadv(args.extadv)
+        hw.cmd_ltk(ltk)
+
+    hw.mark_and_flush()
+
+def capture(args):
+    hw = SniffleHW(args.serport)
+    configure(hw, args)
+
+    # Wireshark opens the FIFO for reading before starting us
+    pcwriter = PcapBleWriter(args.fifo)
+    pcwriter.flush()
+
+    hw.start_reader()
+    try:
+        while True:
+            msg = hw.recv_and_decode()
+            if not isinstance(msg, PacketMessage):
+                continue
+
+            pcwriter.write_packet(int(msg.ts_epoch * 1000000), msg.aa, msg.chan, msg.rssi,
+                    msg.body, msg.orig_len, msg.decrypted)
+
+            # only a CONNECT_IND needs decoding, to learn the new access address
+            if msg.aa == BLE_ADV_AA and classify(msg)[0] == "CONNECT_IND":
+                hw.decoder_state.cur_aa = DPacketMessage.decode(msg).aa
+
+            # nothing else is buffered, so send packets on as they arrive
+            pcwriter.flush()
+    except BrokenPipeError:
+        # Wireshark stopped reading
+        pass
+
+def main():
+    aparse = argparse.ArgumentParser(description="Wireshark extcap interface for Sniffle BLE5 sniffer")
+    aparse.add_argument("--extcap-interfaces", action="store_true")
+    aparse.add_argument("--extcap-interface")
+    aparse.add_argument("--extcap-dlts", action="store_true")
+    aparse.add_argument("--extcap-config", action="store_true")
+    aparse.add_argument("--extcap-version")
+    aparse.add_argument("--extcap-capture-filter")
+    aparse.add_argument("--capture", action="store_true")
+    aparse.add_argument("--fifo")
+    aparse.add_argument("--serport", default="/dev/ttyACM0")
+    aparse.add_argument("--advchan", default=40, choices=[37, 38, 39, 40], type=int)
+    aparse.add_argument("--rssi", default=-80, type=int)
+    aparse.add_argument("--mac", default=None)
+    aparse.add_argument("--irk", default=None)
+    aparse.add_argument("--ltk", default=None)
+    aparse.add_argument("--advonly", action="store_true")
+    aparse.add_argument("--extadv", action="store_true")
+    aparse.add_argument("--hop", action="store_true")
+    aparse.add_argument("--longrange", action="store_true")
+    args = aparse.parse_args()
+
+    if args.extcap_interfaces:
+        extcap_interfaces()
+    elif args.extcap_interface != IFACE:
+        print("Unknown interface, expected %s" % IFACE, file=sys.stderr)
+        sys.exit(1)
+    elif args.extcap_dlts:
+        extcap_dlts()
+    elif args.extcap_config:
+        extcap_config()
+    elif args.capture and args.fifo:
+        # Wireshark stops captures with SIGTERM
+        signal.signal(signal.SIGTERM, lambda signum, frame: sys.exit(0))
+        try:
+            capture(args)
+        except ValueError as e:
+            print(e, file=sys.stderr)
+            sys.exit(1)
+    else:
+        aparse.print_help(sys.stderr)
+        sys.exit(1)
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,436 @@
+/*
+ * Written by Sultan Qasim Khan
+ * Copyright (c) 2020, NCC Group plc
+ * Released as open source under GPLv3
+ */
+
+/* Optional native receive path for fast_reader.py. Build with:
+ *   cc -O2 -shared -fPIC -o libsniffle_fast.so sniffle_fast.c
+ *
+ * sniffle_parse de-frames (base64 or COBS), decodes, splits batches and
+ * parses frame headers for every complete message in a chunk of serial
+ * data, producing one fixed size record per message. Compact frames get
+ * their full timestamp from the last full frame, tracked across calls.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#define MESSAGE_MAX 1024
+
+#define FRAMING_BASE64 0
+#define FRAMING_COBS 1
+
+#define MESSAGE_BLEFRAME 0x10
+#define MESSAGE_BATCH 0x14
+#define MESSAGE_BLEFRAMEX 0x18
+#define MESSAGE_FLUSHACK 0x1C
+#define MESSAGE_BLEFRAMEC 0x1D
+
+#define FRAMEFMT_TS64 0x01
+#define FRAMEFMT_ORIGLEN 0x02
+#define FRAMEFMT_AA 0x04
+#define FRAMEFMT_DECRYPTED 0x08
+#define FRAMEFMT_SEQ 0x10
+
+#define COMPACT_SEQ 0x01
+#define COMPACT_DECRYPTED 0x02
+
+#define TS_MASK 0x3FFFFFFF
+
+// keep in sync with FastRecord in fast_reader.py
+typedef struct
+{
+    uint32_t ts;        // radio timestamp (frames only), low 32 bits with TS64
+    uint32_t dataOff;   // offset of body in data buffer
+    uint16_t length;    // body length
+    uint8_t mtype;      // message type
+    int8_t rssi;        // frames only
+    uint8_t chan;       // frames only
+    uint8_t phy;        // frames only
+    uint8_t flags;      // FRAMEFMT flags of the fields below present
+    uint8_t reserved;
+    uint32_t tsHigh;    // FRAMEFMT_TS64 only
+    uint32_t aa;        // FRAMEFMT_AA only
+    uint16_t origLen;   // FRAMEFMT_ORIGLEN only
+    uint16_t seq;       // FRAMEFMT_SEQ only
+} SniffleRec;
+
+// kept by the caller between calls, keep in sync with FastState
+typedef struct
+{
+    uint32_t frameTs;   // timestamp of the last full frame
+    uint8_t frameTsValid;
+} SniffleState;
+
+typedef struct
+{
+    SniffleState *state;
+    SniffleRec *recs;
+    int numRecs;
+    int maxRecs;
+    uint8_t *data;
+    size_t dataUsed;
+    size_t dataCap;
+    uint32_t errors;
+} ParseCtx;
+
+// table holds value + 1 so that zero means invalid
+static const int8_t b64_vals[256] = {
+    ['A'] = 1, ['B'] = 2, ['C'] = 3, ['D'] = 4, ['E'] = 5, ['F'] = 6,
+    ['G'] = 7, ['H'] = 8, ['I'] = 9, ['J'] = 10, ['K'] = 11, ['L'] = 12,
+    ['M'] = 13, ['N'] = 14, ['O'] = 15, ['P'] = 16, ['Q'] = 17, ['R'] = 18,
+    ['S'] = 19, ['T'] = 20, ['U'] = 21, ['V'] = 22, ['W'] = 23, ['X'] = 24,
+    ['Y'] = 25, ['Z'] = 26, ['a'] = 27, ['b'] = 28, ['c'] = 29, ['d'] = 30,
+    ['e'] = 31, ['f'] = 32, ['g'] = 33, ['h'] = 34, ['i'] = 35, ['j'] = 36,
+    ['k'] = 37, ['l'] = 38, ['m'] = 39, ['n'] = 40, ['o'] = 41, ['p'] = 42,
+    ['q'] = 43, ['r'] = 44, ['s'] = 45, ['t'] = 46, ['u'] = 47, ['v'] = 48,
+    ['w'] = 49, ['x'] = 50, ['y'] = 51, ['z'] = 52, ['0'] = 53, ['1'] = 54,
+    ['2'] = 55, ['3'] = 56, ['4'] = 57, ['5'] = 58, ['6'] = 59, ['7'] = 60,
+    ['8'] = 61, ['9'] = 62, ['+'] = 63, ['/'] = 64
+};
+
+static int b64_decode(uint8_t *dst, const uint8_t *src, size_t len)
+{
+    size_t i, pad = 0;
+    int out = 0;
+
+    if (len & 3)
+        return -1;
+    if (len && src[len - 1] == '=') pad++;
+    if (len > 1 && src[len - 2] == '=') pad++;
+
+    for (i = 0; i < len; i += 4)
+    {
+        int v[4], j;
+        for (j = 0; j < 4; j++)
+        {
+            if (i + j >= len - pad)
+                v[j] = 0;
+            else if ((v[j] = b64_vals[src[i + j]]) == 0)
+                return -1;
+            else
+                v[j]--;
+        }
+        uint32_t w = (v[0] << 18) | (v[1] << 12) | (v[2] << 6) | v[3];
+        dst[out++] = w >> 16;
+        dst[out++] = (w >> 8) & 0xFF;
+        dst[out++] = w & 0xFF;
+    }
+
+    return out - pad;
+}
+
+static int cobs_decode(uint8_t *dst, const uint8_t *src, size_t len)
+{
+    size_t i = 0;
+    int out = 0;
+
+    while (i < len)
+    {
+        uint8_t code = src[i++];
+        if (code == 0 || i + code - 1 > len)
+            return -1;
+        memcpy(dst + out, src + i, code - 1);
+        out += code - 1;
+        i += code - 1;
+        if (code != 0xFF && i < len)
+            dst[out++] = 0;
+    }
+
+    return out;
+}
+
+// same as binascii.crc_hqx(data, 0xFFFF)
+static uint16_t crc16_ccitt(const uint8_t *data, size_t len)
+{
+    uint16_t crc = 0xFFFF;
+    size_t i;
+    int b;
+
+    for (i = 0; i < len; i++)
+    {
+        crc ^= data[i] << 8;
+        for (b = 0; b < 8; b++)
+            crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+    }
+
+    return crc;
+}
+
+// MESSAGE_BLEFRAMEX header, returns its length or -1 if malformed
+static int parse_framex(SniffleRec *rec, const uint8_t *msg, size_t len)
+{
+    size_t hdr = 2;
+    uint16_t plen;
+
+    if (len < 2)
+        return -1;
+    rec->flags = msg[1] & (FRAMEFMT_TS64 | FRAMEFMT_ORIGLEN | FRAMEFMT_AA |
+            FRAMEFMT_DECRYPTED | FRAMEFMT_SEQ);
+
+    // timestamp, length, and the optional fields in FRAMEFMT bit order
+    hdr += (rec->flags & FRAMEFMT_TS64) ? 8 : 4;
+    hdr += 2;
+    if (rec->flags & FRAMEFMT_ORIGLEN) hdr += 2;
+    if (rec->flags & FRAMEFMT_AA) hdr += 4;
+    if (rec->flags & FRAMEFMT_SEQ) hdr += 2;
+    hdr += 2;
+    if (len < hdr)
+        return -1;
+
+    memcpy(&rec->ts, msg + 2, 4);
+    msg += 6;
+    if (rec->flags & FRAMEFMT_TS64)
+    {
+        memcpy(&rec->tsHigh, msg, 4);
+        msg += 4;
+    }
+    memcpy(&plen, msg, 2);
+    msg += 2;
+    if (plen != len - hdr)
+        return -1;
+    if (rec->flags & FRAMEFMT_ORIGLEN)
+    {
+        memcpy(&rec->origLen, msg, 2);
+        msg += 2;
+    }
+    if (rec->flags & FRAMEFMT_AA)
+    {
+        memcpy(&rec->aa, msg, 4);
+        msg += 4;
+    }
+    if (rec->flags & FRAMEFMT_SEQ)
+    {
+        memcpy(&rec->seq, msg, 2);
+        msg += 2;
+    }
+    rec->rssi = (int8_t)msg[0];
+    rec->chan = msg[1] & 0x3F;
+    rec->phy = msg[1] >> 6;
+
+    return hdr;
+}
+
+// MESSAGE_BLEFRAMEC header, returns its length or -1 if malformed
+static int parse_framec(ParseCtx *ctx, SniffleRec *rec, const uint8_t *msg,
+        size_t len)
+{
+    size_t hdr = 2;
+    uint32_t v = 0;
+    unsigned shift = 0;
+
+    // timestamp is relative to the last full frame
+    if (!ctx->state->frameTsValid || len < 2)
+        return -1;
+    rec->chan = msg[1] & 0x3F;
+    rec->phy = msg[1] >> 6;
+
+    // LEB128 varint of delta << 2 and COMPACT flags
+    do {
+        if (hdr >= len || shift > 28)
+            return -1;
+        v |= (uint32_t)(msg[hdr] & 0x7F) << shift;
+        shift += 7;
+    } while (msg[hdr++] & 0x80);
+    rec->ts = (ctx->state->frameTs + (v >> 2)) & TS_MASK;
+
+    if (hdr + 2 + ((v & COMPACT_SEQ) ? 2 : 0) > len)
+        return -1;
+    if (msg[hdr] != len - hdr - 2 - ((v & COMPACT_SEQ) ? 2 : 0))
+        return -1;
+    rec->rssi = (int8_t)msg[hdr + 1];
+    hdr += 2;
+    if (v & COMPACT_SEQ)
+    {
+        rec->flags |= FRAMEFMT_SEQ;
+        memcpy(&rec->seq, msg + hdr, 2);
+        hdr += 2;
+    }
+    if (v & COMPACT_DECRYPTED)
+        rec->flags |= FRAMEFMT_DECRYPTED;
+
+    return hdr;
+}
+
+static int add_message(ParseCtx *ctx, const uint8_t *msg, size_t len)
+{
+    SniffleRec *rec;
+    int hdr = 1;
+
+    if (len < 1)
+        return -1;
+
+    rec = ctx->recs + ctx->numRecs;
+    memset(rec, 0, sizeof(*rec));
+    rec->mtype = msg[0];
+
+    if (msg[0] == MESSAGE_BLEFRAME)
+    {
+        uint16_t plen;
+        if (len < 9)
+            return -1;
+        memcpy(&plen, msg + 5, 2);
+        if (plen != len - 9)
+            return -1;
+        memcpy(&rec->ts, msg + 1, 4);
+        rec->rssi = (int8_t)msg[7];
+        rec->chan = msg[8] & 0x3F;
+        rec->phy = msg[8] >> 6;
+        hdr = 9;
+    } else if (msg[0] == MESSAGE_BLEFRAMEX) {
+        hdr = parse_framex(rec, msg, len);
+    } else if (msg[0] == MESSAGE_BLEFRAMEC) {
+        hdr = parse_framec(ctx, rec, msg, len);
+    } else if (msg[0] == MESSAGE_FLUSHACK) {
+        // the firmware sends the frame after a flush in full
+        ctx->state->frameTsValid = 0;
+    }
+    if (hdr < 0)
+        return -1;
+
+    // compact frames that follow are relative to full ones
+    if (msg[0] == MESSAGE_BLEFRAME || msg[0] == MESSAGE_BLEFRAMEX)
+    {
+        ctx->state->frameTs = rec->ts & TS_MASK;
+        ctx->state->frameTsValid = 1;
+    }
+
+    rec->length = len - hdr;
+    rec->dataOff = ctx->dataUsed;
+    memcpy(ctx->data + ctx->dataUsed, msg + hdr, len - hdr);
+    ctx->dataUsed += len - hdr;
+    ctx->numRecs++;
+
+    return 0;
+}
+
+// count messages in a decoded frame, or -1 if malformed
+static int count_messages(const uint8_t *msg, size_t len)
+{
+    size_t i = 1;
+    int n = 0;
+
+    if (len < 1)
+        return -1;
+    if (msg[0] != MESSAGE_BATCH)
+        return 1;
+
+    while (i + 2 <= len)
+    {
+        uint16_t l = msg[i] | (msg[i + 1] << 8);
+        i += 2;
+        if (l == 0 || i + l > len)
+            return -1;
+        i += l;
+        n++;
+    }
+
+    return n;
+}
+
+// returns 0 if added, 1 if out of room (frame not consumed)
+static int add_frame(ParseCtx *ctx, const uint8_t *msg, size_t len)
+{
+    int n = count_messages(msg, len);
+    size_t i = 1;
+
+    if (n < 0)
+    {
+        ctx->errors++;
+        return 0;
+    }
+    if (ctx->numRecs + n > ctx->maxRecs || ctx->dataUsed + len > ctx->dataCap)
+    {
+        // would never fit, even into empty buffers
+        if (ctx->numRecs == 0)
+        {
+            ctx->errors++;
+            return 0;
+        }
+        return 1;
+    }
+
+    if (msg[0] != MESSAGE_BATCH)
+    {
+        if (add_message(ctx, msg, len) < 0)
+            ctx->errors++;
+        return 0;
+    }
+
+    while (i + 2 <= len)
+    {
+        uint16_t l = msg[i] | (msg[i + 1] << 8);
+        if (add_message(ctx, msg + i + 2, l) < 0)
+            ctx->errors++;
+        i += 2 + l;
+    }
+
+    return 0;
+}
+
+/* Parse complete frames from buf till it's used up or out of room.
+ * Returns number of records produced. *consumed is set to the number of
+ * bytes of buf fully processed; the caller keeps the rest for next time,
+ * along with *state (zeroed to begin with). Malformed frames are skipped
+ * and counted in *errors.
+ */
+int sniffle_parse(SniffleState *state, const uint8_t *buf, size_t len,
+        int framing, SniffleRec *recs, int maxRecs, uint8_t *data, size_t dataCap,
+        size_t *consumed, size_t *dataUsed, uint32_t *errors)
+{
+    // COBS decoded length is under encoded length, which includes CRC
+    uint8_t dec[MESSAGE_MAX + 16];
+    uint8_t delim = (framing == FRAMING_COBS) ? 0 : '\n';
+    ParseCtx ctx = {state, recs, 0, maxRecs, data, 0, dataCap, 0};
+    size_t pos = 0;
+
+    while (pos < len)
+    {
+        const uint8_t *start = buf + pos;
+        const uint8_t *end = memchr(start, delim, len - pos);
+        size_t flen;
+        int dlen;
+
+        if (!end)
+            break;
+        flen = end - start;
+
+        if (framing == FRAMING_COBS)
+        {
+            if (flen == 0)
+                dlen = 0; // resync delimiter
+            else if (flen > MESSAGE_MAX + 8)
+                dlen = -1;
+            else if ((dlen = cobs_decode(dec, start, flen)) < 2)
+                dlen = -1;
+            else if ((dec[dlen - 2] | (dec[dlen - 1] << 8)) !=
+                    crc16_ccitt(dec, dlen - 2))
+                dlen = -1;
+            else
+                dlen -= 2;
+        } else {
+            if (flen && start[flen - 1] == '\r')
+                flen--;
+            if (flen == 0)
+                dlen = 0; // resync CRLF
+            else if (flen > ((MESSAGE_MAX + 2) / 3) * 4)
+                dlen = -1;
+            else
+                dlen = b64_decode(dec, start, flen);
+        }
+
+        if (dlen < 0)
+            ctx.errors++;
+        else if (dlen > 0 && add_frame(&ctx, dec, dlen))
+            break;
+
+        pos = (end - buf) + 1;
+    }
+
+    *consumed = pos;
+    *dataUsed = ctx.dataUsed;
+    *errors = ctx.errors;
+    return ctx.numRecs;
+}
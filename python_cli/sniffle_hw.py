@@ -5,24 +5,114 @@
 from serial import Serial
 from struct import pack, unpack
 from base64 import b64encode, b64decode
-from binascii import Error as BAError
+from binascii import Error as BAError, crc_hqx
 from sys import stderr
 from time import time
 from enum import Enum
 from random import randint
 from traceback import print_exc
+from collections import deque
+from threading import Thread
+from queue import Queue, Empty, Full
+import asyncio, re
+from trace_fmt import TRACE_FORMATS
+
+# UART framing modes
+FRAMING_BASE64 = 0
+FRAMING_COBS = 1
+
+# usable slots in firmware TX queue
+TX_QUEUE_CAPACITY = 7
+
+# optional frame message fields (cmd_frame_format)
+FRAMEFMT_TS64 = 0x01
+FRAMEFMT_ORIGLEN = 0x02 # set by firmware on snapped frames (cmd_snaplen)
+FRAMEFMT_AA = 0x04 # per frame access address, needed with cmd_conn_max(n > 1)
+FRAMEFMT_DECRYPTED = 0x08 # set by firmware on frames decrypted with cmd_ltk
+FRAMEFMT_SEQ = 0x10 # per frame sequence number, to count frames lost on the way
+FRAMEFMT_COMPACT = 0x20 # delta timestamp header where possible (not with TS64 or AA)
+
+# flags in a compact frame's timestamp varint
+COMPACT_SEQ = 0x01
+COMPACT_DECRYPTED = 0x02
+
+# sync pulse pin modes (cmd_sync)
+SYNC_OFF = 0
+SYNC_INPUT = 1
+SYNC_OUTPUT = 2
+
+# PDU filter limits and secondary channel marker (cmd_pdu_filter_add)
+PDUFILT_AD_MAX = 4
+PDUFILT_VALUE_MAX = 16
+PDUFILT_AUX = "aux"
+
+# channel of synthetic frames from cmd_testgen
+TESTGEN_CHANNEL = 63
+
+# most connections the firmware can follow at once (cmd_conn_max)
+CONN_MAX = 4
+
+# largest command payload the length byte can describe
+CMD_MAX = 762
+
+# commands that can't be part of a transaction
+_NO_MULTI_OPS = (0x17, 0x1F, 0x25, 0x32)
+
+# filter table commands, whose add/remove ops can't be part of a transaction
+# (firmware checks a whole transaction before applying it, and these depend
+# on what's in the table)
+_TABLE_OPS = (0x22, 0x23, 0x29)
+
+def _multi_ok(cmd):
+    if cmd[0] in _NO_MULTI_OPS:
+        return False
+    return not (cmd[0] in _TABLE_OPS and cmd[1] != 0)
 
 class SniffleHW:
     def __init__(self, serport):
         self.decoder_state = SniffleDecoderState()
         self.ser = Serial(serport, 2000000)
+        self.framing = FRAMING_BASE64
+        self.framing_resync = False
+        self.pending_msgs = deque()
+
+        # TX flow control state, see tx_flow_init
+        self.tx_synced = False
+        self.tx_sent = 0
+        self.tx_status = None
+        self.tx_backlog = deque()
+
+        # multi-command transaction state, see transaction
+        self.multi_cmds = None
+        self.multi_seq = 0
+        self.multi_ack = None
+
+        # sequence number of the last cmd_flush
+        self.flush_seq = 0
+
+        # background reader state, see start_reader
+        self.reader = None
+        self.reader_queue = None
+        self.reader_drops = 0
+        self.reader_stop = False
+
+        # in case a previous session left the firmware in COBS framing mode
+        self.ser.write(b'\x00' + cobs_frame(bytes([0x01, 0x1F, FRAMING_BASE64])))
         self.ser.write(b'@@@@@@@@\r\n') # command sync
         self.recv_cancelled = False
 
     def _send_cmd(self, cmd_byte_list):
+        if self.multi_cmds is not None:
+            if not _multi_ok(cmd_byte_list):
+                raise ValueError("Command 0x%02X not allowed in transaction" % cmd_byte_list[0])
+            self.multi_cmds.append(cmd_byte_list)
+            return
         b0 = (len(cmd_byte_list) + 3) // 3
         cmd = bytes([b0, *cmd_byte_list])
-        msg = b64encode(cmd) + b'\r\n'
+        if self.framing == FRAMING_COBS:
+            msg = cobs_frame(cmd)
+        else:
+            msg = b64encode(cmd) + b'\r\n'
         self.ser.write(msg)
 
     def cmd_chan_aa_phy(self, chan=37, aa=0x8E89BED6, phy=0, crci=0x555555):
@@ -59,6 +149,40 @@ class SniffleHW:
         else:
             self._send_cmd([0x15, 0x00])
 
+    # Follow up to count connections at once, serving whichever has the
+    # nearest anchor. Enable FRAMEFMT_AA too, to tell their frames apart.
+    def cmd_conn_max(self, count=1):
+        if not (1 <= count <= CONN_MAX):
+            raise ValueError("Connection count out of bounds")
+        self._send_cmd([0x2D, count])
+
+    # Find and follow a connection already in progress, given its access address.
+    # The channel map isn't inferred, so give it if not all channels are used.
+    def cmd_acquire(self, aa, chan_map=0x1FFFFFFFFF, phy=0):
+        if not (0 <= phy <= 2):
+            raise ValueError("PHY must be 0 (1M), 1 (2M), or 2 (coded)")
+        if chan_map >> 37 or bin(chan_map).count("1") < 2:
+            raise ValueError("Channel map needs 2 to 37 data channels")
+        self._send_cmd([0x2E, *list(pack("<L", aa)), *list(pack("<Q", chan_map)[:5]), phy])
+
+    # Decrypt sniffed connections encrypted with this LTK (16 bytes, MSB
+    # first) on the sniffer, or stop decrypting if None. It must be given
+    # before encryption starts, as the session key comes from LL_ENC_REQ/RSP.
+    def cmd_ltk(self, ltk=None):
+        if ltk is None:
+            self._send_cmd([0x2F])
+        elif len(ltk) != 16:
+            raise ValueError("Invalid LTK length!")
+        else:
+            self._send_cmd([0x2F, *ltk])
+
+    # Sweep primary advertising channels 37 to 39 (on 1M, and coded if
+    # requested), spending longer on those finding new advertisers. Only
+    # applies while sniffing advertisements without hopping.
+    def cmd_sweep(self, enable=True, coded=False):
+        mask = (0x01 | (0x02 if coded else 0)) if enable else 0
+        self._send_cmd([0x30, mask])
+
     def cmd_auxadv(self, enable=True):
         if enable:
             self._send_cmd([0x16, 0x01])
@@ -71,20 +195,35 @@ class SniffleHW:
     def cmd_marker(self):
         self._send_cmd([0x18])
 
+    # Drop every message the firmware has queued, then get a FlushAckMessage
+    # (which zeroes time, like a marker). Returns the sequence number it carries.
+    def cmd_flush(self):
+        self.flush_seq = (self.flush_seq + 1) & 0xFF
+        self._send_cmd([0x32, self.flush_seq])
+        return self.flush_seq
+
     # for master or slave modes
+    # returns sequence number of PDU, for use with tx_done
     def cmd_transmit(self, llid, pdu):
         if not (0 <= llid <= 3):
             raise ValueError("Out of bounds LLID")
         if len(pdu) > 255:
             raise ValueError("Too long PDU")
         self._send_cmd([0x19, llid, len(pdu), *pdu])
+        seq = self.tx_sent
+        self.tx_sent = (self.tx_sent + 1) & 0xFFFF
+        return seq
 
-    def cmd_connect(self, peerAddr, llData, is_random=True):
+    # with hop3, the initiator cycles through channels 37 to 39 (1M PHY only)
+    def cmd_connect(self, peerAddr, llData, is_random=True, hop3=False):
         if len(peerAddr) != 6:
             raise ValueError("Invalid peer address")
         if len(llData) != 22:
             raise ValueError("Invalid LLData")
-        self._send_cmd([0x1A, 1 if is_random else 0, *peerAddr, *llData])
+        if hop3:
+            self._send_cmd([0x1A, 1 if is_random else 0, *peerAddr, *llData, 1])
+        else:
+            self._send_cmd([0x1A, 1 if is_random else 0, *peerAddr, *llData])
 
     def cmd_setaddr(self, addr, is_random=True):
         if len(addr) != 6:
@@ -100,6 +239,25 @@ class SniffleHW:
         paddedScnData = [len(scanRspData), *scanRspData] + [0]*(31 - len(scanRspData))
         self._send_cmd([0x1C, *paddedAdvData, *paddedScnData])
 
+    # Advertising sets (0 to 3) are interleaved by the firmware. Set 0 is the
+    # one cmd_advertise uses. Legacy sets are connectable and take up to 31
+    # bytes of data and scan response. Extended sets are non-connectable, put
+    # up to 245 bytes of data in an AUX_ADV_IND, and have no scan response.
+    def cmd_adv_set(self, set_id, advData=None, scanRspData=b'', intervalMs=100,
+            extended=False):
+        if advData is None:
+            self._send_cmd([0x31, set_id, 0x00])
+            return
+        if len(advData) > (245 if extended else 31):
+            raise ValueError("advData too long!")
+        if len(scanRspData) > (0 if extended else 31):
+            raise ValueError("scanRspData too long!")
+        if not (20 <= intervalMs < 0xFFFF):
+            raise ValueError("Advertising interval out of bounds")
+        flags = 0x03 if extended else 0x01
+        self._send_cmd([0x31, set_id, flags, *pack("<H", intervalMs),
+            len(advData), *advData, len(scanRspData), *scanRspData])
+
     def cmd_adv_interval(self, intervalMs):
         if not (20 < intervalMs < 0xFFFF):
             raise ValueError("Advertising interval out of bounds")
@@ -115,63 +273,478 @@ class SniffleHW:
             if hop3:
                 self._send_cmd([0x14])
 
+    # MAC and IRK filter tables allow multiple targets at once
+    # an address passes if it's in the MAC table or resolves with a table IRK
+    # cmd_mac and cmd_irk replace the contents of both tables
+    def cmd_mactbl_clear(self):
+        self._send_cmd([0x22, 0x00])
+
+    def cmd_mactbl_add(self, mac_byte_list):
+        if len(mac_byte_list) != 6:
+            raise ValueError("MAC must be 6 bytes!")
+        self._send_cmd([0x22, 0x01, *mac_byte_list])
+
+    def cmd_mactbl_remove(self, mac_byte_list):
+        if len(mac_byte_list) != 6:
+            raise ValueError("MAC must be 6 bytes!")
+        self._send_cmd([0x22, 0x02, *mac_byte_list])
+
+    def cmd_irktbl_clear(self):
+        self._send_cmd([0x23, 0x00])
+
+    def cmd_irktbl_add(self, irk):
+        if len(irk) != 16:
+            raise ValueError("Invalid IRK length!")
+        self._send_cmd([0x23, 0x01, *irk])
+
+    def cmd_irktbl_remove(self, irk):
+        if len(irk) != 16:
+            raise ValueError("Invalid IRK length!")
+        self._send_cmd([0x23, 0x02, *irk])
+
+    # On-device advertisement filter rules; a frame passes if it matches any
+    # rule. Unset conditions match anything. chans may include 37, 38, 39,
+    # and PDUFILT_AUX for secondary channels. ad is a list of (AD type, value)
+    # or (AD type, value, offset) patterns, all of which must be present;
+    # without an offset the value may be anywhere in the AD data (eg. one
+    # UUID of a list). Frames filtered out still affect hopping/following.
+    def cmd_pdu_filter_clear(self):
+        self._send_cmd([0x29, 0x00])
+
+    def cmd_pdu_filter_add(self, pdu_types=None, min_len=0, max_len=255, chans=None,
+            phys=None, ad=()):
+        if not (0 <= min_len <= max_len <= 255):
+            raise ValueError("Invalid length range")
+        if len(ad) > PDUFILT_AD_MAX:
+            raise ValueError("Too many AD patterns")
+
+        type_mask = 0
+        for t in pdu_types or ():
+            type_mask |= 1 << t
+        chan_mask = 0
+        for c in chans or ():
+            if not c in (37, 38, 39, PDUFILT_AUX):
+                raise ValueError("Invalid advertising channel")
+            chan_mask |= 0x08 if c == PDUFILT_AUX else 1 << (c - 37)
+        phy_mask = 0
+        for p in phys or ():
+            phy_mask |= 1 << p
+
+        rule = [*pack("<H", type_mask), min_len, max_len, chan_mask, phy_mask, len(ad)]
+        for pat in ad:
+            ad_type, value = pat[0], bytes(pat[1])
+            offset = pat[2] if len(pat) > 2 else 0xFF
+            if len(value) > PDUFILT_VALUE_MAX:
+                raise ValueError("AD pattern value too long")
+            rule.extend([ad_type, offset, len(value), *value])
+        self._send_cmd([0x29, 0x01, *rule])
+
+    # binary COBS framing avoids the 33% overhead of base64
+    def cmd_framing(self, framing=FRAMING_COBS):
+        if not framing in (FRAMING_BASE64, FRAMING_COBS):
+            raise ValueError("Invalid framing mode")
+        self._send_cmd([0x1F, framing])
+        self.framing = framing
+
+        # messages in the old framing may still be buffered
+        self.framing_resync = True
+
+    # pack several messages per UART message, reducing per-message overhead
+    def cmd_batching(self, max_len=1024, linger_us=2000):
+        if not (0 <= max_len <= 0xFFFF):
+            raise ValueError("Batch length out of bounds")
+        if not (0 <= linger_us <= 0xFFFF):
+            raise ValueError("Batch linger time out of bounds")
+        self._send_cmd([0x20, *list(pack("<HH", max_len, linger_us))])
+
+    # Advertiser aggregation: legacy advertisements are only sent in full when
+    # the advertiser is new or its payload changes, with an AdvSummaryMessage
+    # of everything seen every period_ms (0 to disable)
+    def cmd_adv_agg(self, period_ms=1000):
+        if not (0 <= period_ms <= 0xFFFF):
+            raise ValueError("Summary period out of bounds")
+        self._send_cmd([0x2A, *list(pack("<H", period_ms))])
+
+    # Only send the first adv_len/data_len bytes (including the 2 byte header)
+    # of advertising/data channel PDUs, 0 for all. LL control PDUs are always
+    # sent in full. Snapped packets have orig_len over len(body).
+    def cmd_snaplen(self, adv_len=0, data_len=0):
+        if not (0 <= adv_len <= 0xFFFF and 0 <= data_len <= 0xFFFF):
+            raise ValueError("Snap length out of bounds")
+        self._send_cmd([0x2B, *list(pack("<HH", adv_len, data_len))])
+
+    # Firmware test mode: inject rate synthetic frames per second of length
+    # bytes (6 to 128) on channel TESTGEN_CHANNEL, bypassing the radio. Body
+    # bytes 2-5 are a sequence number. Stops after count frames (0 for no
+    # limit), or right away if rate is 0.
+    def cmd_testgen(self, length=64, rate=1000, count=0):
+        if rate and not (6 <= length <= 128):
+            raise ValueError("Test frame length out of bounds")
+        if not (0 <= rate <= 0xFFFFFFFF and 0 <= count <= 0xFFFFFFFF):
+            raise ValueError("Test frame rate or count out of bounds")
+        self._send_cmd([0x2C, *list(pack("<HLL", length, rate, count))])
+
+    # request firmware counters now, and then every period_ms (0 for once)
+    def cmd_stats(self, period_ms=0):
+        if not (0 <= period_ms <= 0xFFFF):
+            raise ValueError("Stats period out of bounds")
+        self._send_cmd([0x21, *list(pack("<H", period_ms))])
+
+    # request TX queue status, optionally zeroing firmware TX counters
+    def cmd_tx_status(self, reset=False):
+        self._send_cmd([0x24, 0x01 if reset else 0x00])
+
+    # Follow a connection whose CONNECT_IND (or AUX_CONNECT_REQ) was seen by
+    # another sniffer. conn_ts is the request's timestamp in this sniffer's
+    # radio timebase (see radio_ts).
+    def cmd_follow_conn(self, ll_data, conn_ts, phy=0, csa2=False, aux=False):
+        if len(ll_data) != 22:
+            raise ValueError("Invalid LLData length!")
+        if not (0 <= phy <= 2):
+            raise ValueError("PHY must be 0 (1M), 1 (2M), or 2 (coded)")
+        flags = (0x01 if csa2 else 0) | (0x02 if aux else 0)
+        self._send_cmd([0x26, flags, phy, *list(pack("<L", conn_ts & 0xFFFFFFFF)), *ll_data])
+
+    # Convert host epoch time to this sniffer's raw radio timestamp (us).
+    # Accuracy is limited by USB latency of the last marker.
+    def radio_ts(self, epoch):
+        ds = self.decoder_state
+        real_ts = epoch - ds.first_epoch_time - ds.time_offset - ds.ts_wraps * TS_WRAP_PERIOD
+        return int(real_ts * 1000000) & 0x3FFFFFFF
+
+    # select optional frame message fields (FRAMEFMT_* flags)
+    def cmd_frame_format(self, flags=FRAMEFMT_TS64):
+        if flags & ~(FRAMEFMT_TS64 | FRAMEFMT_AA | FRAMEFMT_SEQ | FRAMEFMT_COMPACT):
+            raise ValueError("Unknown frame format flags")
+        self._send_cmd([0x27, flags])
+
+    # Sync pulse pin: SYNC_OUTPUT sniffer pulses every period_ms, and
+    # SYNC_INPUT sniffers wired to it timestamp the same edges
+    def cmd_sync(self, mode=SYNC_INPUT, period_ms=1000):
+        if not mode in (SYNC_OFF, SYNC_INPUT, SYNC_OUTPUT):
+            raise ValueError("Invalid sync mode")
+        if not (2 <= period_ms <= 0xFFFF):
+            raise ValueError("Sync period out of bounds")
+        self._send_cmd([0x28, mode, *list(pack("<H", period_ms))])
+
+    # Apply several commands at once, acknowledged by one CmdAckMessage.
+    # If any is invalid, none are applied. Returns the sequence number the
+    # ack will carry.
+    def cmd_multi(self, cmd_list):
+        self.multi_seq = (self.multi_seq + 1) & 0xFF
+        payload = [0x25, self.multi_seq]
+        for c in cmd_list:
+            if not _multi_ok(c):
+                raise ValueError("Command 0x%02X not allowed in transaction" % c[0])
+            payload.extend([len(c), *c])
+        if len(payload) > CMD_MAX:
+            raise ValueError("Too many commands for one transaction")
+        self._send_cmd(payload)
+        return self.multi_seq
+
+    # Collect commands issued in a with block, and send them as one
+    # cmd_multi when the block exits without an exception:
+    #   with hw.transaction():
+    #       hw.cmd_rssi(-60)
+    #       hw.cmd_follow(False)
+    def transaction(self):
+        return _CommandTransaction(self)
+
+    # True once firmware acknowledged transaction seq (see multi_ack.status)
+    def multi_acked(self, seq):
+        return self.multi_ack is not None and self.multi_ack.seq == seq
+
+    # Start credit based TX flow control. Firmware reports free TX queue
+    # slots, and PDUs queued with queue_transmit are sent when there's room.
+    def tx_flow_init(self):
+        self.tx_synced = False
+        self.tx_status = None
+        self.tx_sent = 0
+        self.cmd_tx_status(True)
+
+    # free firmware TX slots not already claimed by commands in flight
+    def tx_credits(self):
+        if not self.tx_synced:
+            return 0
+        st = self.tx_status
+        in_flight = (self.tx_sent - st.accepted - st.rejected) & 0xFFFF
+        return max(st.free - in_flight, 0)
+
+    # True once PDU with given sequence number (from cmd_transmit) was sent
+    def tx_done(self, seq):
+        if not self.tx_synced:
+            return False
+        st = self.tx_status
+        completed = (st.accepted - (TX_QUEUE_CAPACITY - st.free)) & 0xFFFF
+        return ((completed - seq - 1) & 0xFFFF) < 0x8000
+
+    # queue a PDU to be sent once firmware has a free TX slot
+    def queue_transmit(self, llid, pdu):
+        if not self.tx_synced and self.tx_status is None and not self.tx_backlog:
+            self.tx_flow_init()
+        self.tx_backlog.append((llid, pdu))
+        self._pump_tx()
+
+    def _pump_tx(self):
+        credits = self.tx_credits()
+        while credits and self.tx_backlog:
+            llid, pdu = self.tx_backlog.popleft()
+            self.cmd_transmit(llid, pdu)
+            credits -= 1
+
+    def _handle_tx_status(self, st):
+        # ignore stale reports until firmware answers our counter reset
+        if not self.tx_synced:
+            if st.reason != TxStatusMessage.REQUESTED:
+                return
+            self.tx_synced = True
+        self.tx_status = st
+        self._pump_tx()
+
+    # Start a thread that drains the serial port into a bounded queue, using
+    # the native parser when built. recv_msg and recv_and_decode then read
+    # from the queue, so slow decoding or output can't stall the serial port.
+    # When the queue is full, new messages are dropped and counted in
+    # reader_drops. Only one thread should consume messages.
+    def start_reader(self, maxsize=8192):
+        if self.reader is not None:
+            return
+        self.reader_queue = Queue(maxsize)
+        self.reader_drops = 0
+        self.reader_stop = False
+        self.reader = Thread(target=self._reader_loop, daemon=True)
+        self.reader.start()
+
+    def stop_reader(self):
+        if self.reader is None:
+            return
+        self.reader_stop = True
+        self.recv_cancelled = True
+        self.ser.cancel_read()
+        self.reader.join()
+        self.reader = None
+        self.recv_cancelled = False
+
+    def _reader_loop(self):
+        fast = None
+        try:
+            import fast_reader
+            if fast_reader.available():
+                fast = fast_reader.FastReader(self)
+        except ImportError:
+            pass
+
+        while not self.reader_stop:
+            if fast:
+                msgs = fast.read_raw()
+            else:
+                msgs = [self._read_msg()]
+            for m in msgs:
+                if m[0] == -1:
+                    continue # stop_reader cancelled the serial read
+                try:
+                    self.reader_queue.put_nowait(m)
+                except Full:
+                    self.reader_drops += 1
+
+    # put message even if queue is full, dropping the oldest to make room
+    def _reader_force_put(self, m):
+        while True:
+            try:
+                self.reader_queue.put_nowait(m)
+                return
+            except Full:
+                try:
+                    self.reader_queue.get_nowait()
+                    self.reader_drops += 1
+                except Empty:
+                    pass
+
+    # Decode messages on another thread, calling callback(msg) for each
+    # till cancel_recv is called. Returns the dispatch thread.
+    def start_dispatch(self, callback):
+        self.start_reader()
+        def dispatch():
+            while True:
+                mtype, mbody, pkt = self.recv_msg()
+                if mtype == -1:
+                    break
+                msg = self._decode_or_report(mtype, mbody, pkt)
+                if msg is not None:
+                    callback(msg)
+        t = Thread(target=dispatch, daemon=True)
+        t.start()
+        return t
+
+    # Async iterator over decoded messages, ending on cancel_recv:
+    #   async for msg in hw.messages():
+    def messages(self):
+        self.start_reader()
+        return _AsyncMessages(self)
+
     def recv_msg(self):
+        if self.reader is not None:
+            return self.reader_queue.get()
+        return self._read_msg()
+
+    def _read_msg(self):
+        # messages already unpacked from a batch
+        if self.pending_msgs:
+            return self.pending_msgs.popleft()
+
+        data, pkt = self._read_frame()
+        if data is None:
+            return -1, None, b''
+
+        if data[0] == 0x14:
+            self._split_batch(data, pkt)
+            if self.pending_msgs:
+                return self.pending_msgs.popleft()
+            return self._read_msg()
+
+        # msg type, msg body
+        return data[0], data[1:], pkt
+
+    # next unframed message and its raw form, data is None if cancelled
+    def _read_frame(self):
         got_msg = False
         while not got_msg:
-            pkt = self.ser.readline()
-            try:
-                data = b64decode(pkt.rstrip())
-            except BAError as e:
-                print(str(pkt, encoding='ascii').rstrip())
-                print("Ignoring message:", e, file=stderr)
-                continue
+            if self.framing == FRAMING_COBS:
+                pkt = self.ser.read_until(b'\x00')
+                if self.recv_cancelled:
+                    break
+                try:
+                    data = cobs_unframe(pkt)
+                except ValueError as e:
+                    if not self.framing_resync:
+                        print(pkt.hex())
+                        print("Ignoring message:", e, file=stderr)
+                    continue
+                if len(data) == 0:
+                    continue # resync delimiter
+            else:
+                pkt = self.ser.readline()
+                if self.recv_cancelled:
+                    break
+                try:
+                    data = b64decode(pkt.rstrip())
+                except BAError as e:
+                    if not self.framing_resync:
+                        print(str(pkt, encoding='ascii', errors='replace').rstrip())
+                        print("Ignoring message:", e, file=stderr)
+                    continue
+                if len(data) == 0:
+                    continue # resync line
             got_msg = True
+            self.framing_resync = False
 
         if self.recv_cancelled:
             self.recv_cancelled = False
-            return -1, None, b''
+            return None, b''
 
-        # msg type, msg body
-        return data[0], data[1:], pkt
+        return data, pkt
+
+    # batch is type byte, then repeated 16 bit length and message
+    def _split_batch(self, data, pkt):
+        i = 1
+        while i + 2 <= len(data):
+            l, = unpack("<H", data[i:i+2])
+            i += 2
+            if l == 0 or i + l > len(data):
+                print("Ignoring truncated batch", file=stderr)
+                return
+            self.pending_msgs.append((data[i], data[i+1:i+l], pkt))
+            i += l
 
     def recv_and_decode(self):
         mtype, mbody, pkt = self.recv_msg()
+        return self._decode_or_report(mtype, mbody, pkt)
+
+    def _decode_or_report(self, mtype, mbody, pkt):
         try:
-            if mtype == 0x10:
-                return PacketMessage(mbody, self.decoder_state)
-            elif mtype == 0x11:
-                return DebugMessage(mbody)
-            elif mtype == 0x12:
-                return MarkerMessage(mbody, self.decoder_state)
-            elif mtype == 0x13:
-                return StateMessage(mbody, self.decoder_state)
-            elif mtype == -1:
-                return None # receive cancelled
-            else:
-                raise SniffleHWPacketError("Unknown message type 0x%02X!" % mtype)
+            return self.decode_msg(mtype, mbody)
         except BaseException as e:
-            print(str(pkt, encoding='ascii').rstrip())
+            if self.framing == FRAMING_COBS:
+                print(pkt.hex())
+            else:
+                print(str(pkt, encoding='ascii').rstrip())
             print("Ignoring message:", e, file=stderr)
             print_exc()
             return None
 
+    # build message object from type and body, also used by FastReader
+    def decode_msg(self, mtype, mbody):
+        if mtype == 0x10:
+            return PacketMessage(mbody, self.decoder_state)
+        elif mtype == 0x11:
+            return DebugMessage(mbody)
+        elif mtype == 0x12:
+            return MarkerMessage(mbody, self.decoder_state)
+        elif mtype == 0x13:
+            return StateMessage(mbody, self.decoder_state)
+        elif mtype == 0x15:
+            return StatsMessage(mbody)
+        elif mtype == 0x16:
+            st = TxStatusMessage(mbody)
+            self._handle_tx_status(st)
+            return st
+        elif mtype == 0x17:
+            self.multi_ack = CmdAckMessage(mbody)
+            return self.multi_ack
+        elif mtype == 0x18:
+            return PacketMessage(mbody, self.decoder_state, True)
+        elif mtype == 0x19:
+            return SyncMessage(mbody)
+        elif mtype == 0x1A:
+            return AdvSummaryMessage(mbody, self.decoder_state)
+        elif mtype == 0x1B:
+            tm = TraceMessage(mbody)
+            return tm if tm.records or tm.lost else None
+        elif mtype == 0x1C:
+            return FlushAckMessage(mbody, self.decoder_state)
+        elif mtype == 0x1D:
+            return PacketMessage(mbody, self.decoder_state, compact=True)
+        elif mtype == -1:
+            return None # receive cancelled
+        else:
+            raise SniffleHWPacketError("Unknown message type 0x%02X!" % mtype)
+
     def cancel_recv(self):
+        if self.reader is not None:
+            # wake the consumer, leaving the reader thread running
+            self._reader_force_put((-1, None, b''))
+            return
         self.recv_cancelled = True
         self.ser.cancel_read()
 
     def mark_and_flush(self):
-        # use marker to zero time, flush every packet before marker
-        # also tolerate errors from incomplete lines in UART buffer
-        self.cmd_marker()
+        # firmware empties its queues and acks, which zeroes time
+        # everything before the ack is stale, so it's thrown out undecoded
+        if self.reader is None:
+            self.pending_msgs.clear()
+            self.ser.reset_input_buffer()
+            self.framing_resync = True # partial frame left after the reset
+        seq = self.cmd_flush()
+
         while True:
-            try:
-                msg = self.recv_and_decode()
-            except SniffleHWPacketError:
-                print("WARNING: invalid message during flush, ignoring...")
-                continue
-            if isinstance(msg, MarkerMessage):
+            if self.reader is not None:
+                mtype, mbody, pkt = self.reader_queue.get()
+                if mtype == -1:
+                    return
+            else:
+                data, pkt = self._read_frame()
+                if data is None:
+                    return
+                if not data:
+                    continue
+                mtype, mbody = data[0], data[1:]
+
+            # the ack is never batched
+            if mtype == 0x1C and mbody[:1] == bytes([seq]):
                 break
 
+        self._decode_or_report(mtype, mbody, pkt)
+
     def random_addr(self):
         # generate a random static address, set it
         addr = [randint(0, 255) for i in range(6)]
@@ -179,7 +752,7 @@ class SniffleHW:
         self.cmd_setaddr(bytes(addr))
 
     # automatically generate sane LLData
-    def initiate_conn(self, peerAddr, is_random=True):
+    def initiate_conn(self, peerAddr, is_random=True, hop3=False):
         llData = []
 
         # access address
@@ -201,11 +774,63 @@ class SniffleHW:
         # Hop, SCA = 0
         llData.append(randint(5, 16))
 
-        self.cmd_connect(peerAddr, bytes(llData), is_random)
+        self.cmd_connect(peerAddr, bytes(llData), is_random, hop3)
 
         # return the access address
         return unpack("<L", bytes(llData[:4]))[0]
 
+def cobs_encode(data):
+    out = bytearray([0])
+    code_idx = 0
+    code = 1
+    for b in data:
+        if b == 0:
+            out[code_idx] = code
+            code_idx = len(out)
+            out.append(0)
+            code = 1
+        else:
+            out.append(b)
+            code += 1
+            if code == 0xFF:
+                out[code_idx] = code
+                code_idx = len(out)
+                out.append(0)
+                code = 1
+    out[code_idx] = code
+    return bytes(out)
+
+def cobs_decode(data):
+    out = bytearray()
+    i = 0
+    while i < len(data):
+        code = data[i]
+        if code == 0 or i + code > len(data):
+            raise ValueError("Invalid COBS data")
+        out += data[i+1:i+code]
+        i += code
+        # maximal and final blocks have no implicit zero
+        if code != 0xFF and i < len(data):
+            out.append(0)
+    return bytes(out)
+
+# COBS frames carry a CRC-16/CCITT-FALSE and end with a zero delimiter
+def cobs_frame(msg):
+    return cobs_encode(msg + pack("<H", crc_hqx(msg, 0xFFFF))) + b'\x00'
+
+def cobs_unframe(pkt):
+    if pkt[-1:] != b'\x00':
+        raise ValueError("Incomplete COBS frame")
+    if len(pkt) == 1:
+        return b''
+    data = cobs_decode(pkt[:-1])
+    if len(data) < 2:
+        raise ValueError("Truncated COBS frame")
+    crc, = unpack("<H", data[-2:])
+    if crc != crc_hqx(data[:-2], 0xFFFF):
+        raise ValueError("Bad COBS frame CRC")
+    return data[:-2]
+
 # raised when sniffle HW gives invalid data (shouldn't happen)
 # this is not for malformed Bluetooth traffic
 class SniffleHWPacketError(ValueError):
@@ -224,45 +849,147 @@ class SniffleDecoderState:
         # access address tracking
         self.cur_aa = 0 if is_data else BLE_ADV_AA
 
+        # timestamp of the last full frame, compact frame timestamps are relative to it
+        self.frame_ts = None
+
+        # FRAMEFMT_SEQ tracking, next_seq is None till the first numbered frame
+        self.next_seq = None
+        self.seq_lost = 0
+
         # state tracking
         self.last_state = SnifferState.STATIC
 
 # radio time wraparound period in seconds
+# frame timestamps are 4 MHz ticks >> 2, so they're 30 bit microseconds
 TS_WRAP_PERIOD = 0x100000000 / 4E6
+TS_MASK = 0x3FFFFFFF
+
+# track wraps of 30 bit timestamps from a 64 bit one
+def _sync_wraps(dstate, ts64):
+    dstate.ts_wraps = ts64 >> 30
+    dstate.last_ts = ts64 & TS_MASK
+
+# LEB128 varint at data[i], returns value and index after it
+def _read_varint(data, i):
+    v = 0
+    shift = 0
+    while True:
+        if i >= len(data) or shift > 28:
+            raise SniffleHWPacketError("Bad varint!")
+        b = data[i]
+        i += 1
+        v |= (b & 0x7F) << shift
+        shift += 7
+        if not b & 0x80:
+            return v, i
 
 class PacketMessage:
-    def __init__(self, raw_msg, dstate):
+    # no per instance dict, as there's one of these per frame
+    __slots__ = ('ts', 'ts_epoch', 'ts_radio', 'orig_len', 'aa', 'rssi', 'chan', 'phy',
+            'body', 'decrypted', 'seq', 'lost')
+
+    def __init__(self, raw_msg, dstate, ext=False, compact=False):
+        ts64 = None
+        orig_len = None
+        aa = None
+        seq = None
+        flags = 0
+        if compact:
+            # MESSAGE_BLEFRAMEC: channel/PHY, then varint of timestamp delta
+            # from the last full frame and flags, 1 byte length and RSSI,
+            # optional sequence number
+            if dstate.frame_ts is None:
+                raise SniffleHWPacketError("Compact frame without a reference time!")
+            chan = raw_msg[0]
+            v, i = _read_varint(raw_msg, 1)
+            delta = v >> 2
+            if i + 2 > len(raw_msg):
+                raise SniffleHWPacketError("Truncated compact frame!")
+            l, rssi = unpack("<Bb", raw_msg[i:i+2])
+            i += 2
+            if v & COMPACT_SEQ:
+                seq, = unpack("<H", raw_msg[i:i+2])
+                i += 2
+            if v & COMPACT_DECRYPTED:
+                flags |= FRAMEFMT_DECRYPTED
+            ts = (dstate.frame_ts + delta) & TS_MASK
+            raw_msg = pack("<LHbB", ts, l, rssi, chan) + raw_msg[i:]
+        elif ext:
+            # MESSAGE_BLEFRAMEX: flags byte, then 32 or 64 bit timestamp
+            flags = raw_msg[0]
+            if flags & FRAMEFMT_TS64:
+                ts64, = unpack("<Q", raw_msg[1:9])
+                raw_msg = pack("<L", ts64 & TS_MASK) + raw_msg[9:]
+            else:
+                raw_msg = raw_msg[1:]
+
+            # original length follows length
+            if flags & FRAMEFMT_ORIGLEN:
+                orig_len, = unpack("<H", raw_msg[6:8])
+                raw_msg = raw_msg[:6] + raw_msg[8:]
+
+            # then access address
+            if flags & FRAMEFMT_AA:
+                aa, = unpack("<L", raw_msg[6:10])
+                raw_msg = raw_msg[:6] + raw_msg[10:]
+
+            # then sequence number
+            if flags & FRAMEFMT_SEQ:
+                seq, = unpack("<H", raw_msg[6:8])
+                raw_msg = raw_msg[:6] + raw_msg[8:]
+
         ts, l, rssi, chan = unpack("<LHbB", raw_msg[:8])
         body = raw_msg[8:]
 
         if len(body) != l:
             raise SniffleHWPacketError("Incorrect length field!")
+        if not compact:
+            dstate.frame_ts = ts
 
         phy = chan >> 6
         chan &= 0x3F
 
-        if chan >= 37 and dstate.cur_aa != BLE_ADV_AA:
+        if aa is not None:
+            dstate.cur_aa = aa
+        elif chan >= 37 and dstate.cur_aa != BLE_ADV_AA:
             dstate.cur_aa = BLE_ADV_AA
 
         if dstate.time_offset > 0:
             dstate.first_epoch_time = time()
-            dstate.time_offset = ts / -1000000.
+            dstate.time_offset = (ts if ts64 is None else ts64) / -1000000.
 
-        if ts < dstate.last_ts:
+        if ts64 is not None:
+            _sync_wraps(dstate, ts64)
+        elif ts < dstate.last_ts:
             dstate.ts_wraps += 1
         dstate.last_ts = ts
 
-        real_ts = dstate.time_offset + (ts / 1000000.) + (dstate.ts_wraps * TS_WRAP_PERIOD)
+        # frames missing between the last numbered one and this
+        lost = 0
+        if seq is not None:
+            if dstate.next_seq is not None:
+                lost = (seq - dstate.next_seq) & 0xFFFF
+                dstate.seq_lost += lost
+            dstate.next_seq = (seq + 1) & 0xFFFF
+
+        # full radio time in microseconds
+        ts_radio = ts + (dstate.ts_wraps << 30)
+        real_ts = dstate.time_offset + (ts_radio / 1000000.)
         real_ts_epoch = dstate.first_epoch_time + real_ts
 
         # Now actually set instance attributes
         self.ts = real_ts
         self.ts_epoch = real_ts_epoch
+        self.ts_radio = ts_radio
+        self.orig_len = len(body) if orig_len is None else orig_len
         self.aa = dstate.cur_aa
         self.rssi = rssi
         self.chan = chan
         self.phy = phy
         self.body = body
+        self.decrypted = bool(flags & FRAMEFMT_DECRYPTED)
+        self.seq = seq
+        self.lost = lost
 
     @classmethod
     def from_body(cls, body, is_data=False):
@@ -275,8 +1002,13 @@ class PacketMessage:
 
     def str_header(self):
         phy_names = ["1M", "2M", "Coded", "Reserved"]
-        return "Timestamp: %.6f\tLength: %i\tRSSI: %i\tChannel: %i\tPHY: %s" % (
-            self.ts, len(self.body), self.rssi, self.chan, phy_names[self.phy])
+        if self.orig_len > len(self.body):
+            len_str = "%i (of %i)" % (len(self.body), self.orig_len)
+        else:
+            len_str = "%i" % len(self.body)
+        return "Timestamp: %.6f\tLength: %s\tRSSI: %i\tChannel: %i\tPHY: %s%s" % (
+            self.ts, len_str, self.rssi, self.chan, phy_names[self.phy],
+            "\tDecrypted" if self.decrypted else "")
 
     def __str__(self):
         return self.str_header()
@@ -291,14 +1023,132 @@ class DebugMessage:
     def __str__(self):
         return "DEBUG: " + self.msg
 
+class TraceRecord:
+    def __init__(self, fmt_id, ts, args):
+        self.fmt_id = fmt_id
+        self.ts = ts
+        self.args = args
+
+    def __str__(self):
+        if self.fmt_id >= len(TRACE_FORMATS):
+            return "unknown trace %d %s" % (self.fmt_id, repr(self.args))
+        name, fmt = TRACE_FORMATS[self.fmt_id]
+
+        # arguments arrive as unsigned 32 bit, signed conversions need sign extension
+        args = []
+        convs = re.findall(r"%[-+ #0]*\d*(?:\.\d+)?[hlLqjzt]*([diouxXcs%])", fmt)
+        convs = [c for c in convs if c != '%']
+        for i, a in enumerate(self.args):
+            if i < len(convs) and convs[i] in "di" and a >= 0x80000000:
+                a -= 0x100000000
+            args.append(a)
+        try:
+            return fmt % tuple(args)
+        except (TypeError, ValueError):
+            return "%s %s" % (name, repr(self.args))
+
+# deferred debug prints, formatted on the host
+class TraceMessage(DebugMessage):
+    def __init__(self, raw_msg):
+        self.lost, = unpack("<H", raw_msg[:2])
+        self.records = []
+        i = 2
+        while i + 6 <= len(raw_msg):
+            fmt_id, nargs, ts = unpack("<BBL", raw_msg[i:i+6])
+            i += 6
+            if i + 4*nargs > len(raw_msg):
+                raise SniffleHWPacketError("Truncated trace record!")
+            args = unpack("<%dL" % nargs, raw_msg[i:i+4*nargs])
+            i += 4*nargs
+            self.records.append(TraceRecord(fmt_id, ts, args))
+
+        lines = [str(r) for r in self.records]
+        if self.lost:
+            lines.append("%d trace records lost" % self.lost)
+        self.msg = "\n".join(lines)
+
 class MarkerMessage:
     def __init__(self, raw_msg, dstate):
-        ts, = unpack("<L", raw_msg)
+        ts, = unpack("<L", raw_msg[:4])
+        self.ts_radio = None
+
+        # newer firmware appends a 64 bit timestamp
+        if len(raw_msg) >= 12:
+            self.ts_radio, = unpack("<Q", raw_msg[4:12])
+            _sync_wraps(dstate, self.ts_radio)
+            ts = self.ts_radio
 
         # these messages are intended to mark the zero time
         dstate.first_epoch_time = time()
         dstate.time_offset = ts / -1000000.
 
+# reply to cmd_flush, with the radio time it was done (taken as zero time)
+class FlushAckMessage(MarkerMessage):
+    def __init__(self, raw_msg, dstate):
+        self.seq = raw_msg[0]
+        super().__init__(raw_msg[1:], dstate)
+
+        # firmware numbers frames from zero again after a flush, and
+        # sends the next one in full
+        dstate.next_seq = 0
+        dstate.frame_ts = None
+
+    def __repr__(self):
+        return "%s(seq=%d, ts_radio=%d)" % (type(self).__name__, self.seq, self.ts_radio)
+
+# edge on the shared sync pulse pin, with its host arrival time
+class SyncMessage:
+    def __init__(self, raw_msg):
+        self.count, self.ts_radio = unpack("<LQ", raw_msg[:12])
+        self.host_time = time()
+
+    def __repr__(self):
+        return "%s(count=%d, ts_radio=%d)" % (type(self).__name__, self.count, self.ts_radio)
+
+    def __str__(self):
+        return "SYNC: pulse %d at %d us" % (self.count, self.ts_radio)
+
+class AdvSummaryRecord:
+    def __init__(self, raw_rec, dstate):
+        self.AdvA = raw_rec[:6]
+        self.pdu_type = raw_rec[6] & 0xF
+        self.TxAdd = 1 if raw_rec[6] & 0x40 else 0
+        chans = raw_rec[7]
+        self.chans = [37 + i for i in range(3) if chans & (1 << i)]
+        self.count, self.rssi_min, self.rssi_max, self.rssi_avg, self.ts_radio = \
+                unpack("<HbbbQ", raw_rec[8:21])
+        # same time base as PacketMessage.ts
+        self.ts = dstate.time_offset + self.ts_radio / 1000000.
+
+    def adva_str(self):
+        return ":".join("%02X" % b for b in reversed(self.AdvA))
+
+    def __repr__(self):
+        return "%s(AdvA=%s, pdu_type=%d, count=%d, rssi_avg=%d)" % (type(self).__name__,
+                self.adva_str(), self.pdu_type, self.count, self.rssi_avg)
+
+    def __str__(self):
+        return "%s type %d: %d frames, RSSI %d/%d/%d (min/avg/max), channels %s" % (
+                self.adva_str(), self.pdu_type, self.count, self.rssi_min, self.rssi_avg,
+                self.rssi_max, ",".join(str(c) for c in self.chans))
+
+# per-advertiser counts since the last summary, from aggregation mode
+class AdvSummaryMessage:
+    REC_LEN = 21
+
+    def __init__(self, raw_msg, dstate):
+        if len(raw_msg) % self.REC_LEN:
+            raise SniffleHWPacketError("Incorrect advertiser summary length!")
+        self.records = [AdvSummaryRecord(raw_msg[i:i + self.REC_LEN], dstate)
+                for i in range(0, len(raw_msg), self.REC_LEN)]
+
+    def __repr__(self):
+        return "%s(records=%s)" % (type(self).__name__, repr(self.records))
+
+    def __str__(self):
+        return "\n".join(["ADV SUMMARY: %d advertisers" % len(self.records)] +
+                ["  " + str(r) for r in self.records])
+
 class SnifferState(Enum):
     STATIC = 0
     ADVERT_SEEK = 1
@@ -310,6 +1160,7 @@ class SnifferState(Enum):
     SLAVE = 7
     ADVERTISING = 8
     SCANNING = 9
+    ACQUIRING = 10
 
 class StateMessage:
     def __init__(self, raw_msg, dstate):
@@ -324,3 +1175,175 @@ class StateMessage:
     def __str__(self):
         return "TRANSITION: %s from %s" % (str(self.new_state),
                 str(self.last_state))
+
+class StatsMessage:
+    counter_names = ["queue_drops", "rssi_rejects", "mac_rejects", "crc_errors",
+            "rf_buf_full", "tx_queue_drops", "cmd_errors", "uart_bytes",
+            "adv_cache_hits", "adv_cache_misses", "pdu_rejects", "agg_suppressed",
+            "defer_drops"]
+
+    # latency histogram section IDs, firmware built with STATS_LATENCY
+    latency_sections = {0x02: "rx_to_uart", 0x03: "rf_callback", 0x04: "conn_req"}
+
+    def __init__(self, raw_msg):
+        # message is a series of [ID][length][data] sections
+        self.sections = {}
+        i = 0
+        while i + 2 <= len(raw_msg):
+            sid, slen = raw_msg[i:i+2]
+            if i + 2 + slen > len(raw_msg):
+                raise SniffleHWPacketError("Truncated stats section!")
+            self.sections[sid] = raw_msg[i+2:i+2+slen]
+            i += 2 + slen
+
+        # counters are cumulative since firmware boot
+        self.counters = {}
+        if 0x00 in self.sections:
+            data = self.sections[0x00]
+            vals = unpack("<%dL" % (len(data) // 4), data[:len(data) & ~3])
+            self.counters = dict(zip(self.counter_names, vals))
+
+        # frames received on each channel, before filtering
+        self.rx_frames = []
+        if 0x01 in self.sections:
+            data = self.sections[0x01]
+            self.rx_frames = list(unpack("<%dL" % (len(data) // 4), data[:len(data) & ~3]))
+
+        # cumulative log2 histograms in radio ticks (0.25 us), bucket n counting
+        # durations of [2^n, 2^(n+1)) ticks, with the last bucket open ended
+        self.latency = {}
+        for sid, name in self.latency_sections.items():
+            if sid in self.sections:
+                data = self.sections[sid]
+                self.latency[name] = list(unpack("<%dL" % (len(data) // 4),
+                    data[:len(data) & ~3]))
+
+        # per data channel (hits, misses, mean RSSI) of a connection being
+        # sniffed, along with its access address and channel map in use
+        self.data_chans = None
+        if 0x05 in self.sections:
+            data = self.sections[0x05]
+            aa, map_lo, map_hi = unpack("<LLB", data[:9])
+            chans = [unpack("<HHb", data[i:i+5]) for i in range(9, len(data) - 4, 5)]
+            self.data_chans = (aa, map_lo | (map_hi << 32), chans)
+
+    @staticmethod
+    def bucket_us(n):
+        # lower bound of histogram bucket n in microseconds
+        return 0. if n == 0 else (1 << n) / 4
+
+    def latency_percentile(self, name, pct):
+        # upper bound of the bucket containing the given percentile, in microseconds
+        hist = self.latency.get(name)
+        if not hist or not sum(hist):
+            return None
+        target = sum(hist) * pct / 100
+        total = 0
+        for n, count in enumerate(hist):
+            total += count
+            if total >= target:
+                return (1 << (n + 1)) / 4
+        return None
+
+    def __repr__(self):
+        return "%s(counters=%s, rx_frames=%s, latency=%s, data_chans=%s)" % (
+                type(self).__name__, repr(self.counters), repr(self.rx_frames),
+                repr(self.latency), repr(self.data_chans))
+
+    def __str__(self):
+        counters = " ".join("%s=%d" % (k, v) for k, v in self.counters.items())
+        chans = " ".join("%d:%d" % (c, n) for c, n in enumerate(self.rx_frames) if n)
+        lines = ["STATS: %s" % counters, "RX frames by channel: %s" % chans]
+        for name, hist in self.latency.items():
+            if not sum(hist):
+                continue
+            buckets = " ".join("%g:%d" % (self.bucket_us(n), c)
+                    for n, c in enumerate(hist) if c)
+            lines.append("Latency %s (us bucket:count): %s, p50<%g p99<%g" % (name,
+                buckets, self.latency_percentile(name, 50),
+                self.latency_percentile(name, 99)))
+        if self.data_chans:
+            aa, chan_map, chans = self.data_chans
+            dchans = " ".join("%d:%d/%d@%d" % (c, h, m, r)
+                    for c, (h, m, r) in enumerate(chans) if h or m)
+            lines.append("Data channels of AA 0x%08X map 0x%010X (hits/misses@RSSI): %s" % (
+                aa, chan_map, dchans))
+        return "\n".join(lines)
+
+class _AsyncMessages:
+    def __init__(self, hw):
+        self.hw = hw
+        self.pending = deque()
+
+    def __aiter__(self):
+        return self
+
+    async def __anext__(self):
+        q = self.hw.reader_queue
+        while True:
+            if not self.pending:
+                # wait in executor for one message, then take what's queued
+                loop = asyncio.get_event_loop()
+                self.pending.append(await loop.run_in_executor(None, q.get))
+                try:
+                    while len(self.pending) < 256:
+                        self.pending.append(q.get_nowait())
+                except Empty:
+                    pass
+
+            mtype, mbody, pkt = self.pending.popleft()
+            if mtype == -1:
+                raise StopAsyncIteration
+            msg = self.hw._decode_or_report(mtype, mbody, pkt)
+            if msg is not None:
+                return msg
+
+class _CommandTransaction:
+    def __init__(self, hw):
+        self.hw = hw
+
+    def __enter__(self):
+        if self.hw.multi_cmds is not None:
+            raise ValueError("Transactions can't be nested")
+        self.hw.multi_cmds = []
+        return self
+
+    def __exit__(self, exc_type, exc_val, tb):
+        cmds, self.hw.multi_cmds = self.hw.multi_cmds, None
+        if exc_type is None and cmds:
+            self.seq = self.hw.cmd_multi(cmds)
+        return False
+
+class CmdAckMessage:
+    OK = 0
+    MALFORMED = 1
+    FAILED = 2
+
+    def __init__(self, raw_msg):
+        self.seq, self.status, self.applied = unpack("<BBB", raw_msg[:3])
+
+    def __repr__(self):
+        return "%s(seq=%d, status=%d, applied=%d)" % (
+                type(self).__name__, self.seq, self.status, self.applied)
+
+    def __str__(self):
+        return "COMMAND ACK: seq=%d status=%d applied=%d" % (
+                self.seq, self.status, self.applied)
+
+class TxStatusMessage:
+    REQUESTED = 0
+    TRANSMITTED = 1
+    REJECTED = 2
+
+    def __init__(self, raw_msg):
+        self.free, self.accepted, self.sent, self.rejected, self.last_sent, \
+                self.reason = unpack("<BHHHBB", raw_msg[:9])
+
+    def __repr__(self):
+        return "%s(free=%d, accepted=%d, sent=%d, rejected=%d, last_sent=%d, reason=%d)" % (
+                type(self).__name__, self.free, self.accepted, self.sent,
+                self.rejected, self.last_sent, self.reason)
+
+    def __str__(self):
+        return "TX STATUS: free=%d accepted=%d sent=%d rejected=%d" % (
+                self.free, self.accepted, self.sent, self.rejected)
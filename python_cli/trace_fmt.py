@@ -0,0 +1,18 @@
+# Generated from fw/trace_fmt.def by fw/gen_trace_fmt.py, do not edit
+
+# (name, printf style format), indexed by trace format ID
+TRACE_FORMATS = [
+    ('TRACE_NO_LEGACY_ADS', 'No legacy ads, jumping to ADVERT_HOP'),
+    ('TRACE_HOP_US', 'hop us %lu'),
+    ('TRACE_HOP_CONFIRMED', 'hop confirmed'),
+    ('TRACE_HOP_CHANGED', 'adv hop interval changed, retrying'),
+    ('TRACE_ACQ_CRCINIT', 'acquire CRCInit %06lX'),
+    ('TRACE_ACQ_INTERVAL', 'acquire interval %lu'),
+    ('TRACE_ACQ_CSA1', 'acquire CSA#1 hop %lu'),
+    ('TRACE_ACQ_CSA2', 'acquire CSA#2 event counter %lu'),
+    ('TRACE_ACQ_HOPS_FAILED', 'acquire hops inconsistent after %lu observations, retrying'),
+    ('TRACE_MAP_DROP', 'channel %lu dropped from map'),
+    ('TRACE_MAP_ADD', 'channel %lu added to map'),
+    ('TRACE_CRYPTO_START', 'LL encryption started, decrypting'),
+    ('TRACE_CRYPTO_FAILED', 'LL decryption failing, wrong LTK?'),
+]